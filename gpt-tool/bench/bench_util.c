@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bench_util.h"
+
+enum {
+    CHUNK_SIZE = 1024 * 1024,
+};
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64, rand() per byte is too slow for the large stages
+static void fill_random(uint8_t *buf, size_t len, uint64_t *state) {
+    for (size_t i = 0; i < len; i += 8) {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        memcpy(buf + i, state, len - i < 8 ? len - i : 8);
+    }
+}
+
+static void file_name(char *name, size_t size, const char *dir, unsigned file) {
+    snprintf(name, size, "%s/D%03u/F%04u.BIN", dir, file / STAGE_FILES_PER_DIR, file % STAGE_FILES_PER_DIR);
+}
+
+bool same_files(const char *a, const char *b) {
+    static uint8_t buf_a[1 << 16], buf_b[1 << 16];
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    bool same = fa && fb;
+    while (same) {
+        size_t na = fread(buf_a, 1, sizeof buf_a, fa), nb = fread(buf_b, 1, sizeof buf_b, fb);
+        same = na == nb && memcmp(buf_a, buf_b, na) == 0;
+        if (na == 0) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+bool make_stage(const char *dir, unsigned files, uint64_t file_size) {
+    uint8_t *buf = malloc(CHUNK_SIZE);
+    if (!buf || (mkdir(dir, 0755) != 0 && errno != EEXIST)) {
+        free(buf);
+        return false;
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    bool ok = true;
+    for (unsigned f = 0; ok && f < files; f++) {
+        char name[256];
+        if (f % STAGE_FILES_PER_DIR == 0) {
+            snprintf(name, sizeof name, "%s/D%03u", dir, f / STAGE_FILES_PER_DIR);
+            mkdir(name, 0755);
+        }
+        file_name(name, sizeof name, dir, f);
+        FILE *file = fopen(name, "wb");
+        if (!file) {
+            ok = false;
+            break;
+        }
+        for (uint64_t done = 0; ok && done < file_size; done += CHUNK_SIZE) {
+            size_t chunk = file_size - done < CHUNK_SIZE ? file_size - done : CHUNK_SIZE;
+            fill_random(buf, chunk, &state);
+            ok = fwrite(buf, 1, chunk, file) == chunk;
+        }
+        ok = fclose(file) == 0 && ok;
+    }
+    free(buf);
+    return ok;
+}
+
+void remove_stage(const char *dir, unsigned files) {
+    char name[256];
+    for (unsigned f = 0; f < files; f++) {
+        file_name(name, sizeof name, dir, f);
+        unlink(name);
+    }
+    for (unsigned d = 0; d * STAGE_FILES_PER_DIR < files; d++) {
+        snprintf(name, sizeof name, "%s/D%03u", dir, d);
+        rmdir(name);
+    }
+    rmdir(dir);
+}
@@ -0,0 +1,24 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Helpers shared by the benchmarks, linked into each of them by the Makefile
+
+enum {
+    STAGE_FILES_PER_DIR = 1000,
+};
+
+// Monotonic clock in seconds
+double now_seconds(void);
+// Staging tree at dir of the given number of files of file_size pseudo random
+// bytes, STAGE_FILES_PER_DIR in each sub directory D000, D001, ... The data is
+// the same every run
+bool make_stage(const char *dir, unsigned files, uint64_t file_size);
+// Remove a staging tree of make_stage, also when it was left half made
+void remove_stage(const char *dir, unsigned files);
+// Whether files a and b both exist and have the same bytes
+bool same_files(const char *a, const char *b);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "build.h"
+#include "verify.h"
+#include "bench_util.h"
+
+// Several images built by one process through the libgpttool API, once one
+// after the other and once with every build on its own thread. Each image
+// gets the same staging tree and must pass verify_image afterwards, which
+// catches builds that share state they should not.
+
+static const char *stage_dir = "concurrent_stage";
+
+enum {
+    MAX_BUILDS = 64,
+    STAGE_FILES = 200,
+    FILE_SIZE = 16 * 1024,
+};
+
+typedef struct {
+    Build_Options options;
+    char output[64];
+    bool ok;
+} Build_Job;
+
+static void *run_job(void *arg) {
+    Build_Job *job = arg;
+    job->ok = build_image(&job->options);
+    return NULL;
+}
+
+// Run all jobs, on a thread each when parallel, returns seconds taken
+static double run_jobs(Build_Job *jobs, unsigned count, bool parallel, bool *ok) {
+    pthread_t threads[MAX_BUILDS];
+    bool started[MAX_BUILDS] = { false };
+    double start = now_seconds();
+    for (unsigned i = 0; i < count; i++) {
+        started[i] = parallel && pthread_create(&threads[i], NULL, run_job, &jobs[i]) == 0;
+        if (!started[i]) run_job(&jobs[i]);
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+    double seconds = now_seconds() - start;
+
+    FILE *null = fopen("/dev/null", "w");
+    *ok = null != NULL;
+    for (unsigned i = 0; *ok && i < count; i++) {
+        if (!jobs[i].ok || !verify_image(jobs[i].output, 1, null)) {
+            fprintf(stderr, "Error: %s build of %s failed\n", parallel ? "parallel" : "serial", jobs[i].output);
+            *ok = false;
+        }
+    }
+    if (null) fclose(null);
+    return seconds;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned count = 8;
+    if (argc > 2 || (argc == 2 && (count = atoi(argv[1])) == 0) || count > MAX_BUILDS) {
+        fprintf(stderr, "Usage: %s [builds, 1-%d]\n", argv[0], MAX_BUILDS);
+        return EXIT_FAILURE;
+    }
+
+    remove_stage(stage_dir, STAGE_FILES);
+    if (!make_stage(stage_dir, STAGE_FILES, FILE_SIZE)) {
+        fprintf(stderr, "Error: could not create %s\n", stage_dir);
+        remove_stage(stage_dir, STAGE_FILES);
+        return EXIT_FAILURE;
+    }
+
+    // Mixed sizes and raw backends, so the builds do not all have the same
+    // shape and verify_image can read every one of them
+    static Build_Job jobs[MAX_BUILDS];
+    for (unsigned i = 0; i < count; i++) {
+        Build_Job *job = &jobs[i];
+        snprintf(job->output, sizeof job->output, "concurrent_%02u.img", i);
+        build_options_init(&job->options);
+        job->options.output = job->output;
+        job->options.backend = i % 2 ? IMAGE_MMAP : IMAGE_STDIO;
+        job->options.sparse = i % 4 >= 2;
+        job->options.esp_size = (uint64_t)(33 + 16 * (i % 4)) * 1024 * 1024;
+        job->options.esp_dir = stage_dir;
+    }
+
+    bool serial_ok, parallel_ok;
+    double serial = run_jobs(jobs, count, false, &serial_ok);
+    double parallel = serial_ok ? run_jobs(jobs, count, true, &parallel_ok) : 0;
+
+    char name[80];
+    for (unsigned i = 0; i < count; i++) {
+        unlink(jobs[i].output);
+        snprintf(name, sizeof name, "%s.manifest", jobs[i].output);
+        unlink(name);
+    }
+    remove_stage(stage_dir, STAGE_FILES);
+    if (!serial_ok || !parallel_ok) return EXIT_FAILURE;
+
+    printf("\n%u builds: serial %.2f ms, parallel %.2f ms, speedup %.2fx\n", count, serial * 1e3,
+           parallel * 1e3, serial / parallel);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "build.h"
+#include "gptz.h"
+#include "bench_util.h"
+
+// Random reads from a .gptz image through gptz_read against inflating the
+// whole disk. The image holds a boot file of half random, half repeated
+// data, so chunks are deflated, stored and holes alike. Every read is
+// checked against the extracted disk, and a read within one chunk has to
+// inflate exactly that chunk, or nothing when it is the chunk read last.
+
+static const char *boot_file = "gptz_bench.efi";
+static const char *bench_image = "gptz_bench.gptz";
+static const char *extracted = "gptz_bench.img";
+
+enum {
+    BOOT_FILE_SIZE = 16 * 1024 * 1024,
+    BLOCK_SIZE = 64 * 1024,             // Alternately random and repeated in the boot file
+    READ_SIZE = 512,
+};
+
+static bool make_boot_file(void) {
+    static uint8_t buf[BLOCK_SIZE];
+    static const char text[] = "gptz bench repeated data ";
+    FILE *file = fopen(boot_file, "wb");
+    bool ok = file != NULL;
+    for (size_t block = 0; ok && block < BOOT_FILE_SIZE / BLOCK_SIZE; block++) {
+        for (size_t i = 0; i < BLOCK_SIZE; i++) buf[i] = block % 2 ? text[i % (sizeof text - 1)] : rand() & 0xFF;
+        ok = fwrite(buf, 1, BLOCK_SIZE, file) == BLOCK_SIZE;
+    }
+    if (file && fclose(file) != 0) ok = false;
+    return ok;
+}
+
+static bool build(void) {
+    Build_Options options;
+    build_options_init(&options);
+    options.backend = IMAGE_GPTZ;
+    options.output = bench_image;
+    options.boot_file = boot_file;
+    options.reproducible = true;
+    options.seed = "gptz_bench";
+    return build_image(&options);
+}
+
+// Whole disk through gptz_extract into memory, NULL after an error
+static uint8_t *extract_all(Gptz *gptz, double *seconds) {
+    int fd = open(extracted, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+    double start = now_seconds();
+    bool ok = gptz_extract(gptz, fd, 1);
+    *seconds = now_seconds() - start;
+
+    const uint64_t size = gptz_size(gptz);
+    uint8_t *disk = ok ? malloc(size) : NULL;
+    ok = disk && pread(fd, disk, size, 0) == (ssize_t)size;
+    close(fd);
+    if (!ok) {
+        free(disk);
+        return NULL;
+    }
+    return disk;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned reads = 20000;
+    if (argc > 2 || (argc == 2 && (reads = atoi(argv[1])) == 0)) {
+        fprintf(stderr, "Usage: %s [random reads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    srand(1);
+    if (!make_boot_file() || !build()) {
+        fprintf(stderr, "Error: could not build %s\n", bench_image);
+        unlink(boot_file);
+        return EXIT_FAILURE;
+    }
+
+    Gptz *gptz = gptz_open(bench_image);
+    double extract_seconds = 0;
+    uint8_t *disk = gptz ? extract_all(gptz, &extract_seconds) : NULL;
+    bool ok = disk != NULL;
+    if (!ok) fprintf(stderr, "Error: could not extract %s\n", bench_image);
+
+    // Reads within one chunk, so each one inflates one chunk or reuses the last
+    const uint64_t size = ok ? gptz_size(gptz) : 0, chunk_size = ok ? gptz_chunk_size(gptz) : 1;
+    uint64_t last_chunk = UINT64_MAX, inflating = 0;
+    double read_seconds = 0, inflating_seconds = 0;
+    for (unsigned r = 0; ok && r < reads; r++) {
+        uint8_t buf[READ_SIZE];
+        uint64_t offset = ((uint64_t)rand() * RAND_MAX + rand()) % (size / READ_SIZE) * READ_SIZE;
+        uint64_t chunk = offset / chunk_size;
+        uint64_t before = gptz_read_chunks(gptz);
+
+        double start = now_seconds();
+        ok = gptz_read(gptz, offset, buf, READ_SIZE);
+        double seconds = now_seconds() - start;
+
+        uint64_t inflated = gptz_read_chunks(gptz) - before;
+        if (ok && inflated != (chunk != last_chunk)) {
+            fprintf(stderr, "Error: read at %llu inflated %llu chunks\n", (unsigned long long)offset,
+                    (unsigned long long)inflated);
+            ok = false;
+        }
+        if (ok && memcmp(buf, disk + offset, READ_SIZE) != 0) {
+            fprintf(stderr, "Error: read at %llu differs from the extracted disk\n", (unsigned long long)offset);
+            ok = false;
+        }
+        read_seconds += seconds;
+        if (inflated) {
+            inflating++;
+            inflating_seconds += seconds;
+        }
+        last_chunk = chunk;
+    }
+
+    if (ok) {
+        printf("%-26s %12s %12s\n", "", "ms", "chunks");
+        printf("%-26s %12.3f %12llu\n", "whole disk", extract_seconds * 1e3,
+               (unsigned long long)((size + chunk_size - 1) / chunk_size));
+        printf("%-26s %12.3f %12.3f\n", "512 byte read", read_seconds / reads * 1e3,
+               (double)gptz_read_chunks(gptz) / reads);
+        printf("%-26s %12.3f %12d\n", "512 byte read, new chunk",
+               inflating ? inflating_seconds / inflating * 1e3 : 0.0, 1);
+    }
+
+    free(disk);
+    gptz_close(gptz);
+    unlink(boot_file);
+    unlink(bench_image);
+    unlink(extracted);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
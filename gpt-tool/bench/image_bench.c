@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "image.h"
+#include "mbr.h"
+#include "gpt.h"
+#include "fat32.h"
+#include "utils.h"
+#include "gpt_constants.h"
+#include "bench_util.h"
+
+// Full image builds over a matrix of ESP sizes, file counts and file sizes,
+// once with every output strategy. Each phase is timed separately for a number
+// of runs, results go to a table on stdout and optionally to CSV and JSON
+// files with min, median, p90, p99 and max per phase.
+// Stream output goes to /dev/null, so it measures planning and emitting the
+// image rather than the disk.
+
+static const char *stage_dir = "bench_stage";
+static const char *bench_image = "image_bench.img";
+
+enum {
+    MAX_RUNS = 100,
+};
+
+typedef struct {
+    const char *name;
+    uint64_t esp_size;
+    unsigned files;
+    uint64_t file_size;
+    bool quick;                 // Part of --quick
+} Bench_Case;
+
+#define KiB (1024ULL)
+#define MiB (1024ULL * KiB)
+#define GiB (1024ULL * MiB)
+
+static const Bench_Case cases[] = {
+    { "esp-33M",    33 * MiB,   1,      1 * KiB,    true },
+    { "esp-256M",   256 * MiB,  1,      1 * KiB,    true },
+    { "esp-1G",     1 * GiB,    1,      1 * KiB,    true },
+    { "esp-8G",     8 * GiB,    1,      1 * KiB,    false },
+    { "files-100",  33 * MiB,   100,    1 * KiB,    true },
+    { "files-1k",   33 * MiB,   1000,   1 * KiB,    true },
+    { "files-10k",  64 * MiB,   10000,  1 * KiB,    false },
+    { "size-64K",   33 * MiB,   1,      64 * KiB,   true },
+    { "size-1M",    33 * MiB,   1,      1 * MiB,    true },
+    { "size-64M",   128 * MiB,  1,      64 * MiB,   false },
+    { "size-512M",  640 * MiB,  1,      512 * MiB,  false },
+    { "mixed-1kx64K", 128 * MiB, 1000,  64 * KiB,   false },
+};
+
+typedef struct {
+    const char *name;
+    Image_Backend backend;
+    Copy_Mode copy;
+    const char *output;         // NULL for bench_image
+} Bench_Strategy;
+
+static const Bench_Strategy strategies[] = {
+    { "raw-stdio",      IMAGE_STDIO,  COPY_STDIO,    NULL },
+    { "raw-buffered",   IMAGE_STDIO,  COPY_BUFFERED, NULL },
+    { "raw-range",      IMAGE_STDIO,  COPY_RANGE,    NULL },
+    { "mmap",           IMAGE_MMAP,   COPY_RANGE,    NULL },
+    { "qcow2",          IMAGE_QCOW2,  COPY_RANGE,    NULL },
+    { "stream",         IMAGE_STREAM, COPY_RANGE,    "/dev/null" },
+    { "gptz",           IMAGE_GPTZ,   COPY_RANGE,    NULL },
+};
+
+typedef enum {
+    PHASE_OPEN,
+    PHASE_MBR,
+    PHASE_GPT,
+    PHASE_ESP,
+    PHASE_IMPORT,
+    PHASE_CLOSE,                // Finish, flush and fsync
+    PHASE_TOTAL,
+    NUM_PHASES,
+} Phase;
+
+static const char *phase_names[NUM_PHASES] = {
+    "open", "write_mbr", "write_gpt", "write_esp", "import", "close", "total",
+};
+
+typedef struct {
+    double min, median, p90, p99, max;
+} Bench_Stats;
+
+typedef struct {
+    const Bench_Case *bench_case;
+    const Bench_Strategy *strategy;
+    Bench_Stats phases[NUM_PHASES];
+} Bench_Result;
+
+// One full build, seconds per phase
+static bool run_build(const Bench_Case *c, const Bench_Strategy *s, double times[NUM_PHASES]) {
+    const char *output = s->output ? s->output : bench_image;
+    const uint64_t data_size = 1024 * 1024;
+
+    Image image;
+    double start = now_seconds(), mark = start;
+    uint64_t size = disk_size_lbas(c->esp_size, data_size, DEFAULT_LBA_SIZE) * DEFAULT_LBA_SIZE;
+    if (!image_open(&image, output, s->backend, size)) return false;
+    image.esp_size = c->esp_size;
+    image.data_size = data_size;
+    image.copy_mode = s->copy;
+    times[PHASE_OPEN] = now_seconds() - mark;
+    mark = now_seconds();
+
+    bool ok = write_mbr(&image);
+    times[PHASE_MBR] = now_seconds() - mark;
+    mark = now_seconds();
+
+    ok = ok && write_gpt(&image);
+    times[PHASE_GPT] = now_seconds() - mark;
+    mark = now_seconds();
+
+    ok = ok && write_esp(&image);
+    times[PHASE_ESP] = now_seconds() - mark;
+    mark = now_seconds();
+
+    ok = ok && import_dir_to_esp(stage_dir, &image);
+    times[PHASE_IMPORT] = now_seconds() - mark;
+    mark = now_seconds();
+
+    ok = image_close(&image) && ok;
+    if (!s->output) {
+        int fd = open(output, O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+    times[PHASE_CLOSE] = now_seconds() - mark;
+    times[PHASE_TOTAL] = now_seconds() - start;
+
+    unlink(bench_image);
+    return ok;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Percentile of sorted values, linear between the closest ranks
+static double percentile(const double *sorted, int n, double p) {
+    double rank = p / 100.0 * (n - 1);
+    int lo = (int)rank;
+    if (lo >= n - 1) return sorted[n - 1];
+    return sorted[lo] + (rank - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+static Bench_Stats summarize(double *values, int n) {
+    qsort(values, n, sizeof *values, compare_doubles);
+    return (Bench_Stats){
+        .min = values[0],
+        .median = percentile(values, n, 50),
+        .p90 = percentile(values, n, 90),
+        .p99 = percentile(values, n, 99),
+        .max = values[n - 1],
+    };
+}
+
+static double data_mb_per_s(const Bench_Result *r) {
+    double bytes = (double)r->bench_case->files * r->bench_case->file_size;
+    return bytes / r->phases[PHASE_TOTAL].median / 1e6;
+}
+
+static bool write_csv(const char *name, const Bench_Result *results, int count, int runs) {
+    FILE *file = fopen(name, "w");
+    if (!file) return false;
+
+    fprintf(file, "case,strategy,esp_bytes,files,file_bytes,runs,phase,min_s,median_s,p90_s,p99_s,max_s,data_mb_s\n");
+    for (int i = 0; i < count; i++) {
+        const Bench_Result *r = &results[i];
+        for (int p = 0; p < NUM_PHASES; p++) {
+            const Bench_Stats *s = &r->phases[p];
+            fprintf(file, "%s,%s,%llu,%u,%llu,%d,%s,%.6f,%.6f,%.6f,%.6f,%.6f,",
+                    r->bench_case->name, r->strategy->name, (unsigned long long)r->bench_case->esp_size,
+                    r->bench_case->files, (unsigned long long)r->bench_case->file_size, runs,
+                    phase_names[p], s->min, s->median, s->p90, s->p99, s->max);
+            if (p == PHASE_TOTAL) fprintf(file, "%.1f", data_mb_per_s(r));
+            fprintf(file, "\n");
+        }
+    }
+    return fclose(file) == 0;
+}
+
+static bool write_json(const char *name, const Bench_Result *results, int count, int runs) {
+    FILE *file = fopen(name, "w");
+    if (!file) return false;
+
+    fprintf(file, "{\n  \"runs\": %d,\n  \"results\": [\n", runs);
+    for (int i = 0; i < count; i++) {
+        const Bench_Result *r = &results[i];
+        fprintf(file, "    {\"case\": \"%s\", \"strategy\": \"%s\", \"esp_bytes\": %llu, \"files\": %u, "
+                      "\"file_bytes\": %llu, \"data_mb_s\": %.1f, \"phases\": {",
+                r->bench_case->name, r->strategy->name, (unsigned long long)r->bench_case->esp_size,
+                r->bench_case->files, (unsigned long long)r->bench_case->file_size, data_mb_per_s(r));
+        for (int p = 0; p < NUM_PHASES; p++) {
+            const Bench_Stats *s = &r->phases[p];
+            fprintf(file, "%s\n      \"%s\": {\"min\": %.6f, \"median\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"max\": %.6f}",
+                    p ? "," : "", phase_names[p], s->min, s->median, s->p90, s->p99, s->max);
+        }
+        fprintf(file, "\n    }}%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--quick] [--runs N] [--csv FILE] [--json FILE] [CASE...]\n"
+                    "  --quick     skip the cases with large ESPs, many files or large files\n"
+                    "  --runs N    builds per case and strategy (default 5)\n"
+                    "  CASE        only run the named cases\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 5;
+    bool quick = false;
+    const char *csv_name = NULL, *json_name = NULL;
+    const char *only[64];
+    int num_only = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            csv_name = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_name = argv[++i];
+        } else if (argv[i][0] != '-' && num_only < 64) {
+            only[num_only++] = argv[i];
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const size_t num_cases = sizeof cases / sizeof cases[0];
+    const size_t num_strategies = sizeof strategies / sizeof strategies[0];
+    Bench_Result *results = calloc(num_cases * num_strategies, sizeof *results);
+    if (!results) return EXIT_FAILURE;
+    int count = 0;
+    bool ok = true;
+
+    for (size_t c = 0; ok && c < num_cases; c++) {
+        const Bench_Case *bench_case = &cases[c];
+        bool selected = num_only == 0 ? !quick || bench_case->quick : false;
+        for (int i = 0; i < num_only; i++) selected |= strcmp(only[i], bench_case->name) == 0;
+        if (!selected) continue;
+
+        if (!make_stage(stage_dir, bench_case->files, bench_case->file_size)) {
+            fprintf(stderr, "Error: could not create %s for case %s\n", stage_dir, bench_case->name);
+            remove_stage(stage_dir, bench_case->files);
+            ok = false;
+            break;
+        }
+
+        for (size_t s = 0; ok && s < num_strategies; s++) {
+            double samples[NUM_PHASES][MAX_RUNS];
+            for (int run = 0; ok && run < runs; run++) {
+                double times[NUM_PHASES];
+                ok = run_build(bench_case, &strategies[s], times);
+                for (int p = 0; p < NUM_PHASES; p++) samples[p][run] = times[p];
+            }
+            if (!ok) {
+                fprintf(stderr, "Error: case %s failed with %s\n", bench_case->name, strategies[s].name);
+                break;
+            }
+
+            Bench_Result *r = &results[count++];
+            r->bench_case = bench_case;
+            r->strategy = &strategies[s];
+            for (int p = 0; p < NUM_PHASES; p++) r->phases[p] = summarize(samples[p], runs);
+        }
+        remove_stage(stage_dir, bench_case->files);
+    }
+
+    // Medians of every phase, the import runs print their own lines above
+    printf("\n%-13s %-13s %9s %9s %9s %9s %9s %9s %9s %9s\n", "case", "strategy", "open ms",
+           "mbr ms", "gpt ms", "esp ms", "import ms", "close ms", "total ms", "MB/s");
+    for (int i = 0; i < count; i++) {
+        const Bench_Result *r = &results[i];
+        printf("%-13s %-13s", r->bench_case->name, r->strategy->name);
+        for (int p = 0; p < NUM_PHASES; p++) printf(" %9.2f", r->phases[p].median * 1e3);
+        printf(" %9.1f\n", data_mb_per_s(r));
+    }
+
+    if (csv_name && !write_csv(csv_name, results, count, runs)) {
+        fprintf(stderr, "Error: could not write %s\n", csv_name);
+        ok = false;
+    }
+    if (json_name && !write_json(json_name, results, count, runs)) {
+        fprintf(stderr, "Error: could not write %s\n", json_name);
+        ok = false;
+    }
+
+    free(results);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
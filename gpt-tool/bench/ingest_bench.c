@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image.h"
+#include "mbr.h"
+#include "gpt.h"
+#include "fat32.h"
+#include "crc32.h"
+#include "utils.h"
+#include "gpt_constants.h"
+#include "bench_util.h"
+
+// Compare file ingestion paths of add_path_to_esp on one large file.
+// Source and image are created in the current directory so reflink can
+// be used when the filesystem supports it.
+
+static const char *source_name = "INGEST.BIN";
+static const char *bench_image = "ingest_bench.img";
+static uint64_t esp_size;                       // Set from the file size
+static const uint64_t data_size = 1024 * 1024;
+
+typedef struct {
+    const char *name;
+    Copy_Mode mode;
+} Copy_Path;
+
+static const Copy_Path paths[] = {
+    { "stdio", COPY_STDIO },
+    { "buffered", COPY_BUFFERED },
+    { "range", COPY_RANGE },
+};
+
+static bool make_source(uint64_t size, uint32_t *crc) {
+    FILE *file = fopen(source_name, "wb");
+    if (!file) return false;
+
+    uint8_t *buf = malloc(1024 * 1024);
+    if (!buf) {
+        fclose(file);
+        return false;
+    }
+    *crc = 0;
+    for (uint64_t done = 0; done < size; done += 1024 * 1024) {
+        size_t chunk = size - done < 1024 * 1024 ? size - done : 1024 * 1024;
+        for (size_t i = 0; i < chunk; i++) buf[i] = rand() & 0xFF;
+        *crc = crc32_update(*crc, buf, chunk);
+        fwrite(buf, 1, chunk, file);
+    }
+    free(buf);
+    return fclose(file) == 0;
+}
+
+// Build an empty ESP, time adding the source file including the flush to disk
+static bool run_path(const Copy_Path *path, uint64_t size, uint32_t expected_crc, double *seconds) {
+    Image image;
+    uint64_t disk_size = disk_size_lbas(esp_size, data_size, DEFAULT_LBA_SIZE) * DEFAULT_LBA_SIZE;
+    if (!image_open(&image, bench_image, IMAGE_STDIO, disk_size)) return false;
+    image.esp_size = esp_size;
+    image.data_size = data_size;
+    image.copy_mode = path->mode;
+    if (!write_mbr(&image) || !write_gpt(&image) || !write_esp(&image)) {
+        image_close(&image);
+        return false;
+    }
+    fflush(image.file);
+
+    char esp_path[32];
+    snprintf(esp_path, sizeof esp_path, "/%s", source_name);
+
+    double start = now_seconds();
+    bool ok = add_path_to_esp(esp_path, NULL, &image);
+    fflush(image.file);
+    fsync(image.fd);
+    *seconds = now_seconds() - start;
+
+    // First file in an empty root lands right after /EFI/BOOT
+    uint8_t *buf = malloc(1024 * 1024);
+    uint32_t crc = 0;
+    uint64_t offset = cluster_to_lba(&image, 5) * image.lba_size;
+    for (uint64_t done = 0; ok && buf && done < size; done += 1024 * 1024) {
+        size_t chunk = size - done < 1024 * 1024 ? size - done : 1024 * 1024;
+        ok = image_read(&image, offset + done, buf, chunk);
+        crc = crc32_update(crc, buf, chunk);
+    }
+    free(buf);
+    if (ok && crc != expected_crc) {
+        fprintf(stderr, "Error: %s path wrote wrong data\n", path->name);
+        ok = false;
+    }
+
+    image_close(&image);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t size = 100ULL * 1000 * 1000;
+    if (argc > 1 && !parse_size(argv[1], &size)) {
+        fprintf(stderr, "Usage: %s [file size, default 100MB]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // ESP with room for the file
+    esp_size = (size / ALIGNMENT + 64) * ALIGNMENT;
+    srand(1);
+
+    uint32_t crc = 0;
+    if (!make_source(size, &crc)) {
+        fprintf(stderr, "Error: could not create %s\n", source_name);
+        return EXIT_FAILURE;
+    }
+
+    bool ok = true;
+    double baseline = 0;
+    printf("%-10s %10s %10s %8s\n", "path", "seconds", "MB/s", "speedup");
+    for (size_t i = 0; ok && i < sizeof paths / sizeof paths[0]; i++) {
+        double seconds = 0;
+        ok = run_path(&paths[i], size, crc, &seconds);
+        if (!ok) break;
+        if (i == 0) baseline = seconds;
+        printf("%-10s %10.3f %10.1f %7.1fx\n", paths[i].name, seconds, size / seconds / 1e6, baseline / seconds);
+    }
+
+    unlink(source_name);
+    unlink(bench_image);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image.h"
+#include "mbr.h"
+#include "gpt.h"
+#include "fat32.h"
+#include "utils.h"
+#include "gpt_constants.h"
+#include "bench_util.h"
+
+// Build time of a full image against the number of write threads.
+// A staging tree of equally sized files is imported into a large ESP with
+// 1, 2, 4, ... threads up to the number of online CPUs (or the given maximum).
+// Every run includes the final flush to disk.
+
+static const char *stage_dir = "parallel_stage";
+static const char *bench_image = "parallel_bench.img";
+static uint64_t esp_size;                       // Set from the data size
+static const uint64_t data_size = 1024 * 1024;
+
+enum {
+    NUM_FILES = 64,
+};
+
+static bool run_build(unsigned threads, double *seconds) {
+    Image image;
+    double start = now_seconds();
+
+    uint64_t size = disk_size_lbas(esp_size, data_size, DEFAULT_LBA_SIZE) * DEFAULT_LBA_SIZE;
+    if (!image_open(&image, bench_image, IMAGE_STDIO, size)) return false;
+    image.esp_size = esp_size;
+    image.data_size = data_size;
+    bool ok = image_set_threads(&image, threads) &&
+              write_mbr(&image) && write_gpt(&image) && write_esp(&image) &&
+              import_dir_to_esp(stage_dir, &image);
+    fflush(image.file);
+    ok = image_close(&image) && ok;
+
+    // Count the flush of written data to disk
+    FILE *file = fopen(bench_image, "rb");
+    if (file) {
+        fsync(fileno(file));
+        fclose(file);
+    }
+    *seconds = now_seconds() - start;
+    unlink(bench_image);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t data_bytes = 512ULL * 1024 * 1024;
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if ((argc > 1 && !parse_size(argv[1], &data_bytes)) || (argc > 2 && (max_threads = atol(argv[2])) < 1)) {
+        fprintf(stderr, "Usage: %s [total file data, default 512M] [max threads, default online CPUs]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (max_threads < 1) max_threads = 1;
+
+    // ESP with room for the files and their cluster slack
+    uint64_t file_size = data_bytes / NUM_FILES;
+    esp_size = ((data_bytes + data_bytes / 8) / ALIGNMENT + 64) * ALIGNMENT;
+
+    if (!make_stage(stage_dir, NUM_FILES, file_size)) {
+        fprintf(stderr, "Error: could not create %s\n", stage_dir);
+        remove_stage(stage_dir, NUM_FILES);
+        return EXIT_FAILURE;
+    }
+
+    // Run every thread count first, the imports print their own summary lines
+    long counts[64];
+    double times[64];
+    int runs = 0;
+    bool ok = true;
+    for (long threads = 1; ok && threads <= max_threads && runs < 64; runs++) {
+        counts[runs] = threads;
+        ok = run_build(threads, &times[runs]);
+
+        long next = threads * 2;
+        if (threads < max_threads && next > max_threads) next = max_threads;
+        threads = next;
+    }
+
+    uint64_t disk_size = disk_size_lbas(esp_size, data_size, DEFAULT_LBA_SIZE) * DEFAULT_LBA_SIZE;
+    printf("\nimage %llu MiB, %d files of %llu bytes, %ld online CPUs\n", (unsigned long long)(disk_size >> 20),
+           NUM_FILES, (unsigned long long)file_size, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %10s %10s %8s %11s\n", "threads", "seconds", "MB/s", "speedup", "efficiency");
+    for (int i = 0; ok && i < runs; i++) {
+        printf("%8ld %10.3f %10.1f %7.2fx %10.0f%%\n", counts[i], times[i],
+               data_bytes / times[i] / 1e6, times[0] / times[i], 100.0 * times[0] / times[i] / counts[i]);
+    }
+
+    remove_stage(stage_dir, NUM_FILES);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
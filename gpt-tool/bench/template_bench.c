@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "build.h"
+#include "template.h"
+#include "utils.h"
+#include "stream.h"
+#include "mbr.h"
+#include "gpt.h"
+#include "fat32.h"
+#include "bench_util.h"
+
+// Image builds with and without a geometry preset (--preset), through the
+// libgpttool API. Every build has an empty ESP, so the time is the metadata
+// of the image: MBR, both GPTs, VBR, FSInfo, FATs and the first directories.
+// Cold start is the first build of a forked process, where the preset also
+// builds its template; per image is the mean of the builds after that, and
+// metadata the mean of writing only the metadata into an in-memory stream
+// plan, without the file and manifest work of a build. Both ways must give
+// the same bytes with the same seed.
+
+static const char *outputs[2] = { "template_plain.img", "template_preset.img" };
+static const char *preset_names[] = { "esp33", "esp128", "esp512", "esp1g", "esp260-4k" };
+
+enum {
+    NUM_PRESETS = sizeof preset_names / sizeof *preset_names,
+};
+
+static void cleanup(void) {
+    char name[64];
+    for (int i = 0; i < 2; i++) {
+        unlink(outputs[i]);
+        snprintf(name, sizeof name, "%s.manifest", outputs[i]);
+        unlink(name);
+    }
+}
+
+// Options of a sparse reproducible build of preset's geometry, through the template when with_preset
+static void preset_options(Build_Options *options, const Geometry_Preset *preset, bool with_preset) {
+    build_options_init(options);
+    options->output = outputs[with_preset];
+    options->sparse = true;
+    options->reproducible = true;
+    options->seed = "template_bench";
+    options->lba_size = preset->lba_size;
+    options->esp_size = preset->esp_size;
+    options->data_size = preset->data_size;
+    options->esp_cluster_size = preset->esp_cluster_size;
+    if (with_preset) options->preset = preset;
+}
+
+// Build once, stdout of the library to /dev/null
+static bool build_quiet(const Build_Options *options) {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    FILE *null = freopen("/dev/null", "w", stdout);
+    bool ok = null && build_image(options);
+    fflush(stdout);
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    return ok;
+}
+
+// Seconds of the first build in a fresh child process, negative after an error
+static double cold_build(const Build_Options *options) {
+    fflush(stdout);
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == 0) _exit(build_quiet(options) ? EXIT_SUCCESS : EXIT_FAILURE);
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        return -1;
+    }
+    return now_seconds() - start;
+}
+
+// Mean seconds of writing the metadata of preset into a stream plan runs times
+static double metadata_seconds(const Geometry_Preset *preset, bool with_preset, unsigned runs) {
+    const uint64_t size = disk_size_lbas(preset->esp_size, preset->data_size, preset->lba_size) * preset->lba_size;
+    double start = now_seconds();
+    for (unsigned r = 0; r < runs; r++) {
+        Image image = {
+            .backend = IMAGE_STREAM,
+            .name = "metadata",
+            .fd = -1,
+            .size = size,
+            .threads = 1,
+            .lba_size = preset->lba_size,
+            .esp_size = preset->esp_size,
+            .data_size = preset->data_size,
+            .esp_cluster_size = preset->esp_cluster_size,
+            .source_date = FAT_EPOCH,
+            .reproducible = true,
+        };
+        image.stream = stream_create(size);
+        bool ok = image.stream && (with_preset ? template_write(&image, preset)
+                                               : write_mbr(&image) && write_gpt(&image) && write_esp(&image));
+        if (image.stream) stream_destroy(image.stream);
+        dir_index_reset(&image);
+        fat32_free_extents_reset(&image);
+        if (!ok) return -1;
+    }
+    return (now_seconds() - start) / runs;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned runs = 200;
+    if (argc > 2 || (argc == 2 && (runs = atoi(argv[1])) == 0)) {
+        fprintf(stderr, "Usage: %s [builds per preset]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-10s %12s %12s %12s %12s %12s %12s %8s\n", "preset", "cold plain", "cold preset", "build plain",
+           "build preset", "meta plain", "meta preset", "speedup");
+    bool ok = true;
+    for (size_t p = 0; ok && p < NUM_PRESETS; p++) {
+        const Geometry_Preset *preset = geometry_preset(preset_names[p]);
+        Build_Options options[2];
+        preset_options(&options[0], preset, false);
+        preset_options(&options[1], preset, true);
+
+        // Children first, this process has no template yet
+        double cold[2], per_image[2], metadata[2];
+        for (int i = 0; ok && i < 2; i++) ok = (cold[i] = cold_build(&options[i])) >= 0;
+
+        // One build to warm up, then the timed ones
+        for (int i = 0; ok && i < 2; i++) {
+            ok = build_quiet(&options[i]);
+            double start = now_seconds();
+            for (unsigned r = 0; ok && r < runs; r++) ok = build_quiet(&options[i]);
+            per_image[i] = (now_seconds() - start) / runs;
+            ok = ok && metadata_seconds(preset, i, 1) >= 0 && (metadata[i] = metadata_seconds(preset, i, runs)) >= 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "Error: build of preset %s failed\n", preset->name);
+            break;
+        }
+        if (!same_files(outputs[0], outputs[1])) {
+            fprintf(stderr, "Error: preset %s does not give the bytes of a normal build\n", preset->name);
+            ok = false;
+            break;
+        }
+
+        printf("%-10s %9.3f ms %9.3f ms %9.3f ms %9.3f ms %9.3f ms %9.3f ms %7.2fx\n", preset->name,
+               cold[0] * 1e3, cold[1] * 1e3, per_image[0] * 1e3, per_image[1] * 1e3, metadata[0] * 1e3,
+               metadata[1] * 1e3, metadata[0] / metadata[1]);
+    }
+
+    cleanup();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "build.h"
+#include "extract.h"
+#include "verify.h"
+#include "utils.h"
+#include "bench_util.h"
+
+// In place updates of an image through build_image against its first build.
+// The staging tree changes between the updates: a file is rewritten, a file
+// becomes a directory and back, and a sub directory is removed. After every
+// step the image must pass verify_image and its ESP, extracted again, must
+// hold exactly the staging tree.
+
+static const char *stage_dir = "update_stage";
+static const char *extract_dir = "update_extract";
+static const char *bench_image = "update_bench.img";
+
+enum {
+    STAGE_FILES = 1500,                 // Two sub directories
+    FILE_SIZE = 8 * 1024,
+};
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st, (void)flag, (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static void remove_tree(const char *path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static bool write_file(const char *path, const char *text) {
+    FILE *file = fopen(path, "w");
+    bool ok = file && fputs(text, file) >= 0;
+    if (file && fclose(file) != 0) ok = false;
+    return ok;
+}
+
+// Same names and file data in both trees, the /EFI the ESP always has aside
+static bool same_tree(const char *host, const char *esp, bool root) {
+    char **host_names = NULL, **esp_names = NULL;
+    size_t num_host = 0, num_esp = 0;
+    bool ok = list_dir(host, &host_names, &num_host) && list_dir(esp, &esp_names, &num_esp);
+
+    size_t e = 0;
+    for (size_t h = 0; ok && h <= num_host; h++, e++) {
+        if (root && e < num_esp && strcmp(esp_names[e], "EFI") == 0) e++;
+        if (h == num_host) {
+            ok = e == num_esp;
+            break;
+        }
+        ok = e < num_esp && strcmp(host_names[h], esp_names[e]) == 0;
+        if (!ok) break;
+
+        char host_path[512], esp_path[512];
+        struct stat st;
+        snprintf(host_path, sizeof host_path, "%s/%s", host, host_names[h]);
+        snprintf(esp_path, sizeof esp_path, "%s/%s", esp, esp_names[e]);
+        ok = stat(host_path, &st) == 0 &&
+             (S_ISDIR(st.st_mode) ? same_tree(host_path, esp_path, false) : same_files(host_path, esp_path));
+    }
+    if (!ok && root) fprintf(stderr, "Error: ESP of %s does not hold %s\n", bench_image, stage_dir);
+
+    free_names(host_names, num_host);
+    free_names(esp_names, num_esp);
+    return ok;
+}
+
+// Build or update the image, seconds taken; then check it against the staging tree
+static bool step(const char *name, FILE *null) {
+    Build_Options options;
+    build_options_init(&options);
+    options.output = bench_image;
+    options.esp_dir = stage_dir;
+    options.update = true;
+
+    double start = now_seconds();
+    bool ok = build_image(&options);
+    double seconds = now_seconds() - start;
+
+    remove_tree(extract_dir);
+    ok = ok && verify_image(bench_image, 1, null) && esp_extract(bench_image, "/", extract_dir) &&
+         same_tree(stage_dir, extract_dir, true);
+    if (!ok) fprintf(stderr, "Error: step '%s' failed\n", name);
+    else printf("%-32s %10.2f ms\n", name, seconds * 1e3);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    (void)argv;
+    if (argc > 1) {
+        fprintf(stderr, "Usage: %s\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *null = fopen("/dev/null", "w");
+    remove_tree(stage_dir);
+    unlink(bench_image);
+    bool ok = null && make_stage(stage_dir, STAGE_FILES, FILE_SIZE);
+    if (!ok) fprintf(stderr, "Error: could not create %s\n", stage_dir);
+
+    char path[256];
+    ok = ok && step("first build", null);
+    ok = ok && step("nothing changed", null);
+
+    snprintf(path, sizeof path, "%s/D000/F0001.BIN", stage_dir);
+    ok = ok && write_file(path, "changed\n") && step("one file changed", null);
+
+    snprintf(path, sizeof path, "%s/D000/F0000.BIN", stage_dir);
+    ok = ok && unlink(path) == 0 && mkdir(path, 0755) == 0;
+    snprintf(path, sizeof path, "%s/D000/F0000.BIN/INNER.TXT", stage_dir);
+    ok = ok && write_file(path, "inner\n") && step("file became a directory", null);
+
+    snprintf(path, sizeof path, "%s/D000/F0000.BIN", stage_dir);
+    remove_tree(path);
+    ok = ok && write_file(path, "file again\n") && step("directory became a file", null);
+
+    snprintf(path, sizeof path, "%s/D001", stage_dir);
+    remove_tree(path);
+    ok = ok && step("directory removed", null);
+
+    if (null) fclose(null);
+    remove_tree(stage_dir);
+    remove_tree(extract_dir);
+    unlink(bench_image);
+    snprintf(path, sizeof path, "%s.manifest", bench_image);
+    unlink(path);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,32 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+
+// Batch builds of many raw images from one manifest. Images with the same ESP
+// inputs (esp-dir, boot-file, esp-size, cluster-size, sector-size, sparse)
+// share one ESP build: it is built and hashed once into the first image of
+// the group, the other images are reflinked (or extent copied) from it and
+// only get new GUIDs, their own data partition payload and their own ESP files.
+// Files given before the first image go into the base before it is cloned.
+//
+// Manifest lines are KEY VALUE..., '#' starts a comment and values can not
+// hold spaces. Keys before the first image line apply to every image:
+//   image OUTPUT                start the next image, written to OUTPUT
+//   esp-dir DIR                 host tree imported into the ESP root
+//   boot-file FILE              host file added as /EFI/BOOT/BOOTx64.efi without esp-dir
+//   esp-size SIZE               ESP size (default 33M)
+//   cluster-size SIZE           FAT32 cluster size (default picked by ESP size)
+//   sector-size 512|4096        logical sector size (default 512)
+//   preset NAME                 geometry preset (template.h), sets the sizes above;
+//                               sizes given after it fall back to a normal build
+//   sparse                      leave zero regions of the shared ESP as holes
+//   data-size SIZE              data partition size (default 1M, or payload size)
+//   data FILE                   payload written at the start of the data partition
+//   file ESP_PATH HOST_FILE     add or replace one ESP file of this image
+
+// Build every image of manifest_name, jobs images at a time.
+// False after an error was printed, images built until then are kept
+bool build_batch(const char *manifest_name, unsigned jobs);
+
+#endif
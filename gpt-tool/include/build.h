@@ -0,0 +1,49 @@
+#ifndef BUILD_H
+#define BUILD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "image.h"
+#include "layout.h"
+#include "template.h"
+
+// Library entry point of libgpttool.a: build or update one disk image.
+// Everything a build changes lives in its own Image, so one process may run
+// builds of different outputs on several threads at once. Only --stats
+// counters are process wide, they add up over all builds.
+
+typedef struct {
+    const char *output;             // Image file or IMAGE_DEVICE device, "-" is stdout for IMAGE_STREAM
+    int output_fd;                  // IMAGE_STREAM writes to this descriptor instead of opening output, or -1
+    Image_Backend backend;
+    uint64_t esp_size, data_size;   // Partition sizes in bytes
+    const Layout *layout;           // Partitions of the disk (layout.h), NULL for the ESP and a data partition
+    uint32_t esp_cluster_size;      // Bytes per cluster, 0 picks by ESP size
+    uint32_t lba_size;              // Logical sector size, 512 or 4096
+    bool sparse;                    // Leave zero regions as holes
+    Copy_Mode copy_mode;
+    unsigned threads;               // Write threads of this build
+    const char *esp_dir;            // Host tree imported into the ESP root, or NULL
+    const char *boot_file;          // Host file added as /EFI/BOOT/BOOTx64.efi when there is no esp_dir, or NULL
+    bool update;                    // Update output in place when it holds a readable image
+    bool reproducible;              // Same options and inputs give the same bytes, GUIDs derived, timestamps fixed
+    const char *seed;               // GUIDs of a reproducible build derive from it, NULL uses a hash of the inputs
+    int64_t source_date;            // Seconds since 1970 stamped on ESP entries, -1 for now (1980 when reproducible)
+    const char *cache_dir;          // Content-addressed image cache (cache.h), implies reproducible, or NULL
+    const Geometry_Preset *preset;  // MBR, GPT and empty ESP come from its template (template.h) when the
+                                    // sizes, sector size and layout are the preset's, or NULL
+} Build_Options;
+
+// Defaults of the command line tool: raw test.img, 512 byte sectors, 33 MiB ESP,
+// 1 MiB data partition, random GUIDs and current timestamps
+void build_options_init(Build_Options *options);
+
+// Build options->output, or update it in place; like the sizes, the layout
+// and its payloads only apply when the image is built. Raw images get an
+// <output>.manifest for later updates. With a cache_dir, a build that is
+// cached already is copied from there instead. Messages go to stdout, a
+// caller streaming the image to stdout points output_fd at it and moves
+// stdout elsewhere first. False after an error was printed
+bool build_image(const Build_Options *options);
+
+#endif
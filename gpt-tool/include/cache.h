@@ -0,0 +1,27 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "build.h"
+#include "sha256.h"
+
+// Content-addressed image cache (--cache DIR). An image is named by the
+// SHA-256 of everything that decides its disk contents: layout, GUID seed,
+// timestamp, partition payloads and the path, size and contents of every
+// input file. Only
+// reproducible builds are cached, so a cached image is exactly what a
+// rebuild would write. Entries are DIR/<key>.img (.qcow2, .gptz) and the
+// .manifest of raw images, written under a temporary name and renamed, so
+// builds sharing DIR never see a partial entry. Streams and devices are
+// built reproducibly but never cached.
+
+// Key of the image options describe, hashes every input file
+bool cache_key(const Build_Options *options, uint8_t key[SHA256_SIZE]);
+// Reflink (or extent copy) the cached image of key to options->output,
+// false when it is not cached
+bool cache_fetch(const Build_Options *options, const uint8_t key[SHA256_SIZE]);
+// Add the built options->output to the cache as key
+bool cache_store(const Build_Options *options, const uint8_t key[SHA256_SIZE]);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// CRC32 (IEEE 802.3) engines. All take the crc of the data so far (0 to start)
+// and return the crc including buf, so they can be chained over chunks.
+
+// Reference implementation, one byte per iteration
+uint32_t crc32_scalar(uint32_t crc, const void *buf, size_t len);
+// Eight bytes per iteration using eight lookup tables
+uint32_t crc32_slice8(uint32_t crc, const void *buf, size_t len);
+// Carry-less multiply folding, falls back to slice-by-8 if not supported
+uint32_t crc32_pclmul(uint32_t crc, const void *buf, size_t len);
+bool crc32_pclmul_supported(void);
+
+// Fastest engine for this CPU
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+// CRC32 of a single buffer
+uint32_t calculate_crc32(const void *buf, int32_t len);
+
+// Extending a crc over a fixed run of zero bytes is linear in the crc
+// register, one column per register bit. Lets a mostly empty buffer be
+// checksummed by its used part only
+typedef struct {
+    uint32_t column[32];
+} Crc32_Zeros;
+
+// Prepare crc32_zeros_apply for len zero bytes
+void crc32_zeros_init(Crc32_Zeros *zeros, size_t len);
+// Same as crc32_update(crc, <len zero bytes>, len) in 32 steps
+uint32_t crc32_zeros_apply(const Crc32_Zeros *zeros, uint32_t crc);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "image.h"
+
+// Image written straight to a block device (--device).
+// The disk is planned in memory like a stream and written in one pass at the
+// close: 1 MiB writes from sector aligned buffers with O_DIRECT, many of them
+// in flight on an io_uring (pwrite one at a time where io_uring is missing).
+// Ranges without planned data are zeroed by the device itself with
+// BLKZEROOUT, which may unmap them; only a device without it gets them
+// written as zeros. Space between the end of the last partition and the
+// backup GPT keeps its old contents. A regular file works as target too, its
+// unplanned ranges stay holes.
+
+// Open name for a disk of at least size bytes. A larger device keeps its
+// size, so the backup GPT goes to its end. A mounted device is refused
+bool device_open(Image *image, const char *name, uint64_t size);
+// Write the planned disk to the device, flush it and print the throughput
+bool device_write(Image *image);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "sha256.h"
+
+// SHA-256 of host files. A digest is remembered for the rest of the process
+// under the device, inode, size, mtime and ctime of its file, so the cache key
+// and the update manifest of a build read every input file only once.
+// Thread safe.
+
+// Digest and size of host_path, st is its stat
+bool file_digest(const char *host_path, const struct stat *st, uint64_t *size, uint8_t digest[SHA256_SIZE]);
+// Remembered digest of the file of st, false if there is none
+bool file_digest_lookup(const struct stat *st, uint8_t digest[SHA256_SIZE]);
+// Remember digest for the file of st, as found in a memo of an earlier process
+void file_digest_remember(const struct stat *st, const uint8_t digest[SHA256_SIZE]);
+
+#endif
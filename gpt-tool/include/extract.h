@@ -0,0 +1,19 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// Files of an image's ESP read back through a Reader mapping, no mount and
+// no privileges needed. ESP paths are matched case-insensitively against the
+// 8.3 names stored in the image, "/" is the root directory.
+
+// List ESP path of image name to out, a directory lists its entries and with
+// recursive every directory below it
+bool esp_list(const char *name, const char *esp_path, bool recursive, FILE *out);
+// Copy ESP file or directory tree esp_path of image name to dest, "-" writes a
+// file to stdout. File data goes in runs of contiguous clusters, copied in the
+// kernel with copy_file_range where it can
+bool esp_extract(const char *name, const char *esp_path, const char *dest);
+
+#endif
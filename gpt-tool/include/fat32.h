@@ -5,8 +5,49 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include "image.h"
+#include "structures.h"
+#include "fat32_dir.h"
 
-bool write_esp(FILE* image);
-bool add_path_to_esp(char *path, FILE *image);
+bool write_esp(Image *image);
+// Read ESP geometry of an existing image after read_gpt
+bool read_esp(Image *image);
+// Add the file at ESP path with its directories, data read from host_path or,
+// when NULL, from the last path name in the current directory
+bool add_path_to_esp(char *path, const char *host_path, Image *image);
+// Add file or directory name to parent directory, file data read from host_path
+bool add_file_to_esp(const char *file_name, const char *host_path, Image *image, File_Type type, Dir_Index *parent,
+                     uint32_t *first_cluster);
+// Import a host directory tree into the ESP root with batched writes
+bool import_dir_to_esp(const char *host_dir, Image *image);
+// Bring esp_path in line with host_path (a file or directory tree), only writing
+// files whose size or hash differ from the manifest, then save the manifest
+bool update_esp(const char *host_path, const char *esp_path, Image *image, const char *manifest_name);
+// Record size and hash of host_path as esp_path for a later update_esp
+bool save_esp_manifest(const char *host_path, const char *esp_path, Image *image, const char *manifest_name);
+// Save the manifest of the image that image was cloned from as to_name, for the
+// disk GUID image has now. Nothing is hashed again
+bool copy_esp_manifest(const char *from_name, const Guid *from_guid, Image *image, const char *to_name);
+
+// FAT helpers, applied to every FAT copy
+bool fat32_alloc_chain(Image *image, uint32_t count, uint32_t *first);
+// Copy len bytes from the start of src_fd into the clusters of the chain at first
+bool fat32_copy_to_chain(Image *image, uint32_t first, int src_fd, uint64_t len);
+bool fat32_free_chain(Image *image, uint32_t first);
+// Write image->fat32_fsinfo to the FSInfo sector and its copy behind the backup
+// VBR if it changed since; allocations only update it, image_close writes it
+bool fat32_flush_fsinfo(Image *image);
+// Take a run of up to count clusters out of the free space map without writing
+// the FATs, for a caller that writes them itself: the smallest free run that
+// fits, else the largest one. Its first cluster goes to first, its length to got
+bool fat32_take_clusters(Image *image, uint32_t count, uint32_t *first, uint32_t *got);
+// Forget the free space map, for code that changed the FAT directly
+void fat32_free_extents_reset(Image *image);
+bool fat32_set_fat_entry(Image *image, uint32_t cluster, uint32_t value);
+uint32_t fat32_get_fat_entry(Image *image, uint32_t cluster);
+
+// Format filename for FAT32 as an upper case 8.3 name, for files and
+// directories alike; characters 8.3 names can not hold become '_'
+void format_fat32_name(char fat_name[11], const char *filename);
 
 #endif
\ No newline at end of file
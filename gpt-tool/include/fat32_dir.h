@@ -0,0 +1,53 @@
+#ifndef FAT32_DIR_H
+#define FAT32_DIR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "image.h"
+#include "structures.h"
+
+// In-memory index of ESP directories, keyed by the 8.3 name from format_fat32_name.
+// Each directory is read from the image once, after that lookups and inserts
+// are hash table operations and directories grow their cluster chain when full.
+
+typedef struct Dir_Index Dir_Index;
+
+typedef struct {
+    uint8_t name[11];
+    uint8_t attr;
+    uint32_t first_cluster;
+    uint32_t slot;              // Entry number in directory
+    Dir_Index *dir;             // Index of sub directory, once opened
+} Dir_Index_Entry;
+
+struct Dir_Index {
+    uint32_t *clusters;         // Cluster chain of directory
+    uint32_t num_clusters;
+    uint32_t next_slot;         // First never used entry
+    uint32_t *free_slots;       // Deleted entries below next_slot, reused before appending
+    uint32_t num_free, free_cap;
+    Dir_Index_Entry *table;     // Open addressing hash table
+    uint32_t capacity, count;
+};
+
+// Index of the ESP root directory, read on first use
+Dir_Index *dir_index_root(Image *image);
+// Index of a sub directory entry, read on first use
+Dir_Index *dir_index_open(Image *image, Dir_Index_Entry *entry);
+// Find entry by 8.3 name, NULL if not in directory
+Dir_Index_Entry *dir_index_find(Dir_Index *dir, const uint8_t name[11]);
+// Write entry into a deleted slot, or append it and grow the cluster chain if full
+bool dir_index_add(Image *image, Dir_Index *dir, const FAT32_Dir_Entry_Short *entry);
+// Read the on disk entry of an indexed name
+bool dir_index_read(Image *image, Dir_Index *dir, const Dir_Index_Entry *indexed, FAT32_Dir_Entry_Short *entry);
+// Overwrite an entry in place, the name must stay the same
+bool dir_index_update(Image *image, Dir_Index *dir, Dir_Index_Entry *indexed, const FAT32_Dir_Entry_Short *entry);
+// Next entry of directory from *pos on, NULL after the last; start with *pos = 0.
+// Entries may be removed while iterating
+Dir_Index_Entry *dir_index_next(Dir_Index *dir, uint32_t *pos);
+// Mark entry deleted, its clusters are not freed
+bool dir_index_remove(Image *image, Dir_Index *dir, Dir_Index_Entry *indexed);
+// Drop all indexes of image, the ESP was rewritten
+void dir_index_reset(Image *image);
+
+#endif
@@ -4,7 +4,14 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "image.h"
+#include "structures.h"
 
-bool write_gpt(FILE *image, uint64_t image_size_lbas);
+// Write both GPTs for a disk of image->size with the placed image->partitions,
+// or an ESP of image->esp_size and a data partition of image->data_size when
+// there are none, sets the partition LBAs in image
+bool write_gpt(Image *image);
+// Read primary GPT of an existing image, sets the partition LBAs and sizes in image
+bool read_gpt(Image *image, Guid *disk_guid);
 
 #endif
\ No newline at end of file
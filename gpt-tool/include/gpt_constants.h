@@ -2,7 +2,8 @@
 #define GPT_CONSTANTS_H
 
 enum {
-    LBA_SIZE = 512,
+    DEFAULT_LBA_SIZE = 512,         // Logical sector size unless asked for 4Kn
+    MAX_LBA_SIZE = 4096,
     GPT_PARTITION_ENTRY_SIZE = 128,
     NUMBER_OF_GPT_ENTRIES = 128,
     GPT_TABLE_SIZE = 16384,         // 128 * 128 entries
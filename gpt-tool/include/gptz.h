@@ -0,0 +1,36 @@
+#ifndef GPTZ_H
+#define GPTZ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Seekable compressed image (.gptz).
+// The disk is cut into fixed size chunks that are deflated independently, so
+// any LBA is read back by inflating one chunk. Chunks holding only zeros are
+// holes without data. File layout: header, chunk data, chunk index. The header
+// is written last and points to the index.
+
+typedef struct Gptz Gptz;
+struct Stream;
+
+// Compress the planned disk of size bytes to fd with threads workers
+bool gptz_write(struct Stream *stream, uint64_t size, int fd, unsigned threads);
+
+// Open a .gptz file for reading, checks header and index
+Gptz *gptz_open(const char *name);
+void gptz_close(Gptz *gptz);
+// Disk size in bytes
+uint64_t gptz_size(const Gptz *gptz);
+// Bytes of disk per chunk
+uint32_t gptz_chunk_size(const Gptz *gptz);
+// Read at disk byte offset, only the chunks covering the range are inflated.
+// The last chunk is kept, reads that continue in it do not inflate it again
+bool gptz_read(Gptz *gptz, uint64_t offset, void *buf, size_t len);
+// Chunks gptz_read inflated so far
+uint64_t gptz_read_chunks(const Gptz *gptz);
+// Inflate the whole disk to out_fd with threads workers. Holes are skipped on
+// regular files, written as zeros on block devices and pipes
+bool gptz_extract(Gptz *gptz, int out_fd, unsigned threads);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sha256.h"
+#include "structures.h"
+
+// How the image file is written
+typedef enum {
+    IMAGE_STDIO,    // FILE* with fseek/fwrite
+    IMAGE_MMAP,     // Whole image mapped, structures built in place, one msync
+    IMAGE_QCOW2,    // qcow2 file, only clusters holding data are allocated
+    IMAGE_STREAM,   // Planned in memory, written in LBA order on close, output may be a pipe
+    IMAGE_GPTZ,     // Planned in memory, compressed into seekable chunks on close
+    IMAGE_DEVICE,   // Planned in memory, written to a block device with O_DIRECT on close
+} Image_Backend;
+
+// How file contents are copied into the image
+typedef enum {
+    COPY_RANGE,     // Reflink (FICLONERANGE) or copy_file_range, buffered if not supported
+    COPY_BUFFERED,  // Large aligned pread/pwrite buffer
+    COPY_STDIO,     // fread/fwrite one LBA at a time
+} Copy_Mode;
+
+// One image being built or updated: the output backend, build settings, the
+// disk layout and the ESP state. Nothing is shared between images, so several
+// can be built at once from different threads.
+typedef struct {
+    Image_Backend backend;
+    const char *name;
+    FILE *file;         // IMAGE_STDIO
+    int fd;
+    uint8_t *map;       // IMAGE_MMAP
+    struct Qcow2 *qcow2;        // IMAGE_QCOW2
+    struct Stream *stream;      // IMAGE_STREAM, IMAGE_GPTZ, IMAGE_DEVICE
+    uint64_t size;      // Logical size in bytes
+    struct Write_Pool *pool;    // Worker threads for large writes, NULL writes in order
+    unsigned threads;
+
+    // Build settings, set after opening
+    uint32_t lba_size;                  // Logical sector size, 512 or 4096 (4Kn); read_gpt detects it
+    uint64_t esp_size, data_size;       // Partition sizes in bytes
+    uint32_t esp_cluster_size;          // Bytes per cluster, 0 picks by ESP size
+    bool sparse;                        // Skip writing zero regions, leave holes
+    Copy_Mode copy_mode;
+    int64_t source_date;                // Seconds since 1970 stamped on new ESP entries, -1 for now
+    bool reproducible;                  // GUIDs derived from guid_seed instead of random
+    uint8_t guid_seed[SHA256_SIZE];
+    uint32_t guid_count;                // GUIDs derived so far
+    struct Partition *partitions;       // Placed layout for write_gpt (layout.h), NULL for ESP and data partition
+    size_t num_partitions;
+
+    // Partitions, set by write_gpt or read_gpt
+    uint64_t esp_lba, esp_size_lbas;
+    uint64_t data_lba, data_size_lbas;  // First Linux data partition, 0 without one
+    uint64_t end_lba;                   // First LBA after the last partition
+
+    // ESP, set by write_esp or read_esp
+    Vbr fat32_vbr;
+    FSInfo fat32_fsinfo;                // Free space as allocations leave it, written by image_close
+    bool fat32_fsinfo_dirty;            // fat32_fsinfo differs from the FSInfo sectors
+    uint8_t fat32_sec_per_clus;
+    uint64_t fat32_fat_lba, fat32_data_lba;
+    struct Dir_Index *root_index;       // Directory index cache, fat32_dir.c
+    struct Free_Space *free_space;      // Free cluster map, fat32.c
+} Image;
+
+// Create image file of the given size, sparse until written
+bool image_open(Image *image, const char *name, Image_Backend backend, uint64_t size);
+// IMAGE_STREAM image written to a copy of fd at the close, name is for messages
+bool image_open_stream_fd(Image *image, const char *name, int fd, uint64_t size);
+// Open an existing image for in place updates, size taken from the file
+bool image_open_existing(Image *image, const char *name, Image_Backend backend);
+// Flush and close image, waits for queued writes and frees the ESP state
+bool image_close(Image *image);
+// Hand large writes and file copies to threads workers using pwrite, 1 keeps one thread
+bool image_set_threads(Image *image, unsigned threads);
+
+// Positional write/read at byte offset
+bool image_write(Image *image, uint64_t offset, const void *buf, size_t len);
+bool image_read(Image *image, uint64_t offset, void *buf, size_t len);
+// Copy len bytes from src into image at offset, one LBA at a time
+bool image_write_from_file(Image *image, uint64_t offset, FILE *src, uint64_t len);
+// Copy len bytes from start of src_fd into image at offset using image->copy_mode
+bool image_copy_from_fd(Image *image, uint64_t offset, int src_fd, uint64_t len);
+// Same from src_offset of src_fd on
+bool image_copy_from_fd_at(Image *image, uint64_t offset, int src_fd, uint64_t src_offset, uint64_t len);
+
+// Print allocated bytes vs logical size of image after the queued writes,
+// false when one of them failed
+bool image_print_allocation(Image *image);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <uchar.h>
+#include "structures.h"
+#include "image.h"
+
+// Partition layout of a disk (--partition, --layout). A partition spec is a
+// list of KEY=VALUE fields separated by ',' or whitespace, so values can not
+// hold either:
+//   type=TYPE           esp, linux (default), linux-root-x86-64, linux-root-arm64,
+//                       linux-usr-x86-64, linux-usr-arm64, swap, home, srv, var,
+//                       xbootldr, bios-boot, basic-data, lvm, raid, or a GUID
+//   name=NAME           GPT partition name, up to 36 UTF-16 units
+//   size=SIZE           size with K/M/G suffix, default the payload size
+//   align=SIZE          start alignment, a multiple of the sector size (default 1M)
+//   attrs=ATTR+...      required, no-block-io, legacy-boot, growfs, read-only,
+//                       hidden, no-automount or a bit number 0-63
+//   guid=GUID           unique partition GUID, default random or derived
+//   payload=FILE        host file written at the partition start, a rootfs or
+//                       squashfs image; reflinked where the filesystem can
+// Partitions are placed in order, each at the first aligned LBA after the one
+// before. The ESP is the partition of type esp, built from the staging tree;
+// a layout without one gets it first. Layout files hold one spec per line,
+// '#' starts a comment.
+
+typedef struct Partition {
+    char16_t name[36];
+    Guid type;
+    Guid guid;                  // Used when guid_given, else the image gives one
+    bool guid_given;
+    bool esp;                   // The FAT32 ESP
+    uint64_t size;              // Bytes, 0 takes the payload size
+    uint64_t align;             // Start alignment in bytes
+    uint64_t attributes;        // GPT attribute bits
+    char *payload;              // Host file copied to the partition start, or NULL
+
+    // Set by layout_place
+    uint64_t lba, lbas;
+} Partition;
+
+typedef struct {
+    Partition *parts;
+    size_t count, cap;
+} Layout;
+
+// Add the partition of spec to layout, where names the spec in errors
+bool layout_add(Layout *layout, const char *spec, const char *where);
+// Add a partition for every line of layout file name
+bool layout_load(Layout *layout, const char *name);
+void layout_free(Layout *layout);
+
+// The layout without --partition: ESP of esp_size, then a data partition of data_size
+void layout_default(Partition parts[2], uint64_t esp_size, uint64_t data_size);
+// Size payload partitions and place all count partitions at lba_size, *disk_lbas
+// gets the disk size holding them and both GPTs. False after an error was printed
+bool layout_place(Partition *parts, size_t count, uint32_t lba_size, uint64_t *disk_lbas);
+// Placed partitions of a disk: layout with an ESP of esp_size first when it has
+// none, or the default layout for NULL. Free the result, NULL after an error
+Partition *layout_plan(const Layout *layout, uint64_t esp_size, uint64_t data_size, uint32_t lba_size,
+                       size_t *count, uint64_t *disk_lbas);
+
+// Copy the payload of every partition of image into place, image->partitions
+// must be placed. Uses image->copy_mode, stream backends keep the fds for close
+bool write_payloads(Image *image);
+
+#endif
@@ -3,7 +3,8 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include "image.h"
 
-bool write_mbr(FILE *image);
+bool write_mbr(Image *image);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef QCOW2_H
+#define QCOW2_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// qcow2 (version 2) image writer.
+// Guest clusters get a host cluster the first time non-zero data is written to
+// them, appended after the header. L2 tables, the L1 table and the refcount
+// structures are written behind the data when the image is finished.
+
+typedef struct Qcow2 Qcow2;
+
+// Start an empty qcow2 file of size guest bytes on fd
+Qcow2 *qcow2_create(int fd, uint64_t size);
+// Write/read at guest byte offset, safe to call from several threads
+bool qcow2_write(Qcow2 *qcow2, uint64_t offset, const void *buf, size_t len);
+bool qcow2_read(Qcow2 *qcow2, uint64_t offset, void *buf, size_t len);
+// Write metadata and header, frees qcow2
+bool qcow2_finish(Qcow2 *qcow2);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "structures.h"
+
+// Read-only view of an image file through one shared mapping.
+// Nothing is copied, every accessor returns a pointer into the mapping and
+// checks the range first, so damaged images can be walked safely. Readers
+// may be used from several threads at once.
+
+typedef struct {
+    const char *name;
+    int fd;
+    const uint8_t *map;
+    uint64_t size;                      // Bytes
+    uint32_t lba_size;                  // 4096 when the GPT header is there, else 512
+
+    // ESP, set by reader_open_esp
+    uint64_t esp_lba, esp_lbas;
+    const Vbr *vbr;
+    const uint32_t *fat;                // First FAT
+    uint32_t fat_entries;               // Entries in one FAT
+    uint32_t max_cluster;               // Highest data cluster number
+    uint32_t cluster_bytes;
+    uint64_t data_offset;               // Byte offset of cluster 2
+} Reader;
+
+// Map image name read-only
+bool reader_open(Reader *reader, const char *name);
+void reader_close(Reader *reader);
+
+// count LBAs of lba_size from lba, NULL if not inside the image
+const void *reader_lba(const Reader *reader, uint64_t lba, uint64_t count);
+
+// Check the FAT32 VBR of the partition at lba and set up cluster access
+bool reader_open_esp(Reader *reader, uint64_t lba, uint64_t num_lbas);
+// Find the first EFI System Partition in the primary GPT, or the backup when
+// the primary is unreadable, and open it. CRCs are left to the verifier
+bool reader_find_esp(Reader *reader);
+// FAT entry of cluster (first FAT, reserved bits masked), 0 when out of range
+uint32_t reader_fat_entry(const Reader *reader, uint32_t cluster);
+// Data of cluster, NULL when not a data cluster of the volume
+const uint8_t *reader_cluster(const Reader *reader, uint32_t cluster);
+
+// First cluster of a directory entry
+uint32_t reader_entry_cluster(const FAT32_Dir_Entry_Short *entry);
+// Printable "NAME.EXT" of an 8.3 entry
+void reader_entry_name(const FAT32_Dir_Entry_Short *entry, char name[13]);
+
+#endif
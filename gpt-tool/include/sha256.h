@@ -0,0 +1,24 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// SHA-256 (FIPS 180-4) for cache keys and derived GUIDs, where a CRC32 is too
+// short to tell inputs apart.
+
+enum { SHA256_SIZE = 32 };
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t bytes;             // Hashed so far
+    uint8_t block[64];          // Partial block
+} Sha256;
+
+void sha256_init(Sha256 *sha);
+void sha256_update(Sha256 *sha, const void *buf, size_t len);
+void sha256_final(Sha256 *sha, uint8_t digest[SHA256_SIZE]);
+// Digest of a single buffer
+void sha256(const void *buf, size_t len, uint8_t digest[SHA256_SIZE]);
+
+#endif
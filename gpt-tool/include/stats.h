@@ -0,0 +1,43 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Build statistics for --stats.
+// Spans time phases of the build: wall time and CPU time of the calling
+// thread. Counters add up I/O calls and bytes at the places the syscalls are
+// made. While disabled every call returns after one branch.
+
+typedef enum {
+    STAT_SEEKS,
+    STAT_READS,
+    STAT_WRITES,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_ZERO_BYTES,        // Zero padding written: cluster slack, zeroed sectors and directories
+    STAT_HOLE_BYTES,        // Zero data skipped, left as holes
+    NUM_STATS,
+} Stat_Counter;
+
+typedef struct {
+    const char *name;       // NULL while disabled
+    double wall, cpu;       // Start times in seconds
+} Stats_Span;
+
+extern bool stats_enabled;
+
+// Start collecting, trace_name (may be NULL) gets a Chrome trace-event JSON.
+// The summary is printed and the trace written when the process exits
+bool stats_enable(const char *trace_name);
+
+void stats_add(Stat_Counter counter, uint64_t n);
+// One read/write call of bytes
+void stats_read(uint64_t bytes);
+void stats_write(uint64_t bytes);
+
+// Time the code between begin and end as phase name, spans may nest
+Stats_Span stats_begin(const char *name);
+void stats_end(Stats_Span *span);
+
+#endif
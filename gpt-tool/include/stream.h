@@ -0,0 +1,30 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Image planned in memory and written front to back in one pass.
+// Writes land in sparse in-memory pages, file copies are only recorded as
+// extents of their source file. stream_finish then emits every byte of the
+// disk in LBA order, so the output can be a pipe.
+
+typedef struct Stream Stream;
+
+// Start an empty plan for a disk of size bytes
+Stream *stream_create(uint64_t size);
+// Write/read at byte offset of the planned disk
+bool stream_write(Stream *stream, uint64_t offset, const void *buf, size_t len);
+bool stream_read(Stream *stream, uint64_t offset, void *buf, size_t len);
+// Plan len bytes of src_fd from src_offset at offset, data is read at stream_finish
+bool stream_add_extent(Stream *stream, uint64_t offset, int src_fd, uint64_t src_offset, uint64_t len);
+// Start of the first 64 KiB page, from the one holding offset on, with a
+// written page or a planned extent in it. size when the rest reads as zeros
+uint64_t stream_next_data(const Stream *stream, uint64_t offset);
+// Write the whole disk to out_fd in order, frees stream
+bool stream_finish(Stream *stream, int out_fd);
+// Free the plan without writing it
+void stream_destroy(Stream *stream);
+
+#endif
@@ -106,6 +106,8 @@ typedef struct {
     uint32_t FSI_TrailSig;
 } __attribute__ ((packed)) FSInfo;
 
+#define FSI_UNKNOWN UINT32_MAX          // Free count or next free cluster not known
+
 typedef struct {
     uint8_t DIR_Name[11];
     uint8_t DIR_Attr;
@@ -121,6 +123,16 @@ typedef struct {
     uint32_t DIR_FileSize;
 } __attribute__ ((packed)) FAT32_Dir_Entry_Short;
 
+// FAT32 entry values
+enum {
+    FAT_ENTRY_MASK = 0x0FFFFFFF,        // Upper 4 bits of FAT32 entries are reserved
+    FAT_BAD_CLUSTER = 0x0FFFFFF7,
+    FAT_EOC_MIN = 0x0FFFFFF8,           // End of chain from here on
+    FAT_EOC = 0x0FFFFFFF,               // End of chain as written
+};
+
+#define FAT_MAX_FILE_SIZE UINT32_MAX    // DIR_FileSize is 32 bits
+
 // FAT32 Directory entry attributes
 typedef enum {
     ATTR_READ_ONLY  = 0x01,
@@ -0,0 +1,38 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "image.h"
+
+// Fixed-geometry templates (--preset NAME). For a standard geometry all the
+// metadata of a new image is the same but for GUIDs, CRCs and directory
+// timestamps: protective MBR, both GPTs, VBR and FSInfo with their backups,
+// the first FAT entries and the /, /EFI and /EFI/BOOT directory clusters.
+// The first build of a preset in a process runs write_mbr, write_gpt and
+// write_esp once into memory and keeps the non-zero sector runs. Every build
+// after that writes those runs, patches the variable fields and checksums
+// only the used GPT entries, extending the crc over the empty rest.
+
+typedef struct {
+    const char *name;
+    const char *description;
+    uint32_t lba_size;
+    uint64_t esp_size, data_size;   // Partition sizes in bytes
+    uint32_t esp_cluster_size;      // 0 picks by ESP size
+} Geometry_Preset;
+
+// Preset called name, NULL when there is none
+const Geometry_Preset *geometry_preset(const char *name);
+// Print name and description of every preset to out
+void geometry_presets_print(FILE *out);
+
+// True when image, opened and set up for a default layout build, has exactly
+// the geometry and disk size of preset
+bool template_matches(const Geometry_Preset *preset, const Image *image);
+// Write MBR, GPT and an empty ESP from the template of preset, the same bytes
+// and Image state write_mbr, write_gpt and write_esp give. Thread safe
+bool template_write(Image *image, const Geometry_Preset *preset);
+
+#endif
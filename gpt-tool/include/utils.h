@@ -5,26 +5,41 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "structures.h"
+#include "image.h"
 
-// Globals
-extern char *image_name;
-extern uint64_t esp_size;       // 33 MiB
-extern uint64_t data_size;      // 1 MiB
-extern uint64_t image_size;
-extern uint64_t image_size_lbas, esp_size_lbas, data_size_lbas, gpt_table_lbas;
-extern uint64_t align_lba, esp_lba, data_lba, fat32_fat_lba, fat32_data_lba;
-extern uint32_t crc_table[256];
+enum {
+    FAT_EPOCH = 315532800,         // 1980-01-01 00:00:00 UTC, the first FAT date
+};
 
+// LBAs of lba_size bytes of a disk with the default layout: an ESP and a
+// data partition of these byte sizes, MBR, both GPTs and partition alignment
+uint64_t disk_size_lbas(uint64_t esp_size, uint64_t data_size, uint32_t lba_size);
 // Convert bytes to LBAs
-uint64_t bytes_to_lbas(const uint64_t bytes);
-// Pad out 0s for bigger lbas
-void write_full_lba_size(FILE* image);
-uint64_t next_aligned_lba(uint64_t lba);
-void get_fat_dir_entry_time_date(uint16_t *in_time, uint16_t *in_date);
-// Create CRC32 table values
-void create_crc32_table(void);
-uint32_t calculate_crc32(const void *buf, int32_t len);
-// Create vers 4 Variant 2 GUID
+uint64_t bytes_to_lbas(const uint64_t bytes, uint32_t lba_size);
+// Parse byte count with optional K/M/G suffix (powers of 1024)
+bool parse_size(const char *str, uint64_t *bytes);
+// Check if buffer is all zeros
+bool is_zero_block(const void *buf, size_t len);
+// First LBA of FAT32 data cluster of the image's ESP
+uint64_t cluster_to_lba(const Image *image, uint32_t cluster);
+// FAT time and date for new directory entries: image->source_date, or now
+void get_fat_dir_entry_time_date(const Image *image, uint16_t *in_time, uint16_t *in_date);
+// Parse a GUID written as XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX
+bool parse_guid(const char *str, Guid *guid);
+// Create vers 4 Variant 2 GUID from the kernel random source, thread safe
 Guid new_guid(void);
+// Next GUID of image, derived from image->guid_seed when it is reproducible
+Guid image_guid(Image *image);
+// Read, pread or write all of len bytes, retrying short transfers and EINTR.
+// Counted in the stats; false on an error or end of file
+bool pread_all(int fd, void *buf, size_t len, uint64_t offset);
+bool pwrite_all(int fd, const void *buf, size_t len, uint64_t offset);
+bool write_all(int fd, const void *buf, size_t len);
+// Reflink src as dst, or copy its data extents so holes stay holes
+bool clone_file(const char *src, const char *dst);
+// Names in directory path but . and .., sorted by strcmp as the ESP import
+// places them. Free with free_names
+bool list_dir(const char *path, char ***names, size_t *count);
+void free_names(char **names, size_t count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// Read-only consistency check of an image: protective MBR, both GPT headers
+// and tables, ESP VBR and its backup, FSInfo, FAT copies and every cluster
+// chain reachable from the root directory. FAT scans and chain walks run on
+// threads workers. A JSON report is written to report.
+// Returns true when no errors were found, warnings do not count.
+bool verify_image(const char *name, unsigned threads, FILE *report);
+
+#endif
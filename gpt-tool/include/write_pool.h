@@ -0,0 +1,28 @@
+#ifndef WRITE_POOL_H
+#define WRITE_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Worker threads running image writes at fixed offsets.
+// Each job owns the byte range it writes. A new job, or a caller about to touch
+// the image, first waits for pending jobs on an overlapping range, so the image
+// ends up the same as if every write ran in order on one thread.
+
+typedef struct Write_Pool Write_Pool;
+
+// Job body, owns and frees arg
+typedef bool (*Write_Job_Fn)(void *arg);
+
+// Start threads workers, submit blocks while max_pending_bytes are queued
+Write_Pool *write_pool_create(unsigned threads, uint64_t max_pending_bytes);
+// Queue fn(arg) writing [offset, offset + len)
+bool write_pool_submit(Write_Pool *pool, uint64_t offset, uint64_t len, Write_Job_Fn fn, void *arg);
+// Wait until no pending job overlaps [offset, offset + len)
+void write_pool_wait_range(Write_Pool *pool, uint64_t offset, uint64_t len);
+// Wait for every job, false if any job failed since the pool was created
+bool write_pool_wait(Write_Pool *pool);
+// Wait for every job and stop the workers
+bool write_pool_destroy(Write_Pool *pool);
+
+#endif
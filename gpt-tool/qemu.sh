@@ -1,8 +1,19 @@
 #!/bin/sh
 
+# Usage: qemu.sh [raw|qcow2] [512|4096], qcow2 boots test.qcow2 from ./main --format qcow2,
+# 4096 boots an image from ./main --sector-size 4096 as a 4Kn NVMe drive
+FORMAT=${1:-raw}
+SECTOR_SIZE=${2:-512}
+IMAGE=test.img
+[ "$FORMAT" = qcow2 ] && IMAGE=test.qcow2
+
+# IDE disks always have 512 byte sectors
+DISK="ide-hd,drive=disk0,model=NOS Boot Manager,serial=NOSDISK"
+[ "$SECTOR_SIZE" = 4096 ] && DISK="nvme,drive=disk0,serial=NOSDISK,logical_block_size=4096,physical_block_size=4096"
+
 qemu-system-x86_64 -enable-kvm -machine q35 \
--device ide-hd,drive=disk0,model=NOS\ Boot\ Manager,serial=NOSDISK \
--drive id=disk0,format=raw,file=test.img,if=none \
+-device "$DISK" \
+-drive id=disk0,format=$FORMAT,file=$IMAGE,if=none \
 -bios /usr/share/edk2-ovmf/x64/OVMF.4m.fd \
 -name NOS \
 -net none
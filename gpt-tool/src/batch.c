@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "build.h"
+#include "gpt_constants.h"
+#include "utils.h"
+#include "mbr.h"
+#include "gpt.h"
+#include "layout.h"
+#include "fat32.h"
+#include "stats.h"
+
+typedef struct {
+    const char *esp_path;
+    const char *host_path;
+    size_t image;               // Owning image, SIZE_MAX for every image
+} Batch_File;
+
+typedef struct {
+    Build_Options options;
+    const char *payload;        // Data partition contents, or NULL
+    bool data_size_given;
+    size_t base;                // Image the ESP is cloned from, its own index for a group base
+} Batch_Image;
+
+typedef struct {
+    char *text;                 // Manifest contents, all strings point into it
+    Batch_Image *images;
+    size_t count, cap;
+    Batch_File *files;
+    size_t num_files, files_cap;
+    _Atomic size_t next;        // Next image to work on
+    atomic_bool failed;
+} Batch;
+
+typedef bool (*Batch_Fn)(Batch *batch, size_t i);
+
+typedef struct {
+    Batch *batch;
+    Batch_Fn fn;
+} Batch_Worker;
+
+static bool same_string(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+// Images that can share one ESP build
+static bool same_esp(const Build_Options *a, const Build_Options *b) {
+    return same_string(a->esp_dir, b->esp_dir) && same_string(a->boot_file, b->boot_file) &&
+           a->esp_size == b->esp_size && a->esp_cluster_size == b->esp_cluster_size && a->sparse == b->sparse &&
+           a->lba_size == b->lba_size;
+}
+
+static char *read_text(const char *name) {
+    FILE *fp = fopen(name, "r");
+    if (!fp) return NULL;
+    char *text = NULL;
+    long size = -1;
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+        text = malloc(size + 1);
+        if (text && fread(text, 1, size, fp) != (size_t)size) {
+            free(text);
+            text = NULL;
+        }
+        if (text) text[size] = '\0';
+    }
+    fclose(fp);
+    return text;
+}
+
+static bool add_file(Batch *batch, const char *esp_path, const char *host_path, size_t image) {
+    if (batch->num_files == batch->files_cap) {
+        size_t cap = batch->files_cap ? batch->files_cap * 2 : 16;
+        Batch_File *files = realloc(batch->files, cap * sizeof *files);
+        if (!files) return false;
+        batch->files = files;
+        batch->files_cap = cap;
+    }
+    batch->files[batch->num_files++] = (Batch_File){ esp_path, host_path, image };
+    return true;
+}
+
+static bool add_image(Batch *batch, const Batch_Image *defaults, const char *output) {
+    if (batch->count == batch->cap) {
+        size_t cap = batch->cap ? batch->cap * 2 : 16;
+        Batch_Image *images = realloc(batch->images, cap * sizeof *images);
+        if (!images) return false;
+        batch->images = images;
+        batch->cap = cap;
+    }
+    Batch_Image *image = &batch->images[batch->count++];
+    *image = *defaults;
+    image->options.output = output;
+    return true;
+}
+
+// Split the manifest into images, the first image line ends the defaults
+static bool parse_manifest(Batch *batch, const char *name) {
+    batch->text = read_text(name);
+    if (!batch->text) {
+        fprintf(stderr, "Error: could not read batch manifest '%s'\n", name);
+        return false;
+    }
+
+    Batch_Image defaults = { 0 };
+    build_options_init(&defaults.options);
+    unsigned line_no = 0;
+    char *next = batch->text;
+    while (next) {
+        char *line = next;
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        line_no++;
+        line[strcspn(line, "#")] = '\0';
+
+        char *save = NULL;
+        char *key = strtok_r(line, " \t\r", &save);
+        if (!key) continue;
+        char *value = strtok_r(NULL, " \t\r", &save);
+        char *extra = value ? strtok_r(NULL, " \t\r", &save) : NULL;
+        bool want_extra = strcmp(key, "file") == 0;
+        bool want_value = strcmp(key, "sparse") != 0;
+        if ((want_value && !value) || (!want_value && value) || (want_extra && !extra) ||
+            (!want_extra && extra) || (want_extra && strtok_r(NULL, " \t\r", &save))) {
+            fprintf(stderr, "Error: %s:%u: wrong number of values for '%s'\n", name, line_no, key);
+            return false;
+        }
+
+        Batch_Image *image = batch->count ? &batch->images[batch->count - 1] : &defaults;
+        Build_Options *options = &image->options;
+        uint64_t size = 0;
+        bool ok = true;
+        if (strcmp(key, "image") == 0) {
+            ok = add_image(batch, &defaults, value);
+        } else if (strcmp(key, "esp-dir") == 0) {
+            options->esp_dir = value;
+        } else if (strcmp(key, "boot-file") == 0) {
+            options->boot_file = value;
+        } else if (strcmp(key, "esp-size") == 0) {
+            ok = parse_size(value, &options->esp_size);
+        } else if (strcmp(key, "cluster-size") == 0) {
+            ok = parse_size(value, &size) && size <= UINT32_MAX;
+            options->esp_cluster_size = size;
+        } else if (strcmp(key, "sector-size") == 0) {
+            ok = parse_size(value, &size) && (size == DEFAULT_LBA_SIZE || size == MAX_LBA_SIZE);
+            options->lba_size = size;
+        } else if (strcmp(key, "preset") == 0) {
+            options->preset = geometry_preset(value);
+            if (options->preset) {
+                options->lba_size = options->preset->lba_size;
+                options->esp_size = options->preset->esp_size;
+                options->data_size = options->preset->data_size;
+                options->esp_cluster_size = options->preset->esp_cluster_size;
+            }
+            ok = options->preset != NULL;
+        } else if (strcmp(key, "sparse") == 0) {
+            options->sparse = true;
+        } else if (strcmp(key, "data-size") == 0) {
+            ok = parse_size(value, &options->data_size);
+            image->data_size_given = true;
+        } else if (strcmp(key, "data") == 0) {
+            image->payload = value;
+        } else if (strcmp(key, "file") == 0) {
+            if (value[0] != '/') {
+                fprintf(stderr, "Error: %s:%u: ESP path '%s' must start with '/'\n", name, line_no, value);
+                return false;
+            }
+            ok = add_file(batch, value, extra, batch->count ? batch->count - 1 : SIZE_MAX);
+        } else {
+            fprintf(stderr, "Error: %s:%u: unknown key '%s'\n", name, line_no, key);
+            return false;
+        }
+        if (!ok) {
+            fprintf(stderr, "Error: %s:%u: invalid value '%s' for '%s'\n", name, line_no, value, key);
+            return false;
+        }
+    }
+
+    if (batch->count == 0) {
+        fprintf(stderr, "Error: no images in batch manifest '%s'\n", name);
+        return false;
+    }
+    return true;
+}
+
+// Size data partitions for their payloads and find the ESP group of every image
+static bool plan_batch(Batch *batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        Batch_Image *image = &batch->images[i];
+        Build_Options *options = &image->options;
+
+        for (size_t j = 0; j < i; j++) {
+            if (strcmp(batch->images[j].options.output, options->output) == 0) {
+                fprintf(stderr, "Error: image '%s' is in the batch twice\n", options->output);
+                return false;
+            }
+        }
+
+        struct stat st;
+        if (image->payload && stat(image->payload, &st) != 0) {
+            fprintf(stderr, "Error: could not stat data payload '%s'\n", image->payload);
+            return false;
+        }
+        if (image->payload && (uint64_t)st.st_size > options->data_size) {
+            if (image->data_size_given) {
+                fprintf(stderr, "Error: data payload '%s' does not fit the %llu byte data partition of '%s'\n",
+                        image->payload, (unsigned long long)options->data_size, options->output);
+                return false;
+            }
+            options->data_size = (st.st_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        }
+
+        image->base = i;
+        for (size_t j = 0; j < i && image->base == i; j++) {
+            if (batch->images[j].base == j && same_esp(&batch->images[j].options, options)) image->base = j;
+        }
+    }
+    return true;
+}
+
+// Bring the ESP files of owner, SIZE_MAX for those of every image, into the open image
+static bool write_files(const Batch *batch, size_t owner, Image *image, const char *manifest) {
+    bool ok = true;
+    for (size_t f = 0; ok && f < batch->num_files; f++) {
+        const Batch_File *file = &batch->files[f];
+        if (file->image == owner) ok = update_esp(file->host_path, file->esp_path, image, manifest);
+    }
+    return ok;
+}
+
+// Write the files of every image into the built base, so clones get them with the copy
+static bool write_global_files(const Batch *batch, const Build_Options *options, const char *manifest) {
+    bool any = false;
+    for (size_t f = 0; f < batch->num_files; f++) any = any || batch->files[f].image == SIZE_MAX;
+    if (!any) return true;
+
+    Image img;
+    Image *image = &img;
+    if (!image_open_existing(image, options->output, IMAGE_STDIO)) {
+        fprintf(stderr, "Error: could not open %s\n", options->output);
+        return false;
+    }
+    image->copy_mode = options->copy_mode;
+    bool ok = write_files(batch, SIZE_MAX, image, manifest);
+    return image_close(image) && ok;
+}
+
+// Build the ESP of a group once into its base image with the files every image
+// gets, then clone the image and its manifest for every other image of the group
+static bool build_group(Batch *batch, size_t i) {
+    Batch_Image *base = &batch->images[i];
+    if (base->base != i) return true;
+
+    char base_manifest[4096], manifest[4096];
+    snprintf(base_manifest, sizeof base_manifest, "%s.manifest", base->options.output);
+
+    Stats_Span span = stats_begin("batch_build_esp");
+    bool ok = build_image(&base->options) && write_global_files(batch, &base->options, base_manifest);
+    stats_end(&span);
+
+    span = stats_begin("batch_clone");
+    for (size_t j = i + 1; ok && j < batch->count; j++) {
+        const Batch_Image *image = &batch->images[j];
+        if (image->base != i) continue;
+        snprintf(manifest, sizeof manifest, "%s.manifest", image->options.output);
+        ok = clone_file(base->options.output, image->options.output) && clone_file(base_manifest, manifest);
+    }
+    stats_end(&span);
+    return ok;
+}
+
+static bool write_payload(Image *image, const char *payload) {
+    int fd = open(payload, O_RDONLY);
+    struct stat st;
+    bool ok = fd >= 0 && fstat(fd, &st) == 0 &&
+              image_copy_from_fd(image, image->data_lba * image->lba_size, fd, st.st_size);
+    if (fd >= 0) close(fd);
+    if (!ok) fprintf(stderr, "Error: could not write data payload '%s' to %s\n", payload, image->name);
+    return ok;
+}
+
+// Give an image its own GUIDs and disk size when it is a clone, then write
+// its data payload and its own ESP files
+static bool patch_image(Batch *batch, size_t i) {
+    const Batch_Image *batch_image = &batch->images[i];
+    const Build_Options *options = &batch_image->options;
+    const bool clone = batch_image->base != i;
+    char manifest[4096];
+    snprintf(manifest, sizeof manifest, "%s.manifest", options->output);
+
+    Stats_Span span = stats_begin("batch_patch");
+    bool ok = true;
+    if (clone) {
+        // Cut off the data partition and backup GPT of the base, grow to this disk size
+        const uint32_t lba_size = options->lba_size;
+        Partition parts[2];
+        uint64_t disk_lbas = 0;
+        layout_default(parts, options->esp_size, options->data_size);
+        ok = layout_place(parts, 2, lba_size, &disk_lbas) &&
+             truncate(options->output, parts[1].lba * lba_size) == 0 &&
+             truncate(options->output, disk_lbas * lba_size) == 0;
+    }
+
+    Image img;
+    Image *image = &img;
+    ok = ok && image_open_existing(image, options->output, IMAGE_STDIO);
+    if (!ok) {
+        stats_end(&span);
+        fprintf(stderr, "Error: could not open %s\n", options->output);
+        return false;
+    }
+    image->copy_mode = options->copy_mode;
+
+    Guid base_guid;
+    ok = read_gpt(image, &base_guid);
+    if (ok && clone) {
+        image->esp_size = options->esp_size;
+        image->data_size = options->data_size;
+        ok = write_mbr(image) && write_gpt(image) && copy_esp_manifest(manifest, &base_guid, image, manifest);
+    }
+    if (ok && batch_image->payload) ok = write_payload(image, batch_image->payload);
+    if (ok) ok = write_files(batch, i, image, manifest);
+    ok = image_close(image) && ok;
+    stats_end(&span);
+
+    if (!ok) fprintf(stderr, "Error: could not finish %s\n", options->output);
+    return ok;
+}
+
+static void *batch_worker(void *arg) {
+    Batch_Worker *worker = arg;
+    Batch *batch = worker->batch;
+    for (;;) {
+        size_t i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->count) break;
+        if (!atomic_load(&batch->failed) && !worker->fn(batch, i)) atomic_store(&batch->failed, true);
+    }
+    return NULL;
+}
+
+// Run fn for every image on up to jobs threads, false if any failed
+static bool run_batch(Batch *batch, Batch_Fn fn, unsigned jobs) {
+    Batch_Worker worker = { batch, fn };
+    pthread_t threads[64];
+    unsigned started = 0;
+    if (jobs > batch->count) jobs = batch->count;
+    if (jobs > 64) jobs = 64;
+
+    atomic_store(&batch->next, 0);
+    for (; started + 1 < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, &worker) != 0) break;
+    }
+    // Whatever is left is done here
+    batch_worker(&worker);
+    for (unsigned t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    return !atomic_load(&batch->failed);
+}
+
+bool build_batch(const char *manifest_name, unsigned jobs) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Batch batch = { 0 };
+    bool ok = parse_manifest(&batch, manifest_name) && plan_batch(&batch);
+
+    // Every ESP group is done before any image is patched, so clones never
+    // see a base image that already has its own files
+    ok = ok && run_batch(&batch, build_group, jobs) && run_batch(&batch, patch_image, jobs);
+
+    if (ok) {
+        size_t groups = 0;
+        for (size_t i = 0; i < batch.count; i++) groups += batch.images[i].base == i;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        printf("Built %zu images from %zu ESP builds in %.1f ms\n", batch.count, groups, ms);
+    }
+
+    free(batch.images);
+    free(batch.files);
+    free(batch.text);
+    return ok;
+}
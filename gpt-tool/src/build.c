@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "build.h"
+#include "gpt_constants.h"
+#include "utils.h"
+#include "mbr.h"
+#include "gpt.h"
+#include "fat32.h"
+#include "stats.h"
+#include "cache.h"
+
+void build_options_init(Build_Options *options) {
+    *options = (Build_Options){
+        .output = "test.img",
+        .output_fd = -1,
+        .backend = IMAGE_STDIO,
+        .lba_size = DEFAULT_LBA_SIZE,
+        .esp_size = 1024 * 1024 * 33,       // 33 MiB
+        .data_size = 1024 * 1024 * 1,       // 1 MiB
+        .copy_mode = COPY_RANGE,
+        .threads = 1,
+        .source_date = -1,
+    };
+}
+
+static bool is_reproducible(const Build_Options *options) {
+    return options->reproducible || options->cache_dir;
+}
+
+// Settings of options that apply to the opened image
+static void apply_options(Image *image, const Build_Options *options, const uint8_t guid_seed[SHA256_SIZE]) {
+    image->lba_size = options->lba_size;
+    image->esp_size = options->esp_size;
+    image->data_size = options->data_size;
+    image->esp_cluster_size = options->esp_cluster_size;
+    image->sparse = options->sparse;
+    image->copy_mode = options->copy_mode;
+    image->reproducible = is_reproducible(options);
+    memcpy(image->guid_seed, guid_seed, SHA256_SIZE);
+    image->source_date = options->source_date;
+    if (image->reproducible && image->source_date < 0) image->source_date = FAT_EPOCH;
+}
+
+// Update an existing image in place, false in *rebuild when it has to be built new
+static bool update_image(const Build_Options *options, const uint8_t guid_seed[SHA256_SIZE], const char *host_input,
+                         const char *esp_input, const char *manifest_name, bool *rebuild) {
+    Image img;
+    Image *image = &img;
+    *rebuild = true;
+
+    Stats_Span span = stats_begin("read_image");
+    bool existing = image_open_existing(image, options->output, options->backend);
+    if (existing) apply_options(image, options, guid_seed);
+    bool readable = existing && read_gpt(image, NULL) && read_esp(image);
+    stats_end(&span);
+    if (!existing) return true;
+
+    if (!readable || !image_set_threads(image, options->threads)) {
+        printf("Rebuilding %s\n", options->output);
+        image_close(image);
+        return true;
+    }
+    *rebuild = false;
+
+    // Old data is overwritten, zero blocks can not be skipped
+    image->sparse = false;
+    span = stats_begin("update_esp");
+    bool ok = update_esp(host_input, esp_input, image, manifest_name);
+    stats_end(&span);
+    span = stats_begin("image_close");
+    ok = image_close(image) && ok;
+    stats_end(&span);
+    if (!ok) fprintf(stderr, "Error: could not update %s\n", options->output);
+    return ok;
+}
+
+// Write protective MBR, GPT headers & tables and the EFI System Partition
+static bool write_metadata(Image *image, const char *name) {
+    Stats_Span span;
+    bool ok;
+
+    // Write protective MBR
+    span = stats_begin("write_mbr");
+    ok = write_mbr(image);
+    stats_end(&span);
+    if (!ok) {
+        fprintf(stderr, "Error: could not write protective MBR for file %s\n", name);
+        return false;
+    }
+
+    // Write GPT headers & tables
+    span = stats_begin("write_gpt");
+    ok = write_gpt(image);
+    stats_end(&span);
+    if (!ok) {
+        fprintf(stderr, "Error: could not write GPT headers & tables for file %s\n", name);
+        return false;
+    }
+
+    // Write EFI System Partition
+    span = stats_begin("write_esp");
+    ok = write_esp(image);
+    stats_end(&span);
+    if (!ok) {
+        fprintf(stderr, "Error: could not write ESP for file %s\n", name);
+        return false;
+    }
+    return true;
+}
+
+bool build_image(const Build_Options *options) {
+    const char *name = options->output;
+    const Image_Backend backend = options->backend;
+
+    // Files tracked in the manifest: the staging tree, or the boot file
+    char manifest_name[4096];
+    snprintf(manifest_name, sizeof manifest_name, "%s.manifest", name);
+    const char *host_input = options->esp_dir ? options->esp_dir : options->boot_file;
+    const char *esp_input = options->esp_dir ? "/" : "/EFI/BOOT/BOOTx64.efi";
+
+    // Reproducible GUIDs derive from the seed, or from the cache key that
+    // covers every input
+    uint8_t key[SHA256_SIZE] = { 0 }, guid_seed[SHA256_SIZE];
+    bool cached = options->cache_dir && backend != IMAGE_STREAM && backend != IMAGE_DEVICE;
+    bool keyed = cached || (is_reproducible(options) && !options->seed);
+    if (keyed && !cache_key(options, key)) return false;
+    if (options->seed) sha256(options->seed, strlen(options->seed), guid_seed);
+    else memcpy(guid_seed, key, SHA256_SIZE);
+
+    // Update in place if there is an image with a readable GPT and ESP
+    if (options->update) {
+        bool rebuild = true;
+        bool ok = update_image(options, guid_seed, host_input, esp_input, manifest_name, &rebuild);
+        if (!rebuild) return ok;
+    }
+
+    if (cached && cache_fetch(options, key)) {
+        printf("Image '%s' taken from cache %s\n", name, options->cache_dir);
+        return true;
+    }
+
+    // img creation
+    Image img;
+    Image *image = &img;
+    Stats_Span span = stats_begin("image_open");
+    size_t num_partitions = 0;
+    uint64_t disk_lbas = 0;
+    Partition *partitions = layout_plan(options->layout, options->esp_size, options->data_size, options->lba_size,
+                                        &num_partitions, &disk_lbas);
+    uint64_t size = disk_lbas * options->lba_size;
+    bool ok = partitions && (backend == IMAGE_STREAM && options->output_fd >= 0
+                                 ? image_open_stream_fd(image, name, options->output_fd, size)
+                                 : image_open(image, name, backend, size));
+    if (ok) {
+        apply_options(image, options, guid_seed);
+        image->partitions = partitions;
+        image->num_partitions = num_partitions;
+    }
+    // qcow2 places clusters in the order they are written, workers would shuffle them
+    ok = ok && image_set_threads(image, is_reproducible(options) && backend == IMAGE_QCOW2 ? 1 : options->threads);
+    stats_end(&span);
+    if (!ok) {
+        free(partitions);
+        return false;
+    }
+
+    // MBR, GPT and the empty ESP, from the preset template when the geometry is its own
+    if (options->preset && !options->layout && template_matches(options->preset, image)) {
+        span = stats_begin("write_template");
+        ok = template_write(image, options->preset);
+        stats_end(&span);
+    }
+    else {
+        ok = write_metadata(image, name);
+    }
+    if (!ok) {
+        goto fail;
+    }
+
+    // Import staging directory tree
+    if (options->esp_dir) {
+        span = stats_begin("import_dir_to_esp");
+        ok = import_dir_to_esp(options->esp_dir, image);
+        stats_end(&span);
+        if (!ok) {
+            goto fail;
+        }
+    }
+
+    // Add the boot loader when there is no staging tree
+    else if (options->boot_file) {
+        char path[] = "/EFI/BOOT/BOOTx64.efi";
+        if (!add_path_to_esp(path, options->boot_file, image)) {
+            fprintf(stderr, "Error: Could not add file '%s'\n", path);
+        }
+    }
+
+    // Partition payloads, prebuilt root filesystems and the like
+    span = stats_begin("write_payloads");
+    ok = write_payloads(image);
+    stats_end(&span);
+    if (!ok) {
+        goto fail;
+    }
+
+    // Record what was written for later --update runs
+    if (backend == IMAGE_STDIO || backend == IMAGE_MMAP) {
+        span = stats_begin("save_esp_manifest");
+        ok = save_esp_manifest(host_input, esp_input, image, manifest_name);
+        stats_end(&span);
+        if (!ok) {
+            goto fail;
+        }
+    }
+
+    if (image->sparse && (backend == IMAGE_STDIO || backend == IMAGE_MMAP) && !image_print_allocation(image)) {
+        fprintf(stderr, "Error: could not finish writing %s\n", name);
+        goto fail;
+    }
+
+    span = stats_begin("image_close");
+    ok = image_close(image);
+    stats_end(&span);
+    free(partitions);
+    if (!ok) {
+        fprintf(stderr, "Error: could not finish writing %s\n", name);
+        return false;
+    }
+
+    struct stat st;
+    if ((backend == IMAGE_QCOW2 || backend == IMAGE_GPTZ) && stat(name, &st) == 0) {
+        printf("Image '%s': %llu byte %s file for a %llu byte disk\n", name,
+               (unsigned long long)st.st_size, backend == IMAGE_QCOW2 ? "qcow2" : "gptz",
+               (unsigned long long)size);
+    }
+
+    // The image is built either way, a cache that can not take it is no error
+    if (cached && !cache_store(options, key)) {
+        fprintf(stderr, "Warning: could not add %s to cache %s\n", name, options->cache_dir);
+    }
+    return true;
+
+fail:
+    image_close(image);
+    free(partitions);
+    return false;
+}
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "digest.h"
+#include "utils.h"
+#include "stats.h"
+
+enum {
+    CACHE_VERSION = 4,                  // Bump when the same inputs give other image bytes
+    RACY_SECONDS = 2,                   // Files changed this recently may change again unseen
+};
+
+static const char *format_suffix(Image_Backend backend) {
+    switch (backend) {
+        case IMAGE_QCOW2: return "qcow2";
+        case IMAGE_GPTZ: return "gptz";
+        default: return "img";
+    }
+}
+
+static void to_hex(const uint8_t *bytes, size_t len, char *hex) {
+    for (size_t i = 0; i < len; i++) sprintf(hex + 2 * i, "%02x", bytes[i]);
+}
+
+static bool from_hex(const char *hex, uint8_t *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned value;
+        if (sscanf(hex + 2 * i, "%2x", &value) != 1) return false;
+        bytes[i] = value;
+    }
+    return true;
+}
+
+// Digest of a host file, remembered in DIR/files under its inode, size,
+// mtime and ctime so unchanged inputs are not read again. Every write moves
+// ctime, also when mtime is set back. Files changed in the last seconds are
+// not remembered, they could change again within the same timestamp
+static bool memo_digest(const Build_Options *options, const char *host_path, const struct stat *st,
+                        uint8_t digest[SHA256_SIZE]) {
+    uint64_t size = 0;
+    if (!options->cache_dir || file_digest_lookup(st, digest)) return file_digest(host_path, st, &size, digest);
+
+    char identity[256], memo[4096], hex[2 * SHA256_SIZE + 1];
+    uint8_t id[SHA256_SIZE];
+    int len = snprintf(identity, sizeof identity, "%llu %llu %lld %lld.%09ld %lld.%09ld",
+                       (unsigned long long)st->st_dev, (unsigned long long)st->st_ino, (long long)st->st_size,
+                       (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+                       (long long)st->st_ctim.tv_sec, st->st_ctim.tv_nsec);
+    sha256(identity, len, id);
+    to_hex(id, SHA256_SIZE, hex);
+    snprintf(memo, sizeof memo, "%s/files/%s", options->cache_dir, hex);
+
+    FILE *fp = fopen(memo, "r");
+    bool found = fp && fgets(hex, sizeof hex, fp) && strlen(hex) == 2 * SHA256_SIZE &&
+                 from_hex(hex, digest, SHA256_SIZE);
+    if (fp) fclose(fp);
+    if (found) {
+        file_digest_remember(st, digest);
+        return true;
+    }
+
+    if (!file_digest(host_path, st, &size, digest)) return false;
+    if (time(NULL) - st->st_ctim.tv_sec < RACY_SECONDS || (uint64_t)st->st_size != size) return true;
+
+    // Best effort, the next build hashes the file again when this fails
+    char dir[4096], tmp[4200];
+    snprintf(dir, sizeof dir, "%s/files", options->cache_dir);
+    snprintf(tmp, sizeof tmp, "%s.tmp.%ld", memo, (long)getpid());
+    mkdir(options->cache_dir, 0755);
+    mkdir(dir, 0755);
+    to_hex(digest, SHA256_SIZE, hex);
+    fp = fopen(tmp, "w");
+    bool saved = fp && fputs(hex, fp) >= 0;
+    if (fp && fclose(fp) != 0) saved = false;
+    if (!saved || rename(tmp, memo) != 0) unlink(tmp);
+    return true;
+}
+
+// Add the tree at host_path, imported as esp_path, to the key. Entries go in
+// sorted by name like the import places them
+static bool hash_tree(const Build_Options *options, Sha256 *key, const char *host_path, const char *esp_path) {
+    struct stat st;
+    if (stat(host_path, &st) != 0) {
+        fprintf(stderr, "Error: could not stat '%s'\n", host_path);
+        return false;
+    }
+
+    char line[8192];
+    if (S_ISREG(st.st_mode)) {
+        uint8_t digest[SHA256_SIZE];
+        char hex[2 * SHA256_SIZE + 1];
+        if (!memo_digest(options, host_path, &st, digest)) return false;
+        to_hex(digest, SHA256_SIZE, hex);
+        int len = snprintf(line, sizeof line, "file %s %lld %s\n", esp_path, (long long)st.st_size, hex);
+        sha256_update(key, line, len);
+        return true;
+    }
+    if (!S_ISDIR(st.st_mode)) return true;
+
+    int len = snprintf(line, sizeof line, "dir %s\n", esp_path);
+    sha256_update(key, line, len);
+
+    char **names = NULL;
+    size_t num_names = 0;
+    bool ok = list_dir(host_path, &names, &num_names);
+    for (size_t i = 0; ok && i < num_names; i++) {
+        char child_host[4096], child_esp[4096];
+        snprintf(child_host, sizeof child_host, "%s/%s", host_path, names[i]);
+        snprintf(child_esp, sizeof child_esp, "%s/%s", strcmp(esp_path, "/") == 0 ? "" : esp_path, names[i]);
+        ok = hash_tree(options, key, child_host, child_esp);
+    }
+    free_names(names, num_names);
+    return ok;
+}
+
+// Add partition i of the layout to the key, its payload by contents
+static bool hash_partition(const Build_Options *options, Sha256 *key, size_t i, const Partition *part) {
+    char line[512], hex[2 * SHA256_SIZE + 1];
+    int len = snprintf(line, sizeof line, "partition %zu esp %d size %llu align %llu attributes %llx guid-given %d\n",
+                       i, part->esp, (unsigned long long)part->size, (unsigned long long)part->align,
+                       (unsigned long long)part->attributes, part->guid_given);
+    sha256_update(key, line, len);
+    sha256_update(key, &part->type, sizeof part->type);
+    sha256_update(key, &part->guid, sizeof part->guid);
+    sha256_update(key, part->name, sizeof part->name);
+    if (!part->payload) return true;
+
+    struct stat st;
+    uint8_t digest[SHA256_SIZE];
+    if (stat(part->payload, &st) != 0) {
+        fprintf(stderr, "Error: could not stat payload '%s'\n", part->payload);
+        return false;
+    }
+    if (!memo_digest(options, part->payload, &st, digest)) return false;
+    to_hex(digest, SHA256_SIZE, hex);
+    len = snprintf(line, sizeof line, "payload %lld %s\n", (long long)st.st_size, hex);
+    sha256_update(key, line, len);
+    return true;
+}
+
+bool cache_key(const Build_Options *options, uint8_t key[SHA256_SIZE]) {
+    Stats_Span span = stats_begin("cache_key");
+    Sha256 sha;
+    sha256_init(&sha);
+
+    // Disk contents only, the format is in the entry name and sparse files
+    // hold the same bytes
+    char line[512];
+    int len = snprintf(line, sizeof line,
+                       "gpt-tool image cache %d\nsector-size %u\nesp-size %llu\ndata-size %llu\n"
+                       "cluster-size %u\nsource-date %lld\n",
+                       CACHE_VERSION, options->lba_size, (unsigned long long)options->esp_size,
+                       (unsigned long long)options->data_size, options->esp_cluster_size,
+                       (long long)options->source_date);
+    sha256_update(&sha, line, len);
+    if (options->seed) {
+        len = snprintf(line, sizeof line, "seed %zu ", strlen(options->seed));
+        sha256_update(&sha, line, len);
+        sha256_update(&sha, options->seed, strlen(options->seed));
+    }
+
+    bool ok = true;
+    if (options->esp_dir) ok = hash_tree(options, &sha, options->esp_dir, "/");
+    else if (options->boot_file) ok = hash_tree(options, &sha, options->boot_file, "/EFI/BOOT/BOOTx64.efi");
+    for (size_t i = 0; ok && options->layout && i < options->layout->count; i++) {
+        ok = hash_partition(options, &sha, i, &options->layout->parts[i]);
+    }
+    sha256_final(&sha, key);
+    stats_end(&span);
+    return ok;
+}
+
+// Cache entry of key with suffix
+static void entry_name(const Build_Options *options, const uint8_t key[SHA256_SIZE], const char *suffix,
+                       char *name, size_t size) {
+    char hex[2 * SHA256_SIZE + 1];
+    to_hex(key, SHA256_SIZE, hex);
+    snprintf(name, size, "%s/%s.%s", options->cache_dir, hex, suffix);
+}
+
+static bool is_raw(const Build_Options *options) {
+    return options->backend == IMAGE_STDIO || options->backend == IMAGE_MMAP;
+}
+
+bool cache_fetch(const Build_Options *options, const uint8_t key[SHA256_SIZE]) {
+    char entry[4096], manifest[4096], output_manifest[4096];
+    entry_name(options, key, format_suffix(options->backend), entry, sizeof entry);
+    entry_name(options, key, "manifest", manifest, sizeof manifest);
+    snprintf(output_manifest, sizeof output_manifest, "%s.manifest", options->output);
+
+    // The image is renamed into place last, once it is there so is its manifest
+    if (access(entry, R_OK) != 0) return false;
+
+    Stats_Span span = stats_begin("cache_fetch");
+    bool ok = clone_file(entry, options->output) && (!is_raw(options) || clone_file(manifest, output_manifest));
+    stats_end(&span);
+    return ok;
+}
+
+// Clone src to a temporary name in the cache, then rename it to entry
+static bool add_entry(const char *src, const char *entry) {
+    static _Atomic unsigned counter;
+    char tmp[4200];
+    snprintf(tmp, sizeof tmp, "%s.tmp.%ld.%u", entry, (long)getpid(), atomic_fetch_add(&counter, 1));
+
+    bool ok = clone_file(src, tmp) && rename(tmp, entry) == 0;
+    if (!ok) unlink(tmp);
+    return ok;
+}
+
+bool cache_store(const Build_Options *options, const uint8_t key[SHA256_SIZE]) {
+    if (mkdir(options->cache_dir, 0755) != 0 && errno != EEXIST) return false;
+
+    char entry[4096], manifest[4096], output_manifest[4096];
+    entry_name(options, key, format_suffix(options->backend), entry, sizeof entry);
+    entry_name(options, key, "manifest", manifest, sizeof manifest);
+    snprintf(output_manifest, sizeof output_manifest, "%s.manifest", options->output);
+
+    Stats_Span span = stats_begin("cache_store");
+    bool ok = (!is_raw(options) || add_entry(output_manifest, manifest)) && add_entry(options->output, entry);
+    stats_end(&span);
+    return ok;
+}
@@ -0,0 +1,211 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "crc32.h"
+#include "crc32_tables.h"
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL 1
+#endif
+
+uint32_t crc32_scalar(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *bufp = buf;
+    uint32_t c = crc ^ 0xFFFFFFFF;
+
+    for (size_t n = 0; n < len; n++) {
+        c = crc32_table[0][(c ^ bufp[n]) & 0xFF] ^ (c >> 8);
+    }
+
+    // invert bits to return value
+    return c ^ 0xFFFFFFFF;
+}
+
+uint32_t crc32_slice8(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *bufp = buf;
+    uint32_t c = crc ^ 0xFFFFFFFF;
+
+    // 8 bytes at a time, each byte looked up in the table for its distance from the end
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, bufp, sizeof lo);
+        memcpy(&hi, bufp + 4, sizeof hi);
+        lo ^= c;
+
+        c = crc32_table[7][lo & 0xFF]         ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+            crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+            crc32_table[3][hi & 0xFF]         ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+            crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+
+        bufp += 8;
+        len -= 8;
+    }
+
+    // remaining tail bytes
+    while (len--) {
+        c = crc32_table[0][(c ^ *bufp++) & 0xFF] ^ (c >> 8);
+    }
+
+    return c ^ 0xFFFFFFFF;
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+// Fold 64 bytes at a time with PCLMULQDQ, then Barrett reduce to 32 bits
+// ("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ", Intel).
+// Takes and returns the raw (non inverted) crc register.
+// len must be at least 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(uint32_t c, const uint8_t *bufp, size_t len) {
+    // bit reflected fold constants and the CRC32 / Barrett polynomials
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(bufp + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(bufp + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(bufp + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(bufp + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+
+    bufp += 64;
+    len -= 64;
+
+    // fold 4 lanes of 128 bits in parallel
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i *)(bufp + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(bufp + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(bufp + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(bufp + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        bufp += 64;
+        len -= 64;
+    }
+
+    // fold the 4 lanes into one
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // remaining 16 byte blocks
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)bufp);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        bufp += 16;
+        len -= 16;
+    }
+
+    // fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduce to 32 bits
+    x0 = _mm_load_si128((const __m128i *)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+bool crc32_pclmul_supported(void) {
+#ifdef CRC32_HAVE_PCLMUL
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#else
+    return false;
+#endif
+}
+
+uint32_t crc32_pclmul(uint32_t crc, const void *buf, size_t len) {
+#ifdef CRC32_HAVE_PCLMUL
+    if (len >= 64 && crc32_pclmul_supported()) {
+        const uint8_t *bufp = buf;
+        size_t chunk = len & ~(size_t)15;
+
+        uint32_t c = crc32_fold_pclmul(crc ^ 0xFFFFFFFF, bufp, chunk);
+        return crc32_slice8(c ^ 0xFFFFFFFF, bufp + chunk, len - chunk);
+    }
+#endif
+    return crc32_slice8(crc, buf, len);
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+    // crc32_pclmul checks CPU support itself and falls back to slice-by-8
+    return crc32_pclmul(crc, buf, len);
+}
+
+uint32_t calculate_crc32(const void *buf, int32_t len) {
+    if (len <= 0) return 0;
+    Stats_Span span = stats_begin("crc32");
+    uint32_t crc = crc32_update(0, buf, (size_t)len);
+    stats_end(&span);
+    return crc;
+}
+
+void crc32_zeros_init(Crc32_Zeros *zeros, size_t len) {
+    static const uint8_t zero_block[4096];
+
+    // The register is the crc inverted, column i is where bit i ends up
+    for (int i = 0; i < 32; i++) {
+        uint32_t crc = ~(1U << i);
+        for (size_t done = 0; done < len; done += sizeof zero_block) {
+            crc = crc32_update(crc, zero_block, len - done < sizeof zero_block ? len - done : sizeof zero_block);
+        }
+        zeros->column[i] = ~crc;
+    }
+}
+
+uint32_t crc32_zeros_apply(const Crc32_Zeros *zeros, uint32_t crc) {
+    uint32_t reg = ~crc, out = 0;
+    for (int i = 0; reg; i++, reg >>= 1) {
+        if (reg & 1) out ^= zeros->column[i];
+    }
+    return ~out;
+}
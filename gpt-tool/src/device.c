@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include "device.h"
+#include "stream.h"
+#include "utils.h"
+#include "stats.h"
+#include "gpt_constants.h"
+
+enum {
+    DEVICE_CHUNK_SIZE = 1024 * 1024,        // Bytes per write, writes start 1 MiB aligned
+    DEVICE_QUEUE_DEPTH = 32,                // Writes in flight
+    DEVICE_BUFFER_ALIGN = 4096,             // O_DIRECT needs sector aligned memory
+};
+
+// The io_uring rings shared with the kernel, set up with raw syscalls
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} Uring;
+
+// One write buffer, busy while its write is in flight
+typedef struct {
+    uint8_t *buf;
+    uint64_t offset;
+    size_t len, done;       // Short writes resubmit the rest
+    bool busy;
+} Device_Slot;
+
+typedef struct {
+    int fd;
+    const char *name;
+    bool is_file;           // Regular file, unplanned ranges are holes already
+    bool uring;             // Else pwrite, one write at a time
+    Uring ring;
+    Device_Slot slots[DEVICE_QUEUE_DEPTH];
+    uint64_t written, zeroed;
+} Device_Writer;
+
+static void uring_teardown(Uring *ring) {
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static bool uring_setup(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    *ring = (Uring){ .sq_ring = MAP_FAILED, .cq_ring = MAP_FAILED, .sqes = MAP_FAILED };
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return false;
+
+    // Older kernels map the completion ring on its own
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = single_mmap ? ring->sq_ring
+                                : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_teardown(ring);
+        return false;
+    }
+
+    uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+// Queue one write and hand it to the kernel. Never more writes than slots
+// are in flight, so the submission ring can not overflow. Without SQPOLL the
+// kernel only takes entries in io_uring_enter, which returns an error only
+// when it took none, so a failed entry is taken back off the ring
+static bool uring_submit(Uring *ring, int fd, const void *buf, size_t len, uint64_t offset, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    for (;;) {
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+        if (submitted == 1) return true;
+        if (submitted < 0 && errno != EINTR) {
+            int error = errno;
+            __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+            errno = error;
+            return false;
+        }
+    }
+}
+
+// Next completion, waits for one when there is none yet
+static bool uring_wait(Uring *ring, uint64_t *user_data, int *res) {
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            *user_data = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+// Write the rest of slot right away, also how a failed io_uring write gets its errno
+static bool write_now(Device_Writer *w, Device_Slot *slot) {
+    slot->busy = false;
+    if (!pwrite_all(w->fd, slot->buf + slot->done, slot->len - slot->done, slot->offset + slot->done)) {
+        fprintf(stderr, "Error: write to %s at byte %llu failed: %s\n", w->name,
+                (unsigned long long)(slot->offset + slot->done), strerror(errno));
+        return false;
+    }
+    w->written += slot->len - slot->done;
+    return true;
+}
+
+static bool submit(Device_Writer *w, Device_Slot *slot) {
+    slot->done = 0;
+    if (!w->uring) return write_now(w, slot);
+
+    // Busy only once the kernel has the write, drain waits for busy slots
+    if (!uring_submit(&w->ring, w->fd, slot->buf, slot->len, slot->offset, slot - w->slots)) {
+        fprintf(stderr, "Error: could not queue write to %s: %s\n", w->name, strerror(errno));
+        return false;
+    }
+    slot->busy = true;
+    return true;
+}
+
+// Handle one completion: slot is free again or its rest is resubmitted
+static bool reap(Device_Writer *w) {
+    uint64_t index;
+    int res;
+    if (!uring_wait(&w->ring, &index, &res)) {
+        fprintf(stderr, "Error: waiting for writes to %s failed: %s\n", w->name, strerror(errno));
+        return false;
+    }
+
+    Device_Slot *slot = &w->slots[index];
+    if (res <= 0) return write_now(w, slot);
+    stats_write(res);
+    slot->done += res;
+    w->written += res;
+    if (slot->done == slot->len) {
+        slot->busy = false;
+        return true;
+    }
+    if (!uring_submit(&w->ring, w->fd, slot->buf + slot->done, slot->len - slot->done, slot->offset + slot->done,
+                      index)) {
+        fprintf(stderr, "Error: could not queue write to %s: %s\n", w->name, strerror(errno));
+        slot->busy = false;
+        return false;
+    }
+    return true;
+}
+
+static Device_Slot *free_slot(Device_Writer *w) {
+    for (;;) {
+        for (size_t i = 0; i < DEVICE_QUEUE_DEPTH; i++) {
+            if (!w->slots[i].busy) return &w->slots[i];
+        }
+        if (!reap(w)) return NULL;
+    }
+}
+
+static bool drain(Device_Writer *w) {
+    for (size_t i = 0; i < DEVICE_QUEUE_DEPTH; i++) {
+        while (w->slots[i].busy) {
+            if (!reap(w)) return false;
+        }
+    }
+    return true;
+}
+
+// Range without planned data: the device zeroes it, or unmaps it where that
+// reads back as zeros. Written as zeros only when it can do neither
+static bool zero_range(Device_Writer *w, uint64_t start, uint64_t end) {
+    if (w->is_file || start >= end) return true;
+
+    uint64_t range[2] = { start, end - start };
+    if (ioctl(w->fd, BLKZEROOUT, range) == 0) {
+        w->zeroed += end - start;
+        return true;
+    }
+
+    for (uint64_t pos = start; pos < end; ) {
+        Device_Slot *slot = free_slot(w);
+        if (!slot) return false;
+        slot->offset = pos;
+        slot->len = end - pos < DEVICE_CHUNK_SIZE ? end - pos : DEVICE_CHUNK_SIZE;
+        memset(slot->buf, 0, slot->len);
+        if (!submit(w, slot)) return false;
+        pos += slot->len;
+    }
+    return true;
+}
+
+bool device_open(Image *image, const char *name, uint64_t size) {
+    struct stat st;
+    bool is_device = stat(name, &st) == 0 && S_ISBLK(st.st_mode);
+
+    // O_EXCL fails while the device is mounted. Filesystems without O_DIRECT
+    // get buffered writes
+    int flags = is_device ? O_WRONLY | O_EXCL : O_WRONLY | O_CREAT | O_TRUNC;
+    image->fd = open(name, flags | O_DIRECT, 0644);
+    if (image->fd < 0 && errno == EINVAL) image->fd = open(name, flags, 0644);
+    if (image->fd < 0) {
+        fprintf(stderr, "Error: could not open device %s: %s\n", name, strerror(errno));
+        return false;
+    }
+
+    uint64_t device_size = size;
+    if (is_device && ioctl(image->fd, BLKGETSIZE64, &device_size) != 0) {
+        fprintf(stderr, "Error: could not get size of device %s\n", name);
+        close(image->fd);
+        return false;
+    }
+    if (device_size < size) {
+        fprintf(stderr, "Error: device %s has %llu bytes, the image needs %llu\n", name,
+                (unsigned long long)device_size, (unsigned long long)size);
+        close(image->fd);
+        return false;
+    }
+    if (!is_device && ftruncate(image->fd, size) != 0) {
+        fprintf(stderr, "Error: could not size %s\n", name);
+        close(image->fd);
+        return false;
+    }
+
+    image->size = device_size;
+    image->stream = stream_create(device_size);
+    if (!image->stream) {
+        fprintf(stderr, "Error: could not plan image for device %s\n", name);
+        close(image->fd);
+        return false;
+    }
+    return true;
+}
+
+bool device_write(Image *image) {
+    Device_Writer w = { .fd = image->fd, .name = image->name };
+    struct stat st;
+    if (fstat(image->fd, &st) != 0) return false;
+    w.is_file = S_ISREG(st.st_mode);
+
+    // The GPT of a 512 byte sector disk is not found on a 4Kn device and the other way round
+    int sector_size = 0;
+    if (!w.is_file && ioctl(image->fd, BLKSSZGET, &sector_size) == 0 && (uint32_t)sector_size != image->lba_size) {
+        fprintf(stderr, "Error: %s has %d byte sectors, the image was built for %u (see --sector-size)\n",
+                image->name, sector_size, image->lba_size);
+        return false;
+    }
+
+    // Nothing points between the last partition and the backup GPT at the
+    // end of the device, whatever is there stays
+    uint64_t skip_start = image->end_lba * image->lba_size;
+    uint64_t skip_end = image->size - GPT_TABLE_SIZE - image->lba_size;
+    if (skip_end < skip_start) skip_end = skip_start;
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < DEVICE_QUEUE_DEPTH; i++) {
+        ok = posix_memalign((void **)&w.slots[i].buf, DEVICE_BUFFER_ALIGN, DEVICE_CHUNK_SIZE) == 0;
+        if (!ok) w.slots[i].buf = NULL;
+    }
+    w.uring = ok && uring_setup(&w.ring, DEVICE_QUEUE_DEPTH);
+    bool direct = fcntl(image->fd, F_GETFL) & O_DIRECT;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t pos = 0;
+    while (ok && pos < image->size) {
+        uint64_t data = stream_next_data(image->stream, pos);
+        if (data > pos) {
+            ok = zero_range(&w, pos, data < skip_start ? data : skip_start) &&
+                 zero_range(&w, pos > skip_end ? pos : skip_end, data);
+            pos = data;
+            continue;
+        }
+
+        // Up to the next 1 MiB boundary, zero pages in there are written along
+        uint64_t chunk_end = (pos / DEVICE_CHUNK_SIZE + 1) * DEVICE_CHUNK_SIZE;
+        if (chunk_end > image->size) chunk_end = image->size;
+        Device_Slot *slot = free_slot(&w);
+        ok = slot && stream_read(image->stream, pos, slot->buf, chunk_end - pos);
+        if (ok) {
+            slot->offset = pos;
+            slot->len = chunk_end - pos;
+            ok = submit(&w, slot);
+        }
+        pos = chunk_end;
+    }
+
+    // Buffers are only freed once the kernel is done with them
+    if (w.uring) {
+        ok = drain(&w) && ok;
+        uring_teardown(&w.ring);
+    }
+    if (ok && fsync(image->fd) != 0) {
+        fprintf(stderr, "Error: could not flush %s: %s\n", image->name, strerror(errno));
+        ok = false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (size_t i = 0; i < DEVICE_QUEUE_DEPTH; i++) free(w.slots[i].buf);
+
+    if (ok) {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        double mib = w.written / (1024.0 * 1024.0);
+        printf("Device '%s': %.1f MiB written in %.1f ms (%.1f MiB/s), %.1f MiB zeroed by the device, %s, %s\n",
+               image->name, mib, seconds * 1e3, seconds > 0 ? mib / seconds : 0, w.zeroed / (1024.0 * 1024.0),
+               w.uring ? "io_uring" : "pwrite", direct ? "O_DIRECT" : "buffered");
+    }
+    return ok;
+}
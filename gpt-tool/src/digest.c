@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "digest.h"
+#include "stats.h"
+
+enum {
+    HASH_BUFFER_SIZE = 1024 * 1024,
+};
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;                          // 0 for an empty slot
+    off_t size;
+    struct timespec mtime, ctime;
+    uint8_t digest[SHA256_SIZE];
+} Digest_Entry;
+
+// Open addressing on device and inode, cap is a power of two
+static struct {
+    pthread_mutex_t lock;
+    Digest_Entry *entries;
+    size_t count, cap;
+} memo = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t slot_of(dev_t dev, ino_t ino, size_t cap) {
+    uint64_t h = ((uint64_t)dev * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)ino * 0xC2B2AE3D27D4EB4FULL);
+    return (h ^ (h >> 29)) & (cap - 1);
+}
+
+static Digest_Entry *find_slot(Digest_Entry *entries, size_t cap, dev_t dev, ino_t ino) {
+    size_t i = slot_of(dev, ino, cap);
+    while (entries[i].ino != 0 && (entries[i].dev != dev || entries[i].ino != ino)) i = (i + 1) & (cap - 1);
+    return &entries[i];
+}
+
+static bool same_file(const Digest_Entry *e, const struct stat *st) {
+    return e->ino != 0 && e->size == st->st_size && e->mtime.tv_sec == st->st_mtim.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtim.tv_nsec && e->ctime.tv_sec == st->st_ctim.tv_sec &&
+           e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+bool file_digest_lookup(const struct stat *st, uint8_t digest[SHA256_SIZE]) {
+    pthread_mutex_lock(&memo.lock);
+    const Digest_Entry *e = memo.cap ? find_slot(memo.entries, memo.cap, st->st_dev, st->st_ino) : NULL;
+    bool found = e && same_file(e, st);
+    if (found) memcpy(digest, e->digest, SHA256_SIZE);
+    pthread_mutex_unlock(&memo.lock);
+    return found;
+}
+
+// Best effort, a digest that is not remembered is computed again
+void file_digest_remember(const struct stat *st, const uint8_t digest[SHA256_SIZE]) {
+    if (st->st_ino == 0) return;
+    pthread_mutex_lock(&memo.lock);
+    if (2 * (memo.count + 1) > memo.cap) {
+        size_t cap = memo.cap ? memo.cap * 2 : 256;
+        Digest_Entry *entries = calloc(cap, sizeof *entries);
+        if (!entries) {
+            pthread_mutex_unlock(&memo.lock);
+            return;
+        }
+        for (size_t i = 0; i < memo.cap; i++) {
+            if (memo.entries[i].ino != 0) {
+                *find_slot(entries, cap, memo.entries[i].dev, memo.entries[i].ino) = memo.entries[i];
+            }
+        }
+        free(memo.entries);
+        memo.entries = entries;
+        memo.cap = cap;
+    }
+
+    Digest_Entry *e = find_slot(memo.entries, memo.cap, st->st_dev, st->st_ino);
+    if (e->ino == 0) memo.count++;
+    *e = (Digest_Entry){
+        .dev = st->st_dev,
+        .ino = st->st_ino,
+        .size = st->st_size,
+        .mtime = st->st_mtim,
+        .ctime = st->st_ctim,
+    };
+    memcpy(e->digest, digest, SHA256_SIZE);
+    pthread_mutex_unlock(&memo.lock);
+}
+
+bool file_digest(const char *host_path, const struct stat *st, uint64_t *size, uint8_t digest[SHA256_SIZE]) {
+    if (file_digest_lookup(st, digest)) {
+        *size = st->st_size;
+        return true;
+    }
+
+    int fd = open(host_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open '%s'\n", host_path);
+        return false;
+    }
+
+    Stats_Span span = stats_begin("hash_file");
+    uint8_t *buf = malloc(HASH_BUFFER_SIZE);
+    Sha256 sha;
+    sha256_init(&sha);
+    ssize_t got = 0;
+    *size = 0;
+    while (buf && (got = read(fd, buf, HASH_BUFFER_SIZE)) > 0) {
+        stats_read(got);
+        sha256_update(&sha, buf, got);
+        *size += got;
+    }
+    sha256_final(&sha, digest);
+    stats_end(&span);
+    free(buf);
+    close(fd);
+
+    if (!buf || got < 0) {
+        fprintf(stderr, "Error: could not read '%s'\n", host_path);
+        return false;
+    }
+    // A file that changed while it was read is not remembered
+    if (*size == (uint64_t)st->st_size) file_digest_remember(st, digest);
+    return true;
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "extract.h"
+#include "reader.h"
+#include "structures.h"
+#include "utils.h"
+#include "stats.h"
+
+// Called for every live entry of a directory, false stops the walk
+typedef bool (*Entry_Fn)(const Reader *r, const FAT32_Dir_Entry_Short *entry, const char *name, void *arg);
+
+typedef struct {
+    const char *name;
+    FAT32_Dir_Entry_Short entry;
+    bool found;
+} Find_Arg;
+
+typedef struct {
+    FILE *out;
+    bool recursive;
+    const char *dir;
+} List_Arg;
+
+typedef struct {
+    uint64_t files, directories, bytes;
+} Extract_Totals;
+
+typedef struct {
+    const char *dest;
+    Extract_Totals *totals;
+} Extract_Arg;
+
+static bool for_each_entry(const Reader *r, uint32_t cluster, Entry_Fn fn, void *arg) {
+    // No chain is longer than the volume, a longer one loops
+    for (uint32_t n = 0; n <= r->max_cluster; n++) {
+        const uint8_t *data = reader_cluster(r, cluster);
+        if (!data) {
+            fprintf(stderr, "Error: directory cluster %u is outside the volume\n", cluster);
+            return false;
+        }
+
+        const FAT32_Dir_Entry_Short *entries = (const FAT32_Dir_Entry_Short *)data;
+        for (size_t i = 0; i < r->cluster_bytes / sizeof *entries; i++) {
+            const FAT32_Dir_Entry_Short *entry = &entries[i];
+            if (entry->DIR_Name[0] == 0x00) return true;
+            if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Name[0] == '.') continue;     // Deleted, "." and ".."
+            if ((entry->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME || (entry->DIR_Attr & ATTR_VOLUME_ID)) continue;
+
+            char name[13];
+            reader_entry_name(entry, name);
+            if (strchr(name, '/')) {
+                fprintf(stderr, "Warning: skipping entry '%s', not a valid name\n", name);
+                continue;
+            }
+            if (!fn(r, entry, name, arg)) return false;
+        }
+
+        uint32_t next = reader_fat_entry(r, cluster);
+        if (next >= FAT_EOC_MIN) return true;
+        cluster = next;
+    }
+    fprintf(stderr, "Error: directory chain at cluster %u loops\n", cluster);
+    return false;
+}
+
+static bool find_entry(const Reader *r, const FAT32_Dir_Entry_Short *entry, const char *name, void *arg) {
+    (void)r;
+    Find_Arg *find = arg;
+    if (strcasecmp(name, find->name) != 0) return true;
+    find->entry = *entry;
+    find->found = true;
+    return false;
+}
+
+// Directory entry of esp_path, the root gets one made up from the VBR
+static bool lookup(const Reader *r, const char *esp_path, FAT32_Dir_Entry_Short *entry) {
+    *entry = (FAT32_Dir_Entry_Short){
+        .DIR_Attr = ATTR_DIRECTORY,
+        .DIR_FstClusHI = r->vbr->BPB_RootClus >> 16,
+        .DIR_FstClusLO = r->vbr->BPB_RootClus & 0xFFFF,
+    };
+
+    char path[4096], *save = NULL;
+    snprintf(path, sizeof path, "%s", esp_path);
+    for (char *part = strtok_r(path, "/", &save); part; part = strtok_r(NULL, "/", &save)) {
+        Find_Arg find = { .name = part };
+        bool ok = (entry->DIR_Attr & ATTR_DIRECTORY) &&
+                  (for_each_entry(r, reader_entry_cluster(entry), find_entry, &find) || find.found);
+        if (!ok) return false;
+        if (!find.found) {
+            fprintf(stderr, "Error: '%s' not found in the ESP\n", esp_path);
+            return false;
+        }
+        *entry = find.entry;
+    }
+    return true;
+}
+
+static bool list_entry(const Reader *r, const FAT32_Dir_Entry_Short *entry, const char *name, void *arg) {
+    List_Arg *list = arg;
+    char path[4096];
+    if ((size_t)snprintf(path, sizeof path, "%s%s%s", list->dir, strcmp(list->dir, "/") == 0 ? "" : "/", name) >=
+        sizeof path) {
+        fprintf(stderr, "Error: path of '%s' too long, directories loop?\n", name);
+        return false;
+    }
+
+    // FAT date: years since 1980, month, day. Time: hours, minutes, seconds / 2
+    bool is_dir = entry->DIR_Attr & ATTR_DIRECTORY;
+    fprintf(list->out, "%c %10u %04u-%02u-%02u %02u:%02u:%02u %s%s\n", is_dir ? 'd' : '-', entry->DIR_FileSize,
+            1980 + (entry->DIR_WrtDate >> 9), (entry->DIR_WrtDate >> 5) & 0xF, entry->DIR_WrtDate & 0x1F,
+            entry->DIR_WrtTime >> 11, (entry->DIR_WrtTime >> 5) & 0x3F, (entry->DIR_WrtTime & 0x1F) * 2,
+            path, is_dir ? "/" : "");
+
+    if (!is_dir || !list->recursive) return true;
+    List_Arg sub = { .out = list->out, .recursive = true, .dir = path };
+    return for_each_entry(r, reader_entry_cluster(entry), list_entry, &sub);
+}
+
+bool esp_list(const char *name, const char *esp_path, bool recursive, FILE *out) {
+    Reader reader;
+    if (!reader_open(&reader, name)) return false;
+    if (!reader_find_esp(&reader)) {
+        fprintf(stderr, "Error: no readable EFI System Partition in %s\n", name);
+        reader_close(&reader);
+        return false;
+    }
+
+    FAT32_Dir_Entry_Short entry;
+    bool ok = lookup(&reader, esp_path, &entry);
+    if (ok && (entry.DIR_Attr & ATTR_DIRECTORY)) {
+        List_Arg list = { .out = out, .recursive = recursive, .dir = esp_path };
+        ok = for_each_entry(&reader, reader_entry_cluster(&entry), list_entry, &list);
+    }
+    else if (ok) {
+        // A file lists itself, under the directory part of its path
+        char dir[4096], file_name[13];
+        snprintf(dir, sizeof dir, "%s", esp_path);
+        char *slash = strrchr(dir, '/');
+        if (slash) *slash = '\0';
+        reader_entry_name(&entry, file_name);
+        List_Arg list = { .out = out, .dir = slash && dir[0] ? dir : "/" };
+        ok = list_entry(&reader, &entry, file_name, &list);
+    }
+    reader_close(&reader);
+    return ok;
+}
+
+// Image bytes to out at its file position: in the kernel where
+// copy_file_range works, else one write straight from the mapping
+static bool copy_out(const Reader *r, int out, uint64_t offset, uint64_t len) {
+    while (len > 0) {
+        loff_t off_in = offset;
+        ssize_t n = copy_file_range(r->fd, &off_in, out, NULL, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        stats_write(n);
+        offset += n;
+        len -= n;
+    }
+    return write_all(out, r->map + offset, len);
+}
+
+// FAT timestamps are local time
+static void set_mtime(const char *dest, const FAT32_Dir_Entry_Short *entry) {
+    struct tm tm = {
+        .tm_year = 80 + (entry->DIR_WrtDate >> 9),
+        .tm_mon = ((entry->DIR_WrtDate >> 5) & 0xF) - 1,
+        .tm_mday = entry->DIR_WrtDate & 0x1F,
+        .tm_hour = entry->DIR_WrtTime >> 11,
+        .tm_min = (entry->DIR_WrtTime >> 5) & 0x3F,
+        .tm_sec = (entry->DIR_WrtTime & 0x1F) * 2,
+        .tm_isdst = -1,
+    };
+    time_t t = mktime(&tm);
+    if (t == (time_t)-1) return;
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_sec = t } };
+    utimensat(AT_FDCWD, dest, times, 0);
+}
+
+static bool extract_file(const Reader *r, const FAT32_Dir_Entry_Short *entry, const char *dest, int out) {
+    uint64_t left = entry->DIR_FileSize;
+    uint32_t cluster = reader_entry_cluster(entry);
+
+    while (left > 0) {
+        if (!reader_cluster(r, cluster)) {
+            fprintf(stderr, "Error: chain of '%s' leaves the volume at cluster %u\n", dest, cluster);
+            return false;
+        }
+
+        // Longest run of consecutive clusters, copied in one go
+        uint64_t run_bytes = r->cluster_bytes;
+        uint32_t next = reader_fat_entry(r, cluster);
+        while (run_bytes < left && next == cluster + 1) {
+            cluster = next;
+            run_bytes += r->cluster_bytes;
+            next = reader_fat_entry(r, cluster);
+        }
+        uint64_t first = cluster - (run_bytes / r->cluster_bytes - 1);
+        uint64_t len = run_bytes < left ? run_bytes : left;
+        if (!copy_out(r, out, r->data_offset + (first - 2) * r->cluster_bytes, len)) {
+            fprintf(stderr, "Error: could not write '%s': %s\n", dest, strerror(errno));
+            return false;
+        }
+        left -= len;
+        if (left > 0 && next >= FAT_EOC_MIN) {
+            fprintf(stderr, "Error: chain of '%s' ends %llu bytes early\n", dest, (unsigned long long)left);
+            return false;
+        }
+        cluster = next;
+    }
+    return true;
+}
+
+static bool extract_entry(const Reader *r, const FAT32_Dir_Entry_Short *entry, const char *name, void *arg);
+
+static bool extract_tree(const Reader *r, const FAT32_Dir_Entry_Short *entry, const char *dest,
+                         Extract_Totals *totals) {
+    if (mkdir(dest, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: could not create directory '%s'\n", dest);
+        return false;
+    }
+    totals->directories++;
+    Extract_Arg sub = { .dest = dest, .totals = totals };
+    return for_each_entry(r, reader_entry_cluster(entry), extract_entry, &sub);
+}
+
+static bool extract_one(const Reader *r, const FAT32_Dir_Entry_Short *entry, const char *dest,
+                        Extract_Totals *totals) {
+    if (entry->DIR_Attr & ATTR_DIRECTORY) return extract_tree(r, entry, dest, totals);
+
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        fprintf(stderr, "Error: could not create '%s'\n", dest);
+        return false;
+    }
+    bool ok = extract_file(r, entry, dest, out);
+    if (close(out) != 0) ok = false;
+    if (ok) set_mtime(dest, entry);
+    totals->files++;
+    totals->bytes += entry->DIR_FileSize;
+    return ok;
+}
+
+static bool extract_entry(const Reader *r, const FAT32_Dir_Entry_Short *entry, const char *name, void *arg) {
+    Extract_Arg *extract = arg;
+    char dest[4096];
+    if ((size_t)snprintf(dest, sizeof dest, "%s/%s", extract->dest, name) >= sizeof dest) {
+        fprintf(stderr, "Error: path of '%s' too long, directories loop?\n", name);
+        return false;
+    }
+    return extract_one(r, entry, dest, extract->totals);
+}
+
+bool esp_extract(const char *name, const char *esp_path, const char *dest) {
+    Reader reader;
+    if (!reader_open(&reader, name)) return false;
+    if (!reader_find_esp(&reader)) {
+        fprintf(stderr, "Error: no readable EFI System Partition in %s\n", name);
+        reader_close(&reader);
+        return false;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FAT32_Dir_Entry_Short entry;
+    bool ok = lookup(&reader, esp_path, &entry);
+    bool to_stdout = strcmp(dest, "-") == 0;
+    Extract_Totals totals = { 0 };
+
+    if (ok && to_stdout) {
+        if (entry.DIR_Attr & ATTR_DIRECTORY) {
+            fprintf(stderr, "Error: '%s' is a directory, only files go to stdout\n", esp_path);
+            ok = false;
+        }
+        else {
+            ok = extract_file(&reader, &entry, "stdout", STDOUT_FILENO);
+        }
+    }
+    else if (ok) {
+        ok = extract_one(&reader, &entry, dest, &totals);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    reader_close(&reader);
+
+    if (ok && !to_stdout) {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Extracted '%s' to '%s': %llu files, %llu directories, %llu bytes in %.3f s (%.1f MB/s)\n",
+               esp_path, dest, (unsigned long long)totals.files, (unsigned long long)totals.directories,
+               (unsigned long long)totals.bytes, seconds, seconds > 0 ? totals.bytes / seconds / 1e6 : 0);
+    }
+    return ok;
+}
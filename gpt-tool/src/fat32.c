@@ -2,26 +2,81 @@
 #include "structures.h"
 #include "utils.h"
 #include "gpt_constants.h"
+#include "fat32_dir.h"
+#include "stats.h"
+
+enum {
+    FAT32_MIN_CLUSTERS = 65525,         // Fewer clusters than this is FAT16 by definition
+    FAT32_MAX_CLUSTERS = 0x0FFFFFF5,
+    FAT32_MAX_CLUSTER_SIZE = 32768,
+};
+
+// Pick cluster size from volume size, same table mkfs.fat and Windows use for FAT32
+static uint32_t auto_cluster_size(uint64_t volume_bytes) {
+    if (volume_bytes <= 260ULL * 1024 * 1024) return 512;
+    if (volume_bytes <= 8ULL * 1024 * 1024 * 1024) return 4096;
+    if (volume_bytes <= 16ULL * 1024 * 1024 * 1024) return 8192;
+    if (volume_bytes <= 32ULL * 1024 * 1024 * 1024) return 16384;
+    return FAT32_MAX_CLUSTER_SIZE;
+}
 
 // Write esp
-bool write_esp(FILE* image) {
+bool write_esp(Image *image) {
     const uint8_t reserved_sectors = 32;
+    const uint8_t num_fats = 2;
+
+    // Cluster size in sectors, at least one sector
+    uint32_t cluster_size = image->esp_cluster_size;
+    if (!cluster_size) {
+        cluster_size = auto_cluster_size(image->esp_size_lbas * image->lba_size);
+        if (cluster_size < image->lba_size) cluster_size = image->lba_size;
+    }
+    if (cluster_size < image->lba_size || cluster_size > FAT32_MAX_CLUSTER_SIZE || (cluster_size & (cluster_size - 1))) {
+        fprintf(stderr, "Error: invalid cluster size %u, must be a power of two from %u to %u\n", cluster_size,
+                image->lba_size, FAT32_MAX_CLUSTER_SIZE);
+        return false;
+    }
+    image->fat32_sec_per_clus = cluster_size / image->lba_size;
+
+    // FAT size from volume geometry (FAT32 spec, "FAT Type Determination"):
+    // each FAT sector maps lba_size / 4 clusters, shared by both FATs
+    uint64_t tmp1 = image->esp_size_lbas - reserved_sectors;
+    uint64_t tmp2 = (((image->lba_size / 2) * image->fat32_sec_per_clus) + num_fats) / 2;
+    uint32_t fat_size = (tmp1 + tmp2 - 1) / tmp2;
+
+    // Grow reserved area so the data region starts 1 MiB aligned like the ESP itself
+    uint64_t align_sectors = ALIGNMENT / image->lba_size;
+    uint64_t metadata_sectors = reserved_sectors + num_fats * (uint64_t)fat_size;
+    uint16_t rsvd_sectors = reserved_sectors + (align_sectors - metadata_sectors % align_sectors) % align_sectors;
+
+    uint64_t data_sectors = image->esp_size_lbas - rsvd_sectors - num_fats * (uint64_t)fat_size;
+    uint64_t num_clusters = data_sectors / image->fat32_sec_per_clus;
+    if (image->esp_size_lbas <= rsvd_sectors + num_fats * (uint64_t)fat_size || num_clusters < FAT32_MIN_CLUSTERS) {
+        fprintf(stderr, "Error: ESP of %llu bytes is too small for FAT32 with %u byte clusters\n",
+                (unsigned long long)(image->esp_size_lbas * image->lba_size), cluster_size);
+        return false;
+    }
+    if (num_clusters > FAT32_MAX_CLUSTERS) {
+        fprintf(stderr, "Error: ESP has too many clusters for FAT32, use a larger cluster size\n");
+        return false;
+    }
+
     Vbr vbr = {
         .BS_jmpBoot = { 0xEB, 0x00, 0x90 }, 
         .BS_OEMName  = { "THISDISK" },
-        .BPB_BytesPerSec = LBA_SIZE,
-        .BPB_SecPerClus = 1,
-        .BPB_RsvdSecCnt = reserved_sectors,
-        .BPB_NumFATs = 2,
+        .BPB_BytesPerSec = image->lba_size,
+        .BPB_SecPerClus = image->fat32_sec_per_clus,
+        .BPB_RsvdSecCnt = rsvd_sectors,
+        .BPB_NumFATs = num_fats,
         .BPB_RootEntCnt = 0,
         .BPB_TotSec16 = 0,
         .BPB_Media = 0xF8, // "Fixed" non-removable media
         .BPB_FATSz16 = 0,
         .BPB_SecPerTrk = 0,
         .BPB_NumHeads = 0,
-        .BPB_HiddSec = esp_lba - 1,
-        .BPB_TotSec32 = esp_size_lbas,
-        .BPB_FATSz32 = ((ALIGNMENT / LBA_SIZE) - reserved_sectors) / 2,
+        .BPB_HiddSec = image->esp_lba, // Sectors before the partition
+        .BPB_TotSec32 = image->esp_size_lbas,
+        .BPB_FATSz32 = fat_size,
         .BPB_ExtFlags = 0,
         .BPB_FSVer = 0,
         .BPB_RootClus = 2,
@@ -44,74 +99,57 @@ bool write_esp(FILE* image) {
         .FSI_LeadSig = 0x41615252,
         .FSI_Reserved1 = {0},
         .FSI_StrucSig = 0x61417272,
-        .FSI_Free_Count = 0xFFFFFFFF,
+        .FSI_Free_Count = num_clusters - 3,     // All but the three directories below
         .FSI_Next_Free = 5,             // First available cluster after /EFI/BOOT
         .FSI_Reserved2 = {0},
         .FSI_TrailSig = 0xAA550000,
     };
 
-    fat32_fat_lba = esp_lba + vbr.BPB_RsvdSecCnt;
-    fat32_data_lba = fat32_fat_lba + (vbr.BPB_NumFATs * vbr.BPB_FATSz32);
+    // Directory indexes and free space of a previous ESP are stale
+    dir_index_reset(image);
+    fat32_free_extents_reset(image);
+
+    image->fat32_vbr = vbr;
+    image->fat32_fsinfo = fsinfo;
+    image->fat32_fsinfo_dirty = true;
+    image->fat32_fat_lba = image->esp_lba + vbr.BPB_RsvdSecCnt;
+    image->fat32_data_lba = image->fat32_fat_lba + (vbr.BPB_NumFATs * vbr.BPB_FATSz32);
 
     // write vbr and fs info
-    fseek(image, esp_lba * LBA_SIZE, SEEK_SET);
-    if (fwrite(&vbr, 1, sizeof vbr, image) != sizeof vbr) {
+    if (!image_write(image, image->esp_lba * image->lba_size, &vbr, sizeof vbr)) {
         fprintf(stderr, "Error: Could not write ESP VBR to image\n");
         return false;
     }
-    write_full_lba_size(image);
 
-    if (fwrite(&fsinfo, 1, sizeof fsinfo, image) != sizeof fsinfo) {
-        fprintf(stderr, "Error: Could not write ESP FSInfo to image\n");
-        return false;
-    }
-    write_full_lba_size(image);
-
-    // go to backup boot sector location
-    // write vbr and fsinfo at back up
-    fseek(image, (esp_lba  + vbr.BPB_BkBootSec) * LBA_SIZE, SEEK_SET);
-    if (fwrite(&vbr, 1, sizeof vbr, image) != sizeof vbr) {
+    // write vbr at back up boot sector location
+    if (!image_write(image, (image->esp_lba + vbr.BPB_BkBootSec) * image->lba_size, &vbr, sizeof vbr)) {
         fprintf(stderr, "Error: Could not write VBR to image\n");
         return false;
     }
-    write_full_lba_size(image);
 
-    if (fwrite(&fsinfo, 1, sizeof fsinfo, image) != sizeof fsinfo) {
+    if (!fat32_flush_fsinfo(image)) {
         fprintf(stderr, "Error: Could not write ESP FSInfo to image\n");
         return false;
     }
-    write_full_lba_size(image);
-    
+
     // write FATs
+    const uint32_t reserved_fat[] = {
+        0xFFFFFF00 | vbr.BPB_Media,     // cluster 0 reserved; FAT identifier, lowest 8 bits are media type
+        FAT_EOC,                        // cluster 1; End of Chain marker
+        FAT_EOC,                        // cluster 2; Root dir cluster start
+        FAT_EOC,                        // cluster 3; '/EFI' dir cluster'
+        FAT_EOC,                        // cluster 4; '/EFI/BOOT' dir cluster
+                                        // cluster 5+; other files
+    };
     for (uint8_t i = 0; i < vbr.BPB_NumFATs; i++) {
-        fseek(image, (fat32_fat_lba + (i*vbr.BPB_FATSz32)) * LBA_SIZE, SEEK_SET); 
-        uint32_t cluster = 0;
-        
-        // cluster 0 reserved; FAT identifier, lowest 8 bits are media type
-        cluster = 0xFFFFFF00 | vbr.BPB_Media;
-        fwrite(&cluster, sizeof cluster, 1, image);
-
-        // cluster 1; End of Chain marker
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
-        
-        // cluster 2; Root dir cluster start
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
-
-        // cluster 3; '/EFI' dir cluster'
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
-        
-        // cluster 4; '/EFI/BOOT' dir cluster
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
-        
-        // cluster 5+; other files
+        uint64_t fat_offset = (image->fat32_fat_lba + (i*vbr.BPB_FATSz32)) * image->lba_size;
+        if (!image_write(image, fat_offset, reserved_fat, sizeof reserved_fat)) {
+            fprintf(stderr, "Error: Could not write FAT to image\n");
+            return false;
+        }
     }
 
     // write file data
-    fseek(image, fat32_data_lba * LBA_SIZE, SEEK_SET);
 
     // root directory
     FAT32_Dir_Entry_Short dir_ent = {
@@ -130,183 +168,484 @@ bool write_esp(FILE* image) {
     };
 
     uint16_t create_time = 0, create_date = 0;
-    get_fat_dir_entry_time_date(&create_time, &create_date);
+    get_fat_dir_entry_time_date(image, &create_time, &create_date);
 
     dir_ent.DIR_CrtTime = create_time;
     dir_ent.DIR_CrtTime = create_time;
     dir_ent.DIR_WrtTime = create_time;
     dir_ent.DIR_WrtDate = create_date;
 
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
-    
+    // root directory, built in memory and written one cluster at a time
+    FAT32_Dir_Entry_Short dir[3] = { 0 };
+    dir[0] = dir_ent;
+    if (!image_write(image, cluster_to_lba(image, 2) * image->lba_size, dir, sizeof dir[0])) return false;
+
     // "/EFI" directory entries
-    fseek(image, (fat32_data_lba + 1) * LBA_SIZE, SEEK_SET);
-    
-    memcpy(dir_ent.DIR_Name, ".          ", 11);    // "." dir entry, this directory itself
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
-    
-    memcpy(dir_ent.DIR_Name, "..         ", 11);    // ".." dir entry, parent dir (ROOT dir)
-    dir_ent.DIR_FstClusLO = 0;                      // Root directory does not have a cluster value
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
-
-    memcpy(dir_ent.DIR_Name, "BOOT       ", 11);    // /EFI/BOOT directory
-    dir_ent.DIR_FstClusLO = 4;
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
+    dir[0] = dir_ent;
+    memcpy(dir[0].DIR_Name, ".          ", 11);     // "." dir entry, this directory itself
+
+    dir[1] = dir_ent;
+    memcpy(dir[1].DIR_Name, "..         ", 11);     // ".." dir entry, parent dir (ROOT dir)
+    dir[1].DIR_FstClusLO = 0;                       // Root directory does not have a cluster value
+
+    dir[2] = dir[1];
+    memcpy(dir[2].DIR_Name, "BOOT       ", 11);     // /EFI/BOOT directory
+    dir[2].DIR_FstClusLO = 4;
+    if (!image_write(image, cluster_to_lba(image, 3) * image->lba_size, dir, sizeof dir)) return false;
 
     // "/EFI/BOOT" directory
-    fseek(image, (fat32_data_lba + 2) * LBA_SIZE, SEEK_SET);
-    
-    memcpy(dir_ent.DIR_Name, ".          ", 11);    // "." dir entry, this directory itself
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
-    
-    memcpy(dir_ent.DIR_Name, "..         ", 11);    // ".." dir entry, parent dir (/EFI dir)
-    dir_ent.DIR_FstClusLO = 3;                      // EFI directory cluster
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
+    dir[0] = dir[2];
+    memcpy(dir[0].DIR_Name, ".          ", 11);     // "." dir entry, this directory itself
+
+    dir[1] = dir[2];
+    memcpy(dir[1].DIR_Name, "..         ", 11);     // ".." dir entry, parent dir (/EFI dir)
+    dir[1].DIR_FstClusLO = 3;                       // EFI directory cluster
+    if (!image_write(image, cluster_to_lba(image, 4) * image->lba_size, dir, 2 * sizeof dir[0])) return false;
 
     return true;
 }
 
-// Helper function to compare null-terminated string with FAT32 directory name
-static bool fat32_name_matches(const char dir_name[11], const char *str) {
-    int str_len = strlen(str);
-    if (str_len > 11) return false;
-    
-    // Compare the string part (case-insensitive)
-    for (int i = 0; i < str_len; i++) {
-        char dir_char = dir_name[i];
-        char str_char = str[i];
-        // Convert to uppercase for comparison
-        if (str_char >= 'a' && str_char <= 'z') {
-            str_char = str_char - 'a' + 'A';
-        }
-        if (dir_char != str_char) return false;
+// Read ESP geometry of an existing image, image->esp_lba must already be set from the GPT
+bool read_esp(Image *image) {
+    // Free space of earlier changes first, the sectors are read again below
+    if (!fat32_flush_fsinfo(image)) return false;
+
+    Vbr vbr = { 0 };
+    FSInfo fsinfo = { 0 };
+    if (!image_read(image, image->esp_lba * image->lba_size, &vbr, sizeof vbr)) return false;
+
+    if (vbr.bootsect_sig != 0xAA55 || vbr.BPB_BytesPerSec != image->lba_size || vbr.BPB_NumFATs == 0 ||
+        vbr.BPB_SecPerClus == 0 || vbr.BPB_FATSz16 != 0 || vbr.BPB_FATSz32 == 0) {
+        fprintf(stderr, "Error: ESP of %s is not a FAT32 volume with %u byte sectors\n", image->name, image->lba_size);
+        return false;
     }
-    
-    // Check that remaining bytes are spaces (0x20)
-    for (int i = str_len; i < 11; i++) {
-        if (dir_name[i] != ' ') return false;
+
+    // Directory indexes and free space of a previous ESP are stale
+    dir_index_reset(image);
+    fat32_free_extents_reset(image);
+
+    if (!image_read(image, (image->esp_lba + vbr.BPB_FSInfo) * image->lba_size, &fsinfo, sizeof fsinfo)) {
+        return false;
     }
-    
+
+    image->fat32_vbr = vbr;
+    image->fat32_fsinfo = fsinfo;
+    image->fat32_sec_per_clus = vbr.BPB_SecPerClus;
+    image->fat32_fat_lba = image->esp_lba + vbr.BPB_RsvdSecCnt;
+    image->fat32_data_lba = image->fat32_fat_lba + (vbr.BPB_NumFATs * vbr.BPB_FATSz32);
     return true;
 }
 
-// Helper function to format filename for FAT32 (8.3 format or space-padded for directories)
-static void format_fat32_name(char fat_name[11], const char *filename, File_Type type) {
+// Character of a short name: upper case, '_' for what 8.3 names can not hold
+static char short_name_char(char c) {
+    if (c >= 'a' && c <= 'z') return c - 'a' + 'A';
+    if ((unsigned char)c < 0x20 || strchr(" \"*+,./:;<=>?[\\]|", c)) return '_';
+    return c;
+}
+
+// Format filename for FAT32 as 8.3, base name and the extension after the
+// last dot. Directories are named the same way as files
+void format_fat32_name(char fat_name[11], const char *filename) {
     memset(fat_name, ' ', 11);  // Fill with spaces
-    
-    if (type == TYPE_DIR) {
-        // For directories, just copy the name and space-pad
-        int len = strlen(filename);
-        if (len > 11) len = 11;
-        memcpy(fat_name, filename, len);
-        // Convert to uppercase
-        for (int i = 0; i < len; i++) {
-            if (fat_name[i] >= 'a' && fat_name[i] <= 'z') {
-                fat_name[i] = fat_name[i] - 'a' + 'A';
-            }
+
+    // Leading dots are not an extension separator
+    while (*filename == '.') filename++;
+    const char *dot = strrchr(filename, '.');
+    size_t name_len = dot ? (size_t)(dot - filename) : strlen(filename);
+    for (size_t i = 0; i < name_len && i < 8; i++) fat_name[i] = short_name_char(filename[i]);
+    for (size_t i = 0; dot && dot[i + 1] && i < 3; i++) fat_name[8 + i] = short_name_char(dot[i + 1]);
+    if (fat_name[0] == ' ') fat_name[0] = '_';
+
+    // 0xE5 marks a deleted entry, 0x05 stands for it in the first byte
+    if ((unsigned char)fat_name[0] == 0xE5) fat_name[0] = 0x05;
+}
+
+// Free space of the ESP as runs of free clusters, sorted by first cluster.
+// Built from the FAT once and then kept in step with every chain allocated or
+// freed, so allocations never have to scan the FAT again.
+typedef struct {
+    uint32_t first, count;
+} Free_Extent;
+
+typedef struct Free_Space {
+    Free_Extent *extents;
+    size_t count, capacity;
+    uint32_t end;                   // Highest cluster + 1
+    uint32_t free_clusters;         // Sum of all runs
+} Free_Space;
+
+void fat32_free_extents_reset(Image *image) {
+    if (image->free_space) free(image->free_space->extents);
+    free(image->free_space);
+    image->free_space = NULL;
+}
+
+static bool insert_free_extent(Free_Space *space, size_t i, uint32_t first, uint32_t count) {
+    if (space->count == space->capacity) {
+        size_t capacity = space->capacity ? space->capacity * 2 : 64;
+        Free_Extent *extents = realloc(space->extents, capacity * sizeof *extents);
+        if (!extents) return false;
+        space->extents = extents;
+        space->capacity = capacity;
+    }
+    memmove(&space->extents[i + 1], &space->extents[i], (space->count - i) * sizeof *space->extents);
+    space->extents[i] = (Free_Extent){ .first = first, .count = count };
+    space->count++;
+    return true;
+}
+
+static void remove_free_extent(Free_Space *space, size_t i) {
+    memmove(&space->extents[i], &space->extents[i + 1], (space->count - i - 1) * sizeof *space->extents);
+    space->count--;
+}
+
+// Free space map of the image, read from the first FAT on first use
+static Free_Space *load_free_extents(Image *image, const Vbr *vbr) {
+    if (image->free_space) return image->free_space;
+
+    uint64_t end = (vbr->BPB_TotSec32 - vbr->BPB_RsvdSecCnt - (uint64_t)vbr->BPB_NumFATs * vbr->BPB_FATSz32)
+                 / vbr->BPB_SecPerClus + 2;
+    const uint64_t fat_entries = (uint64_t)vbr->BPB_FATSz32 * image->lba_size / sizeof(uint32_t);
+    if (end > fat_entries) end = fat_entries;
+
+    Free_Space *space = calloc(1, sizeof *space);
+    uint32_t *fat = malloc(end * sizeof *fat);
+    bool ok = space && fat && image_read(image, image->fat32_fat_lba * image->lba_size, fat, end * sizeof *fat);
+    for (uint32_t c = 2; ok && c < end; c++) {
+        if (fat[c] & FAT_ENTRY_MASK) continue;
+        uint32_t first = c;
+        while (c < end && !(fat[c] & FAT_ENTRY_MASK)) c++;
+        ok = insert_free_extent(space, space->count, first, c - first);
+        space->free_clusters += c - first;
+    }
+    free(fat);
+
+    if (!ok) {
+        if (space) free(space->extents);
+        free(space);
+        return NULL;
+    }
+    space->end = end;
+    image->free_space = space;
+    return space;
+}
+
+// Give clusters [first, first + count) back, merged with the runs next to them
+static bool release_free_run(Free_Space *space, uint32_t first, uint32_t count) {
+    space->free_clusters += count;
+    size_t lo = 0, hi = space->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (space->extents[mid].first < first) lo = mid + 1;
+        else hi = mid;
+    }
+
+    Free_Extent *prev = lo > 0 ? &space->extents[lo - 1] : NULL;
+    Free_Extent *next = lo < space->count ? &space->extents[lo] : NULL;
+    bool join_prev = prev && prev->first + prev->count == first;
+    bool join_next = next && first + count == next->first;
+
+    if (join_prev && join_next) {
+        prev->count += count + next->count;
+        remove_free_extent(space, lo);
+    }
+    else if (join_prev) prev->count += count;
+    else if (join_next) {
+        next->first = first;
+        next->count += count;
+    }
+    else return insert_free_extent(space, lo, first, count);
+    return true;
+}
+
+// Every cluster from FSI_Next_Free on is free: the start of the last run if it
+// reaches the end of the ESP, else unknown
+static uint32_t free_extents_next_free(const Free_Space *space) {
+    if (space->count == 0) return FSI_UNKNOWN;
+    const Free_Extent *last = &space->extents[space->count - 1];
+    return last->first + last->count == space->end ? last->first : FSI_UNKNOWN;
+}
+
+// Note free cluster count and next free cluster of the map for FSInfo
+static void note_free_space(Image *image) {
+    const Free_Space *space = image->free_space;
+    FSInfo *fsinfo = &image->fat32_fsinfo;
+    uint32_t next_free = free_extents_next_free(space);
+    if (fsinfo->FSI_Free_Count == space->free_clusters && fsinfo->FSI_Next_Free == next_free) return;
+    fsinfo->FSI_Free_Count = space->free_clusters;
+    fsinfo->FSI_Next_Free = next_free;
+    image->fat32_fsinfo_dirty = true;
+}
+
+bool fat32_flush_fsinfo(Image *image) {
+    if (!image->fat32_fsinfo_dirty) return true;
+    const Vbr *vbr = &image->fat32_vbr;
+    const FSInfo *fsinfo = &image->fat32_fsinfo;
+    if (!image_write(image, (image->esp_lba + vbr->BPB_FSInfo) * image->lba_size, fsinfo, sizeof *fsinfo)) return false;
+    if (vbr->BPB_BkBootSec != 0 &&
+        !image_write(image, (image->esp_lba + vbr->BPB_BkBootSec + vbr->BPB_FSInfo) * image->lba_size, fsinfo,
+                     sizeof *fsinfo)) {
+        return false;
+    }
+    image->fat32_fsinfo_dirty = false;
+    return true;
+}
+
+// Take clusters [first, first + count) out of the free run that starts at first
+static void take_free_run(Free_Space *space, uint32_t first, uint32_t count) {
+    size_t lo = 0, hi = space->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (space->extents[mid].first < first) lo = mid + 1;
+        else hi = mid;
+    }
+    space->extents[lo].first += count;
+    space->extents[lo].count -= count;
+    space->free_clusters -= count;
+    if (space->extents[lo].count == 0) remove_free_extent(space, lo);
+}
+
+// Link clusters [first, first + count) in every FAT, the last one to next
+static bool write_chain_run(Image *image, const Vbr *vbr, uint32_t first, uint32_t count, uint32_t next) {
+    uint32_t *chain = malloc((size_t)count * sizeof *chain);
+    if (!chain) return false;
+    for (uint32_t c = 0; c < count; c++) chain[c] = c + 1 < count ? first + c + 1 : next;
+
+    // One write per FAT copy
+    bool ok = true;
+    for (uint8_t i = 0; ok && i < vbr->BPB_NumFATs; i++) {
+        uint64_t fat_offset = (image->fat32_fat_lba + (i * vbr->BPB_FATSz32)) * image->lba_size + first * sizeof *chain;
+        ok = image_write(image, fat_offset, chain, (size_t)count * sizeof *chain);
+    }
+    free(chain);
+    return ok;
+}
+
+static int compare_extent_size(const void *a, const void *b) {
+    const Free_Extent *x = a, *y = b;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+// Smallest free run of at least count clusters, the lowest run wins a tie;
+// space->count if there is none
+static size_t best_fit(const Free_Space *space, uint32_t count) {
+    size_t best = space->count;
+    for (size_t i = 0; i < space->count; i++) {
+        if (space->extents[i].count < count) continue;
+        if (best == space->count || space->extents[i].count < space->extents[best].count) best = i;
+        if (space->extents[best].count == count) break;
+    }
+    return best;
+}
+
+bool fat32_take_clusters(Image *image, uint32_t count, uint32_t *first, uint32_t *got) {
+    Free_Space *space = load_free_extents(image, &image->fat32_vbr);
+    if (!space) return false;
+    if (space->count == 0) {
+        fprintf(stderr, "Error: ESP is full\n");
+        return false;
+    }
+
+    size_t run = best_fit(space, count);
+    if (run == space->count) {
+        run = 0;
+        for (size_t i = 1; i < space->count; i++) {
+            if (space->extents[i].count > space->extents[run].count) run = i;
         }
-    } else {
-        // For files, use 8.3 format
-        const char *dot = strrchr(filename, '.');
-        if (dot) {
-            // Has extension
-            int name_len = dot - filename;
-            if (name_len > 8) name_len = 8;
-            memcpy(fat_name, filename, name_len);
-            
-            int ext_len = strlen(dot + 1);
-            if (ext_len > 3) ext_len = 3;
-            memcpy(fat_name + 8, dot + 1, ext_len);
-        } else {
-            // No extension
-            int name_len = strlen(filename);
-            if (name_len > 8) name_len = 8;
-            memcpy(fat_name, filename, name_len);
+    }
+    *first = space->extents[run].first;
+    *got = space->extents[run].count < count ? space->extents[run].count : count;
+    take_free_run(space, *first, *got);
+    note_free_space(image);
+    return true;
+}
+
+// Allocate count clusters as a chain in every FAT, first cluster returned in
+// first. The smallest free run that fits is used, so holes left by freed
+// chains are filled before the free space at the end is split. When no run is
+// large enough the chain goes through the largest runs, fewest pieces first.
+bool fat32_alloc_chain(Image *image, uint32_t count, uint32_t *first) {
+    const Vbr *vbr = &image->fat32_vbr;
+    *first = 0;
+    if (count == 0) return true;
+    Free_Space *space = load_free_extents(image, vbr);
+    if (!space) return false;
+    if (space->free_clusters < count) {
+        fprintf(stderr, "Error: ESP has %u free clusters, %u needed\n", space->free_clusters, count);
+        return false;
+    }
+
+    size_t best = best_fit(space, count);
+    if (best < space->count) {
+        *first = space->extents[best].first;
+        if (!write_chain_run(image, vbr, *first, count, FAT_EOC)) return false;
+        take_free_run(space, *first, count);
+        note_free_space(image);
+        return true;
+    }
+
+    // Fragmented: largest runs first, the last piece only takes what is left
+    Free_Extent *runs = malloc(space->count * sizeof *runs);
+    if (!runs) return false;
+    memcpy(runs, space->extents, space->count * sizeof *runs);
+    qsort(runs, space->count, sizeof *runs, compare_extent_size);
+    size_t pieces = 0;
+    for (uint32_t got = 0; got < count; pieces++) {
+        if (runs[pieces].count > count - got) runs[pieces].count = count - got;
+        got += runs[pieces].count;
+    }
+
+    // Link back to front so every piece knows the start of the next one
+    bool ok = true;
+    for (size_t i = pieces; ok && i-- > 0; ) {
+        uint32_t next = i + 1 < pieces ? runs[i + 1].first : FAT_EOC;
+        ok = write_chain_run(image, vbr, runs[i].first, runs[i].count, next);
+    }
+    for (size_t i = 0; ok && i < pieces; i++) take_free_run(space, runs[i].first, runs[i].count);
+    if (ok) {
+        *first = runs[0].first;
+        note_free_space(image);
+    }
+    free(runs);
+    return ok;
+}
+
+bool fat32_copy_to_chain(Image *image, uint32_t first, int src_fd, uint64_t len) {
+    enum { FAT_BATCH = 1024 };                  // FAT entries read at once
+    const uint64_t cluster_bytes = (uint64_t)image->fat32_sec_per_clus * image->lba_size;
+    uint32_t fat[FAT_BATCH];
+    uint32_t batch_first = 0, batch_count = 0;
+
+    uint64_t done = 0;
+    uint32_t c = first;
+    while (done < len) {
+        if (c < 2 || c >= FAT_EOC_MIN) {
+            fprintf(stderr, "Error: cluster chain at %u is shorter than its file\n", first);
+            return false;
         }
-        
-        // Convert to uppercase
-        for (int i = 0; i < 11; i++) {
-            if (fat_name[i] >= 'a' && fat_name[i] <= 'z') {
-                fat_name[i] = fat_name[i] - 'a' + 'A';
+
+        // Follow the chain while it stays on consecutive clusters, reading
+        // the FAT entries of the clusters still to come in batches
+        uint32_t run_first = c, run_count = 0, next = c;
+        while (next == c && (uint64_t)run_count * cluster_bytes < len - done) {
+            if (c < batch_first || c >= batch_first + batch_count) {
+                uint64_t left = (len - done - (uint64_t)run_count * cluster_bytes + cluster_bytes - 1) / cluster_bytes;
+                batch_first = c;
+                batch_count = left < FAT_BATCH ? left : FAT_BATCH;
+                uint64_t offset = image->fat32_fat_lba * image->lba_size + (uint64_t)c * sizeof *fat;
+                if (!image_read(image, offset, fat, batch_count * sizeof *fat)) return false;
             }
+            run_count++;
+            next = fat[c - batch_first] & FAT_ENTRY_MASK;
+            c++;
+        }
+
+        uint64_t bytes = (uint64_t)run_count * cluster_bytes;
+        if (bytes > len - done) bytes = len - done;
+        if (!image_copy_from_fd_at(image, cluster_to_lba(image, run_first) * image->lba_size, src_fd, done, bytes)) {
+            return false;
         }
+        done += bytes;
+        c = next;
     }
+    return true;
 }
 
-uint32_t add_file_to_esp(char *file_name, FILE *image, File_Type type, uint32_t parent_dir_cluster) {
-    // Get FAT32 fs info for VBR 
-    Vbr vbr =  { 0 };
-    fseek(image, esp_lba * LBA_SIZE, SEEK_SET);
-    fread(&vbr, sizeof vbr, 1, image);
+// Clear clusters [first, first + count) in every FAT and give them back
+static bool free_run(Image *image, const Vbr *vbr, const uint32_t *zero, uint32_t first, uint32_t count) {
+    for (uint8_t i = 0; i < vbr->BPB_NumFATs; i++) {
+        uint64_t fat_offset = (image->fat32_fat_lba + (i * vbr->BPB_FATSz32)) * image->lba_size + first * sizeof *zero;
+        if (!image_write(image, fat_offset, zero, (size_t)count * sizeof *zero)) return false;
+    }
+    return release_free_run(image->free_space, first, count);
+}
 
-    FSInfo fsinfo = { 0 };
-    fseek(image, (esp_lba + 1) * LBA_SIZE, SEEK_SET);
-    fread(&fsinfo, sizeof fsinfo, 1, image);
+// Release a cluster chain in every FAT, consecutive clusters are cleared together
+bool fat32_free_chain(Image *image, uint32_t first) {
+    enum { MAX_RUN = 4096 };                    // Entries cleared per write
+    const Vbr *vbr = &image->fat32_vbr;
+    const Free_Space *space = load_free_extents(image, vbr);
+    if (!space) return false;
+
+    uint32_t *zero = calloc(MAX_RUN, sizeof *zero);
+    if (!zero) return false;
+
+    bool ok = true;
+    uint32_t run_first = 0, run_count = 0, length = 0;
+    for (uint32_t c = first; ok && c >= 2 && c < space->end && length++ < space->end; ) {
+        uint32_t next = fat32_get_fat_entry(image, c);
+        if (next == 0) break;                   // already free, chain is damaged
+
+        if (run_count && (c != run_first + run_count || run_count == MAX_RUN)) {
+            ok = free_run(image, vbr, zero, run_first, run_count);
+            run_count = 0;
+        }
+        if (run_count++ == 0) run_first = c;
+        c = next;
+    }
+    if (ok && run_count) ok = free_run(image, vbr, zero, run_first, run_count);
+    free(zero);
+
+    // A freed chain at the end of used space gives it back to the free area
+    if (ok) note_free_space(image);
+    return ok;
+}
+
+bool fat32_set_fat_entry(Image *image, uint32_t cluster, uint32_t value) {
+    const Vbr *vbr = &image->fat32_vbr;
+    for (uint8_t i = 0; i < vbr->BPB_NumFATs; i++) {
+        uint64_t fat_offset = (image->fat32_fat_lba + (i * vbr->BPB_FATSz32)) * image->lba_size + cluster * sizeof value;
+        if (!image_write(image, fat_offset, &value, sizeof value)) return false;
+    }
+    return true;
+}
+
+uint32_t fat32_get_fat_entry(Image *image, uint32_t cluster) {
+    uint32_t value = 0;
+    image_read(image, image->fat32_fat_lba * image->lba_size + cluster * sizeof value, &value, sizeof value);
+    return value & FAT_ENTRY_MASK;
+}
+
+// Add a file or directory to parent directory, returns its first cluster in first_cluster
+bool add_file_to_esp(const char *file_name, const char *host_path, Image *image, File_Type type, Dir_Index *parent,
+                     uint32_t *first_cluster) {
+    const uint32_t cluster_bytes = (uint32_t)image->fat32_sec_per_clus * image->lba_size;
+    FAT32_Dir_Entry_Short dir_entry = { 0 };
 
     // Get file size if file
     FILE *new_file = NULL;
-    uint64_t file_size_bytes = 0, file_size_lbas = 0;
+    uint64_t file_size_bytes = 0;
     if (type == TYPE_FILE) {
-        new_file = fopen(file_name, "rb");
-        if (!new_file) return 0; // Return 0 to indicate error
+        new_file = fopen(host_path, "rb");
+        if (!new_file) return false;
 
         fseek(new_file, 0, SEEK_END);
         file_size_bytes = ftell(new_file);
-        file_size_lbas = bytes_to_lbas(file_size_bytes);
         rewind(new_file);
-    }
-
-    // Get next free cluster in FATs
-    uint32_t next_free_cluster = fsinfo.FSI_Next_Free;
-    const uint32_t starting_cluster = next_free_cluster;
-
-    // Add new clusters to FATs
-    for (uint8_t i = 0; i < vbr.BPB_NumFATs; i++) {
-        fseek(image, (fat32_fat_lba + (i * vbr.BPB_FATSz32)) * LBA_SIZE, SEEK_SET);
-        fseek(image, next_free_cluster * sizeof next_free_cluster, SEEK_CUR);
-
-        uint32_t cluster = fsinfo.FSI_Next_Free;
-        next_free_cluster = cluster;
-        if (type == TYPE_FILE) {
-            for (uint64_t lba  = 0; lba < file_size_lbas - 1; lba++) {
-                cluster++;  // Each cluster points to next cluster of file data
-                next_free_cluster++;
-                fwrite(&cluster, sizeof cluster, 1, image);
-            }
+        if (file_size_bytes > FAT_MAX_FILE_SIZE) {
+            fprintf(stderr, "Error: '%s' is larger than the FAT32 limit of %u bytes\n", host_path, FAT_MAX_FILE_SIZE);
+            fclose(new_file);
+            return false;
         }
-
-        // only cluster added for a directory, being the EOC marker
-        cluster = 0xFFFFFFFF;
-        next_free_cluster++;
-        fwrite(&cluster, sizeof cluster, 1, image);
     }
 
-    // Update next free cluster
-    fsinfo.FSI_Next_Free = next_free_cluster;
-    fseek(image, (esp_lba + 1) * LBA_SIZE, SEEK_SET);
-    fwrite(&fsinfo, sizeof fsinfo, 1, image);
-
-    // Go to Parent Directory's data location
-    fseek(image, (fat32_data_lba + parent_dir_cluster - 2) * LBA_SIZE, SEEK_SET);
-    
-    // Add new directory entry for this new dir/file
-    FAT32_Dir_Entry_Short dir_entry = { 0 };
-
-    fread(&dir_entry, 1, sizeof dir_entry, image);
-    while (dir_entry.DIR_Name[0] != '\0') {
-        fread(&dir_entry, 1, sizeof dir_entry, image);
+    // Clusters needed, a directory always gets one, empty files have no cluster chain
+    uint32_t num_clusters = (type == TYPE_DIR) ? 1 : (file_size_bytes + cluster_bytes - 1) / cluster_bytes;
+    uint32_t starting_cluster = 0;
+    if (num_clusters && !fat32_alloc_chain(image, num_clusters, &starting_cluster)) {
+        if (new_file) fclose(new_file);
+        return false;
     }
 
-    // size of dir_entry = 32, back up to overwrite empty spot
-    fseek(image, -32, SEEK_CUR);        
-   
-    format_fat32_name((char *)dir_entry.DIR_Name, file_name, type);
+    // Add new directory entry for this new dir/file
+    format_fat32_name((char *)dir_entry.DIR_Name, file_name);
     if (type == TYPE_DIR) {
         dir_entry.DIR_Attr = ATTR_DIRECTORY;
     }
 
     uint16_t fat_time, fat_date;
-    get_fat_dir_entry_time_date(&fat_time, &fat_date);
+    get_fat_dir_entry_time_date(image, &fat_time, &fat_date);
     dir_entry.DIR_CrtTime = fat_time;
     dir_entry.DIR_CrtDate = fat_date;
     dir_entry.DIR_WrtTime = fat_time;
@@ -317,41 +656,52 @@ uint32_t add_file_to_esp(char *file_name, FILE *image, File_Type type, uint32_t
     if (type == TYPE_FILE)
         dir_entry.DIR_FileSize = file_size_bytes;
 
-    fwrite(&dir_entry, 1, sizeof dir_entry, image);
+    if (!dir_index_add(image, parent, &dir_entry)) {
+        if (new_file) fclose(new_file);
+        if (starting_cluster) fat32_free_chain(image, starting_cluster);
+        return false;
+    }
+    *first_cluster = starting_cluster;
 
     // Go to new file's cluster's data location
-    fseek(image, (fat32_data_lba + starting_cluster - 2) * LBA_SIZE, SEEK_SET);
+    uint64_t data_offset = cluster_to_lba(image, starting_cluster) * image->lba_size;
 
     // Add new file data
+    bool ok = true;
     if (type == TYPE_DIR) {
-        // Add "." and ".." for dir entry
-        memcpy(dir_entry.DIR_Name, ".          ", 11);
-        fwrite(&dir_entry, 1, sizeof dir_entry, image);
+        // Whole cluster is written so no stale data is read as entries
+        FAT32_Dir_Entry_Short *dir_cluster = calloc(1, cluster_bytes);
+        if (!dir_cluster) return false;
 
-        memcpy(dir_entry.DIR_Name, "..         ", 11);
-        dir_entry.DIR_FstClusHI = (parent_dir_cluster >> 16) & 0xFFFF;
-        dir_entry.DIR_FstClusLO = parent_dir_cluster & 0xFFFF;
-        fwrite(&dir_entry, 1, sizeof dir_entry, image);
+        // Add "." and ".." for dir entry
+        dir_cluster[0] = dir_entry;
+        memcpy(dir_cluster[0].DIR_Name, ".          ", 11);
+
+        // Root directory does not have a cluster value
+        uint32_t parent_dir_cluster = (parent == dir_index_root(image)) ? 0 : parent->clusters[0];
+        dir_cluster[1] = dir_entry;
+        memcpy(dir_cluster[1].DIR_Name, "..         ", 11);
+        dir_cluster[1].DIR_FstClusHI = (parent_dir_cluster >> 16) & 0xFFFF;
+        dir_cluster[1].DIR_FstClusLO = parent_dir_cluster & 0xFFFF;
+        ok = image_write(image, data_offset, dir_cluster, cluster_bytes);
+        free(dir_cluster);
     }
     else {
-        // Add file data
-        uint8_t *file_buf = calloc(1, LBA_SIZE);
-        for (uint64_t i = 0; i < file_size_lbas; i++) {
-            size_t bytes_read = fread(file_buf, 1, LBA_SIZE, new_file);     // read file data into buf, write buf into img
-            fwrite(file_buf, 1, bytes_read, image);                         // reason for two parts is due to partial data
-        }
-        free(file_buf);
+        // Add file data, the chain may be in several pieces
+        if (num_clusters) ok = fat32_copy_to_chain(image, starting_cluster, fileno(new_file), file_size_bytes);
+        fclose(new_file);
     }
-    return starting_cluster;
+    return ok;
 }
 
-bool add_path_to_esp(char *path, FILE *image) {
+static bool add_path(char *path, const char *host_path, Image *image) {
     if (*path != '/') return false; // Path must begin with root '/'
 
     File_Type type = TYPE_DIR;
     char *start = path + 1; // skip initial slash
     char *end = start;
-    uint32_t dir_cluster = 2;   // Next directory's cluster location; start at root
+    Dir_Index *dir = dir_index_root(image);    // Next directory; start at root
+    if (!dir) return false;
 
     // Get next name from path until end of path
     while (type == TYPE_DIR) {
@@ -366,35 +716,31 @@ bool add_path_to_esp(char *path, FILE *image) {
         }
 
         *end = '\0';        // Null terminates next name in caseof directory
-        
-        FAT32_Dir_Entry_Short dir_entry = { 0 };
-        bool found = false;
-        fseek(image, (fat32_data_lba + dir_cluster - 2) * LBA_SIZE, SEEK_SET);
-        do {
-            fread(&dir_entry, 1, sizeof dir_entry, image);
-            if (fat32_name_matches((const char *)dir_entry.DIR_Name, start)) {
-                // Found name in dir
-                found = true;
-                break;
-            };
-        } while (dir_entry.DIR_Name[0] != '\0');
-
-        if (!found) {
-            uint32_t new_cluster = add_file_to_esp(start, image, type, dir_cluster);
-            if (new_cluster == 0)
+
+        // Look up normalized 8.3 name in directory index
+        uint8_t fat_name[11];
+        format_fat32_name((char *)fat_name, start);
+        Dir_Index_Entry *entry = dir_index_find(dir, fat_name);
+
+        if (!entry) {
+            uint32_t new_cluster = 0;
+            const char *host = (type == TYPE_FILE && host_path) ? host_path : start;
+            if (!add_file_to_esp(start, host, image, type, dir, &new_cluster))
+                return false;
+            entry = dir_index_find(dir, fat_name);
+        }
+
+        // Navigate into directory
+        if (type == TYPE_DIR) {
+            dir = entry ? dir_index_open(image, entry) : NULL;
+            if (!dir) {
+                fprintf(stderr, "Error: '%s' is not a directory\n", start);
                 return false;
-            // If we created a directory, update dir_cluster to navigate into it
-            if (type == TYPE_DIR) {
-                dir_cluster = new_cluster;
-            }
-        } else {
-            // If we found an existing entry, update dir_cluster to navigate into it if it's a directory
-            if (type == TYPE_DIR) {
-                dir_cluster = (dir_entry.DIR_FstClusHI << 16) | dir_entry.DIR_FstClusLO;
             }
         }
 
-        *end++ = '/';
+        // Restore separator, the last name was already terminated
+        if (type == TYPE_DIR) *end++ = '/';
         start = end;
     }
 
@@ -402,3 +748,10 @@ bool add_path_to_esp(char *path, FILE *image) {
 
     return true;
 }
+
+bool add_path_to_esp(char *path, const char *host_path, Image *image) {
+    Stats_Span span = stats_begin("add_path_to_esp");
+    bool ok = add_path(path, host_path, image);
+    stats_end(&span);
+    return ok;
+}
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fat32_dir.h"
+#include "fat32.h"
+#include "structures.h"
+#include "utils.h"
+#include "gpt_constants.h"
+
+enum {
+    DIR_ENTRY_SIZE = sizeof(FAT32_Dir_Entry_Short),
+    DIR_ENTRY_FREE = 0xE5,          // First name byte of a deleted entry, also a removed table slot
+    DIR_MAX_ENTRIES = 65536,        // FAT32 limit, directories are at most 2 MiB
+    DIR_INDEX_MIN_CAPACITY = 16,
+};
+
+// FNV-1a over the 11 name bytes
+static uint32_t hash_name(const uint8_t name[11]) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 11; i++) {
+        hash = (hash ^ name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static Dir_Index_Entry *find_slot(Dir_Index_Entry *table, uint32_t capacity, const uint8_t name[11]) {
+    uint32_t i = hash_name(name) & (capacity - 1);
+    while (table[i].name[0] != 0 && memcmp(table[i].name, name, 11) != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &table[i];
+}
+
+// Insert into hash table, doubling it past 70% load
+static Dir_Index_Entry *insert_entry(Dir_Index *dir, const FAT32_Dir_Entry_Short *entry, uint32_t slot) {
+    if ((dir->count + 1) * 10 > dir->capacity * 7) {
+        uint32_t new_capacity = dir->capacity ? dir->capacity * 2 : DIR_INDEX_MIN_CAPACITY;
+        Dir_Index_Entry *new_table = calloc(new_capacity, sizeof *new_table);
+        if (!new_table) return NULL;
+
+        dir->count = 0;
+        for (uint32_t i = 0; i < dir->capacity; i++) {
+            if (dir->table[i].name[0] == 0 || dir->table[i].name[0] == DIR_ENTRY_FREE) continue;
+            *find_slot(new_table, new_capacity, dir->table[i].name) = dir->table[i];
+            dir->count++;
+        }
+        free(dir->table);
+        dir->table = new_table;
+        dir->capacity = new_capacity;
+    }
+
+    Dir_Index_Entry *indexed = find_slot(dir->table, dir->capacity, entry->DIR_Name);
+    if (indexed->name[0] == 0) dir->count++;
+    memcpy(indexed->name, entry->DIR_Name, 11);
+    indexed->attr = entry->DIR_Attr;
+    indexed->first_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    indexed->slot = slot;
+    indexed->dir = NULL;
+    return indexed;
+}
+
+static uint64_t slot_offset(const Image *image, const Dir_Index *dir, uint32_t slot, uint32_t cluster_bytes) {
+    uint32_t per_cluster = cluster_bytes / DIR_ENTRY_SIZE;
+    return cluster_to_lba(image, dir->clusters[slot / per_cluster]) * image->lba_size
+         + (uint64_t)(slot % per_cluster) * DIR_ENTRY_SIZE;
+}
+
+static uint32_t esp_cluster_bytes(const Image *image) {
+    return (uint32_t)image->fat32_sec_per_clus * image->lba_size;
+}
+
+static bool push_free_slot(Dir_Index *dir, uint32_t slot) {
+    if (dir->num_free == dir->free_cap) {
+        uint32_t cap = dir->free_cap ? dir->free_cap * 2 : 16;
+        uint32_t *slots = realloc(dir->free_slots, cap * sizeof *slots);
+        if (!slots) return false;
+        dir->free_slots = slots;
+        dir->free_cap = cap;
+    }
+    dir->free_slots[dir->num_free++] = slot;
+    return true;
+}
+
+// Read a directory's cluster chain and entries from the image
+static Dir_Index *load_dir(Image *image, uint32_t first_cluster) {
+    const uint32_t cluster_bytes = esp_cluster_bytes(image);
+    Dir_Index *dir = calloc(1, sizeof *dir);
+    uint8_t *buf = malloc(cluster_bytes);
+    if (!dir || !buf) goto fail;
+
+    uint32_t cap = 0;
+    for (uint32_t c = first_cluster; c >= 2 && c < FAT_EOC_MIN; c = fat32_get_fat_entry(image, c)) {
+        if (dir->num_clusters * (cluster_bytes / DIR_ENTRY_SIZE) >= DIR_MAX_ENTRIES) {
+            fprintf(stderr, "Error: directory cluster chain at %u is too long\n", first_cluster);
+            goto fail;
+        }
+        if (dir->num_clusters == cap) {
+            cap = cap ? cap * 2 : 4;
+            uint32_t *clusters = realloc(dir->clusters, cap * sizeof *clusters);
+            if (!clusters) goto fail;
+            dir->clusters = clusters;
+        }
+        dir->clusters[dir->num_clusters++] = c;
+    }
+    if (dir->num_clusters == 0) goto fail;
+
+    // Index entries up to the first never used one
+    bool end = false;
+    for (uint32_t i = 0; i < dir->num_clusters && !end; i++) {
+        if (!image_read(image, cluster_to_lba(image, dir->clusters[i]) * image->lba_size, buf, cluster_bytes)) goto fail;
+
+        for (uint32_t e = 0; e < cluster_bytes / DIR_ENTRY_SIZE; e++) {
+            const FAT32_Dir_Entry_Short *entry = (const FAT32_Dir_Entry_Short *)(buf + e * DIR_ENTRY_SIZE);
+            if (entry->DIR_Name[0] == '\0') {
+                end = true;
+                break;
+            }
+            dir->next_slot++;
+
+            // Remember deleted entries for reuse, skip long name and volume label entries, and "." / ".."
+            if (entry->DIR_Name[0] == DIR_ENTRY_FREE) {
+                if (!push_free_slot(dir, dir->next_slot - 1)) goto fail;
+                continue;
+            }
+            if (entry->DIR_Name[0] == '.') continue;
+            if ((entry->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME || (entry->DIR_Attr & ATTR_VOLUME_ID)) continue;
+            if (!insert_entry(dir, entry, dir->next_slot - 1)) goto fail;
+        }
+    }
+
+    free(buf);
+    return dir;
+
+fail:
+    fprintf(stderr, "Error: could not read directory at cluster %u\n", first_cluster);
+    free(buf);
+    if (dir) {
+        free(dir->clusters);
+        free(dir->free_slots);
+        free(dir->table);
+        free(dir);
+    }
+    return NULL;
+}
+
+static void free_dir(Dir_Index *dir) {
+    if (!dir) return;
+    for (uint32_t i = 0; i < dir->capacity; i++) {
+        free_dir(dir->table[i].dir);
+    }
+    free(dir->table);
+    free(dir->clusters);
+    free(dir->free_slots);
+    free(dir);
+}
+
+Dir_Index *dir_index_root(Image *image) {
+    if (!image->root_index) image->root_index = load_dir(image, image->fat32_vbr.BPB_RootClus);
+    return image->root_index;
+}
+
+Dir_Index *dir_index_open(Image *image, Dir_Index_Entry *entry) {
+    if (!(entry->attr & ATTR_DIRECTORY)) return NULL;
+    if (!entry->dir) entry->dir = load_dir(image, entry->first_cluster);
+    return entry->dir;
+}
+
+Dir_Index_Entry *dir_index_find(Dir_Index *dir, const uint8_t name[11]) {
+    if (dir->capacity == 0) return NULL;
+    Dir_Index_Entry *entry = find_slot(dir->table, dir->capacity, name);
+    return entry->name[0] != 0 ? entry : NULL;
+}
+
+Dir_Index_Entry *dir_index_next(Dir_Index *dir, uint32_t *pos) {
+    for (; *pos < dir->capacity; (*pos)++) {
+        Dir_Index_Entry *entry = &dir->table[*pos];
+        if (entry->name[0] != 0 && entry->name[0] != DIR_ENTRY_FREE) {
+            (*pos)++;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+bool dir_index_add(Image *image, Dir_Index *dir, const FAT32_Dir_Entry_Short *entry) {
+    const uint32_t cluster_bytes = esp_cluster_bytes(image);
+    const uint32_t per_cluster = cluster_bytes / DIR_ENTRY_SIZE;
+
+    // Reuse a deleted entry, else append and when full extend the chain by one zeroed cluster
+    if (dir->num_free == 0 && dir->next_slot >= dir->num_clusters * per_cluster) {
+        if (dir->next_slot >= DIR_MAX_ENTRIES) {
+            fprintf(stderr, "Error: directory has the maximum of %d entries\n", DIR_MAX_ENTRIES);
+            return false;
+        }
+
+        uint32_t *clusters = realloc(dir->clusters, (dir->num_clusters + 1) * sizeof *clusters);
+        if (!clusters) return false;
+        dir->clusters = clusters;
+
+        uint32_t new_cluster = 0;
+        uint8_t *zero = calloc(1, cluster_bytes);
+        bool ok = zero && fat32_alloc_chain(image, 1, &new_cluster) &&
+                  image_write(image, cluster_to_lba(image, new_cluster) * image->lba_size, zero, cluster_bytes) &&
+                  fat32_set_fat_entry(image, dir->clusters[dir->num_clusters - 1], new_cluster);
+        free(zero);
+        if (!ok) return false;
+
+        dir->clusters[dir->num_clusters++] = new_cluster;
+    }
+
+    uint32_t slot = dir->num_free ? dir->free_slots[dir->num_free - 1] : dir->next_slot;
+    if (!image_write(image, slot_offset(image, dir, slot, cluster_bytes), entry, sizeof *entry)) return false;
+    if (dir->num_free) {
+        dir->num_free--;
+    } else {
+        dir->next_slot++;
+    }
+
+    return insert_entry(dir, entry, slot) != NULL;
+}
+
+bool dir_index_read(Image *image, Dir_Index *dir, const Dir_Index_Entry *indexed, FAT32_Dir_Entry_Short *entry) {
+    return image_read(image, slot_offset(image, dir, indexed->slot, esp_cluster_bytes(image)), entry, sizeof *entry);
+}
+
+bool dir_index_update(Image *image, Dir_Index *dir, Dir_Index_Entry *indexed, const FAT32_Dir_Entry_Short *entry) {
+    if (memcmp(indexed->name, entry->DIR_Name, 11) != 0) return false;     // renames would move the table slot
+    if (!image_write(image, slot_offset(image, dir, indexed->slot, esp_cluster_bytes(image)), entry, sizeof *entry)) {
+        return false;
+    }
+    indexed->attr = entry->DIR_Attr;
+    indexed->first_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    return true;
+}
+
+bool dir_index_remove(Image *image, Dir_Index *dir, Dir_Index_Entry *indexed) {
+    const uint8_t deleted = DIR_ENTRY_FREE;
+    if (!image_write(image, slot_offset(image, dir, indexed->slot, esp_cluster_bytes(image)), &deleted, 1)) return false;
+
+    // Best effort, a slot that is not remembered is only reused after the directory is read again
+    push_free_slot(dir, indexed->slot);
+
+    // Keep the table slot so probing continues past it
+    free_dir(indexed->dir);
+    indexed->dir = NULL;
+    indexed->name[0] = DIR_ENTRY_FREE;
+    return true;
+}
+
+void dir_index_reset(Image *image) {
+    free_dir(image->root_index);
+    image->root_index = NULL;
+}
@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fat32.h"
+#include "fat32_dir.h"
+#include "structures.h"
+#include "utils.h"
+#include "gpt_constants.h"
+#include "stats.h"
+
+// Bulk import of a host directory tree into the ESP.
+// The whole tree is scanned and planned in memory first: every directory's
+// entries and every cluster chain, taken from the image's free space map. Then
+// the FATs, directory clusters and file data are written in a few large
+// sequential writes, runs of consecutive clusters staged together.
+
+enum {
+    IMPORT_COPY_BUFFER_SIZE = 4 * 1024 * 1024,
+    DIR_ENTRY_SIZE = sizeof(FAT32_Dir_Entry_Short),
+};
+
+typedef struct Import_Node {
+    char fat_name[11];
+    char *host_path;
+    File_Type type;
+    uint64_t size;                  // File size in bytes
+    uint32_t first_cluster;
+    bool fragmented;                // File chain is not one run of clusters
+
+    // Directories only
+    struct Import_Node *children;
+    size_t num_children;
+    bool existing;                  // Directory already on the ESP
+    uint32_t *clusters;             // Cluster chain of directory
+    size_t num_clusters, num_existing_clusters;
+    uint8_t *entries;               // Directory contents, num_clusters * cluster size
+    size_t num_entries;             // Used 32 byte entries
+} Import_Node;
+
+typedef struct {
+    Image *image;
+    Vbr vbr;
+    uint32_t *fat;                  // Copy of the first FAT
+    uint32_t cluster_size;          // Bytes per cluster
+    uint32_t total_clusters;        // Highest valid cluster + 1
+    uint64_t fat_offset, data_offset;
+    uint64_t clean_offset;          // Never written from here on, sparse images skip zeros there
+    uint32_t dirty_min, dirty_max;  // FAT entries changed
+    uint16_t fat_time, fat_date;
+    uint64_t num_files, num_dirs, bytes;
+} Import_Ctx;
+
+static uint64_t cluster_offset(const Import_Ctx *ctx, uint32_t cluster) {
+    return ctx->data_offset + (uint64_t)(cluster - 2) * ctx->cluster_size;
+}
+
+static void set_fat_entry(Import_Ctx *ctx, uint32_t cluster, uint32_t value) {
+    ctx->fat[cluster] = value;
+    if (cluster < ctx->dirty_min) ctx->dirty_min = cluster;
+    if (cluster > ctx->dirty_max) ctx->dirty_max = cluster;
+}
+
+// Take count clusters from the free space map and chain them in the FAT copy,
+// the first cluster is returned, 0 if the ESP is full. A chain that does not fit
+// one free run goes through several and sets fragmented. clusters gets every
+// cluster of the chain when it is not NULL
+static uint32_t alloc_chain(Import_Ctx *ctx, uint32_t count, uint32_t *clusters, bool *fragmented) {
+    uint32_t first = 0, last = 0;
+    for (uint32_t done = 0; done < count; ) {
+        uint32_t run = 0, got = 0;
+        if (!fat32_take_clusters(ctx->image, count - done, &run, &got)) return 0;
+        if (last) set_fat_entry(ctx, last, run);
+        else first = run;
+
+        for (uint32_t c = 0; c < got; c++) {
+            set_fat_entry(ctx, run + c, c + 1 < got ? run + c + 1 : FAT_EOC);
+            if (clusters) clusters[done + c] = run + c;
+        }
+        last = run + got - 1;
+        done += got;
+        if (done < count) *fragmented = true;
+    }
+    return first;
+}
+
+static void free_node(Import_Node *node) {
+    for (size_t i = 0; i < node->num_children; i++) {
+        free_node(&node->children[i]);
+    }
+    free(node->children);
+    free(node->clusters);
+    free(node->entries);
+    free(node->host_path);
+}
+
+// Read host directory into node's children, sorted by name so images are stable
+static bool scan_host_dir(Import_Ctx *ctx, Import_Node *node) {
+    char **names = NULL;
+    size_t num_names = 0;
+    if (!list_dir(node->host_path, &names, &num_names)) return false;
+
+    bool ok = true;
+    node->children = calloc(num_names ? num_names : 1, sizeof *node->children);
+    if (!node->children) {
+        fprintf(stderr, "Error: out of memory\n");
+        ok = false;
+    }
+    for (size_t i = 0; ok && i < num_names; i++) {
+        Import_Node *child = &node->children[node->num_children];
+        size_t path_len = strlen(node->host_path) + strlen(names[i]) + 2;
+        child->host_path = malloc(path_len);
+        if (!child->host_path) {
+            fprintf(stderr, "Error: out of memory\n");
+            ok = false;
+            break;
+        }
+        snprintf(child->host_path, path_len, "%s/%s", node->host_path, names[i]);
+
+        struct stat st;
+        if (stat(child->host_path, &st) != 0) {
+            fprintf(stderr, "Error: could not stat '%s'\n", child->host_path);
+            free(child->host_path);
+            ok = false;
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            child->type = TYPE_DIR;
+            format_fat32_name(child->fat_name, names[i]);
+            node->num_children++;
+            ctx->num_dirs++;
+            ok = scan_host_dir(ctx, child);
+        } else if (S_ISREG(st.st_mode)) {
+            if ((uint64_t)st.st_size > FAT_MAX_FILE_SIZE) {
+                fprintf(stderr, "Error: '%s' is larger than the FAT32 limit of %u bytes\n", child->host_path,
+                        FAT_MAX_FILE_SIZE);
+                free(child->host_path);
+                ok = false;
+                break;
+            }
+            child->type = TYPE_FILE;
+            child->size = st.st_size;
+            format_fat32_name(child->fat_name, names[i]);
+            node->num_children++;
+            ctx->num_files++;
+            ctx->bytes += st.st_size;
+        } else {
+            fprintf(stderr, "Warning: skipping '%s', not a file or directory\n", child->host_path);
+            free(child->host_path);
+        }
+    }
+
+    free_names(names, num_names);
+    return ok;
+}
+
+// Load an existing directory's cluster chain and entries from the image
+static bool load_existing_dir(Import_Ctx *ctx, Import_Node *node) {
+    size_t cap = 0;
+    for (uint32_t c = node->first_cluster; c >= 2 && c < FAT_EOC_MIN; c = ctx->fat[c] & FAT_ENTRY_MASK) {
+        if (c >= ctx->total_clusters || node->num_clusters >= ctx->total_clusters) {
+            fprintf(stderr, "Error: corrupt cluster chain in ESP directory\n");
+            return false;
+        }
+        if (node->num_clusters == cap) {
+            cap = cap ? cap * 2 : 4;
+            uint32_t *clusters = realloc(node->clusters, cap * sizeof *clusters);
+            if (!clusters) {
+                fprintf(stderr, "Error: out of memory\n");
+                return false;
+            }
+            node->clusters = clusters;
+        }
+        node->clusters[node->num_clusters++] = c;
+    }
+    node->num_existing_clusters = node->num_clusters;
+
+    node->entries = calloc(node->num_clusters ? node->num_clusters : 1, ctx->cluster_size);
+    if (!node->entries) {
+        fprintf(stderr, "Error: out of memory\n");
+        return false;
+    }
+    for (size_t i = 0; i < node->num_clusters; i++) {
+        if (!image_read(ctx->image, cluster_offset(ctx, node->clusters[i]),
+                        node->entries + i * ctx->cluster_size, ctx->cluster_size)) {
+            return false;
+        }
+    }
+
+    // Entries are used up to the first never used slot
+    size_t max_entries = node->num_clusters * ctx->cluster_size / DIR_ENTRY_SIZE;
+    while (node->num_entries < max_entries && node->entries[node->num_entries * DIR_ENTRY_SIZE] != '\0') {
+        node->num_entries++;
+    }
+    return true;
+}
+
+// Match children against entries of existing directories, count what has to be allocated
+static bool plan_dir(Import_Ctx *ctx, Import_Node *node, uint32_t parent_cluster) {
+    if (node->existing && !load_existing_dir(ctx, node)) return false;
+
+    size_t new_entries = node->existing ? 0 : 2;    // "." and ".." for new directories
+    for (size_t i = 0; i < node->num_children; i++) {
+        Import_Node *child = &node->children[i];
+
+        // Same 8.3 name twice in this host directory
+        for (size_t j = 0; j < i; j++) {
+            if (memcmp(node->children[j].fat_name, child->fat_name, 11) == 0) {
+                fprintf(stderr, "Error: '%s' has the same 8.3 name as '%s'\n",
+                        child->host_path, node->children[j].host_path);
+                return false;
+            }
+        }
+
+        // Already on the ESP; directories are merged, files are not replaced
+        for (size_t e = 0; node->existing && e < node->num_entries; e++) {
+            const FAT32_Dir_Entry_Short *entry = (const FAT32_Dir_Entry_Short *)(node->entries + e * DIR_ENTRY_SIZE);
+            if (entry->DIR_Name[0] == 0xE5 || memcmp(entry->DIR_Name, child->fat_name, 11) != 0) continue;
+
+            if (child->type != TYPE_DIR || !(entry->DIR_Attr & ATTR_DIRECTORY)) {
+                fprintf(stderr, "Error: '%s' already exists in the ESP\n", child->host_path);
+                return false;
+            }
+            child->existing = true;
+            child->first_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+            break;
+        }
+        if (!child->existing) new_entries++;
+    }
+
+    // Grow directory to fit the new entries
+    size_t total_entries = node->num_entries + new_entries;
+    size_t needed = (total_entries * DIR_ENTRY_SIZE + ctx->cluster_size - 1) / ctx->cluster_size;
+    if (needed == 0) needed = 1;
+    if (needed > node->num_clusters) {
+        uint32_t *clusters = realloc(node->clusters, needed * sizeof *clusters);
+        if (clusters) node->clusters = clusters;
+        uint8_t *entries = clusters ? realloc(node->entries, needed * ctx->cluster_size) : NULL;
+        if (!entries) {
+            fprintf(stderr, "Error: out of memory\n");
+            return false;
+        }
+        node->entries = entries;
+        memset(node->entries + node->num_clusters * ctx->cluster_size, 0,
+               (needed - node->num_clusters) * ctx->cluster_size);
+
+        // New clusters hang off the old end of an existing directory's chain
+        bool fragmented = false;
+        uint32_t first = alloc_chain(ctx, needed - node->num_clusters, node->clusters + node->num_clusters,
+                                     &fragmented);
+        if (first == 0) return false;
+        if (node->num_clusters) set_fat_entry(ctx, node->clusters[node->num_clusters - 1], first);
+        node->num_clusters = needed;
+    }
+    if (!node->existing) node->first_cluster = node->clusters[0];
+
+    // New directories start with "." and ".."
+    if (!node->existing) {
+        FAT32_Dir_Entry_Short dot = {
+            .DIR_Name = { ".          " },
+            .DIR_Attr = ATTR_DIRECTORY,
+            .DIR_CrtTime = ctx->fat_time,
+            .DIR_CrtDate = ctx->fat_date,
+            .DIR_WrtTime = ctx->fat_time,
+            .DIR_WrtDate = ctx->fat_date,
+            .DIR_FstClusHI = (node->first_cluster >> 16) & 0xFFFF,
+            .DIR_FstClusLO = node->first_cluster & 0xFFFF,
+        };
+        memcpy(node->entries, &dot, sizeof dot);
+
+        // Root directory does not have a cluster value
+        uint32_t dotdot_cluster = parent_cluster == ctx->vbr.BPB_RootClus ? 0 : parent_cluster;
+        memcpy(dot.DIR_Name, "..         ", 11);
+        dot.DIR_FstClusHI = (dotdot_cluster >> 16) & 0xFFFF;
+        dot.DIR_FstClusLO = dotdot_cluster & 0xFFFF;
+        memcpy(node->entries + DIR_ENTRY_SIZE, &dot, sizeof dot);
+        node->num_entries = 2;
+    }
+
+    // Sub directories first so their clusters are laid out together
+    for (size_t i = 0; i < node->num_children; i++) {
+        if (node->children[i].type == TYPE_DIR && !plan_dir(ctx, &node->children[i], node->first_cluster)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Allocate clusters for every file in tree order, one run each where the free space allows
+static bool plan_files(Import_Ctx *ctx, Import_Node *node) {
+    for (size_t i = 0; i < node->num_children; i++) {
+        Import_Node *child = &node->children[i];
+        if (child->type == TYPE_DIR) {
+            if (!plan_files(ctx, child)) return false;
+            continue;
+        }
+
+        uint32_t count = (child->size + ctx->cluster_size - 1) / ctx->cluster_size;
+        if (count == 0) continue;   // Empty files have no clusters
+
+        child->first_cluster = alloc_chain(ctx, count, NULL, &child->fragmented);
+        if (child->first_cluster == 0) return false;
+    }
+    return true;
+}
+
+// Fill in directory entries of new children
+static void fill_dir_entries(Import_Ctx *ctx, Import_Node *node) {
+    for (size_t i = 0; i < node->num_children; i++) {
+        Import_Node *child = &node->children[i];
+        if (child->type == TYPE_DIR) fill_dir_entries(ctx, child);
+        if (child->existing) continue;
+
+        FAT32_Dir_Entry_Short entry = {
+            .DIR_Attr = child->type == TYPE_DIR ? ATTR_DIRECTORY : 0,
+            .DIR_CrtTime = ctx->fat_time,
+            .DIR_CrtDate = ctx->fat_date,
+            .DIR_WrtTime = ctx->fat_time,
+            .DIR_WrtDate = ctx->fat_date,
+            .DIR_FstClusHI = (child->first_cluster >> 16) & 0xFFFF,
+            .DIR_FstClusLO = child->first_cluster & 0xFFFF,
+            .DIR_FileSize = child->type == TYPE_FILE ? child->size : 0,
+        };
+        memcpy(entry.DIR_Name, child->fat_name, 11);
+        memcpy(node->entries + node->num_entries * DIR_ENTRY_SIZE, &entry, sizeof entry);
+        node->num_entries++;
+    }
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t used;
+    uint64_t offset;        // Image offset of buf[0]
+} Copy_Buffer;
+
+static bool flush_copy_buffer(Import_Ctx *ctx, Copy_Buffer *copy) {
+    if (copy->used == 0) return true;
+    bool ok = true;
+    if (ctx->image->sparse && copy->offset >= ctx->clean_offset && is_zero_block(copy->buf, copy->used)) {
+        stats_add(STAT_HOLE_BYTES, copy->used);
+    }
+    else ok = image_write(ctx->image, copy->offset, copy->buf, copy->used);
+    copy->offset += copy->used;
+    copy->used = 0;
+    return ok;
+}
+
+// Start staging at offset, unless it continues the bytes staged so far
+static bool seek_copy_buffer(Import_Ctx *ctx, Copy_Buffer *copy, uint64_t offset) {
+    if (copy->used && copy->offset + copy->used == offset) return true;
+    if (!flush_copy_buffer(ctx, copy)) return false;
+    copy->offset = offset;
+    return true;
+}
+
+// Directory clusters go through the copy buffer, so consecutive ones are written together
+static bool write_dirs(Import_Ctx *ctx, Import_Node *node, Copy_Buffer *copy) {
+    for (size_t i = 0; i < node->num_clusters; i++) {
+        if (!seek_copy_buffer(ctx, copy, cluster_offset(ctx, node->clusters[i]))) return false;
+        if (copy->used + ctx->cluster_size > IMPORT_COPY_BUFFER_SIZE && !flush_copy_buffer(ctx, copy)) return false;
+        memcpy(copy->buf + copy->used, node->entries + i * ctx->cluster_size, ctx->cluster_size);
+        copy->used += ctx->cluster_size;
+    }
+
+    for (size_t i = 0; i < node->num_children; i++) {
+        if (node->children[i].type == TYPE_DIR && !write_dirs(ctx, &node->children[i], copy)) return false;
+    }
+    return true;
+}
+
+// Copy file straight from its fd, slack at the end of the last cluster is not written
+static bool copy_file(Import_Ctx *ctx, Import_Node *node) {
+    int fd = open(node->host_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open '%s'\n", node->host_path);
+        return false;
+    }
+    bool ok = node->fragmented ? fat32_copy_to_chain(ctx->image, node->first_cluster, fd, node->size)
+                               : image_copy_from_fd(ctx->image, cluster_offset(ctx, node->first_cluster), fd, node->size);
+    close(fd);
+    return ok;
+}
+
+// Files allocated back to back have their data streamed as one sequential run
+static bool write_files(Import_Ctx *ctx, Import_Node *node, Copy_Buffer *copy) {
+    for (size_t i = 0; i < node->num_children; i++) {
+        Import_Node *child = &node->children[i];
+        if (child->type == TYPE_DIR) {
+            if (!write_files(ctx, child, copy)) return false;
+            continue;
+        }
+        if (child->size == 0) continue;
+
+        // Kernel side copy, no staging buffer; a fragmented chain is followed through the FAT
+        if (ctx->image->copy_mode == COPY_RANGE || child->fragmented) {
+            if (!flush_copy_buffer(ctx, copy) || !copy_file(ctx, child)) return false;
+            continue;
+        }
+
+        FILE *file = fopen(child->host_path, "rb");
+        if (!file) {
+            fprintf(stderr, "Error: could not open '%s'\n", child->host_path);
+            return false;
+        }
+
+        // Start of run, or continue right after the previous file
+        if (!seek_copy_buffer(ctx, copy, cluster_offset(ctx, child->first_cluster))) {
+            fclose(file);
+            return false;
+        }
+
+        uint64_t remaining = child->size;
+        while (remaining > 0) {
+            size_t chunk = IMPORT_COPY_BUFFER_SIZE - copy->used;
+            if (chunk > remaining) chunk = remaining;
+            if (fread(copy->buf + copy->used, 1, chunk, file) != chunk) {
+                fprintf(stderr, "Error: could not read '%s'\n", child->host_path);
+                fclose(file);
+                return false;
+            }
+            copy->used += chunk;
+            remaining -= chunk;
+            if (copy->used == IMPORT_COPY_BUFFER_SIZE && !flush_copy_buffer(ctx, copy)) {
+                fclose(file);
+                return false;
+            }
+        }
+        fclose(file);
+
+        // Zero the slack at the end of the last cluster
+        size_t slack = (ctx->cluster_size - child->size % ctx->cluster_size) % ctx->cluster_size;
+        stats_add(STAT_ZERO_BYTES, slack);
+        while (slack > 0) {
+            size_t chunk = IMPORT_COPY_BUFFER_SIZE - copy->used;
+            if (chunk > slack) chunk = slack;
+            memset(copy->buf + copy->used, 0, chunk);
+            copy->used += chunk;
+            slack -= chunk;
+            if (copy->used == IMPORT_COPY_BUFFER_SIZE && !flush_copy_buffer(ctx, copy)) return false;
+        }
+    }
+    return true;
+}
+
+bool import_dir_to_esp(const char *host_dir, Image *image) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Import_Ctx ctx = { .image = image, .dirty_min = UINT32_MAX };
+    Import_Node root = { .type = TYPE_DIR, .existing = true, .host_path = strdup(host_dir) };
+    Copy_Buffer copy = { 0 };
+    bool ok = false;
+
+    // VBR of the image, the FAT read once
+    ctx.vbr = image->fat32_vbr;
+    uint64_t fat_bytes = (uint64_t)ctx.vbr.BPB_FATSz32 * ctx.vbr.BPB_BytesPerSec;
+    ctx.cluster_size = ctx.vbr.BPB_SecPerClus * ctx.vbr.BPB_BytesPerSec;
+    ctx.fat_offset = (image->esp_lba + ctx.vbr.BPB_RsvdSecCnt) * ctx.vbr.BPB_BytesPerSec;
+    ctx.data_offset = ctx.fat_offset + ctx.vbr.BPB_NumFATs * fat_bytes;
+    ctx.total_clusters = (ctx.vbr.BPB_TotSec32 - ctx.vbr.BPB_RsvdSecCnt - ctx.vbr.BPB_NumFATs * ctx.vbr.BPB_FATSz32)
+                         / ctx.vbr.BPB_SecPerClus + 2;
+    if (ctx.total_clusters > fat_bytes / sizeof(uint32_t)) ctx.total_clusters = fat_bytes / sizeof(uint32_t);
+
+    // Clusters from the free space hint on were never written, anything below may hold old data
+    uint32_t next_free = image->fat32_fsinfo.FSI_Next_Free;
+    ctx.clean_offset = next_free >= 2 && next_free < ctx.total_clusters ? cluster_offset(&ctx, next_free) : UINT64_MAX;
+
+    ctx.fat = malloc(fat_bytes);
+    if (!ctx.fat || !image_read(image, ctx.fat_offset, ctx.fat, fat_bytes)) goto out;
+    get_fat_dir_entry_time_date(image, &ctx.fat_time, &ctx.fat_date);
+
+    // Plan: scan host tree, merge with ESP directories, allocate every cluster
+    if (!root.host_path || !scan_host_dir(&ctx, &root)) goto out;
+
+    root.first_cluster = ctx.vbr.BPB_RootClus;
+    if (!plan_dir(&ctx, &root, 0)) goto out;
+    if (!plan_files(&ctx, &root)) goto out;
+    fill_dir_entries(&ctx, &root);
+
+    // Write FAT copies, one write each for the changed range
+    if (ctx.dirty_min <= ctx.dirty_max) {
+        size_t dirty_len = (ctx.dirty_max - ctx.dirty_min + 1) * sizeof(uint32_t);
+        for (uint8_t i = 0; i < ctx.vbr.BPB_NumFATs; i++) {
+            if (!image_write(image, ctx.fat_offset + i * fat_bytes + ctx.dirty_min * sizeof(uint32_t),
+                             &ctx.fat[ctx.dirty_min], dirty_len)) {
+                goto out;
+            }
+        }
+    }
+
+    // Write directory clusters, then file data
+    copy.buf = malloc(IMPORT_COPY_BUFFER_SIZE);
+    if (!copy.buf || !write_dirs(&ctx, &root, &copy) || !flush_copy_buffer(&ctx, &copy) ||
+        !write_files(&ctx, &root, &copy) || !flush_copy_buffer(&ctx, &copy)) {
+        goto out;
+    }
+
+    // Directories changed underneath any cached index. The free space map and
+    // FSInfo already account for every allocation
+    dir_index_reset(image);
+    ok = true;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0) seconds = 1e-9;
+    printf("Imported '%s': %llu files, %llu directories, %llu bytes in %.3f s (%.0f files/s, %.1f MB/s)\n",
+           host_dir, (unsigned long long)ctx.num_files, (unsigned long long)ctx.num_dirs,
+           (unsigned long long)ctx.bytes, seconds, ctx.num_files / seconds, ctx.bytes / seconds / 1e6);
+
+out:
+    if (!ok) {
+        fprintf(stderr, "Error: could not import '%s' into ESP\n", host_dir);
+        fat32_free_extents_reset(image);        // May hold allocations the FAT never got
+    }
+    free(copy.buf);
+    free(ctx.fat);
+    free_node(&root);
+    return ok;
+}
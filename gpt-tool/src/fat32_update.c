@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fat32.h"
+#include "fat32_dir.h"
+#include "gpt.h"
+#include "digest.h"
+#include "structures.h"
+#include "utils.h"
+#include "gpt_constants.h"
+#include "stats.h"
+
+// Incremental update of the ESP of an existing image.
+// A sidecar manifest next to the image records the size and SHA-256 of every
+// file written from the host. Files that match are left alone, changed files are
+// rewritten in their old clusters when they still fit, and files that are gone
+// from the host have their entries deleted and their chains freed, along with
+// directories they leave empty. A path that changed between file and
+// directory has the old entry removed before the new one is added.
+
+enum {
+    MANIFEST_GUID_CHARS = 2 * sizeof(Guid),
+    MANIFEST_DIGEST_CHARS = 2 * SHA256_SIZE,
+};
+
+// Manifests of older versions do not match and have all files rewritten once
+static const char MANIFEST_MAGIC[] = "# gpt-tool manifest sha256";
+
+typedef struct {
+    char *path;                     // ESP path, long names as on the host
+    char *host_path;                // Host file, only for current inputs
+    uint64_t size;
+    uint8_t digest[SHA256_SIZE];
+    bool seen;
+} Manifest_Entry;
+
+typedef struct {
+    Manifest_Entry *entries;
+    size_t count, cap;
+} Manifest;
+
+typedef struct {
+    Image *image;
+    const char *host_root, *esp_root;   // Update inputs, host_root is NULL without any
+    Manifest old, cur;
+    uint64_t changed, unchanged, removed, bytes;
+} Update_Ctx;
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const Manifest_Entry *)a)->path, ((const Manifest_Entry *)b)->path);
+}
+
+static bool manifest_add(Manifest *m, const char *path, const char *host_path, uint64_t size,
+                         const uint8_t digest[SHA256_SIZE]) {
+    if (m->count == m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 64;
+        Manifest_Entry *entries = realloc(m->entries, cap * sizeof *entries);
+        if (!entries) return false;
+        m->entries = entries;
+        m->cap = cap;
+    }
+    Manifest_Entry *e = &m->entries[m->count++];
+    *e = (Manifest_Entry){
+        .path = strdup(path),
+        .host_path = host_path ? strdup(host_path) : NULL,
+        .size = size,
+    };
+    memcpy(e->digest, digest, SHA256_SIZE);
+    return e->path && (!host_path || e->host_path);
+}
+
+// Entries must be sorted
+static Manifest_Entry *manifest_find(Manifest *m, const char *path) {
+    Manifest_Entry key = { .path = (char *)path };
+    return m->count ? bsearch(&key, m->entries, m->count, sizeof key, compare_entries) : NULL;
+}
+
+static void manifest_free(Manifest *m) {
+    for (size_t i = 0; i < m->count; i++) {
+        free(m->entries[i].path);
+        free(m->entries[i].host_path);
+    }
+    free(m->entries);
+    *m = (Manifest){ 0 };
+}
+
+static void to_hex(const void *data, size_t len, char *hex) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        sprintf(hex + 2 * i, "%02x", bytes[i]);
+    }
+}
+
+static bool from_hex(const char *hex, uint8_t *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned int value;
+        if (sscanf(hex + 2 * i, "%2x", &value) != 1) return false;
+        bytes[i] = value;
+    }
+    return true;
+}
+
+// Load manifest, stays empty if missing or written for another image
+static bool manifest_load(const char *name, const Guid *disk_guid, Manifest *m) {
+    FILE *fp = fopen(name, "r");
+    if (!fp) return true;
+
+    char guid_hex[MANIFEST_GUID_CHARS + 1];
+    to_hex(disk_guid, sizeof *disk_guid, guid_hex);
+
+    char line[4096 + 128];
+    bool ok = true;
+    if (!fgets(line, sizeof line, fp) || strncmp(line, MANIFEST_MAGIC, sizeof MANIFEST_MAGIC - 1) != 0 ||
+        strncmp(line + sizeof MANIFEST_MAGIC, guid_hex, MANIFEST_GUID_CHARS) != 0) {
+        printf("Manifest '%s' does not match image, rewriting all files\n", name);
+        fclose(fp);
+        return true;
+    }
+
+    while (ok && fgets(line, sizeof line, fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        uint8_t digest[SHA256_SIZE];
+        unsigned long long size = 0;
+        int path_start = 0;
+        if (strlen(line) <= MANIFEST_DIGEST_CHARS || line[MANIFEST_DIGEST_CHARS] != ' ' ||
+            !from_hex(line, digest, SHA256_SIZE) ||
+            sscanf(line + MANIFEST_DIGEST_CHARS, " %llu %n", &size, &path_start) != 1 ||
+            line[MANIFEST_DIGEST_CHARS + path_start] != '/') {
+            fprintf(stderr, "Error: bad line in manifest '%s'\n", name);
+            ok = false;
+            break;
+        }
+        ok = manifest_add(m, line + MANIFEST_DIGEST_CHARS + path_start, NULL, size, digest);
+    }
+    fclose(fp);
+
+    if (ok) qsort(m->entries, m->count, sizeof *m->entries, compare_entries);
+    return ok;
+}
+
+// Write to a temporary file first so an interrupted build never leaves a partial manifest.
+// Entries are sorted by path, the same inputs give the same manifest
+static bool manifest_save(const char *name, const Guid *disk_guid, Manifest *m) {
+    if (m->count) qsort(m->entries, m->count, sizeof *m->entries, compare_entries);
+
+    char tmp_name[4096];
+    snprintf(tmp_name, sizeof tmp_name, "%s.tmp", name);
+
+    FILE *fp = fopen(tmp_name, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: could not write manifest '%s'\n", tmp_name);
+        return false;
+    }
+
+    char guid_hex[MANIFEST_GUID_CHARS + 1], digest_hex[MANIFEST_DIGEST_CHARS + 1];
+    to_hex(disk_guid, sizeof *disk_guid, guid_hex);
+    fprintf(fp, "%s %s\n", MANIFEST_MAGIC, guid_hex);
+    for (size_t i = 0; i < m->count; i++) {
+        to_hex(m->entries[i].digest, SHA256_SIZE, digest_hex);
+        fprintf(fp, "%s %llu %s\n", digest_hex, (unsigned long long)m->entries[i].size, m->entries[i].path);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp_name, name) != 0) {
+        fprintf(stderr, "Error: could not write manifest '%s'\n", name);
+        return false;
+    }
+    return true;
+}
+
+// Hash host file, or every file of a host directory tree, as ESP paths under
+// esp_path. Names are taken in sorted order like the import writes them
+static bool collect_inputs(const char *host_path, const char *esp_path, Manifest *cur) {
+    struct stat st;
+    if (stat(host_path, &st) != 0) {
+        fprintf(stderr, "Error: could not stat '%s'\n", host_path);
+        return false;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if ((uint64_t)st.st_size > FAT_MAX_FILE_SIZE) {
+            fprintf(stderr, "Error: '%s' is larger than the FAT32 limit of %u bytes\n", host_path, FAT_MAX_FILE_SIZE);
+            return false;
+        }
+        uint64_t size = 0;
+        uint8_t digest[SHA256_SIZE];
+        return file_digest(host_path, &st, &size, digest) && manifest_add(cur, esp_path, host_path, size, digest);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Warning: skipping '%s', not a file or directory\n", host_path);
+        return true;
+    }
+
+    char **names = NULL;
+    size_t num_names = 0;
+    bool ok = list_dir(host_path, &names, &num_names);
+    for (size_t i = 0; ok && i < num_names; i++) {
+        char child_host[4096], child_esp[4096];
+        snprintf(child_host, sizeof child_host, "%s/%s", host_path, names[i]);
+        snprintf(child_esp, sizeof child_esp, "%s/%s", strcmp(esp_path, "/") == 0 ? "" : esp_path, names[i]);
+        ok = collect_inputs(child_host, child_esp, cur);
+    }
+    free_names(names, num_names);
+    return ok;
+}
+
+// Delete an entry and free its chain, for a directory everything below it first
+static bool remove_entry(Image *image, Dir_Index *dir, Dir_Index_Entry *indexed) {
+    if (indexed->attr & ATTR_DIRECTORY) {
+        Dir_Index *sub = dir_index_open(image, indexed);
+        if (!sub) return false;
+        uint32_t pos = 0;
+        for (Dir_Index_Entry *child = dir_index_next(sub, &pos); child; child = dir_index_next(sub, &pos)) {
+            if (!remove_entry(image, sub, child)) return false;
+        }
+    }
+    if (indexed->first_cluster && !fat32_free_chain(image, indexed->first_cluster)) return false;
+    return dir_index_remove(image, dir, indexed);
+}
+
+// Find the entry for an ESP path, creating missing parent directories if asked.
+// dir is set to the parent directory index, entry is NULL if the name is not there.
+// A file where the path has a directory is replaced when creating, else the path is not there
+static bool lookup_path(Image *image, const char *esp_path, bool create, Dir_Index **dir,
+                        Dir_Index_Entry **entry, char *name) {
+    char path[4096];
+    snprintf(path, sizeof path, "%s", esp_path);
+
+    *dir = dir_index_root(image);
+    *entry = NULL;
+    if (!*dir) return false;
+
+    char *start = path + 1;
+    for (char *end = strchr(start, '/'); end; start = end + 1, end = strchr(start, '/')) {
+        *end = '\0';
+
+        uint8_t fat_name[11];
+        format_fat32_name((char *)fat_name, start);
+        Dir_Index_Entry *sub = dir_index_find(*dir, fat_name);
+        if (sub && !(sub->attr & ATTR_DIRECTORY)) {
+            if (!create) return true;
+            if (!remove_entry(image, *dir, sub)) return false;
+            sub = NULL;
+        }
+        if (!sub && !create) return true;
+        if (!sub) {
+            uint32_t new_cluster = 0;
+            if (!add_file_to_esp(start, NULL, image, TYPE_DIR, *dir, &new_cluster)) return false;
+            sub = dir_index_find(*dir, fat_name);
+        }
+
+        *dir = sub ? dir_index_open(image, sub) : NULL;
+        if (!*dir) {
+            fprintf(stderr, "Error: '%s' in '%s' is not a directory\n", start, esp_path);
+            return false;
+        }
+    }
+
+    uint8_t fat_name[11];
+    format_fat32_name((char *)fat_name, start);
+    *entry = dir_index_find(*dir, fat_name);
+    strcpy(name, start);
+    return true;
+}
+
+// Rewrite an existing file entry, reusing its chain when the new data fits
+static bool replace_file(Update_Ctx *ctx, Dir_Index *dir, Dir_Index_Entry *indexed, const Manifest_Entry *in) {
+    Image *image = ctx->image;
+    const uint32_t cluster_bytes = (uint32_t)image->fat32_sec_per_clus * image->lba_size;
+
+    FAT32_Dir_Entry_Short dir_entry;
+    if (!dir_index_read(image, dir, indexed, &dir_entry)) return false;
+    if (dir_entry.DIR_Attr & ATTR_DIRECTORY) {
+        fprintf(stderr, "Error: '%s' is a directory on the ESP\n", in->path);
+        return false;
+    }
+
+    // Length of the old chain and whether it is one run of clusters
+    uint32_t need = (in->size + cluster_bytes - 1) / cluster_bytes;
+    uint32_t old_first = indexed->first_cluster, have = 0;
+    uint32_t max_old = (dir_entry.DIR_FileSize + (uint64_t)cluster_bytes - 1) / cluster_bytes;
+    bool contiguous = true;
+    for (uint32_t c = old_first; c >= 2 && c < FAT_EOC_MIN && have <= max_old; have++) {
+        uint32_t next = fat32_get_fat_entry(image, c);
+        if (next < FAT_EOC_MIN && next != c + 1) contiguous = false;
+        c = next;
+    }
+
+    uint32_t first = 0;
+    if (need && contiguous && need <= have) {
+        // Rewrite in place, cut the chain short and free its tail
+        first = old_first;
+        if (need < have && (!fat32_set_fat_entry(image, first + need - 1, FAT_EOC) ||
+                            !fat32_free_chain(image, first + need))) {
+            return false;
+        }
+    }
+    else {
+        if (old_first && !fat32_free_chain(image, old_first)) return false;
+        if (need && !fat32_alloc_chain(image, need, &first)) return false;
+    }
+
+    if (need) {
+        int fd = open(in->host_path, O_RDONLY);
+        bool ok = fd >= 0 && fat32_copy_to_chain(image, first, fd, in->size);
+        if (fd >= 0) close(fd);
+        if (!ok) {
+            fprintf(stderr, "Error: could not copy '%s' into image\n", in->host_path);
+            return false;
+        }
+    }
+
+    uint16_t fat_time, fat_date;
+    get_fat_dir_entry_time_date(image, &fat_time, &fat_date);
+    dir_entry.DIR_WrtTime = fat_time;
+    dir_entry.DIR_WrtDate = fat_date;
+    dir_entry.DIR_FstClusHI = (first >> 16) & 0xFFFF;
+    dir_entry.DIR_FstClusLO = first & 0xFFFF;
+    dir_entry.DIR_FileSize = in->size;
+    return dir_index_update(image, dir, indexed, &dir_entry);
+}
+
+static bool update_file(Update_Ctx *ctx, const Manifest_Entry *in) {
+    Dir_Index *dir = NULL;
+    Dir_Index_Entry *indexed = NULL;
+    char name[4096];
+    if (!lookup_path(ctx->image, in->path, true, &dir, &indexed, name)) return false;
+
+    // Unchanged if the manifest agrees and the ESP still has a file of that size
+    Manifest_Entry *old = manifest_find(&ctx->old, in->path);
+    if (old) old->seen = true;
+    if (old && indexed && old->size == in->size && memcmp(old->digest, in->digest, SHA256_SIZE) == 0) {
+        FAT32_Dir_Entry_Short dir_entry;
+        if (dir_index_read(ctx->image, dir, indexed, &dir_entry) && !(dir_entry.DIR_Attr & ATTR_DIRECTORY) &&
+            dir_entry.DIR_FileSize == in->size) {
+            ctx->unchanged++;
+            return true;
+        }
+    }
+
+    ctx->changed++;
+    ctx->bytes += in->size;
+
+    // Was a directory, its tree goes and the file is added in its place
+    if (indexed && (indexed->attr & ATTR_DIRECTORY)) {
+        if (!remove_entry(ctx->image, dir, indexed)) return false;
+        indexed = NULL;
+    }
+    if (indexed) return replace_file(ctx, dir, indexed, in);
+
+    uint32_t first_cluster = 0;
+    return add_file_to_esp(name, in->host_path, ctx->image, TYPE_FILE, dir, &first_cluster);
+}
+
+static bool under_path(const char *path, const char *prefix) {
+    size_t len = strlen(prefix);
+    if (strcmp(prefix, "/") == 0) return true;
+    return strncmp(path, prefix, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Whether the host tree has a directory for ESP path under esp_root
+static bool host_has_dir(const Update_Ctx *ctx, const char *path) {
+    char host_path[4096];
+    const char *rest = strcmp(ctx->esp_root, "/") == 0 ? path : path + strlen(ctx->esp_root);
+    snprintf(host_path, sizeof host_path, "%s%s", ctx->host_root, rest);
+    struct stat st;
+    return stat(host_path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Delete a file that was written by an earlier build and is gone from the host
+static bool remove_file(Update_Ctx *ctx, const Manifest_Entry *old) {
+    Dir_Index *dir = NULL;
+    Dir_Index_Entry *indexed = NULL;
+    char name[4096];
+    if (!lookup_path(ctx->image, old->path, false, &dir, &indexed, name)) return false;
+    if (!indexed || (indexed->attr & ATTR_DIRECTORY)) return true;
+
+    if (!remove_entry(ctx->image, dir, indexed)) return false;
+    printf("Removed file '%s'\n", old->path);
+    ctx->removed++;
+
+    // Parent directories below esp_root that are left empty, unless the host still has them
+    char path[4096];
+    snprintf(path, sizeof path, "%s", old->path);
+    for (char *slash = strrchr(path, '/'); slash && slash != path; slash = strrchr(path, '/')) {
+        *slash = '\0';
+        if (!under_path(path, ctx->esp_root) || strcmp(path, ctx->esp_root) == 0 || host_has_dir(ctx, path)) break;
+        if (!lookup_path(ctx->image, path, false, &dir, &indexed, name)) return false;
+        if (!indexed || !(indexed->attr & ATTR_DIRECTORY)) break;
+
+        Dir_Index *sub = dir_index_open(ctx->image, indexed);
+        uint32_t pos = 0;
+        if (!sub) return false;
+        if (dir_index_next(sub, &pos)) break;
+        if (!remove_entry(ctx->image, dir, indexed)) return false;
+        printf("Removed directory '%s'\n", path);
+    }
+    return true;
+}
+
+bool update_esp(const char *host_path, const char *esp_path, Image *image, const char *manifest_name) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Update_Ctx ctx = { .image = image, .host_root = host_path, .esp_root = esp_path };
+    Guid disk_guid;
+    bool ok = read_gpt(image, &disk_guid) && read_esp(image) &&
+              manifest_load(manifest_name, &disk_guid, &ctx.old) &&
+              (!host_path || collect_inputs(host_path, esp_path, &ctx.cur));
+
+    for (size_t i = 0; ok && i < ctx.cur.count; i++) {
+        ok = update_file(&ctx, &ctx.cur.entries[i]);
+    }
+
+    // Files of earlier builds under esp_path that are gone; the rest is kept in the manifest
+    for (size_t i = 0; ok && i < ctx.old.count; i++) {
+        Manifest_Entry *old = &ctx.old.entries[i];
+        if (old->seen) continue;
+        if (host_path && under_path(old->path, esp_path)) {
+            ok = remove_file(&ctx, old);
+        } else {
+            ok = manifest_add(&ctx.cur, old->path, NULL, old->size, old->digest);
+        }
+    }
+
+    dir_index_reset(image);
+    if (ok) ok = manifest_save(manifest_name, &disk_guid, &ctx.cur);
+
+    if (ok) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        printf("Updated ESP of '%s': %llu changed, %llu unchanged, %llu removed, %llu bytes written in %.1f ms\n",
+               image->name, (unsigned long long)ctx.changed, (unsigned long long)ctx.unchanged,
+               (unsigned long long)ctx.removed, (unsigned long long)ctx.bytes, ms);
+    }
+    else {
+        fprintf(stderr, "Error: could not update ESP of %s\n", image->name);
+    }
+
+    manifest_free(&ctx.old);
+    manifest_free(&ctx.cur);
+    return ok;
+}
+
+bool save_esp_manifest(const char *host_path, const char *esp_path, Image *image, const char *manifest_name) {
+    Manifest cur = { 0 };
+    Guid disk_guid;
+    bool ok = read_gpt(image, &disk_guid) && (!host_path || collect_inputs(host_path, esp_path, &cur)) &&
+              manifest_save(manifest_name, &disk_guid, &cur);
+    manifest_free(&cur);
+    return ok;
+}
+
+bool copy_esp_manifest(const char *from_name, const Guid *from_guid, Image *image, const char *to_name) {
+    Manifest m = { 0 };
+    Guid disk_guid;
+    bool ok = read_gpt(image, &disk_guid) && manifest_load(from_name, from_guid, &m) &&
+              manifest_save(to_name, &disk_guid, &m);
+    manifest_free(&m);
+    return ok;
+}
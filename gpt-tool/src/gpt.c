@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <uchar.h>
 #include "gpt.h"
 #include "structures.h"
 #include "utils.h"
+#include "crc32.h"
 #include "gpt_constants.h"
+#include "layout.h"
 
 // Constants and enums
 const Guid ESP_GUID = { 0xC12A7328, 0xF81F, 0x11D2, 0xBA, 0x4B,
@@ -17,7 +21,25 @@ const Guid LINUX_DATA_GUID = {
 };
 
 // Write GPT headers & tables, primary and alternate
-bool write_gpt(FILE *image, uint64_t image_size_lbas) {
+bool write_gpt(Image *image) {
+    const uint64_t image_size_lbas = image->size / image->lba_size;
+    const uint64_t table_lbas = GPT_TABLE_SIZE / image->lba_size;
+
+    // Without a layout the disk holds the ESP and a data partition
+    Partition defaults[2];
+    const Partition *parts = image->partitions;
+    size_t count = image->num_partitions;
+    if (!parts) {
+        uint64_t disk_lbas = 0;
+        layout_default(defaults, image->esp_size, image->data_size);
+        if (!layout_place(defaults, 2, image->lba_size, &disk_lbas)) return false;
+        parts = defaults;
+        count = 2;
+    }
+
+    // Taken in a fixed order, reproducible images count them from their seed
+    const Guid disk_guid = image_guid(image);
+
     Gpt_Header primary_gpt = {
         .signature = { 'E','F','I',' ','P','A','R','T' },
         .revision = 0x00010000,
@@ -26,9 +48,9 @@ bool write_gpt(FILE *image, uint64_t image_size_lbas) {
         .reserved_1 = 0,
         .my_lba = 1,
         .alternate_lba = image_size_lbas - 1,
-        .first_usable_lba = 34, // MBR + GPT + Primary GPT table
-        .last_usable_lba = image_size_lbas - 34, // 2nd GPT header, table
-        .disk_guid = new_guid(),
+        .first_usable_lba = 2 + table_lbas, // MBR + GPT + Primary GPT table
+        .last_usable_lba = image_size_lbas - 2 - table_lbas, // 2nd GPT header, table
+        .disk_guid = disk_guid,
         .partition_table_lba = 2, // After MBR, GPT Header
         .number_of_entries = 128,
         .size_of_entry = 128,
@@ -36,48 +58,54 @@ bool write_gpt(FILE *image, uint64_t image_size_lbas) {
         .reserved_2 = { 0 },
     };
 
-    align_lba = ALIGNMENT / LBA_SIZE;
-    esp_lba = align_lba;
-    data_lba = next_aligned_lba(esp_lba + esp_size_lbas);
+    const uint64_t end_lba = parts[count - 1].lba + parts[count - 1].lbas;
+    if (count > NUMBER_OF_GPT_ENTRIES || end_lba > primary_gpt.last_usable_lba + 1) {
+        fprintf(stderr, "Error: the partitions do not fit a disk of %llu bytes\n", (unsigned long long)image->size);
+        return false;
+    }
 
-    // TODO: 
     // Fill out primary table entries
-    Gpt_Partition_Entry gpt_table[NUMBER_OF_GPT_ENTRIES] = {
-        // EFI System Partition
-        {
-            .partition_type_guid = ESP_GUID,
-            .unique_guid = new_guid(),
-            .starting_lba = esp_lba,
-            .ending_lba = esp_lba + esp_size_lbas - 1,
-            .attributes = 0,
-            .name = u"EFI SYSTEM" 
-        },
-
-        // Basic Data Partition
-        {
-            .partition_type_guid = LINUX_DATA_GUID,
-            .unique_guid = new_guid(),
-            .starting_lba = data_lba,
-            .ending_lba = data_lba + data_size_lbas,
-            .attributes = 0,
-            .name = u"LINUX DATA" 
-        },
-    };
+    Gpt_Partition_Entry gpt_table[NUMBER_OF_GPT_ENTRIES] = { 0 };
+    image->esp_lba = image->esp_size_lbas = 0;
+    image->data_lba = image->data_size_lbas = 0;
+    for (size_t i = 0; i < count; i++) {
+        const Partition *part = &parts[i];
 
-    // Fill out CRC
-    primary_gpt.partition_table_crc32 = 0;
-    primary_gpt.header_crc32 = 0;
-    primary_gpt.partition_table_crc32 = calculate_crc32(gpt_table, sizeof gpt_table);
+        // Given GUIDs use up theirs too, so the others do not shift
+        const Guid guid = image_guid(image);
+        gpt_table[i] = (Gpt_Partition_Entry){
+            .partition_type_guid = part->type,
+            .unique_guid = part->guid_given ? part->guid : guid,
+            .starting_lba = part->lba,
+            .ending_lba = part->lba + part->lbas - 1,
+            .attributes = part->attributes,
+        };
+        memcpy(gpt_table[i].name, part->name, sizeof gpt_table[i].name);
+
+        if (part->esp && !image->esp_lba) {
+            image->esp_lba = part->lba;
+            image->esp_size_lbas = part->lbas;
+        }
+        else if (!image->data_lba && memcmp(&part->type, &LINUX_DATA_GUID, sizeof(Guid)) == 0) {
+            image->data_lba = part->lba;
+            image->data_size_lbas = part->lbas;
+        }
+    }
+    image->esp_size = image->esp_size_lbas * image->lba_size;
+    image->end_lba = end_lba;
+
+    // Fill out CRC, the table is the same in both GPTs
+    const uint32_t table_crc32 = calculate_crc32(gpt_table, sizeof gpt_table);
+    primary_gpt.partition_table_crc32 = table_crc32;
     primary_gpt.header_crc32 = calculate_crc32(&primary_gpt, primary_gpt.header_size);
 
     // write gpt header to file
-    if (fwrite(&primary_gpt, 1, sizeof primary_gpt, image) != sizeof primary_gpt) {
+    if (!image_write(image, primary_gpt.my_lba * image->lba_size, &primary_gpt, sizeof primary_gpt)) {
         return false;
     }
-    write_full_lba_size(image);
 
     // write gpt table to file
-    if (fwrite(&gpt_table, 1, sizeof gpt_table, image) != sizeof gpt_table) {
+    if (!image_write(image, primary_gpt.partition_table_lba * image->lba_size, &gpt_table, sizeof gpt_table)) {
         return false;
     }
 
@@ -87,25 +115,80 @@ bool write_gpt(FILE *image, uint64_t image_size_lbas) {
     secondary_gpt.partition_table_crc32 = 0;
     secondary_gpt.my_lba = primary_gpt.alternate_lba;
     secondary_gpt.alternate_lba = primary_gpt.my_lba;
-    secondary_gpt.partition_table_lba = image_size_lbas - 1 - 32; // - 32 entries and one before last
+    secondary_gpt.partition_table_lba = image_size_lbas - 1 - table_lbas; // Table right before the last LBA
 
     // fill crc32 for secondary
-    secondary_gpt.partition_table_crc32 = calculate_crc32(gpt_table, sizeof gpt_table);
+    secondary_gpt.partition_table_crc32 = table_crc32;
     secondary_gpt.header_crc32 = calculate_crc32(&secondary_gpt, secondary_gpt.header_size);
 
     // write alternate header and table
-    fseek(image, secondary_gpt.partition_table_lba * LBA_SIZE, SEEK_SET);
-
     // write secondary gpt table to file
-    if (fwrite(&gpt_table, 1, sizeof gpt_table, image) != sizeof gpt_table) {
+    if (!image_write(image, secondary_gpt.partition_table_lba * image->lba_size, &gpt_table, sizeof gpt_table)) {
         return false;
     }
 
     // write secondary gpt header to file
-    if (fwrite(&secondary_gpt, 1, sizeof secondary_gpt, image) != sizeof secondary_gpt) {
+    if (!image_write(image, secondary_gpt.my_lba * image->lba_size, &secondary_gpt, sizeof secondary_gpt)) {
+        return false;
+    }
+
+    return true;
+}
+
+// Read primary GPT of an existing image, sets partition LBAs and sizes
+bool read_gpt(Image *image, Guid *disk_guid) {
+    // The header is in LBA 1, its offset tells the sector size: 512, then 4096
+    Gpt_Header header = { 0 };
+    for (uint32_t lba_size = DEFAULT_LBA_SIZE; lba_size <= MAX_LBA_SIZE; lba_size *= 8) {
+        if (image->size < 2 * (uint64_t)lba_size) break;
+        if (!image_read(image, lba_size, &header, sizeof header)) return false;
+        image->lba_size = lba_size;
+        if (memcmp(header.signature, "EFI PART", 8) == 0 && header.my_lba == 1) break;
+    }
+
+    uint32_t header_crc32 = header.header_crc32;
+    header.header_crc32 = 0;
+    if (memcmp(header.signature, "EFI PART", 8) != 0 || header.header_size > sizeof header ||
+        calculate_crc32(&header, header.header_size) != header_crc32) {
+        fprintf(stderr, "Error: no valid GPT header in %s\n", image->name);
+        return false;
+    }
+    if (header.size_of_entry < sizeof(Gpt_Partition_Entry) || header.number_of_entries > 1024) {
+        fprintf(stderr, "Error: unsupported GPT table layout in %s\n", image->name);
+        return false;
+    }
+
+    size_t table_bytes = (size_t)header.number_of_entries * header.size_of_entry;
+    uint8_t *table = malloc(table_bytes);
+    if (!table || !image_read(image, header.partition_table_lba * image->lba_size, table, table_bytes) ||
+        calculate_crc32(table, table_bytes) != header.partition_table_crc32) {
+        fprintf(stderr, "Error: GPT table of %s is damaged\n", image->name);
+        free(table);
+        return false;
+    }
+
+    image->esp_lba = image->data_lba = image->end_lba = 0;
+    for (uint32_t i = 0; i < header.number_of_entries; i++) {
+        const Gpt_Partition_Entry *entry = (const Gpt_Partition_Entry *)(table + (size_t)i * header.size_of_entry);
+        if (memcmp(&entry->partition_type_guid, &ESP_GUID, sizeof(Guid)) == 0 && !image->esp_lba) {
+            image->esp_lba = entry->starting_lba;
+            image->esp_size_lbas = entry->ending_lba - entry->starting_lba + 1;
+        }
+        else if (memcmp(&entry->partition_type_guid, &LINUX_DATA_GUID, sizeof(Guid)) == 0 && !image->data_lba) {
+            image->data_lba = entry->starting_lba;
+            image->data_size_lbas = entry->ending_lba - entry->starting_lba + 1;
+        }
+        if (entry->starting_lba && entry->ending_lba + 1 > image->end_lba) image->end_lba = entry->ending_lba + 1;
+    }
+    free(table);
+
+    if (!image->esp_lba) {
+        fprintf(stderr, "Error: no EFI System Partition in %s\n", image->name);
         return false;
     }
-    write_full_lba_size(image);
 
+    image->esp_size = image->esp_size_lbas * image->lba_size;
+    image->data_size = image->data_size_lbas * image->lba_size;
+    if (disk_guid) *disk_guid = header.disk_guid;
     return true;
-}
\ No newline at end of file
+}
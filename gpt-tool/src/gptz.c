@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <zlib.h>
+#include "gptz.h"
+#include "stream.h"
+#include "crc32.h"
+#include "utils.h"
+#include "stats.h"
+
+enum {
+    GPTZ_VERSION = 1,
+    GPTZ_CHUNK_SIZE = 256 * 1024,       // One random read inflates at most this much
+    GPTZ_SLOTS_PER_THREAD = 4,          // Chunks in flight per worker
+    GPTZ_CHUNK_HOLE = 1 << 0,           // Only zeros, nothing stored
+    GPTZ_CHUNK_STORED = 1 << 1,         // Deflate did not help, stored as is
+};
+
+static const char GPTZ_MAGIC[8] = "GPTZIMG";
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t disk_size;
+    uint64_t num_chunks;
+    uint64_t index_offset;
+    uint32_t index_crc32;
+    uint32_t header_crc32;              // Of the header with this field zero
+} __attribute__ ((packed)) Gptz_Header;
+
+typedef struct {
+    uint64_t offset;                    // In the file, 0 for holes
+    uint32_t len;                       // Bytes stored in the file
+    uint32_t flags;
+} __attribute__ ((packed)) Gptz_Chunk;
+
+struct Gptz {
+    int fd;
+    Gptz_Header header;
+    Gptz_Chunk *index;
+    uint8_t *cache;                     // Last chunk inflated by gptz_read
+    uint8_t *packed;
+    uint64_t cached;                    // Its number, UINT64_MAX for none
+    uint64_t read_chunks;               // Chunks inflated by gptz_read
+};
+
+// Buffers of one chunk being packed or unpacked
+typedef struct {
+    uint8_t *raw;
+    uint8_t *packed;
+    uLongf packed_len;
+    uint32_t flags;
+} Gptz_Slot;
+
+static uint64_t chunk_bytes(uint64_t disk_size, uint32_t chunk_size, uint64_t chunk) {
+    uint64_t start = chunk * chunk_size;
+    return disk_size - start < chunk_size ? disk_size - start : chunk_size;
+}
+
+static Gptz_Slot *alloc_slots(size_t count, size_t raw_len, size_t packed_len) {
+    Gptz_Slot *slots = calloc(count, sizeof *slots);
+    for (size_t i = 0; slots && i < count; i++) {
+        slots[i].raw = malloc(raw_len);
+        slots[i].packed = malloc(packed_len);
+        if (!slots[i].raw || !slots[i].packed) {
+            for (size_t j = 0; j <= i; j++) {
+                free(slots[j].raw);
+                free(slots[j].packed);
+            }
+            free(slots);
+            return NULL;
+        }
+    }
+    return slots;
+}
+
+static void free_slots(Gptz_Slot *slots, size_t count) {
+    for (size_t i = 0; slots && i < count; i++) {
+        free(slots[i].raw);
+        free(slots[i].packed);
+    }
+    free(slots);
+}
+
+// Run fn on slots [0, count), slot i on worker i % threads
+typedef bool (*Slot_Fn)(void *ctx, size_t slot);
+
+typedef struct {
+    pthread_t thread;
+    Slot_Fn fn;
+    void *ctx;
+    size_t first, step, count;
+    bool ok;
+} Slot_Worker;
+
+static void *run_slots(void *arg) {
+    Slot_Worker *worker = arg;
+    for (size_t slot = worker->first; slot < worker->count; slot += worker->step) {
+        if (!worker->fn(worker->ctx, slot)) worker->ok = false;
+    }
+    return NULL;
+}
+
+static bool run_batch(unsigned threads, size_t count, Slot_Fn fn, void *ctx) {
+    if (threads > count) threads = count;
+    if (threads <= 1) {
+        Slot_Worker worker = { .fn = fn, .ctx = ctx, .step = 1, .count = count, .ok = true };
+        run_slots(&worker);
+        return worker.ok;
+    }
+
+    Slot_Worker *workers = calloc(threads, sizeof *workers);
+    if (!workers) return false;
+    unsigned started = 0;
+    for (; started < threads; started++) {
+        workers[started] = (Slot_Worker){ .fn = fn, .ctx = ctx, .first = started, .step = threads,
+                                          .count = count, .ok = true };
+        if (pthread_create(&workers[started].thread, NULL, run_slots, &workers[started]) != 0) break;
+    }
+    // Whatever could not be started runs here
+    bool ok = true;
+    if (started < threads) {
+        Slot_Worker rest = { .fn = fn, .ctx = ctx, .step = threads, .count = count, .ok = true };
+        for (unsigned w = started; w < threads; w++) {
+            rest.first = w;
+            run_slots(&rest);
+        }
+        ok = rest.ok;
+    }
+    for (unsigned w = 0; w < started; w++) {
+        pthread_join(workers[w].thread, NULL);
+        ok &= workers[w].ok;
+    }
+    free(workers);
+    return ok;
+}
+
+typedef struct {
+    Stream *stream;
+    uint64_t size;
+    uint64_t first;                     // Chunk in slot 0
+    Gptz_Slot *slots;
+} Compress_Batch;
+
+static bool compress_slot(void *ctx, size_t slot) {
+    Compress_Batch *batch = ctx;
+    Gptz_Slot *s = &batch->slots[slot];
+    uint64_t chunk = batch->first + slot;
+    size_t len = chunk_bytes(batch->size, GPTZ_CHUNK_SIZE, chunk);
+
+    if (!stream_read(batch->stream, chunk * GPTZ_CHUNK_SIZE, s->raw, len)) return false;
+    if (is_zero_block(s->raw, len)) {
+        s->flags = GPTZ_CHUNK_HOLE;
+        s->packed_len = 0;
+        return true;
+    }
+
+    s->packed_len = compressBound(GPTZ_CHUNK_SIZE);
+    if (compress2(s->packed, &s->packed_len, s->raw, len, Z_DEFAULT_COMPRESSION) != Z_OK ||
+        s->packed_len >= len) {
+        s->flags = GPTZ_CHUNK_STORED;
+        s->packed_len = len;
+        return true;
+    }
+    s->flags = 0;
+    return true;
+}
+
+bool gptz_write(Stream *stream, uint64_t size, int fd, unsigned threads) {
+    if (threads == 0) threads = 1;
+    uint64_t num_chunks = (size + GPTZ_CHUNK_SIZE - 1) / GPTZ_CHUNK_SIZE;
+    size_t num_slots = (size_t)threads * GPTZ_SLOTS_PER_THREAD;
+    Gptz_Chunk *index = calloc(num_chunks ? num_chunks : 1, sizeof *index);
+    Gptz_Slot *slots = alloc_slots(num_slots, GPTZ_CHUNK_SIZE, compressBound(GPTZ_CHUNK_SIZE));
+    bool ok = index && slots;
+
+    // Chunks are packed in parallel and appended in order
+    uint64_t pos = sizeof(Gptz_Header);
+    Compress_Batch batch = { .stream = stream, .size = size, .slots = slots };
+    for (batch.first = 0; ok && batch.first < num_chunks; batch.first += num_slots) {
+        size_t count = num_chunks - batch.first < num_slots ? num_chunks - batch.first : num_slots;
+        ok = run_batch(threads, count, compress_slot, &batch);
+
+        for (size_t slot = 0; ok && slot < count; slot++) {
+            Gptz_Slot *s = &slots[slot];
+            Gptz_Chunk *c = &index[batch.first + slot];
+            c->flags = s->flags;
+            if (s->flags & GPTZ_CHUNK_HOLE) {
+                stats_add(STAT_HOLE_BYTES, chunk_bytes(size, GPTZ_CHUNK_SIZE, batch.first + slot));
+                continue;
+            }
+
+            c->offset = pos;
+            c->len = s->packed_len;
+            ok = pwrite_all(fd, s->flags & GPTZ_CHUNK_STORED ? s->raw : s->packed, c->len, pos);
+            pos += c->len;
+        }
+    }
+
+    // Index behind the data, header last so a cut short file never looks valid
+    Gptz_Header header = {
+        .version = GPTZ_VERSION,
+        .chunk_size = GPTZ_CHUNK_SIZE,
+        .disk_size = size,
+        .num_chunks = num_chunks,
+        .index_offset = pos,
+    };
+    memcpy(header.magic, GPTZ_MAGIC, sizeof header.magic);
+    if (ok) {
+        header.index_crc32 = crc32_update(0, index, num_chunks * sizeof *index);
+        header.header_crc32 = crc32_update(0, &header, sizeof header);
+        ok = pwrite_all(fd, index, num_chunks * sizeof *index, pos) &&
+             ftruncate(fd, pos + num_chunks * sizeof *index) == 0 &&
+             pwrite_all(fd, &header, sizeof header, 0);
+    }
+
+    free_slots(slots, num_slots);
+    free(index);
+    return ok;
+}
+
+Gptz *gptz_open(const char *name) {
+    Gptz *gptz = calloc(1, sizeof *gptz);
+    if (!gptz) return NULL;
+    gptz->cached = UINT64_MAX;
+    gptz->fd = open(name, O_RDONLY);
+    if (gptz->fd < 0) {
+        fprintf(stderr, "Error: could not open %s\n", name);
+        free(gptz);
+        return NULL;
+    }
+
+    Gptz_Header *header = &gptz->header;
+    struct stat st;
+    bool ok = fstat(gptz->fd, &st) == 0 && pread_all(gptz->fd, header, sizeof *header, 0);
+
+    uint32_t header_crc = header->header_crc32;
+    header->header_crc32 = 0;
+    ok = ok && memcmp(header->magic, GPTZ_MAGIC, sizeof header->magic) == 0 &&
+         header->version == GPTZ_VERSION &&
+         crc32_update(0, header, sizeof *header) == header_crc &&
+         header->chunk_size >= 4096 && header->chunk_size <= 64 * 1024 * 1024 &&
+         header->num_chunks == (header->disk_size + header->chunk_size - 1) / header->chunk_size &&
+         header->index_offset + header->num_chunks * sizeof(Gptz_Chunk) <= (uint64_t)st.st_size;
+    header->header_crc32 = header_crc;
+
+    size_t index_bytes = ok ? header->num_chunks * sizeof(Gptz_Chunk) : 0;
+    if (ok) {
+        gptz->index = malloc(index_bytes ? index_bytes : 1);
+        gptz->cache = malloc(header->chunk_size);
+        gptz->packed = malloc(compressBound(header->chunk_size));
+        ok = gptz->index && gptz->cache && gptz->packed &&
+             pread_all(gptz->fd, gptz->index, index_bytes, header->index_offset) &&
+             crc32_update(0, gptz->index, index_bytes) == header->index_crc32;
+    }
+
+    // Every stored chunk has to lie before the index
+    for (uint64_t i = 0; ok && i < header->num_chunks; i++) {
+        const Gptz_Chunk *c = &gptz->index[i];
+        if (c->flags & GPTZ_CHUNK_HOLE) continue;
+        uint64_t len = chunk_bytes(header->disk_size, header->chunk_size, i);
+        ok = c->offset >= sizeof *header && c->offset + c->len <= header->index_offset &&
+             ((c->flags & GPTZ_CHUNK_STORED) ? c->len == len : c->len <= compressBound(header->chunk_size));
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error: %s is not a valid gptz image\n", name);
+        gptz_close(gptz);
+        return NULL;
+    }
+    return gptz;
+}
+
+void gptz_close(Gptz *gptz) {
+    if (!gptz) return;
+    close(gptz->fd);
+    free(gptz->index);
+    free(gptz->cache);
+    free(gptz->packed);
+    free(gptz);
+}
+
+uint64_t gptz_size(const Gptz *gptz) {
+    return gptz->header.disk_size;
+}
+
+uint32_t gptz_chunk_size(const Gptz *gptz) {
+    return gptz->header.chunk_size;
+}
+
+uint64_t gptz_read_chunks(const Gptz *gptz) {
+    return gptz->read_chunks;
+}
+
+// Unpack chunk into out, packed is scratch space for the deflated bytes
+static bool inflate_chunk(const Gptz *gptz, uint64_t chunk, uint8_t *out, uint8_t *packed) {
+    const Gptz_Chunk *c = &gptz->index[chunk];
+    uLongf len = chunk_bytes(gptz->header.disk_size, gptz->header.chunk_size, chunk);
+
+    if (c->flags & GPTZ_CHUNK_HOLE) {
+        memset(out, 0, len);
+        return true;
+    }
+    if (c->flags & GPTZ_CHUNK_STORED) return pread_all(gptz->fd, out, len, c->offset);
+
+    uLongf expected = len;
+    return pread_all(gptz->fd, packed, c->len, c->offset) &&
+           uncompress(out, &len, packed, c->len) == Z_OK && len == expected;
+}
+
+bool gptz_read(Gptz *gptz, uint64_t offset, void *buf, size_t len) {
+    const Gptz_Header *header = &gptz->header;
+    if (offset > header->disk_size || len > header->disk_size - offset) return false;
+
+    uint8_t *p = buf;
+    while (len > 0) {
+        uint64_t chunk = offset / header->chunk_size;
+        size_t in_chunk = offset % header->chunk_size;
+        size_t chunk_len = chunk_bytes(header->disk_size, header->chunk_size, chunk);
+        size_t n = chunk_len - in_chunk < len ? chunk_len - in_chunk : len;
+
+        if (in_chunk == 0 && n == chunk_len) {
+            // Whole chunk wanted, no need to go through the cache
+            if (!inflate_chunk(gptz, chunk, p, gptz->packed)) return false;
+            gptz->read_chunks++;
+        } else {
+            if (gptz->cached != chunk) {
+                gptz->cached = UINT64_MAX;
+                if (!inflate_chunk(gptz, chunk, gptz->cache, gptz->packed)) return false;
+                gptz->cached = chunk;
+                gptz->read_chunks++;
+            }
+            memcpy(p, gptz->cache + in_chunk, n);
+        }
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+typedef struct {
+    const Gptz *gptz;
+    uint64_t first;
+    Gptz_Slot *slots;
+} Extract_Batch;
+
+static bool extract_slot(void *ctx, size_t slot) {
+    Extract_Batch *batch = ctx;
+    uint64_t chunk = batch->first + slot;
+    batch->slots[slot].flags = batch->gptz->index[chunk].flags;
+    // Holes are left to the writer
+    if (batch->slots[slot].flags & GPTZ_CHUNK_HOLE) return true;
+    return inflate_chunk(batch->gptz, chunk, batch->slots[slot].raw, batch->slots[slot].packed);
+}
+
+bool gptz_extract(Gptz *gptz, int out_fd, unsigned threads) {
+    const Gptz_Header *header = &gptz->header;
+    struct stat st;
+    if (fstat(out_fd, &st) != 0) return false;
+    bool is_file = S_ISREG(st.st_mode);
+    bool is_device = S_ISBLK(st.st_mode);
+
+    // Holes in a regular file read as zeros already
+    if (is_file && ftruncate(out_fd, header->disk_size) != 0) return false;
+
+    if (threads == 0) threads = 1;
+    size_t num_slots = (size_t)threads * GPTZ_SLOTS_PER_THREAD;
+    Gptz_Slot *slots = alloc_slots(num_slots, header->chunk_size, compressBound(header->chunk_size));
+    bool ok = slots != NULL;
+
+    Extract_Batch batch = { .gptz = gptz, .slots = slots };
+    for (batch.first = 0; ok && batch.first < header->num_chunks; batch.first += num_slots) {
+        size_t count = header->num_chunks - batch.first < num_slots ? header->num_chunks - batch.first : num_slots;
+        ok = run_batch(threads, count, extract_slot, &batch);
+
+        for (size_t slot = 0; ok && slot < count; slot++) {
+            uint64_t chunk = batch.first + slot;
+            uint64_t offset = chunk * header->chunk_size;
+            size_t len = chunk_bytes(header->disk_size, header->chunk_size, chunk);
+
+            if (slots[slot].flags & GPTZ_CHUNK_HOLE) {
+                if (is_file) continue;
+                // Let the device zero the range itself if it can
+                uint64_t range[2] = { offset, len };
+                if (is_device && ioctl(out_fd, BLKZEROOUT, range) == 0) continue;
+                memset(slots[slot].raw, 0, len);
+            }
+            ok = is_file || is_device ? pwrite_all(out_fd, slots[slot].raw, len, offset)
+                                      : write_all(out_fd, slots[slot].raw, len);
+        }
+    }
+
+    free_slots(slots, num_slots);
+    return ok;
+}
@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "image.h"
+#include "write_pool.h"
+#include "qcow2.h"
+#include "stream.h"
+#include "gptz.h"
+#include "device.h"
+#include "fat32.h"
+#include "stats.h"
+#include "utils.h"
+#include "gpt_constants.h"
+
+enum {
+    COPY_BUFFER_SIZE = 1024 * 1024,
+    COPY_BUFFER_ALIGN = 4096,
+    ASYNC_WRITE_MIN = 64 * 1024,                    // Smaller writes are done right away
+    MAX_PENDING_BYTES = 64 * 1024 * 1024,           // Buffers held by queued writes
+};
+
+bool image_open(Image *image, const char *name, Image_Backend backend, uint64_t size) {
+    *image = (Image){
+        .backend = backend, .name = name, .fd = -1, .size = size, .threads = 1, .lba_size = DEFAULT_LBA_SIZE,
+        .source_date = -1,
+    };
+
+    if (backend == IMAGE_DEVICE) return device_open(image, name, size);
+
+    // Nothing is written until the close, "-" is stdout
+    if (backend == IMAGE_STREAM && strcmp(name, "-") == 0) {
+        return image_open_stream_fd(image, name, STDOUT_FILENO, size);
+    }
+    if (backend == IMAGE_STREAM || backend == IMAGE_GPTZ) {
+        image->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        image->stream = image->fd >= 0 ? stream_create(size) : NULL;
+        if (!image->stream) {
+            fprintf(stderr, "Error: could not open stream output %s\n", name);
+            if (image->fd >= 0) close(image->fd);
+            return false;
+        }
+        return true;
+    }
+
+    image->file = fopen(name, "wb+"); // specify image location and permissions
+    if (!image->file) {
+        fprintf(stderr, "Error: could not open file %s\n", name);
+        return false;
+    }
+    image->fd = fileno(image->file);
+
+    // Clusters are mapped as they are written, the file only holds data
+    if (backend == IMAGE_QCOW2) {
+        image->qcow2 = qcow2_create(image->fd, size);
+        if (!image->qcow2) {
+            fprintf(stderr, "Error: could not start qcow2 image %s\n", name);
+            fclose(image->file);
+            return false;
+        }
+        return true;
+    }
+
+    // Set final size now, everything not written stays a hole
+    if (ftruncate(image->fd, size) != 0) {
+        fprintf(stderr, "Error: could not size image %s\n", name);
+        fclose(image->file);
+        return false;
+    }
+
+    if (backend == IMAGE_MMAP) {
+        image->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0);
+        if (image->map == MAP_FAILED) {
+            fprintf(stderr, "Error: could not map image %s\n", name);
+            image->map = NULL;
+            fclose(image->file);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool image_open_stream_fd(Image *image, const char *name, int fd, uint64_t size) {
+    *image = (Image){
+        .backend = IMAGE_STREAM, .name = name, .fd = dup(fd), .size = size, .threads = 1,
+        .lba_size = DEFAULT_LBA_SIZE, .source_date = -1,
+    };
+    image->stream = image->fd >= 0 ? stream_create(size) : NULL;
+    if (!image->stream) {
+        fprintf(stderr, "Error: could not open stream output %s\n", name);
+        if (image->fd >= 0) close(image->fd);
+        return false;
+    }
+    return true;
+}
+
+bool image_open_existing(Image *image, const char *name, Image_Backend backend) {
+    *image = (Image){
+        .backend = backend, .name = name, .fd = -1, .threads = 1, .lba_size = DEFAULT_LBA_SIZE, .source_date = -1,
+    };
+
+    image->file = fopen(name, "rb+");
+    if (!image->file) return false;
+    image->fd = fileno(image->file);
+
+    struct stat st;
+    if (fstat(image->fd, &st) != 0 || st.st_size == 0) {
+        fclose(image->file);
+        return false;
+    }
+    image->size = st.st_size;
+
+    if (backend == IMAGE_MMAP) {
+        image->map = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0);
+        if (image->map == MAP_FAILED) {
+            fprintf(stderr, "Error: could not map image %s\n", name);
+            image->map = NULL;
+            fclose(image->file);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool image_close(Image *image) {
+    bool ok = true;
+
+    // Free space of every allocation since the ESP was written or read
+    if (!fat32_flush_fsinfo(image)) {
+        fprintf(stderr, "Error: could not write ESP FSInfo of %s\n", image->name);
+        ok = false;
+    }
+    dir_index_reset(image);
+    fat32_free_extents_reset(image);
+
+    if (image->pool) {
+        if (!write_pool_destroy(image->pool)) {
+            fprintf(stderr, "Error: write to image %s failed\n", image->name);
+            ok = false;
+        }
+        image->pool = NULL;
+    }
+
+    if (image->map) {
+        // One flush of every dirty page
+        if (msync(image->map, image->size, MS_SYNC) != 0) {
+            fprintf(stderr, "Error: could not flush image %s\n", image->name);
+            ok = false;
+        }
+        munmap(image->map, image->size);
+        image->map = NULL;
+    }
+
+    if (image->qcow2) {
+        if (!qcow2_finish(image->qcow2)) {
+            fprintf(stderr, "Error: could not write qcow2 tables of %s\n", image->name);
+            ok = false;
+        }
+        image->qcow2 = NULL;
+    }
+
+    if (image->stream && image->backend == IMAGE_GPTZ) {
+        if (!gptz_write(image->stream, image->size, image->fd, image->threads)) {
+            fprintf(stderr, "Error: could not compress image to %s\n", image->name);
+            ok = false;
+        }
+        stream_destroy(image->stream);
+        image->stream = NULL;
+        if (close(image->fd) != 0) ok = false;
+    }
+
+    if (image->stream && image->backend == IMAGE_DEVICE) {
+        if (!device_write(image)) {
+            fprintf(stderr, "Error: could not write image to device %s\n", image->name);
+            ok = false;
+        }
+        stream_destroy(image->stream);
+        image->stream = NULL;
+        if (close(image->fd) != 0) ok = false;
+    }
+
+    if (image->stream) {
+        if (!stream_finish(image->stream, image->fd)) {
+            fprintf(stderr, "Error: could not stream image to %s\n", image->name);
+            ok = false;
+        }
+        image->stream = NULL;
+        if (close(image->fd) != 0) ok = false;
+    }
+
+    if (image->file && fclose(image->file) != 0) ok = false;
+    image->file = NULL;
+    image->fd = -1;
+
+    return ok;
+}
+
+bool image_set_threads(Image *image, unsigned threads) {
+    image->threads = threads ? threads : 1;
+    // A stream only plans in memory until the close, gptz uses the threads to compress then
+    if (threads <= 1 || image->stream) return true;
+
+    // Workers write through the fd, nothing may be left in the FILE buffer
+    if (image->file && fflush(image->file) != 0) return false;
+    image->pool = write_pool_create(threads, MAX_PENDING_BYTES);
+    return image->pool != NULL;
+}
+
+// Write/read through the fd or mapping, usable from worker threads
+static bool write_at(Image *image, uint64_t offset, const void *buf, size_t len) {
+    if (image->backend == IMAGE_MMAP) {
+        memcpy(image->map + offset, buf, len);
+        stats_write(len);
+        return true;
+    }
+    if (image->backend == IMAGE_QCOW2) return qcow2_write(image->qcow2, offset, buf, len);
+    if (image->stream) return stream_write(image->stream, offset, buf, len);
+    return pwrite_all(image->fd, buf, len, offset);
+}
+
+static bool read_at(Image *image, uint64_t offset, void *buf, size_t len) {
+    if (image->backend == IMAGE_MMAP) {
+        memcpy(buf, image->map + offset, len);
+        stats_read(len);
+        return true;
+    }
+    if (image->backend == IMAGE_QCOW2) return qcow2_read(image->qcow2, offset, buf, len);
+    if (image->stream) return stream_read(image->stream, offset, buf, len);
+    return pread_all(image->fd, buf, len, offset);
+}
+
+typedef struct {
+    Image *image;
+    uint64_t offset;
+    size_t len;
+    uint8_t data[];
+} Write_Buffer_Job;
+
+static bool run_write_buffer(void *arg) {
+    Write_Buffer_Job *job = arg;
+    bool ok = write_at(job->image, job->offset, job->data, job->len);
+    free(job);
+    return ok;
+}
+
+bool image_write(Image *image, uint64_t offset, const void *buf, size_t len) {
+    if (offset + len > image->size) {
+        fprintf(stderr, "Error: write past end of image %s\n", image->name);
+        return false;
+    }
+    if (stats_enabled && is_zero_block(buf, len)) stats_add(STAT_ZERO_BYTES, len);
+
+    // Large regions go to the workers with a copy of the data
+    if (image->pool && len >= ASYNC_WRITE_MIN) {
+        Write_Buffer_Job *job = malloc(sizeof *job + len);
+        if (!job) return false;
+        job->image = image;
+        job->offset = offset;
+        job->len = len;
+        memcpy(job->data, buf, len);
+        return write_pool_submit(image->pool, offset, len, run_write_buffer, job);
+    }
+    if (image->pool) write_pool_wait_range(image->pool, offset, len);
+
+    // FILE writes only when nothing else writes through the fd
+    if (image->pool || image->backend != IMAGE_STDIO) return write_at(image, offset, buf, len);
+
+    if (fseek(image->file, offset, SEEK_SET) != 0) return false;
+    stats_add(STAT_SEEKS, 1);
+    stats_write(len);
+    return fwrite(buf, 1, len, image->file) == len;
+}
+
+bool image_read(Image *image, uint64_t offset, void *buf, size_t len) {
+    if (offset + len > image->size) {
+        fprintf(stderr, "Error: read past end of image %s\n", image->name);
+        return false;
+    }
+    if (image->pool) write_pool_wait_range(image->pool, offset, len);
+
+    if (image->pool || image->backend != IMAGE_STDIO) return read_at(image, offset, buf, len);
+
+    if (fseek(image->file, offset, SEEK_SET) != 0) return false;
+    stats_add(STAT_SEEKS, 1);
+    stats_read(len);
+    return fread(buf, 1, len, image->file) == len;
+}
+
+bool image_write_from_file(Image *image, uint64_t offset, FILE *src, uint64_t len) {
+    if (offset + len > image->size) {
+        fprintf(stderr, "Error: write past end of image %s\n", image->name);
+        return false;
+    }
+
+    // Read straight into the mapping
+    if (image->backend == IMAGE_MMAP) {
+        stats_read(len);
+        return fread(image->map + offset, 1, len, src) == len;
+    }
+
+    uint8_t *file_buf = calloc(1, image->lba_size);
+    if (!file_buf) return false;
+
+    bool ok = fseek(image->file, offset, SEEK_SET) == 0;
+    stats_add(STAT_SEEKS, 1);
+    for (uint64_t done = 0; ok && done < len; done += image->lba_size) {
+        size_t bytes_read = fread(file_buf, 1, image->lba_size, src);              // read file data into buf, write buf into img
+        if (bytes_read == 0) {
+            ok = false;
+            break;
+        }
+        stats_read(bytes_read);
+        if (image->sparse && is_zero_block(file_buf, bytes_read)) {
+            fseek(image->file, bytes_read, SEEK_CUR);                       // leave a hole for zero data
+            stats_add(STAT_SEEKS, 1);
+            stats_add(STAT_HOLE_BYTES, bytes_read);
+            continue;
+        }
+        stats_write(bytes_read);
+        ok = fwrite(file_buf, 1, bytes_read, image->file) == bytes_read;    // reason for two parts is due to partial data
+    }
+
+    free(file_buf);
+    return ok;
+}
+
+// pread/pwrite through one large page aligned buffer
+static bool copy_buffered(Image *image, uint64_t offset, int src_fd, uint64_t src_offset, uint64_t len) {
+    uint8_t *buf = NULL;
+    if (posix_memalign((void **)&buf, COPY_BUFFER_ALIGN, COPY_BUFFER_SIZE) != 0) return false;
+
+    bool ok = true;
+    while (ok && len > 0) {
+        size_t chunk = len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE;
+        // Read straight into the mapping unless zero blocks have to be skipped
+        bool direct = image->backend == IMAGE_MMAP && !image->sparse;
+        ssize_t got = pread(src_fd, direct ? image->map + offset : buf, chunk, src_offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            ok = false;
+            break;
+        }
+        stats_read(got);
+
+        // Leave holes for zero data
+        if (direct) stats_write(got);
+        else if (image->sparse && is_zero_block(buf, got)) stats_add(STAT_HOLE_BYTES, got);
+        else ok = write_at(image, offset, buf, got);
+        offset += got;
+        src_offset += got;
+        len -= got;
+    }
+
+    free(buf);
+    return ok;
+}
+
+// copy_file_range, lets the kernel copy without going through user space
+static bool copy_range(Image *image, uint64_t offset, int src_fd, uint64_t src_offset, uint64_t len) {
+    while (len > 0) {
+        loff_t off_in = src_offset, off_out = offset;
+        ssize_t copied = copy_file_range(src_fd, &off_in, image->fd, &off_out, len, 0);
+        if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            return copy_buffered(image, offset, src_fd, src_offset, len);
+        }
+        if (copied <= 0) return false;
+        stats_write(copied);
+
+        offset += copied;
+        src_offset += copied;
+        len -= copied;
+    }
+    return true;
+}
+
+// Copy a data extent of the source, sharing whole filesystem blocks when possible
+static bool copy_extent(Image *image, uint64_t offset, int src_fd, uint64_t src_offset, uint64_t len) {
+    struct stat st;
+    uint64_t block = (fstat(image->fd, &st) == 0 && st.st_blksize > 0) ? (uint64_t)st.st_blksize : 4096;
+
+    // Reflink needs block aligned offsets and length, the unaligned tail is copied
+    if (offset % block == 0 && src_offset % block == 0 && len >= block) {
+        struct file_clone_range range = {
+            .src_fd = src_fd,
+            .src_offset = src_offset,
+            .src_length = len - len % block,
+            .dest_offset = offset,
+        };
+        if (ioctl(image->fd, FICLONERANGE, &range) == 0) {
+            stats_write(range.src_length);
+            offset += range.src_length;
+            src_offset += range.src_length;
+            len -= range.src_length;
+        }
+    }
+
+    return len == 0 || copy_range(image, offset, src_fd, src_offset, len);
+}
+
+static bool copy_from_fd(Image *image, uint64_t offset, int src_fd, uint64_t src_offset, uint64_t len) {
+    if (image->copy_mode == COPY_BUFFERED || image->backend != IMAGE_STDIO) {
+        return copy_buffered(image, offset, src_fd, src_offset, len);
+    }
+
+    // Sparse image: only copy the data extents of the source, its holes stay holes
+    const uint64_t end = src_offset + len;
+    uint64_t pos = src_offset;
+    while (image->sparse && pos < end) {
+        off_t data = lseek(src_fd, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) return true;    // rest of the file is a hole
+        if (data < 0) break;                            // SEEK_DATA not supported, copy everything
+        if ((uint64_t)data >= end) return true;
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole > end) hole = end;
+        stats_add(STAT_SEEKS, 2);
+        stats_add(STAT_HOLE_BYTES, data - pos);
+
+        if (!copy_extent(image, offset + (data - src_offset), src_fd, data, hole - data)) return false;
+        pos = hole;
+    }
+    if (image->sparse && pos >= end) return true;
+
+    return copy_extent(image, offset + (pos - src_offset), src_fd, pos, end - pos);
+}
+
+typedef struct {
+    Image *image;
+    uint64_t offset, src_offset, len;
+    int src_fd;                 // Own descriptor, the caller closes theirs
+} Copy_Job;
+
+static bool run_copy(void *arg) {
+    Copy_Job *job = arg;
+    bool ok = copy_from_fd(job->image, job->offset, job->src_fd, job->src_offset, job->len);
+    close(job->src_fd);
+    free(job);
+    return ok;
+}
+
+bool image_copy_from_fd(Image *image, uint64_t offset, int src_fd, uint64_t len) {
+    return image_copy_from_fd_at(image, offset, src_fd, 0, len);
+}
+
+bool image_copy_from_fd_at(Image *image, uint64_t offset, int src_fd, uint64_t src_offset, uint64_t len) {
+    if (offset + len > image->size) {
+        fprintf(stderr, "Error: write past end of image %s\n", image->name);
+        return false;
+    }
+
+    // Only remember where the data comes from, it is read when the stream is written
+    if (image->stream) {
+        return stream_add_extent(image->stream, offset, src_fd, src_offset, len);
+    }
+
+    // qcow2 data goes through the cluster map, never straight to the file
+    if (image->copy_mode == COPY_STDIO && image->backend != IMAGE_QCOW2) {
+        if (image->pool) write_pool_wait_range(image->pool, offset, len);
+        FILE *src = fdopen(dup(src_fd), "rb");
+        if (!src) return false;
+        bool ok = fseeko(src, src_offset, SEEK_SET) == 0 && image_write_from_file(image, offset, src, len);
+        fclose(src);
+        // Later reads and worker writes bypass the FILE buffer
+        if (image->pool && image->file && fflush(image->file) != 0) ok = false;
+        return ok;
+    }
+
+    // Writes below go straight to the fd
+    if (image->file && fflush(image->file) != 0) return false;
+
+    if (image->pool) {
+        Copy_Job *job = malloc(sizeof *job);
+        if (!job) return false;
+        *job = (Copy_Job){ .image = image, .offset = offset, .src_offset = src_offset, .len = len,
+                           .src_fd = dup(src_fd) };
+        if (job->src_fd < 0) {
+            free(job);
+            return false;
+        }
+        return write_pool_submit(image->pool, offset, len, run_copy, job);
+    }
+
+    return copy_from_fd(image, offset, src_fd, src_offset, len);
+}
+
+bool image_print_allocation(Image *image) {
+    struct stat st;
+    if (image->pool && !write_pool_wait(image->pool)) return false;
+    if (image->file && fflush(image->file) != 0) return false;
+    if (fstat(image->fd, &st) != 0) {
+        fprintf(stderr, "Error: could not stat image %s\n", image->name);
+        return false;
+    }
+
+    // st_blocks is always in 512 byte units
+    uint64_t allocated = (uint64_t)st.st_blocks * 512;
+    uint64_t logical = (uint64_t)st.st_size;
+    printf("Image '%s': %llu bytes allocated of %llu bytes logical (%.2f%%)\n",
+           image->name, (unsigned long long)allocated, (unsigned long long)logical,
+           logical ? 100.0 * allocated / logical : 0.0);
+    return true;
+}
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "layout.h"
+#include "gpt_constants.h"
+#include "utils.h"
+
+typedef struct {
+    const char *name;
+    const char *guid;
+} Partition_Type;
+
+// Type names, the Linux ones as in the Discoverable Partitions Specification
+static const Partition_Type partition_types[] = {
+    { "esp", "C12A7328-F81F-11D2-BA4B-00A0C93EC93B" },
+    { "linux", "0FC63DAF-8483-4772-8E79-3D69D8477DE4" },
+    { "linux-root-x86-64", "4F68BCE3-E8CD-4DB1-96E7-FBCAF984B709" },
+    { "linux-root-arm64", "B921B045-1DF0-41C3-AF44-4C6F280D3FAE" },
+    { "linux-usr-x86-64", "8484680C-9521-48C6-9C11-B0720656F69E" },
+    { "linux-usr-arm64", "B0E01050-EE5F-4390-949A-9101B17104E9" },
+    { "swap", "0657FD6D-A4AB-43C4-84E5-0933C84B4F4F" },
+    { "home", "933AC7E1-2EB4-4F13-B844-0E14E2AEF915" },
+    { "srv", "3B8F8425-20E0-4F3B-907F-1A25A76F98E8" },
+    { "var", "4D21B016-B534-45C2-A9FB-5C16E091FD2D" },
+    { "xbootldr", "BC13C2FF-59E6-4262-A352-B275FD6F7172" },
+    { "bios-boot", "21686148-6449-6E6F-744E-656564454649" },
+    { "basic-data", "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7" },
+    { "lvm", "E6D6D379-F507-44C2-A23C-238F2A3DF928" },
+    { "raid", "A19D880F-05FC-4D3B-A006-743F0F84911E" },
+};
+
+typedef struct {
+    const char *name;
+    unsigned bit;
+} Partition_Attribute;
+
+static const Partition_Attribute partition_attributes[] = {
+    { "required", 0 },
+    { "no-block-io", 1 },
+    { "legacy-boot", 2 },
+    { "growfs", 59 },
+    { "read-only", 60 },
+    { "hidden", 62 },
+    { "no-automount", 63 },
+};
+
+static bool parse_type(const char *str, Guid *type) {
+    for (size_t i = 0; i < sizeof partition_types / sizeof *partition_types; i++) {
+        if (strcmp(str, partition_types[i].name) == 0) return parse_guid(partition_types[i].guid, type);
+    }
+    return parse_guid(str, type);
+}
+
+// ATTR+ATTR+..., each a name or a bit number
+static bool parse_attributes(char *str, uint64_t *attributes) {
+    char *save = NULL;
+    *attributes = 0;
+    for (char *attr = strtok_r(str, "+", &save); attr; attr = strtok_r(NULL, "+", &save)) {
+        char *end = NULL;
+        unsigned long bit = strtoul(attr, &end, 10);
+        for (size_t i = 0; end == attr && i < sizeof partition_attributes / sizeof *partition_attributes; i++) {
+            if (strcmp(attr, partition_attributes[i].name) == 0) {
+                bit = partition_attributes[i].bit;
+                end = attr + strlen(attr);
+            }
+        }
+        if (end == attr || *end != '\0' || bit > 63) return false;
+        *attributes |= 1ULL << bit;
+    }
+    return true;
+}
+
+// UTF-8 to the UTF-16 of a GPT entry, false when invalid or too long
+static bool parse_name(const char *str, char16_t name[36]) {
+    const unsigned char *p = (const unsigned char *)str;
+    size_t n = 0;
+    memset(name, 0, 36 * sizeof *name);
+    while (*p) {
+        uint32_t c = *p;
+        int extra = c < 0x80 ? 0 : (c & 0xE0) == 0xC0 ? 1 : (c & 0xF0) == 0xE0 ? 2 : (c & 0xF8) == 0xF0 ? 3 : -1;
+        if (extra < 0) return false;
+        c &= 0x7F >> extra;
+        for (p++; extra > 0; extra--, p++) {
+            if ((*p & 0xC0) != 0x80) return false;
+            c = c << 6 | (*p & 0x3F);
+        }
+        if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return false;
+
+        // Outside the BMP as a surrogate pair
+        if (n + (c >= 0x10000 ? 2 : 1) > 36) return false;
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            name[n++] = 0xD800 | c >> 10;
+            name[n++] = 0xDC00 | (c & 0x3FF);
+        } else {
+            name[n++] = c;
+        }
+    }
+    return true;
+}
+
+bool layout_add(Layout *layout, const char *spec, const char *where) {
+    if (layout->count == NUMBER_OF_GPT_ENTRIES) {
+        fprintf(stderr, "Error: %s: a GPT holds %d partitions\n", where, NUMBER_OF_GPT_ENTRIES);
+        return false;
+    }
+    if (layout->count == layout->cap) {
+        size_t cap = layout->cap ? layout->cap * 2 : 8;
+        Partition *parts = realloc(layout->parts, cap * sizeof *parts);
+        if (!parts) return false;
+        layout->parts = parts;
+        layout->cap = cap;
+    }
+
+    Partition part = { .type = LINUX_DATA_GUID, .align = ALIGNMENT };
+    bool name_given = false;
+    char *text = strdup(spec);
+    char *save = NULL;
+    bool ok = text != NULL;
+    for (char *field = ok ? strtok_r(text, ", \t\r\n", &save) : NULL; ok && field;
+         field = strtok_r(NULL, ", \t\r\n", &save)) {
+        char *value = strchr(field, '=');
+        if (!value) {
+            fprintf(stderr, "Error: %s: '%s' is not KEY=VALUE\n", where, field);
+            ok = false;
+            break;
+        }
+        *value++ = '\0';
+
+        if (strcmp(field, "type") == 0) {
+            ok = parse_type(value, &part.type);
+        } else if (strcmp(field, "name") == 0) {
+            ok = parse_name(value, part.name);
+            name_given = true;
+        } else if (strcmp(field, "size") == 0) {
+            ok = parse_size(value, &part.size) && part.size > 0;
+        } else if (strcmp(field, "align") == 0) {
+            ok = parse_size(value, &part.align) && part.align > 0;
+        } else if (strcmp(field, "attrs") == 0) {
+            char attrs[256];
+            snprintf(attrs, sizeof attrs, "%s", value);
+            ok = parse_attributes(attrs, &part.attributes);
+        } else if (strcmp(field, "guid") == 0) {
+            ok = parse_guid(value, &part.guid);
+            part.guid_given = true;
+        } else if (strcmp(field, "payload") == 0) {
+            free(part.payload);
+            part.payload = strdup(value);
+            ok = part.payload != NULL;
+        } else {
+            fprintf(stderr, "Error: %s: unknown partition key '%s'\n", where, field);
+            ok = false;
+            break;
+        }
+        if (!ok) fprintf(stderr, "Error: %s: invalid value '%s' for '%s'\n", where, value, field);
+    }
+    free(text);
+
+    part.esp = memcmp(&part.type, &ESP_GUID, sizeof(Guid)) == 0;
+    if (ok && part.esp && part.payload) {
+        fprintf(stderr, "Error: %s: the ESP is built from the staging tree, it takes no payload\n", where);
+        ok = false;
+    }
+    for (size_t i = 0; ok && part.esp && i < layout->count; i++) {
+        if (layout->parts[i].esp) {
+            fprintf(stderr, "Error: %s: the layout has an ESP already\n", where);
+            ok = false;
+        }
+    }
+    if (!ok) {
+        free(part.payload);
+        return false;
+    }
+
+    if (part.esp && !name_given) parse_name("EFI SYSTEM", part.name);
+    layout->parts[layout->count++] = part;
+    return true;
+}
+
+bool layout_load(Layout *layout, const char *name) {
+    FILE *fp = fopen(name, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: could not read layout '%s'\n", name);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    unsigned line_no = 0;
+    bool ok = true;
+    while (ok && getline(&line, &cap, fp) >= 0) {
+        line_no++;
+        line[strcspn(line, "#")] = '\0';
+        if (line[strspn(line, ", \t\r\n")] == '\0') continue;
+
+        char where[4200];
+        snprintf(where, sizeof where, "%s:%u", name, line_no);
+        ok = layout_add(layout, line, where);
+    }
+    free(line);
+    fclose(fp);
+    return ok;
+}
+
+void layout_free(Layout *layout) {
+    for (size_t i = 0; i < layout->count; i++) free(layout->parts[i].payload);
+    free(layout->parts);
+    *layout = (Layout){ 0 };
+}
+
+void layout_default(Partition parts[2], uint64_t esp_size, uint64_t data_size) {
+    parts[0] = (Partition){
+        .name = u"EFI SYSTEM",
+        .type = ESP_GUID,
+        .esp = true,
+        .size = esp_size,
+        .align = ALIGNMENT,
+    };
+    parts[1] = (Partition){
+        .name = u"LINUX DATA",
+        .type = LINUX_DATA_GUID,
+        .size = data_size,
+        .align = ALIGNMENT,
+    };
+}
+
+bool layout_place(Partition *parts, size_t count, uint32_t lba_size, uint64_t *disk_lbas) {
+    const uint64_t table_lbas = GPT_TABLE_SIZE / lba_size;
+    uint64_t next = 2 + table_lbas;     // MBR, GPT header, GPT table
+
+    for (size_t i = 0; i < count; i++) {
+        Partition *part = &parts[i];
+        struct stat st;
+        if (part->payload && stat(part->payload, &st) != 0) {
+            fprintf(stderr, "Error: could not stat payload '%s' of partition %zu\n", part->payload, i + 1);
+            return false;
+        }
+        if (part->payload && part->size == 0) part->size = st.st_size;
+        if (part->payload && (uint64_t)st.st_size > part->size) {
+            fprintf(stderr, "Error: payload '%s' does not fit the %llu byte partition %zu\n", part->payload,
+                    (unsigned long long)part->size, i + 1);
+            return false;
+        }
+        if (part->size == 0) {
+            fprintf(stderr, "Error: partition %zu needs a size or a payload\n", i + 1);
+            return false;
+        }
+        if (part->align % lba_size != 0) {
+            fprintf(stderr, "Error: alignment of partition %zu is not a multiple of the %u byte sector size\n",
+                    i + 1, lba_size);
+            return false;
+        }
+
+        const uint64_t align_lbas = part->align / lba_size;
+        part->lba = (next + align_lbas - 1) / align_lbas * align_lbas;
+        part->lbas = bytes_to_lbas(part->size, lba_size);
+        next = part->lba + part->lbas;
+    }
+
+    // Backup table and header after the last partition
+    *disk_lbas = next + table_lbas + 1;
+    return true;
+}
+
+Partition *layout_plan(const Layout *layout, uint64_t esp_size, uint64_t data_size, uint32_t lba_size,
+                       size_t *count, uint64_t *disk_lbas) {
+    bool has_esp = false;
+    for (size_t i = 0; layout && i < layout->count; i++) has_esp |= layout->parts[i].esp;
+    const size_t n = layout ? layout->count + !has_esp : 2;
+    if (n > NUMBER_OF_GPT_ENTRIES) {
+        fprintf(stderr, "Error: a GPT holds %d partitions, the layout has %zu with the ESP\n",
+                NUMBER_OF_GPT_ENTRIES, n);
+        return NULL;
+    }
+
+    Partition *parts = calloc(n, sizeof *parts);
+    if (!parts) return NULL;
+    Partition defaults[2];
+    layout_default(defaults, esp_size, data_size);
+    if (!layout) {
+        memcpy(parts, defaults, sizeof defaults);
+    } else {
+        if (!has_esp) parts[0] = defaults[0];
+        memcpy(parts + !has_esp, layout->parts, layout->count * sizeof *parts);
+        for (size_t i = 0; i < n; i++) {
+            if (parts[i].esp && parts[i].size == 0) parts[i].size = esp_size;
+        }
+    }
+
+    if (!layout_place(parts, n, lba_size, disk_lbas)) {
+        free(parts);
+        return NULL;
+    }
+    *count = n;
+    return parts;
+}
+
+bool write_payloads(Image *image) {
+    for (size_t i = 0; i < image->num_partitions; i++) {
+        const Partition *part = &image->partitions[i];
+        if (!part->payload) continue;
+
+        // Checked when placed, the file may have grown since
+        int fd = open(part->payload, O_RDONLY);
+        struct stat st;
+        bool ok = fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size <= part->lbas * image->lba_size &&
+                  image_copy_from_fd(image, part->lba * image->lba_size, fd, st.st_size);
+        if (fd >= 0) close(fd);
+        if (!ok) {
+            fprintf(stderr, "Error: could not write payload '%s' to partition %zu of %s\n", part->payload, i + 1,
+                    image->name);
+            return false;
+        }
+    }
+    return true;
+}
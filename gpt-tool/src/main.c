@@ -3,67 +3,545 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
-#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "gpt_constants.h"
 #include "structures.h"
 #include "utils.h"
-#include "mbr.h"
-#include "gpt.h"
-#include "fat32.h"
-
-int main(void) {
-    // img creation
-    FILE *image = fopen(image_name, "wb+"); // specify image location and permissions
-    if (!image) {
-        fprintf(stderr, "Error: could not open file %s\n", image_name);
+#include "image.h"
+#include "build.h"
+#include "gptz.h"
+#include "stats.h"
+#include "verify.h"
+#include "batch.h"
+#include "extract.h"
+#include "layout.h"
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options]\n"
+           "       %s cat [-j N] [--offset BYTES] [--length BYTES] IMAGE.gptz [OUTPUT]\n"
+           "                  decompress a gptz image to OUTPUT (file or block device,\n"
+           "                  holes stay sparse) or stdout; with --offset or --length\n"
+           "                  only that range of the disk, inflating only its chunks\n"
+           "       %s verify [-j N] IMAGE\n"
+           "                  check MBR, GPT, ESP and its cluster chains, JSON report on stdout\n"
+           "       %s ls [-r] IMAGE [PATH]\n"
+           "                  list the ESP directory PATH (default /), -r recursively\n"
+           "       %s extract IMAGE [PATH] DEST\n"
+           "                  copy the ESP file or directory PATH (default /) to DEST,\n"
+           "                  \"-\" writes a file to stdout; no mount needed\n"
+           "       %s batch [-j N] MANIFEST\n"
+           "                  build every raw image of MANIFEST, N at a time; images\n"
+           "                  with the same ESP inputs share one ESP build (see batch.h)\n"
+           "\n",
+           prog, prog, prog, prog, prog, prog);
+    // Two parts, one string literal would be longer than C compilers must take
+    fputs("  -s, --sparse    size image up front and only write non-zero regions\n"
+          "  -m, --mmap      build the image in a memory mapping, flushed once at the end\n"
+          "  -f, --format FORMAT\n"
+          "                  raw (test.img, default), qcow2 (test.qcow2, only clusters\n"
+          "                  holding data are stored) or gptz (test.gptz, independently\n"
+          "                  compressed chunks, zero chunks stored as holes)\n"
+          "  -o, --output FILE\n"
+          "                  image file to write (default test.img, test.qcow2, test.gptz)\n"
+          "      --stream    plan the image in memory and write it front to back in one\n"
+          "                  pass, to --output or stdout when that is not given\n"
+          "      --device DEV\n"
+          "                  write the image straight to block device DEV with O_DIRECT\n"
+          "                  and io_uring, the device zeroes unused ranges itself; the\n"
+          "                  backup GPT goes to the end of DEV, throughput is printed\n"
+          "  -e, --esp-size SIZE\n"
+          "                  size of the EFI System Partition (default 33M)\n"
+          "  -P, --partition SPEC\n"
+          "                  add a partition to the disk layout, SPEC is KEY=VALUE fields\n"
+          "                  separated by commas: type, name, size, align, attrs, guid and\n"
+          "                  payload=FILE copied to the partition start (see layout.h);\n"
+          "                  the ESP comes first unless a partition has type=esp, without\n"
+          "                  any the disk has the ESP and a 1M Linux data partition\n"
+          "      --layout FILE\n"
+          "                  add the partitions of FILE, one SPEC per line\n"
+          "  -c, --cluster-size SIZE\n"
+          "                  FAT32 cluster size, sector size to 32K (default picked by ESP size)\n"
+          "      --sector-size BYTES\n"
+          "                  logical sector size of the disk, 512 (default) or 4096 for\n"
+          "                  4Kn drives; FAT32 needs an ESP of 260M with 4096, which is\n"
+          "                  then the default\n"
+          "      --preset NAME\n"
+          "                  fixed geometry esp33, esp128, esp512, esp1g or esp260-4k;\n"
+          "                  MBR, GPT and empty ESP are patched from a cached template\n"
+          "      --copy MODE file copy strategy: range (reflink/copy_file_range, default),\n"
+          "                  buffered (1 MiB pread/pwrite) or stdio (fread/fwrite per LBA)\n"
+          "  -d, --esp-dir DIR\n"
+          "                  import the directory tree DIR into the ESP root\n"
+          "                  (instead of adding ./BOOTx64.efi); symlinks are followed,\n"
+          "                  sockets, FIFOs and devices are skipped with a warning\n"
+          "  -j, --threads N write large regions and file data with N threads using pwrite\n"
+          "                  (default 1, 0 uses every online CPU), gptz compresses with them\n"
+          "  -u, --update    update an existing image in place, only rewriting ESP files\n"
+          "                  that changed since the last build (see <image>.manifest);\n"
+          "                  size and layout options only apply when the image has to be built\n"
+          "      --reproducible[=SEED]\n"
+          "                  same options and inputs give the same image: GUIDs derived\n"
+          "                  from SEED or from a hash of the inputs, ESP timestamps from\n"
+          "                  SOURCE_DATE_EPOCH (always honoured) or else 1980-01-01\n"
+          "      --cache DIR reproducible build through a content-addressed cache in DIR,\n"
+          "                  an image built before with the same inputs and options is\n"
+          "                  reflinked or copied from there\n"
+          "      --stats[=TRACE]\n"
+          "                  print wall/CPU time per phase and I/O counters at the end,\n"
+          "                  TRACE gets a Chrome trace-event JSON of the timeline\n"
+          "  -h, --help      show this help\n",
+          stdout);
+}
+
+// Thread count option, 0 means every online CPU
+static bool parse_threads(const char *str, long *threads) {
+    char *end = NULL;
+    *threads = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || *threads < 0 || *threads > 1024) {
+        fprintf(stderr, "Error: invalid thread count '%s'\n", str);
+        return false;
+    }
+    if (*threads == 0) *threads = sysconf(_SC_NPROCESSORS_ONLN);
+    return true;
+}
+
+// Write length bytes of the disk at offset to out through gptz_read. Reads go
+// one chunk size at a time, so each chunk of the range is inflated once
+static bool cat_range(Gptz *gptz, uint64_t offset, uint64_t length, FILE *out) {
+    const size_t buf_size = gptz_chunk_size(gptz);
+    uint8_t *buf = malloc(buf_size);
+    bool ok = buf != NULL;
+    while (ok && length > 0) {
+        size_t n = length < buf_size ? length : buf_size;
+        ok = gptz_read(gptz, offset, buf, n) && fwrite(buf, 1, n, out) == n;
+        offset += n;
+        length -= n;
+    }
+    free(buf);
+    return ok;
+}
+
+// cat [-j N] [--offset BYTES] [--length BYTES] IMAGE.gptz [OUTPUT]
+static int cat_image(const char *prog, int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "offset", required_argument, NULL, 'O' },
+        { "length", required_argument, NULL, 'L' },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL,     0,                 NULL,  0  },
+    };
+
+    long threads = 1;
+    uint64_t offset = 0, length = 0;
+    bool range = false, length_given = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'j':
+                if (!parse_threads(optarg, &threads)) return EXIT_FAILURE;
+                break;
+            case 'O':
+            case 'L':
+                if (!parse_size(optarg, opt == 'O' ? &offset : &length)) {
+                    fprintf(stderr, "Error: invalid %s '%s'\n", opt == 'O' ? "offset" : "length", optarg);
+                    return EXIT_FAILURE;
+                }
+                range = true;
+                if (opt == 'L') length_given = true;
+                break;
+            case 'h':
+                usage(prog);
+                return EXIT_SUCCESS;
+            default:
+                usage(prog);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || argc - optind > 2) {
+        usage(prog);
+        return EXIT_FAILURE;
+    }
+
+    const char *output = optind + 1 < argc ? argv[optind + 1] : "-";
+    bool to_stdout = strcmp(output, "-") == 0;
+    if (to_stdout && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Error: not writing an image to a terminal, redirect stdout or give OUTPUT\n");
         return EXIT_FAILURE;
     }
 
-    // Set size
-    gpt_table_lbas = GPT_TABLE_SIZE / LBA_SIZE;
+    Gptz *gptz = gptz_open(argv[optind]);
+    if (!gptz) return EXIT_FAILURE;
 
-    const uint64_t padding = (ALIGNMENT*2 + (LBA_SIZE * ((gpt_table_lbas*2) + 1 + 2))); // extra padding for GPTs/MBR
-    image_size = esp_size + data_size + padding; // add padding
-    image_size_lbas = bytes_to_lbas(image_size);
-    esp_size_lbas = bytes_to_lbas(esp_size);
-    data_size_lbas = bytes_to_lbas(data_size);
+    // A range of the disk, the rest of it when no length is given
+    if (range) {
+        const uint64_t disk_size = gptz_size(gptz);
+        if (offset > disk_size || (length_given && length > disk_size - offset)) {
+            fprintf(stderr, "Error: range %llu+%llu is beyond the %llu byte disk\n", (unsigned long long)offset,
+                    (unsigned long long)length, (unsigned long long)disk_size);
+            gptz_close(gptz);
+            return EXIT_FAILURE;
+        }
+        if (!length_given) length = disk_size - offset;
 
-    // Seed rand
-    srand(time(NULL));
+        FILE *out = to_stdout ? stdout : fopen(output, "wb");
+        bool ok = out && cat_range(gptz, offset, length, out);
+        if (out && (to_stdout ? fflush(out) : fclose(out)) != 0) ok = false;
+        gptz_close(gptz);
+        if (!ok) {
+            fprintf(stderr, "Error: could not decompress %s to %s\n", argv[optind], output);
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
 
-    // Write protective MBR
-    if (!write_mbr(image)) {
-        fprintf(stderr, "Error: could not write protective MBR for file %s\n", image_name);
+    int fd = to_stdout ? STDOUT_FILENO : open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open %s\n", output);
+        gptz_close(gptz);
         return EXIT_FAILURE;
-    }    
+    }
 
-    // Write GPT headers & tables
-    if (!write_gpt(image, image_size_lbas)) {
-        fprintf(stderr, "Error: could not write GPT headers & tables for file %s\n", image_name);
+    bool ok = gptz_extract(gptz, fd, threads);
+    if (!to_stdout && close(fd) != 0) ok = false;
+    gptz_close(gptz);
+    if (!ok) {
+        fprintf(stderr, "Error: could not decompress %s to %s\n", argv[optind], output);
         return EXIT_FAILURE;
     }
+    return EXIT_SUCCESS;
+}
 
-    // Write EFI System Partition
-    if (!write_esp(image)) {
-        fprintf(stderr, "Error: could not write ESP for file %s\n", image_name);
+// verify [-j N] IMAGE
+static int verify(const char *prog, int argc, char *argv[]) {
+    long threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:h")) != -1) {
+        switch (opt) {
+            case 'j':
+                if (!parse_threads(optarg, &threads)) return EXIT_FAILURE;
+                break;
+            case 'h':
+                usage(prog);
+                return EXIT_SUCCESS;
+            default:
+                usage(prog);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(prog);
         return EXIT_FAILURE;
     }
+    return verify_image(argv[optind], threads, stdout) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    // Check if "BOOTx64.EFI" file exists in curr directory and automatically add it to ESP
-    FILE *fp = fopen("BOOTx64.efi", "rb");
-    if(fp) {
-        printf("Found file!");
-        fclose(fp);
-        char *path = calloc(1, 25);
-        strcpy(path, "/EFI/BOOT/BOOTx64.efi");
-        if (!add_path_to_esp(path, image)) {
-            fprintf(stderr, "Error: Could not add file '%s'\n", path);
+// ls [-r] IMAGE [PATH]
+static int list(const char *prog, int argc, char *argv[]) {
+    bool recursive = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "rh")) != -1) {
+        switch (opt) {
+            case 'r':
+                recursive = true;
+                break;
+            case 'h':
+                usage(prog);
+                return EXIT_SUCCESS;
+            default:
+                usage(prog);
+                return EXIT_FAILURE;
         }
-        free(path);
     }
+    if (optind >= argc || argc - optind > 2) {
+        usage(prog);
+        return EXIT_FAILURE;
+    }
+    const char *path = optind + 1 < argc ? argv[optind + 1] : "/";
+    return esp_list(argv[optind], path, recursive, stdout) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    fclose(image);
+// extract IMAGE [PATH] DEST
+static int extract(const char *prog, int argc, char *argv[]) {
+    if (argc < 3 || argc > 4 || strcmp(argv[1], "-h") == 0) {
+        usage(prog);
+        return argc == 2 && strcmp(argv[1], "-h") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    const char *path = argc == 4 ? argv[2] : "/";
+    return esp_extract(argv[1], path, argv[argc - 1]) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    return EXIT_SUCCESS;
+// batch [-j N] MANIFEST
+static int batch(const char *prog, int argc, char *argv[]) {
+    long threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:h")) != -1) {
+        switch (opt) {
+            case 'j':
+                if (!parse_threads(optarg, &threads)) return EXIT_FAILURE;
+                break;
+            case 'h':
+                usage(prog);
+                return EXIT_SUCCESS;
+            default:
+                usage(prog);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(prog);
+        return EXIT_FAILURE;
+    }
+    return build_batch(argv[optind], threads) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "cat") == 0) return cat_image(argv[0], argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "verify") == 0) return verify(argv[0], argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "ls") == 0) return list(argv[0], argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "extract") == 0) return extract(argv[0], argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "batch") == 0) return batch(argv[0], argc - 1, argv + 1);
+
+    const struct option long_options[] = {
+        { "sparse", no_argument, NULL, 's' },
+        { "mmap",   no_argument, NULL, 'm' },
+        { "format", required_argument, NULL, 'f' },
+        { "output", required_argument, NULL, 'o' },
+        { "stream", no_argument, NULL, 'S' },
+        { "device", required_argument, NULL, 'D' },
+        { "esp-dir", required_argument, NULL, 'd' },
+        { "esp-size", required_argument, NULL, 'e' },
+        { "partition", required_argument, NULL, 'P' },
+        { "layout", required_argument, NULL, 'L' },
+        { "cluster-size", required_argument, NULL, 'c' },
+        { "sector-size", required_argument, NULL, 'B' },
+        { "preset", required_argument, NULL, 'G' },
+        { "copy", required_argument, NULL, 'C' },
+        { "update", no_argument, NULL, 'u' },
+        { "threads", required_argument, NULL, 'j' },
+        { "reproducible", optional_argument, NULL, 'R' },
+        { "cache", required_argument, NULL, 'K' },
+        { "stats", optional_argument, NULL, 'T' },
+        { "help",   no_argument, NULL, 'h' },
+        { NULL,     0,           NULL,  0  },
+    };
+
+    Build_Options options;
+    build_options_init(&options);
+    bool qcow2 = false;
+    bool gptz = false;
+    bool stream = false;
+    const char *output = NULL;
+    const char *device = NULL;
+    bool esp_size_given = false;
+    bool geometry_given = false;        // Sizes or layout, which --preset sets itself
+    Layout layout = { 0 };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "smf:o:d:e:P:c:uj:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                options.sparse = true;
+                break;
+            case 'm':
+                options.backend = IMAGE_MMAP;
+                break;
+            case 'f':
+                qcow2 = strcmp(optarg, "qcow2") == 0;
+                gptz = strcmp(optarg, "gptz") == 0;
+                if (!qcow2 && !gptz && strcmp(optarg, "raw") != 0) {
+                    fprintf(stderr, "Error: unknown image format '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'S':
+                stream = true;
+                break;
+            case 'D':
+                device = optarg;
+                break;
+            case 'd':
+                options.esp_dir = optarg;
+                break;
+            case 'e':
+                if (!parse_size(optarg, &options.esp_size)) {
+                    fprintf(stderr, "Error: invalid ESP size '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                esp_size_given = true;
+                geometry_given = true;
+                break;
+            case 'P':
+                if (!layout_add(&layout, optarg, "--partition")) return EXIT_FAILURE;
+                geometry_given = true;
+                break;
+            case 'L':
+                if (!layout_load(&layout, optarg)) return EXIT_FAILURE;
+                geometry_given = true;
+                break;
+            case 'C':
+                if (strcmp(optarg, "range") == 0) {
+                    options.copy_mode = COPY_RANGE;
+                } else if (strcmp(optarg, "buffered") == 0) {
+                    options.copy_mode = COPY_BUFFERED;
+                } else if (strcmp(optarg, "stdio") == 0) {
+                    options.copy_mode = COPY_STDIO;
+                } else {
+                    fprintf(stderr, "Error: unknown copy mode '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c': {
+                uint64_t bytes = 0;
+                if (!parse_size(optarg, &bytes) || bytes > UINT32_MAX) {
+                    fprintf(stderr, "Error: invalid cluster size '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                options.esp_cluster_size = bytes;
+                geometry_given = true;
+                break;
+            }
+            case 'B': {
+                uint64_t bytes = 0;
+                if (!parse_size(optarg, &bytes) || (bytes != DEFAULT_LBA_SIZE && bytes != MAX_LBA_SIZE)) {
+                    fprintf(stderr, "Error: sector size '%s' is not 512 or 4096\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                options.lba_size = bytes;
+                geometry_given = true;
+                break;
+            }
+            case 'G':
+                options.preset = geometry_preset(optarg);
+                if (!options.preset) {
+                    fprintf(stderr, "Error: unknown preset '%s', there are:\n", optarg);
+                    geometry_presets_print(stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'u':
+                options.update = true;
+                break;
+            case 'j': {
+                long threads = 1;
+                if (!parse_threads(optarg, &threads)) return EXIT_FAILURE;
+                options.threads = threads;
+                break;
+            }
+            case 'R':
+                options.reproducible = true;
+                options.seed = optarg;
+                break;
+            case 'K':
+                options.cache_dir = optarg;
+                break;
+            case 'T':
+                if (!stats_enable(optarg)) return EXIT_FAILURE;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (qcow2) {
+        if (options.update || options.backend == IMAGE_MMAP) {
+            fprintf(stderr, "Error: --update and --mmap only work with raw images\n");
+            return EXIT_FAILURE;
+        }
+        options.backend = IMAGE_QCOW2;
+        options.output = "test.qcow2";
+    }
+
+    if (gptz) {
+        if (options.update || options.backend == IMAGE_MMAP) {
+            fprintf(stderr, "Error: --update and --mmap only work with raw images\n");
+            return EXIT_FAILURE;
+        }
+        options.backend = IMAGE_GPTZ;
+        options.output = "test.gptz";
+    }
+
+    if (stream) {
+        if (options.update || qcow2 || gptz || options.backend == IMAGE_MMAP) {
+            fprintf(stderr, "Error: --stream can not be combined with --update, --mmap, qcow2 or gptz\n");
+            return EXIT_FAILURE;
+        }
+        if (!output) output = "-";
+        if (strcmp(output, "-") == 0 && isatty(STDOUT_FILENO)) {
+            fprintf(stderr, "Error: not writing an image to a terminal, redirect stdout or use --output\n");
+            return EXIT_FAILURE;
+        }
+        options.backend = IMAGE_STREAM;
+    }
+    if (output) options.output = output;
+
+    if (device) {
+        if (options.update || qcow2 || gptz || stream || output || options.backend == IMAGE_MMAP) {
+            fprintf(stderr, "Error: --device can not be combined with --update, --mmap, --stream, --output, "
+                            "qcow2 or gptz\n");
+            return EXIT_FAILURE;
+        }
+        options.backend = IMAGE_DEVICE;
+        options.output = device;
+    }
+
+    if (options.cache_dir && (options.backend == IMAGE_STREAM || options.backend == IMAGE_DEVICE)) {
+        fprintf(stderr, "Error: --cache only works with image files, not --stream or --device\n");
+        return EXIT_FAILURE;
+    }
+
+    // https://reproducible-builds.org/specs/source-date-epoch/
+    const char *epoch = getenv("SOURCE_DATE_EPOCH");
+    if (epoch && *epoch) {
+        char *end = NULL;
+        long long seconds = strtoll(epoch, &end, 10);
+        if (*end != '\0' || seconds < 0) {
+            fprintf(stderr, "Error: SOURCE_DATE_EPOCH '%s' is not a count of seconds\n", epoch);
+            return EXIT_FAILURE;
+        }
+        options.source_date = seconds;
+    }
+
+    // Smallest ESP that still has FAT32's 65525 clusters of 4 KiB
+    if (options.lba_size == MAX_LBA_SIZE && !esp_size_given) options.esp_size = 260 * 1024 * 1024;
+
+    if (options.preset) {
+        if (geometry_given) {
+            fprintf(stderr, "Error: --preset sets the geometry, it can not be combined with --esp-size, "
+                            "--cluster-size, --sector-size, --partition or --layout\n");
+            return EXIT_FAILURE;
+        }
+        options.lba_size = options.preset->lba_size;
+        options.esp_size = options.preset->esp_size;
+        options.data_size = options.preset->data_size;
+        options.esp_cluster_size = options.preset->esp_cluster_size;
+    }
+
+    // Without a staging tree ./BOOTx64.efi is added when there is one
+    if (!options.esp_dir && access("BOOTx64.efi", R_OK) == 0) options.boot_file = "BOOTx64.efi";
+
+    // The image owns stdout, messages of the build go to stderr
+    if (options.backend == IMAGE_STREAM && strcmp(options.output, "-") == 0) {
+        fflush(stdout);
+        options.output_fd = dup(STDOUT_FILENO);
+        if (options.output_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "Error: could not move messages off stdout\n");
+            layout_free(&layout);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (layout.count) options.layout = &layout;
+    bool ok = build_image(&options);
+    if (options.output_fd >= 0) close(options.output_fd);
+    layout_free(&layout);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
\ No newline at end of file
@@ -3,11 +3,13 @@
 #include "mbr.h"
 #include "structures.h"
 #include "utils.h"
+#include "gpt_constants.h"
 
 // Write protective MBR
-bool write_mbr(FILE *image) {
-    uint64_t mbr_image_lbas = image_size_lbas;
-    if (mbr_image_lbas > 0xFFFFFFFF) image_size_lbas = 0x100000000;
+bool write_mbr(Image *image) {
+    // Covers the whole disk, or as much as fits in 32 bits
+    uint64_t mbr_image_lbas = image->size / image->lba_size;
+    if (mbr_image_lbas > 0xFFFFFFFF) mbr_image_lbas = 0x100000000;
 
     Mbr mbr = {
         .boot_code = { 0 },
@@ -24,12 +26,9 @@ bool write_mbr(FILE *image) {
         .boot_signature = 0xAA55
     };
 
-    if (fwrite(&mbr, 1, sizeof mbr, image) != sizeof mbr) {
+    if (!image_write(image, 0, &mbr, sizeof mbr)) {
         return false;
     }
 
-    // fill out lba
-    write_full_lba_size(image);
-    
     return true;
-}
\ No newline at end of file
+}
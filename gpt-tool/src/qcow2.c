@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "qcow2.h"
+#include "utils.h"
+#include "stats.h"
+
+enum {
+    QCOW2_MAGIC = 0x514649FB,               // "QFI\xfb"
+    QCOW2_VERSION = 2,
+    QCOW2_CLUSTER_BITS = 16,                // 64 KiB clusters, the qemu-img default
+    QCOW2_CLUSTER_SIZE = 1 << QCOW2_CLUSTER_BITS,
+    QCOW2_L2_ENTRIES = QCOW2_CLUSTER_SIZE / sizeof(uint64_t),
+    QCOW2_REFCOUNTS_PER_BLOCK = QCOW2_CLUSTER_SIZE / sizeof(uint16_t),  // Version 2 refcounts are 16 bit
+};
+
+static const uint64_t QCOW2_OFLAG_COPIED = 1ULL << 63;     // Refcount is exactly one
+
+// Version 2 header, all fields big endian
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t backing_file_offset;
+    uint32_t backing_file_size;
+    uint32_t cluster_bits;
+    uint64_t size;
+    uint32_t crypt_method;
+    uint32_t l1_size;
+    uint64_t l1_table_offset;
+    uint64_t refcount_table_offset;
+    uint32_t refcount_table_clusters;
+    uint32_t nb_snapshots;
+    uint64_t snapshots_offset;
+} __attribute__ ((packed)) Qcow2_Header;
+
+struct Qcow2 {
+    int fd;
+    uint64_t size;                  // Guest bytes
+    uint64_t num_clusters;          // Guest clusters
+    uint64_t *map;                  // Host offset of each guest cluster, 0 if not allocated
+    uint64_t next_host;             // Next free host cluster offset
+    pthread_mutex_t lock;
+};
+
+static uint64_t div_round_up(uint64_t a, uint64_t b) {
+    return (a + b - 1) / b;
+}
+
+Qcow2 *qcow2_create(int fd, uint64_t size) {
+    Qcow2 *qcow2 = calloc(1, sizeof *qcow2);
+    if (!qcow2) return NULL;
+
+    qcow2->fd = fd;
+    qcow2->size = size;
+    qcow2->num_clusters = div_round_up(size, QCOW2_CLUSTER_SIZE);
+    qcow2->map = calloc(qcow2->num_clusters ? qcow2->num_clusters : 1, sizeof *qcow2->map);
+    qcow2->next_host = QCOW2_CLUSTER_SIZE;     // Cluster 0 holds the header
+    pthread_mutex_init(&qcow2->lock, NULL);
+
+    if (!qcow2->map || ftruncate(fd, 0) != 0) {
+        free(qcow2->map);
+        free(qcow2);
+        return NULL;
+    }
+    return qcow2;
+}
+
+bool qcow2_write(Qcow2 *qcow2, uint64_t offset, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        uint64_t cluster = offset >> QCOW2_CLUSTER_BITS;
+        size_t in_cluster = offset & (QCOW2_CLUSTER_SIZE - 1);
+        size_t chunk = QCOW2_CLUSTER_SIZE - in_cluster;
+        if (chunk > len) chunk = len;
+
+        pthread_mutex_lock(&qcow2->lock);
+        uint64_t host = qcow2->map[cluster];
+        // Zeros in a cluster that was never written are already there
+        if (!host && !is_zero_block(p, chunk)) {
+            host = qcow2->map[cluster] = qcow2->next_host;
+            qcow2->next_host += QCOW2_CLUSTER_SIZE;
+        }
+        pthread_mutex_unlock(&qcow2->lock);
+
+        if (!host) stats_add(STAT_HOLE_BYTES, chunk);
+        else if (!pwrite_all(qcow2->fd, p, chunk, host + in_cluster)) return false;
+        p += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+bool qcow2_read(Qcow2 *qcow2, uint64_t offset, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        uint64_t cluster = offset >> QCOW2_CLUSTER_BITS;
+        size_t in_cluster = offset & (QCOW2_CLUSTER_SIZE - 1);
+        size_t chunk = QCOW2_CLUSTER_SIZE - in_cluster;
+        if (chunk > len) chunk = len;
+
+        pthread_mutex_lock(&qcow2->lock);
+        uint64_t host = qcow2->map[cluster];
+        pthread_mutex_unlock(&qcow2->lock);
+
+        ssize_t got = host ? pread(qcow2->fd, p, chunk, host + in_cluster) : 0;
+        if (got < 0) return false;
+        if (host) stats_read(got);
+        // Unallocated, or past the end of a cluster only partly written so far
+        memset(p + got, 0, chunk - got);
+        p += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+bool qcow2_finish(Qcow2 *qcow2) {
+    bool ok = true;
+    uint64_t l1_size = div_round_up(qcow2->num_clusters, QCOW2_L2_ENTRIES);
+    uint64_t *l1 = calloc(l1_size ? l1_size : 1, sizeof *l1);
+    uint64_t *l2 = malloc(QCOW2_CLUSTER_SIZE);
+    if (!l1 || !l2) ok = false;
+
+    // L2 tables, only for ranges with allocated clusters
+    for (uint64_t i = 0; ok && i < l1_size; i++) {
+        bool used = false;
+        for (uint64_t e = 0; e < QCOW2_L2_ENTRIES; e++) {
+            uint64_t cluster = i * QCOW2_L2_ENTRIES + e;
+            uint64_t host = cluster < qcow2->num_clusters ? qcow2->map[cluster] : 0;
+            l2[e] = host ? htobe64(host | QCOW2_OFLAG_COPIED) : 0;
+            used |= host != 0;
+        }
+        if (!used) continue;
+
+        l1[i] = htobe64(qcow2->next_host | QCOW2_OFLAG_COPIED);
+        ok = pwrite_all(qcow2->fd, l2, QCOW2_CLUSTER_SIZE, qcow2->next_host);
+        qcow2->next_host += QCOW2_CLUSTER_SIZE;
+    }
+
+    // L1 table
+    uint64_t l1_offset = qcow2->next_host;
+    uint64_t l1_clusters = div_round_up(l1_size * sizeof *l1, QCOW2_CLUSTER_SIZE);
+    if (ok) ok = pwrite_all(qcow2->fd, l1, l1_size * sizeof *l1, l1_offset);
+    qcow2->next_host += l1_clusters * QCOW2_CLUSTER_SIZE;
+
+    // Refcount blocks and table, they count themselves too
+    uint64_t used_clusters = qcow2->next_host / QCOW2_CLUSTER_SIZE;
+    uint64_t num_blocks = 0, table_clusters = 0;
+    for (;;) {
+        uint64_t total = used_clusters + num_blocks + table_clusters;
+        uint64_t blocks = div_round_up(total, QCOW2_REFCOUNTS_PER_BLOCK);
+        uint64_t table = div_round_up(blocks * sizeof(uint64_t), QCOW2_CLUSTER_SIZE);
+        if (blocks == num_blocks && table == table_clusters) break;
+        num_blocks = blocks;
+        table_clusters = table;
+    }
+    uint64_t total_clusters = used_clusters + num_blocks + table_clusters;
+    uint64_t blocks_offset = qcow2->next_host;
+    uint64_t table_offset = blocks_offset + num_blocks * QCOW2_CLUSTER_SIZE;
+
+    uint16_t *block = malloc(QCOW2_CLUSTER_SIZE);
+    uint64_t *table = calloc(table_clusters, QCOW2_CLUSTER_SIZE);
+    if (!block || !table) ok = false;
+    for (uint64_t b = 0; ok && b < num_blocks; b++) {
+        for (uint64_t e = 0; e < QCOW2_REFCOUNTS_PER_BLOCK; e++) {
+            block[e] = b * QCOW2_REFCOUNTS_PER_BLOCK + e < total_clusters ? htobe16(1) : 0;
+        }
+        table[b] = htobe64(blocks_offset + b * QCOW2_CLUSTER_SIZE);
+        ok = pwrite_all(qcow2->fd, block, QCOW2_CLUSTER_SIZE, blocks_offset + b * QCOW2_CLUSTER_SIZE);
+    }
+    if (ok) ok = pwrite_all(qcow2->fd, table, table_clusters * QCOW2_CLUSTER_SIZE, table_offset);
+
+    // Header last, the file is not a valid image until everything it points to is written
+    Qcow2_Header header = {
+        .magic = htobe32(QCOW2_MAGIC),
+        .version = htobe32(QCOW2_VERSION),
+        .cluster_bits = htobe32(QCOW2_CLUSTER_BITS),
+        .size = htobe64(qcow2->size),
+        .l1_size = htobe32(l1_size),
+        .l1_table_offset = htobe64(l1_offset),
+        .refcount_table_offset = htobe64(table_offset),
+        .refcount_table_clusters = htobe32(table_clusters),
+    };
+    if (ok) ok = ftruncate(qcow2->fd, total_clusters * QCOW2_CLUSTER_SIZE) == 0 &&
+                 pwrite_all(qcow2->fd, &header, sizeof header, 0);
+
+    free(table);
+    free(block);
+    free(l2);
+    free(l1);
+    pthread_mutex_destroy(&qcow2->lock);
+    free(qcow2->map);
+    free(qcow2);
+    return ok;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "reader.h"
+#include "gpt_constants.h"
+
+bool reader_open(Reader *reader, const char *name) {
+    *reader = (Reader){ .name = name, .fd = -1, .lba_size = DEFAULT_LBA_SIZE };
+
+    reader->fd = open(name, O_RDONLY);
+    struct stat st;
+    if (reader->fd < 0 || fstat(reader->fd, &st) != 0) {
+        fprintf(stderr, "Error: could not open image %s\n", name);
+        if (reader->fd >= 0) close(reader->fd);
+        return false;
+    }
+    reader->size = st.st_size;
+    // Block devices have no file size, an image written with --device is checked in place
+    if (S_ISBLK(st.st_mode) && ioctl(reader->fd, BLKGETSIZE64, &reader->size) != 0) reader->size = 0;
+    if (reader->size < 2 * DEFAULT_LBA_SIZE) {
+        fprintf(stderr, "Error: %s is too small to be a disk image\n", name);
+        close(reader->fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map image %s\n", name);
+        close(reader->fd);
+        return false;
+    }
+    reader->map = map;
+
+    // 4Kn disks have the GPT header in their LBA 1 at 4096
+    if (memcmp(reader->map + DEFAULT_LBA_SIZE, "EFI PART", 8) != 0 && reader->size >= 2 * MAX_LBA_SIZE &&
+        memcmp(reader->map + MAX_LBA_SIZE, "EFI PART", 8) == 0) {
+        reader->lba_size = MAX_LBA_SIZE;
+    }
+    return true;
+}
+
+void reader_close(Reader *reader) {
+    if (reader->map) munmap((void *)reader->map, reader->size);
+    if (reader->fd >= 0) close(reader->fd);
+    *reader = (Reader){ .fd = -1, .lba_size = DEFAULT_LBA_SIZE };
+}
+
+const void *reader_lba(const Reader *reader, uint64_t lba, uint64_t count) {
+    uint64_t lbas = reader->size / reader->lba_size;
+    if (lba > lbas || count > lbas - lba) return NULL;
+    return reader->map + lba * reader->lba_size;
+}
+
+bool reader_open_esp(Reader *reader, uint64_t lba, uint64_t num_lbas) {
+    const Vbr *vbr = reader_lba(reader, lba, 1);
+    if (!vbr || !reader_lba(reader, lba, num_lbas)) return false;
+
+    // Only what is needed to find the clusters, the verifier checks the rest
+    if (vbr->bootsect_sig != 0xAA55 || vbr->BPB_BytesPerSec != reader->lba_size || vbr->BPB_SecPerClus == 0 ||
+        vbr->BPB_NumFATs == 0 || vbr->BPB_FATSz16 != 0 || vbr->BPB_FATSz32 == 0 ||
+        vbr->BPB_TotSec32 > num_lbas) {
+        return false;
+    }
+
+    uint64_t fat_lba = lba + vbr->BPB_RsvdSecCnt;
+    uint64_t data_lba = fat_lba + (uint64_t)vbr->BPB_NumFATs * vbr->BPB_FATSz32;
+    uint64_t end_lba = lba + vbr->BPB_TotSec32;
+    if (data_lba >= end_lba) return false;
+
+    reader->esp_lba = lba;
+    reader->esp_lbas = num_lbas;
+    reader->vbr = vbr;
+    reader->fat = reader_lba(reader, fat_lba, vbr->BPB_FATSz32);
+    reader->fat_entries = (uint64_t)vbr->BPB_FATSz32 * reader->lba_size / sizeof(uint32_t);
+    reader->cluster_bytes = vbr->BPB_SecPerClus * reader->lba_size;
+    reader->data_offset = data_lba * reader->lba_size;
+
+    uint64_t clusters = (end_lba - data_lba) / vbr->BPB_SecPerClus;
+    uint64_t max_cluster = clusters + 1;
+    if (max_cluster > reader->fat_entries - 1) max_cluster = reader->fat_entries - 1;
+    if (max_cluster > FAT_BAD_CLUSTER - 1) max_cluster = FAT_BAD_CLUSTER - 1;
+    reader->max_cluster = max_cluster;
+    return reader->fat != NULL;
+}
+
+bool reader_find_esp(Reader *reader) {
+    uint64_t header_lbas[2] = { 1, reader->size / reader->lba_size - 1 };
+    for (int h = 0; h < 2; h++) {
+        const Gpt_Header *header = reader_lba(reader, header_lbas[h], 1);
+        if (!header || memcmp(header->signature, "EFI PART", 8) != 0 ||
+            header->size_of_entry < sizeof(Gpt_Partition_Entry) || header->number_of_entries > 1024) {
+            continue;
+        }
+        uint64_t table_bytes = (uint64_t)header->number_of_entries * header->size_of_entry;
+        const uint8_t *table = reader_lba(reader, header->partition_table_lba,
+                                          (table_bytes + reader->lba_size - 1) / reader->lba_size);
+        if (!table) continue;
+
+        for (uint32_t i = 0; i < header->number_of_entries; i++) {
+            const Gpt_Partition_Entry *entry = (const Gpt_Partition_Entry *)(table + (size_t)i * header->size_of_entry);
+            if (memcmp(&entry->partition_type_guid, &ESP_GUID, sizeof(Guid)) == 0 &&
+                entry->starting_lba <= entry->ending_lba) {
+                return reader_open_esp(reader, entry->starting_lba, entry->ending_lba - entry->starting_lba + 1);
+            }
+        }
+    }
+    return false;
+}
+
+uint32_t reader_fat_entry(const Reader *reader, uint32_t cluster) {
+    if (cluster >= reader->fat_entries) return 0;
+    return reader->fat[cluster] & FAT_ENTRY_MASK;
+}
+
+const uint8_t *reader_cluster(const Reader *reader, uint32_t cluster) {
+    if (cluster < 2 || cluster > reader->max_cluster) return NULL;
+    return reader->map + reader->data_offset + (uint64_t)(cluster - 2) * reader->cluster_bytes;
+}
+
+uint32_t reader_entry_cluster(const FAT32_Dir_Entry_Short *entry) {
+    return ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+}
+
+void reader_entry_name(const FAT32_Dir_Entry_Short *entry, char name[13]) {
+    size_t len = 0;
+    for (int i = 0; i < 8 && entry->DIR_Name[i] != ' '; i++) name[len++] = entry->DIR_Name[i];
+    // 0x05 stands for a leading 0xE5 byte
+    if (len > 0 && (uint8_t)name[0] == 0x05) name[0] = (char)0xE5;
+    if (entry->DIR_Name[8] != ' ') {
+        name[len++] = '.';
+        for (int i = 8; i < 11 && entry->DIR_Name[i] != ' '; i++) name[len++] = entry->DIR_Name[i];
+    }
+    name[len] = '\0';
+}
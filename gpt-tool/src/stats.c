@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+typedef struct {
+    const char *name;
+    double start, wall, cpu;        // Seconds, start relative to stats_enable
+    pid_t tid;
+} Stats_Event;
+
+bool stats_enabled = false;
+
+static const char *trace_name;
+static double enable_time;
+static _Atomic uint64_t counters[NUM_STATS];
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static Stats_Event *events;
+static size_t num_events, cap_events;
+
+static const char *counter_names[NUM_STATS] = {
+    "seeks", "reads", "writes", "bytes_read", "bytes_written", "zero_bytes", "hole_bytes",
+};
+
+static double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void stats_add(Stat_Counter counter, uint64_t n) {
+    if (!stats_enabled) return;
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+void stats_read(uint64_t bytes) {
+    if (!stats_enabled) return;
+    atomic_fetch_add_explicit(&counters[STAT_READS], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[STAT_BYTES_READ], bytes, memory_order_relaxed);
+}
+
+void stats_write(uint64_t bytes) {
+    if (!stats_enabled) return;
+    atomic_fetch_add_explicit(&counters[STAT_WRITES], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[STAT_BYTES_WRITTEN], bytes, memory_order_relaxed);
+}
+
+Stats_Span stats_begin(const char *name) {
+    if (!stats_enabled) return (Stats_Span){ 0 };
+    return (Stats_Span){
+        .name = name,
+        .wall = clock_seconds(CLOCK_MONOTONIC),
+        .cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID),
+    };
+}
+
+void stats_end(Stats_Span *span) {
+    if (!span->name) return;
+    Stats_Event event = {
+        .name = span->name,
+        .start = span->wall - enable_time,
+        .wall = clock_seconds(CLOCK_MONOTONIC) - span->wall,
+        .cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID) - span->cpu,
+        .tid = gettid(),
+    };
+
+    pthread_mutex_lock(&events_lock);
+    if (num_events == cap_events) {
+        size_t cap = cap_events ? cap_events * 2 : 256;
+        Stats_Event *grown = realloc(events, cap * sizeof *grown);
+        if (grown) {
+            events = grown;
+            cap_events = cap;
+        }
+    }
+    if (num_events < cap_events) events[num_events++] = event;
+    pthread_mutex_unlock(&events_lock);
+}
+
+// Phases summed by name, in order of first appearance
+static void print_summary(void) {
+    typedef struct {
+        const char *name;
+        uint64_t calls;
+        double wall, cpu, max;
+    } Phase_Total;
+
+    Phase_Total *totals = calloc(num_events ? num_events : 1, sizeof *totals);
+    size_t num_totals = 0;
+    for (size_t i = 0; totals && i < num_events; i++) {
+        size_t t = 0;
+        while (t < num_totals && strcmp(totals[t].name, events[i].name) != 0) t++;
+        if (t == num_totals) totals[num_totals++].name = events[i].name;
+        totals[t].calls++;
+        totals[t].wall += events[i].wall;
+        totals[t].cpu += events[i].cpu;
+        if (events[i].wall > totals[t].max) totals[t].max = events[i].wall;
+    }
+
+    printf("\n%-20s %8s %12s %12s %12s\n", "phase", "calls", "wall ms", "cpu ms", "max ms");
+    for (size_t t = 0; t < num_totals; t++) {
+        printf("%-20s %8llu %12.3f %12.3f %12.3f\n", totals[t].name, (unsigned long long)totals[t].calls,
+               totals[t].wall * 1e3, totals[t].cpu * 1e3, totals[t].max * 1e3);
+    }
+    free(totals);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-20s %8s %12.3f %12.3f   (user %.3f, sys %.3f)\n", "process", "",
+           (clock_seconds(CLOCK_MONOTONIC) - enable_time) * 1e3,
+           (usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6) * 1e3,
+           (usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6) * 1e3,
+           (usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6) * 1e3);
+
+    printf("\n");
+    for (int c = 0; c < NUM_STATS; c++) {
+        printf("%-20s %20llu\n", counter_names[c], (unsigned long long)atomic_load(&counters[c]));
+    }
+}
+
+// Chrome trace-event format, complete events in microseconds plus the final counters
+static bool write_trace(void) {
+    FILE *file = fopen(trace_name, "w");
+    if (!file) return false;
+
+    pid_t pid = getpid();
+    fprintf(file, "{\"traceEvents\": [\n");
+    for (size_t i = 0; i < num_events; i++) {
+        const Stats_Event *e = &events[i];
+        fprintf(file, "  {\"name\": \"%s\", \"cat\": \"phase\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                      "\"pid\": %d, \"tid\": %d, \"args\": {\"cpu_ms\": %.3f}},\n",
+                e->name, e->start * 1e6, e->wall * 1e6, (int)pid, (int)e->tid, e->cpu * 1e3);
+    }
+    fprintf(file, "  {\"name\": \"io\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": %d, \"args\": {",
+            (clock_seconds(CLOCK_MONOTONIC) - enable_time) * 1e6, (int)pid);
+    for (int c = 0; c < NUM_STATS; c++) {
+        fprintf(file, "%s\"%s\": %llu", c ? ", " : "", counter_names[c],
+                (unsigned long long)atomic_load(&counters[c]));
+    }
+    fprintf(file, "}}\n]}\n");
+    return fclose(file) == 0;
+}
+
+static void stats_report(void) {
+    pthread_mutex_lock(&events_lock);
+    print_summary();
+    if (trace_name && !write_trace()) fprintf(stderr, "Error: could not write trace %s\n", trace_name);
+    free(events);
+    events = NULL;
+    num_events = cap_events = 0;
+    pthread_mutex_unlock(&events_lock);
+    stats_enabled = false;
+}
+
+bool stats_enable(const char *trace) {
+    if (stats_enabled) return true;
+    if (atexit(stats_report) != 0) return false;
+    trace_name = trace;
+    enable_time = clock_seconds(CLOCK_MONOTONIC);
+    stats_enabled = true;
+    return true;
+}
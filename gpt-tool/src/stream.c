@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include "stream.h"
+#include "utils.h"
+#include "stats.h"
+
+enum {
+    STREAM_PAGE_SIZE = 64 * 1024,
+    STREAM_CHUNK_SIZE = 1024 * 1024,        // Zero runs and fallback copies
+};
+
+typedef struct {
+    uint64_t offset, len;           // Where on the disk
+    uint64_t src_offset;
+    int source;                     // Index into sources
+} Stream_Extent;
+
+struct Stream {
+    uint64_t size;
+    uint64_t num_pages;
+    uint8_t **pages;                // NULL page reads as zeros
+    Stream_Extent *extents;         // Sorted by offset, never overlapping
+    size_t num_extents, cap_extents;
+    int *sources;                   // Own descriptors of source files
+    size_t num_sources, cap_sources;
+};
+
+Stream *stream_create(uint64_t size) {
+    Stream *stream = calloc(1, sizeof *stream);
+    if (!stream) return NULL;
+
+    stream->size = size;
+    stream->num_pages = (size + STREAM_PAGE_SIZE - 1) / STREAM_PAGE_SIZE;
+    stream->pages = calloc(stream->num_pages ? stream->num_pages : 1, sizeof *stream->pages);
+    if (!stream->pages) {
+        free(stream);
+        return NULL;
+    }
+
+    // Every copied file stays open until the end
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    return stream;
+}
+
+// First extent ending after offset
+static size_t first_extent_after(const Stream *stream, uint64_t offset) {
+    size_t lo = 0, hi = stream->num_extents;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const Stream_Extent *e = &stream->extents[mid];
+        if (e->offset + e->len <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static bool insert_extent(Stream *stream, size_t at, Stream_Extent extent) {
+    if (stream->num_extents == stream->cap_extents) {
+        size_t cap = stream->cap_extents ? stream->cap_extents * 2 : 64;
+        Stream_Extent *extents = realloc(stream->extents, cap * sizeof *extents);
+        if (!extents) return false;
+        stream->extents = extents;
+        stream->cap_extents = cap;
+    }
+    memmove(&stream->extents[at + 1], &stream->extents[at], (stream->num_extents - at) * sizeof extent);
+    stream->extents[at] = extent;
+    stream->num_extents++;
+    return true;
+}
+
+// Cut [offset, offset + len) out of the planned extents, newer data goes there
+static bool trim_extents(Stream *stream, uint64_t offset, uint64_t len) {
+    uint64_t end = offset + len;
+    size_t i = first_extent_after(stream, offset);
+    while (i < stream->num_extents && stream->extents[i].offset < end) {
+        Stream_Extent *e = &stream->extents[i];
+        uint64_t e_end = e->offset + e->len;
+
+        if (e->offset < offset && e_end > end) {
+            // Range in the middle, split in two
+            Stream_Extent right = *e;
+            right.offset = end;
+            right.src_offset += end - e->offset;
+            right.len = e_end - end;
+            e->len = offset - e->offset;
+            return insert_extent(stream, i + 1, right);
+        }
+        if (e->offset < offset) {
+            e->len = offset - e->offset;
+            i++;
+        }
+        else if (e_end > end) {
+            e->src_offset += end - e->offset;
+            e->len = e_end - end;
+            e->offset = end;
+            break;
+        }
+        else {
+            memmove(e, e + 1, (stream->num_extents - i - 1) * sizeof *e);
+            stream->num_extents--;
+        }
+    }
+    return true;
+}
+
+bool stream_write(Stream *stream, uint64_t offset, const void *buf, size_t len) {
+    if (!trim_extents(stream, offset, len)) return false;
+
+    const uint8_t *p = buf;
+    while (len > 0) {
+        uint64_t page = offset / STREAM_PAGE_SIZE;
+        size_t in_page = offset % STREAM_PAGE_SIZE;
+        size_t chunk = STREAM_PAGE_SIZE - in_page;
+        if (chunk > len) chunk = len;
+
+        // Zeros in a page never written are already there
+        if (!stream->pages[page] && !is_zero_block(p, chunk)) {
+            stream->pages[page] = calloc(1, STREAM_PAGE_SIZE);
+            if (!stream->pages[page]) return false;
+        }
+        if (stream->pages[page]) memcpy(stream->pages[page] + in_page, p, chunk);
+
+        p += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+bool stream_read(Stream *stream, uint64_t offset, void *buf, size_t len) {
+    uint8_t *p = buf;
+    for (uint64_t pos = offset; pos < offset + len; ) {
+        uint64_t page = pos / STREAM_PAGE_SIZE;
+        size_t in_page = pos % STREAM_PAGE_SIZE;
+        size_t chunk = STREAM_PAGE_SIZE - in_page;
+        if (chunk > offset + len - pos) chunk = offset + len - pos;
+
+        if (stream->pages[page]) memcpy(p + (pos - offset), stream->pages[page] + in_page, chunk);
+        else memset(p + (pos - offset), 0, chunk);
+        pos += chunk;
+    }
+
+    // Planned file data wins over pages underneath it
+    for (size_t i = first_extent_after(stream, offset);
+         i < stream->num_extents && stream->extents[i].offset < offset + len; i++) {
+        const Stream_Extent *e = &stream->extents[i];
+        uint64_t start = e->offset > offset ? e->offset : offset;
+        uint64_t end = e->offset + e->len < offset + len ? e->offset + e->len : offset + len;
+        ssize_t got = pread(stream->sources[e->source], p + (start - offset), end - start,
+                            e->src_offset + (start - e->offset));
+        if (got < 0) return false;
+        memset(p + (start - offset) + got, 0, end - start - got);
+    }
+    return true;
+}
+
+// Copy source data into pages now, when no descriptor can be kept for it
+static bool read_into_pages(Stream *stream, uint64_t offset, int src_fd, uint64_t src_offset, uint64_t len) {
+    uint8_t *buf = malloc(STREAM_CHUNK_SIZE);
+    bool ok = buf != NULL;
+    for (uint64_t done = 0; ok && done < len; ) {
+        size_t chunk = len - done < STREAM_CHUNK_SIZE ? len - done : STREAM_CHUNK_SIZE;
+        ssize_t got = pread(src_fd, buf, chunk, src_offset + done);
+        ok = got > 0 && stream_write(stream, offset + done, buf, got);
+        done += got > 0 ? (uint64_t)got : 0;
+    }
+    free(buf);
+    return ok;
+}
+
+bool stream_add_extent(Stream *stream, uint64_t offset, int src_fd, uint64_t src_offset, uint64_t len) {
+    if (len == 0) return true;
+
+    int fd = dup(src_fd);
+    if (fd >= 0 && stream->num_sources == stream->cap_sources) {
+        size_t cap = stream->cap_sources ? stream->cap_sources * 2 : 64;
+        int *sources = realloc(stream->sources, cap * sizeof *sources);
+        if (sources) {
+            stream->sources = sources;
+            stream->cap_sources = cap;
+        } else {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) return read_into_pages(stream, offset, src_fd, src_offset, len);
+    stream->sources[stream->num_sources] = fd;
+
+    if (!trim_extents(stream, offset, len)) return false;
+    Stream_Extent extent = { .offset = offset, .len = len, .src_offset = src_offset, .source = stream->num_sources++ };
+    return insert_extent(stream, first_extent_after(stream, offset), extent);
+}
+
+uint64_t stream_next_data(const Stream *stream, uint64_t offset) {
+    uint64_t first = offset / STREAM_PAGE_SIZE;
+    uint64_t next = stream->size;
+    size_t i = first_extent_after(stream, offset);
+    if (i < stream->num_extents) next = stream->extents[i].offset / STREAM_PAGE_SIZE * STREAM_PAGE_SIZE;
+    if (next < first * STREAM_PAGE_SIZE) next = first * STREAM_PAGE_SIZE;    // Extent started before offset
+
+    for (uint64_t page = first; page * STREAM_PAGE_SIZE < next; page++) {
+        if (stream->pages[page]) return page * STREAM_PAGE_SIZE;
+    }
+    return next;
+}
+
+// File data to the output, in kernel when sendfile can reach it
+static bool emit_extent(const Stream *stream, const Stream_Extent *e, int out_fd, uint8_t *buf) {
+    int src = stream->sources[e->source];
+    off_t src_offset = e->src_offset;
+    uint64_t left = e->len;
+
+    while (left > 0) {
+        ssize_t sent = sendfile(out_fd, src, &src_offset, left);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) break;
+        stats_write(sent);
+        left -= sent;
+    }
+
+    // sendfile not possible, or source shorter than planned
+    while (left > 0) {
+        size_t chunk = left < STREAM_CHUNK_SIZE ? left : STREAM_CHUNK_SIZE;
+        ssize_t got = pread(src, buf, chunk, src_offset);
+        if (got < 0) return false;
+        stats_read(got);
+        if (got == 0) {
+            memset(buf, 0, chunk);
+            got = chunk;
+        }
+        if (!write_all(out_fd, buf, got)) return false;
+        src_offset += got;
+        left -= got;
+    }
+    return true;
+}
+
+bool stream_finish(Stream *stream, int out_fd) {
+    uint8_t *zeros = calloc(1, STREAM_CHUNK_SIZE);
+    uint8_t *buf = malloc(STREAM_CHUNK_SIZE);
+    bool ok = zeros && buf;
+
+    uint64_t pos = 0;
+    size_t next = 0;
+    while (ok && pos < stream->size) {
+        if (next < stream->num_extents && stream->extents[next].offset <= pos) {
+            ok = emit_extent(stream, &stream->extents[next], out_fd, buf);
+            pos = stream->extents[next].offset + stream->extents[next].len;
+            next++;
+            continue;
+        }
+
+        // Pages and zero runs up to the next extent
+        uint64_t end = next < stream->num_extents ? stream->extents[next].offset : stream->size;
+        uint64_t page = pos / STREAM_PAGE_SIZE;
+        size_t in_page = pos % STREAM_PAGE_SIZE;
+        uint64_t chunk = STREAM_PAGE_SIZE - in_page;
+        if (stream->pages[page]) {
+            if (chunk > end - pos) chunk = end - pos;
+            ok = write_all(out_fd, stream->pages[page] + in_page, chunk);
+        }
+        else {
+            while (pos + chunk < end && chunk < STREAM_CHUNK_SIZE && !stream->pages[(pos + chunk) / STREAM_PAGE_SIZE]) {
+                chunk += STREAM_PAGE_SIZE;
+            }
+            if (chunk > STREAM_CHUNK_SIZE) chunk = STREAM_CHUNK_SIZE;
+            if (chunk > end - pos) chunk = end - pos;
+            ok = write_all(out_fd, zeros, chunk);
+        }
+        pos += chunk;
+    }
+
+    stream_destroy(stream);
+    free(buf);
+    free(zeros);
+    return ok;
+}
+
+void stream_destroy(Stream *stream) {
+    for (uint64_t i = 0; i < stream->num_pages; i++) free(stream->pages[i]);
+    for (size_t i = 0; i < stream->num_sources; i++) close(stream->sources[i]);
+    free(stream->pages);
+    free(stream->extents);
+    free(stream->sources);
+    free(stream);
+}
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "template.h"
+#include "structures.h"
+#include "gpt_constants.h"
+#include "utils.h"
+#include "crc32.h"
+#include "stream.h"
+#include "mbr.h"
+#include "gpt.h"
+#include "fat32.h"
+
+enum {
+    TEMPLATE_MAX_RUNS = 32,
+    TEMPLATE_SCAN_SIZE = 64 * 1024,     // Stream page, the unit stream_next_data reports
+    TEMPLATE_ENTRIES = 2,               // ESP and data partition
+};
+
+static const Geometry_Preset presets[] = {
+    { "esp33", "33M ESP, 512 byte clusters, 1M data, 512 byte sectors (the defaults)",
+      DEFAULT_LBA_SIZE, 33ULL << 20, 1ULL << 20, 0 },
+    { "esp128", "128M ESP, 512 byte clusters, 1M data, 512 byte sectors",
+      DEFAULT_LBA_SIZE, 128ULL << 20, 1ULL << 20, 0 },
+    { "esp512", "512M ESP, 4K clusters, 1M data, 512 byte sectors",
+      DEFAULT_LBA_SIZE, 512ULL << 20, 1ULL << 20, 0 },
+    { "esp1g", "1G ESP, 4K clusters, 1M data, 512 byte sectors",
+      DEFAULT_LBA_SIZE, 1ULL << 30, 1ULL << 20, 0 },
+    { "esp260-4k", "260M ESP, 4K clusters, 1M data, 4096 byte sectors (4Kn)",
+      MAX_LBA_SIZE, 260ULL << 20, 1ULL << 20, 0 },
+};
+
+enum {
+    NUM_PRESETS = sizeof presets / sizeof *presets,
+};
+
+// Bytes of the disk at offset, kept in bytes from at on
+typedef struct {
+    uint64_t offset;
+    size_t len;
+    size_t at;
+} Template_Run;
+
+typedef struct {
+    bool built;
+    uint64_t disk_size;
+    uint8_t *bytes;
+    size_t num_bytes;
+    Template_Run runs[TEMPLATE_MAX_RUNS];   // In the order the writers first wrote them
+    size_t num_runs;
+
+    // Disk offsets of the variable fields
+    uint64_t primary_header, primary_table, backup_table, backup_header;
+    uint64_t dir_clusters[3];               // /, /EFI and /EFI/BOOT
+    Crc32_Zeros table_tail;                 // The empty entries after the used ones
+
+    Image state;                            // Partition and ESP fields the writers set
+} Template;
+
+static Template templates[NUM_PRESETS];
+static pthread_mutex_t templates_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const Geometry_Preset *geometry_preset(const char *name) {
+    for (size_t i = 0; i < NUM_PRESETS; i++) {
+        if (strcmp(presets[i].name, name) == 0) return &presets[i];
+    }
+    return NULL;
+}
+
+void geometry_presets_print(FILE *out) {
+    for (size_t i = 0; i < NUM_PRESETS; i++) fprintf(out, "  %-10s %s\n", presets[i].name, presets[i].description);
+}
+
+bool template_matches(const Geometry_Preset *preset, const Image *image) {
+    return image->lba_size == preset->lba_size && image->esp_size == preset->esp_size &&
+           image->data_size == preset->data_size && image->esp_cluster_size == preset->esp_cluster_size &&
+           image->size == disk_size_lbas(preset->esp_size, preset->data_size, preset->lba_size) * preset->lba_size;
+}
+
+// Where the disk bytes at offset are in bytes, NULL unless a run holds all len
+static uint8_t *field(const Template *t, uint8_t *bytes, uint64_t offset, size_t len) {
+    for (size_t i = 0; i < t->num_runs; i++) {
+        const Template_Run *run = &t->runs[i];
+        if (offset >= run->offset && offset + len <= run->offset + run->len) {
+            return bytes + run->at + (offset - run->offset);
+        }
+    }
+    return NULL;
+}
+
+// Add the runs of non-zero sectors of stream, in disk order
+static bool add_runs(Template *t, Stream *stream, uint32_t lba_size) {
+    uint8_t *page = malloc(TEMPLATE_SCAN_SIZE);
+    if (!page) return false;
+
+    const size_t first = t->num_runs;
+    bool ok = true;
+    uint64_t pos = 0;
+    while (ok && pos < t->disk_size && (pos = stream_next_data(stream, pos)) < t->disk_size) {
+        size_t len = t->disk_size - pos < TEMPLATE_SCAN_SIZE ? t->disk_size - pos : TEMPLATE_SCAN_SIZE;
+        ok = stream_read(stream, pos, page, len);
+
+        for (size_t off = 0; ok && off < len; off += lba_size) {
+            if (is_zero_block(page + off, lba_size)) continue;
+            Template_Run *last = t->num_runs > first ? &t->runs[t->num_runs - 1] : NULL;
+            if (last && last->offset + last->len == pos + off) {
+                last->len += lba_size;
+                continue;
+            }
+            ok = t->num_runs < TEMPLATE_MAX_RUNS;
+            if (ok) t->runs[t->num_runs++] = (Template_Run){ .offset = pos + off, .len = lba_size };
+        }
+        pos += len;
+    }
+    free(page);
+    return ok;
+}
+
+// Copy the bytes of runs from on out of stream
+static bool keep_runs(Template *t, Stream *stream, size_t from) {
+    size_t total = t->num_bytes;
+    for (size_t i = from; i < t->num_runs; i++) total += t->runs[i].len;
+    uint8_t *bytes = realloc(t->bytes, total);
+    if (!bytes) return false;
+    t->bytes = bytes;
+
+    for (size_t i = from; i < t->num_runs; i++) {
+        t->runs[i].at = t->num_bytes;
+        if (!stream_read(stream, t->runs[i].offset, t->bytes + t->num_bytes, t->runs[i].len)) return false;
+        t->num_bytes += t->runs[i].len;
+    }
+    return true;
+}
+
+// Run the writers for preset into memory with a fixed seed and date. GPT and
+// ESP go to separate plans, so their runs keep the order the writers touch
+// the disk in and qcow2 allocates clusters the same way a normal build does
+static bool build_template(Template *t, const Geometry_Preset *preset) {
+    t->disk_size = disk_size_lbas(preset->esp_size, preset->data_size, preset->lba_size) * preset->lba_size;
+    Image image = {
+        .backend = IMAGE_STREAM,
+        .name = preset->name,
+        .fd = -1,
+        .size = t->disk_size,
+        .threads = 1,
+        .lba_size = preset->lba_size,
+        .esp_size = preset->esp_size,
+        .data_size = preset->data_size,
+        .esp_cluster_size = preset->esp_cluster_size,
+        .source_date = FAT_EPOCH,
+        .reproducible = true,
+    };
+
+    image.stream = stream_create(t->disk_size);
+    bool ok = image.stream && write_mbr(&image) && write_gpt(&image) && add_runs(t, image.stream, preset->lba_size) &&
+              keep_runs(t, image.stream, 0);
+    if (image.stream) stream_destroy(image.stream);
+
+    const size_t esp_runs = t->num_runs;
+    image.stream = ok ? stream_create(t->disk_size) : NULL;
+    ok = image.stream && write_esp(&image) && add_runs(t, image.stream, preset->lba_size) &&
+         keep_runs(t, image.stream, esp_runs);
+    if (image.stream) stream_destroy(image.stream);
+    image.stream = NULL;
+    dir_index_reset(&image);
+    fat32_free_extents_reset(&image);
+    if (!ok) return false;
+
+    const uint32_t lba_size = preset->lba_size;
+    t->primary_header = lba_size;
+    t->primary_table = 2 * (uint64_t)lba_size;
+    t->backup_table = t->disk_size - lba_size - GPT_TABLE_SIZE;
+    t->backup_header = t->disk_size - lba_size;
+    for (uint32_t i = 0; i < 3; i++) t->dir_clusters[i] = cluster_to_lba(&image, 2 + i) * lba_size;
+    crc32_zeros_init(&t->table_tail, GPT_TABLE_SIZE - TEMPLATE_ENTRIES * sizeof(Gpt_Partition_Entry));
+    t->state = image;
+
+    // Every field a build patches has to be in a run
+    const size_t entries = TEMPLATE_ENTRIES * sizeof(Gpt_Partition_Entry);
+    ok = field(t, t->bytes, t->primary_header, sizeof(Gpt_Header)) &&
+         field(t, t->bytes, t->backup_header, sizeof(Gpt_Header)) &&
+         field(t, t->bytes, t->primary_table, entries) && field(t, t->bytes, t->backup_table, entries);
+    for (uint32_t i = 0; ok && i < 3; i++) ok = field(t, t->bytes, t->dir_clusters[i], lba_size) != NULL;
+    return ok;
+}
+
+// Template of preset, built on first use
+static const Template *get_template(const Geometry_Preset *preset) {
+    size_t index = 0;
+    while (index < NUM_PRESETS && preset != &presets[index]) index++;
+    if (index == NUM_PRESETS) {
+        fprintf(stderr, "Error: preset %s is not one of geometry_preset\n", preset->name);
+        return NULL;
+    }
+
+    Template *t = &templates[index];
+    pthread_mutex_lock(&templates_lock);
+    if (!t->built) {
+        t->built = build_template(t, preset);
+        if (!t->built) {
+            free(t->bytes);
+            *t = (Template){ 0 };
+        }
+    }
+    const Template *result = t->built ? t : NULL;
+    pthread_mutex_unlock(&templates_lock);
+    if (!result) fprintf(stderr, "Error: could not build the template of preset %s\n", preset->name);
+    return result;
+}
+
+// Disk GUID, table crc and header crc of the GPT header at p
+static void patch_header(uint8_t *p, const Guid *disk_guid, uint32_t table_crc32) {
+    Gpt_Header header;
+    memcpy(&header, p, sizeof header);
+    header.disk_guid = *disk_guid;
+    header.partition_table_crc32 = table_crc32;
+    header.header_crc32 = 0;
+    header.header_crc32 = calculate_crc32(&header, header.header_size);
+    memcpy(p, &header, sizeof header);
+}
+
+bool template_write(Image *image, const Geometry_Preset *preset) {
+    if (!template_matches(preset, image)) {
+        fprintf(stderr, "Error: %s does not have the geometry of preset %s\n", image->name, preset->name);
+        return false;
+    }
+    const Template *t = get_template(preset);
+    if (!t) return false;
+
+    uint8_t *bytes = malloc(t->num_bytes);
+    if (!bytes) return false;
+    memcpy(bytes, t->bytes, t->num_bytes);
+
+    // GUIDs in the order write_gpt takes them, the backup table is a copy
+    Gpt_Partition_Entry entries[TEMPLATE_ENTRIES];
+    uint8_t *primary_table = field(t, bytes, t->primary_table, sizeof entries);
+    memcpy(entries, primary_table, sizeof entries);
+    const Guid disk_guid = image_guid(image);
+    for (size_t i = 0; i < TEMPLATE_ENTRIES; i++) entries[i].unique_guid = image_guid(image);
+    memcpy(primary_table, entries, sizeof entries);
+    memcpy(field(t, bytes, t->backup_table, sizeof entries), entries, sizeof entries);
+
+    const uint32_t table_crc32 = crc32_zeros_apply(&t->table_tail, crc32_update(0, entries, sizeof entries));
+    patch_header(field(t, bytes, t->primary_header, sizeof(Gpt_Header)), &disk_guid, table_crc32);
+    patch_header(field(t, bytes, t->backup_header, sizeof(Gpt_Header)), &disk_guid, table_crc32);
+
+    // The times write_esp stamps on every directory entry it makes
+    uint16_t time = 0, date = 0;
+    get_fat_dir_entry_time_date(image, &time, &date);
+    for (size_t c = 0; c < 3; c++) {
+        uint8_t *cluster = field(t, bytes, t->dir_clusters[c], image->lba_size);
+        for (size_t i = 0; i < image->lba_size / sizeof(FAT32_Dir_Entry_Short); i++) {
+            FAT32_Dir_Entry_Short entry;
+            memcpy(&entry, cluster + i * sizeof entry, sizeof entry);
+            if (entry.DIR_Name[0] == 0x00) break;
+            entry.DIR_CrtTime = time;
+            entry.DIR_WrtTime = time;
+            entry.DIR_WrtDate = date;
+            memcpy(cluster + i * sizeof entry, &entry, sizeof entry);
+        }
+    }
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < t->num_runs; i++) {
+        ok = image_write(image, t->runs[i].offset, bytes + t->runs[i].at, t->runs[i].len);
+    }
+    free(bytes);
+    if (!ok) return false;
+
+    // What write_gpt and write_esp leave in image
+    dir_index_reset(image);
+    fat32_free_extents_reset(image);
+    image->esp_lba = t->state.esp_lba;
+    image->esp_size_lbas = t->state.esp_size_lbas;
+    image->esp_size = t->state.esp_size;
+    image->data_lba = t->state.data_lba;
+    image->data_size_lbas = t->state.data_size_lbas;
+    image->end_lba = t->state.end_lba;
+    image->fat32_vbr = t->state.fat32_vbr;
+    image->fat32_fsinfo = t->state.fat32_fsinfo;
+    image->fat32_fsinfo_dirty = false;
+    image->fat32_sec_per_clus = t->state.fat32_sec_per_clus;
+    image->fat32_fat_lba = t->state.fat32_fat_lba;
+    image->fat32_data_lba = t->state.fat32_data_lba;
+    return true;
+}
@@ -2,44 +2,86 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 #include "utils.h"
+#include "layout.h"
 #include "gpt_constants.h"
+#include "sha256.h"
+#include "stats.h"
 
-char *image_name = "test.img";
+enum {
+    COPY_CHUNK = 1024 * 1024,
+};
 
-uint64_t    esp_size = 1024*1024*33;    // 33 MiB
-uint64_t    data_size = 1024*1024*1;    // 1 MiB
-uint64_t    image_size = 0;
-uint64_t    image_size_lbas = 0, esp_size_lbas = 0, data_size_lbas = 0,
-            gpt_table_lbas = 0;                                 // Sizes in lbas
-uint64_t    align_lba = 0, esp_lba = 0, data_lba = 0, 
-            fat32_fat_lba = 0, fat32_data_lba = 0;             // Starting LBA values
-
-uint32_t crc_table[256];
+uint64_t disk_size_lbas(uint64_t esp_size, uint64_t data_size, uint32_t lba_size) {
+    Partition parts[2];
+    uint64_t disk_lbas = 0;
+    layout_default(parts, esp_size, data_size);
+    return layout_place(parts, 2, lba_size, &disk_lbas) ? disk_lbas : 0;
+}
 
 // Convert bytes to LBAs
-uint64_t bytes_to_lbas(const uint64_t bytes) {
-    return (bytes / LBA_SIZE) + (bytes % LBA_SIZE > 0 ? 1 : 0); 
+uint64_t bytes_to_lbas(const uint64_t bytes, uint32_t lba_size) {
+    return (bytes / lba_size) + (bytes % lba_size > 0 ? 1 : 0); 
     // add extra lba in case of partial byte count
 }
 
-void write_full_lba_size(FILE* image) {
-    uint64_t lba_size = LBA_SIZE;
-    uint8_t zero_sector[512] = { 0 };
-    for (uint8_t i = 0; i < (lba_size - sizeof zero_sector) / sizeof zero_sector; i++) {
-        fwrite(zero_sector, sizeof zero_sector, 1, image);
+bool parse_size(const char *str, uint64_t *bytes) {
+    char *end = NULL;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str) return false;
+
+    switch (*end) {
+        case 'G': case 'g': value *= 1024;  // fall through
+        case 'M': case 'm': value *= 1024;  // fall through
+        case 'K': case 'k': value *= 1024; end++; break;
+        case '\0': break;
+        default: return false;
     }
+    if (*end != '\0' && strcmp(end, "iB") != 0 && strcmp(end, "B") != 0) return false;
+
+    *bytes = value;
+    return true;
 }
 
-uint64_t next_aligned_lba(uint64_t lba) {
-    return lba - (lba % align_lba) + align_lba;
+bool is_zero_block(const void *buf, size_t len) {
+    const uint8_t *bufp = buf;
+    if (len == 0) return true;
+
+    // First byte zero and every byte equal to the one after it
+    return bufp[0] == 0 && memcmp(bufp, bufp + 1, len - 1) == 0;
+}
+
+uint64_t cluster_to_lba(const Image *image, uint32_t cluster) {
+    // Data region starts at cluster 2
+    return image->fat32_data_lba + (uint64_t)(cluster - 2) * image->fat32_sec_per_clus;
 }
 
-void get_fat_dir_entry_time_date(uint16_t *in_time, uint16_t *in_date) {
-    time_t curr_time;
-    curr_time = time(NULL);
-    struct tm tm = *localtime(&curr_time);
+void get_fat_dir_entry_time_date(const Image *image, uint16_t *in_time, uint16_t *in_date) {
+    struct tm tm;
+    if (image->source_date >= 0) {
+        // Fixed build time, in UTC so every machine stamps the same, clamped
+        // to the dates FAT can hold
+        time_t t = image->source_date < FAT_EPOCH ? FAT_EPOCH : image->source_date;
+        gmtime_r(&t, &tm);
+        if (tm.tm_year > 207) tm = (struct tm){ .tm_year = 207, .tm_mon = 11, .tm_mday = 31, .tm_hour = 23,
+                                                .tm_min = 59, .tm_sec = 59 };
+    }
+    else {
+        time_t curr_time = time(NULL);
+        localtime_r(&curr_time, &tm);
+    }
 
     // FAT32 relative to 1980, 
     // tm relative to 1900, 
@@ -51,47 +93,33 @@ void get_fat_dir_entry_time_date(uint16_t *in_time, uint16_t *in_date) {
     *in_time = (tm.tm_hour) << 11 | (tm.tm_min) << 5 | (tm.tm_sec) / 2;
 }
 
-void create_crc32_table(void) {
-    uint32_t c;
-
-    for(int32_t n = 0; n < 256; n++) {
-        c = (uint32_t)n;
-        for (int32_t k = 0; k < 8; k++) {
-            if (c & 1)
-                c = 0xedb88320L ^ (c >> 1); // magic constant
-            else
-                c = c >> 1;
-        }
-        crc_table[n] = c;
-    }
-}
-
-uint32_t calculate_crc32(const void *buf, int32_t len) {
-    static bool made_crc_table = false;
-
-    const uint8_t *bufp = buf;
-    uint32_t c = 0xFFFFFFFFL;
-
-    if (!made_crc_table) {
-        create_crc32_table();
-        made_crc_table = true;
+// Fill buf from the kernel, a clock and counter mix only if that is unavailable
+static void random_bytes(uint8_t *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = getrandom(buf + got, len - got, 0);
+        if (n > 0) got += n;
+        else if (n < 0 && errno == EINTR) continue;
+        else break;
     }
+    if (got == len) return;
 
-    for (int32_t n = 0; n < len; n++) {
-        c = crc_table[(c ^ bufp[n]) & 0xFF] ^ (c >> 8);
+    // splitmix64 over time and a process wide counter
+    static _Atomic uint64_t counter;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t x = ((uint64_t)ts.tv_sec << 30) ^ ts.tv_nsec ^ (atomic_fetch_add(&counter, 1) * 0x9E3779B97F4A7C15ULL);
+    for (; got < len; got++) {
+        x += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        buf[got] = (z ^ (z >> 31)) & 0xFF;
     }
-
-    // invert bits to return value
-    return c ^ 0xFFFFFFFFL;
 }
 
-Guid new_guid(void) {
-    uint8_t rand_arr[16] = { 0 };
-
-    for (uint8_t i = 0; i < sizeof rand_arr; i++) {
-        rand_arr[i] = rand() % (UINT8_MAX + 1);
-    }
-
+// Version 4 GUID from 16 random or derived bytes
+static Guid guid_from_bytes(const uint8_t rand_arr[16]) {
     Guid result = {
         .time_low = *(uint32_t *)&rand_arr[0],
         .time_mid = *(uint16_t *)&rand_arr[4],
@@ -112,4 +140,177 @@ Guid new_guid(void) {
     result.clock_seq_hi_and_res |= 0x80;
 
     return result;
-}
\ No newline at end of file
+}
+
+bool parse_guid(const char *str, Guid *guid) {
+    // Text order is the byte order of the first three fields as numbers, then bytes
+    if (strlen(str) != 36) return false;
+    for (int i = 0; i < 36; i++) {
+        bool dash = i == 8 || i == 13 || i == 18 || i == 23;
+        if (dash ? str[i] != '-' : !isxdigit((unsigned char)str[i])) return false;
+    }
+    unsigned long long time_low, time_mid, time_hi, clock_seq, node;
+    if (sscanf(str, "%8llx-%4llx-%4llx-%4llx-%12llx", &time_low, &time_mid, &time_hi, &clock_seq, &node) != 5) {
+        return false;
+    }
+
+    *guid = (Guid){
+        .time_low = time_low,
+        .time_mid = time_mid,
+        .time_hi_and_ver = time_hi,
+        .clock_seq_hi_and_res = clock_seq >> 8,
+        .clock_seq_low = clock_seq & 0xFF,
+    };
+    for (int i = 0; i < 6; i++) guid->node[i] = node >> (8 * (5 - i));
+    return true;
+}
+
+Guid new_guid(void) {
+    uint8_t rand_arr[16] = { 0 };
+    random_bytes(rand_arr, sizeof rand_arr);
+    return guid_from_bytes(rand_arr);
+}
+
+Guid image_guid(Image *image) {
+    if (!image->reproducible) return new_guid();
+
+    // The nth GUID of the image is the SHA-256 of the seed and n
+    uint8_t input[SHA256_SIZE + 4], digest[SHA256_SIZE];
+    uint32_t n = image->guid_count++;
+    memcpy(input, image->guid_seed, SHA256_SIZE);
+    for (int i = 0; i < 4; i++) input[SHA256_SIZE + i] = n >> (8 * i);
+    sha256(input, sizeof input, digest);
+    return guid_from_bytes(digest);
+}
+
+bool pread_all(int fd, void *buf, size_t len, uint64_t offset) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t got = pread(fd, p, len, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        stats_read(got);
+        p += got;
+        offset += got;
+        len -= got;
+    }
+    return true;
+}
+
+bool pwrite_all(int fd, const void *buf, size_t len, uint64_t offset) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t written = pwrite(fd, p, len, offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        stats_write(written);
+        p += written;
+        offset += written;
+        len -= written;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        stats_write(written);
+        p += written;
+        len -= written;
+    }
+    return true;
+}
+
+// Copy len bytes at offset, in the kernel when it can
+static bool copy_span(int in, int out, uint64_t offset, uint64_t len) {
+    while (len > 0) {
+        loff_t off_in = offset, off_out = offset;
+        ssize_t n = copy_file_range(in, &off_in, out, &off_out, len, 0);
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) break;
+        if (n <= 0) return false;
+        offset += n;
+        len -= n;
+    }
+
+    static _Thread_local uint8_t buf[COPY_CHUNK];
+    while (len > 0) {
+        size_t chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+        if (!pread_all(in, buf, chunk, offset) || !pwrite_all(out, buf, chunk, offset)) return false;
+        offset += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+// Reflink src as dst, or copy its data extents so holes stay holes
+bool clone_file(const char *src, const char *dst) {
+    int in = open(src, O_RDONLY);
+    int out = in >= 0 ? open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    struct stat st;
+    bool ok = out >= 0 && fstat(in, &st) == 0;
+
+    if (ok && ioctl(out, FICLONE, in) != 0) {
+        ok = ftruncate(out, st.st_size) == 0;
+        off_t data = lseek(in, 0, SEEK_DATA);
+        while (ok && data >= 0 && data < st.st_size) {
+            off_t hole = lseek(in, data, SEEK_HOLE);
+            if (hole < 0) hole = st.st_size;
+            ok = copy_span(in, out, data, hole - data);
+            data = lseek(in, hole, SEEK_DATA);
+        }
+    }
+
+    if (out >= 0 && close(out) != 0) ok = false;
+    if (in >= 0) close(in);
+    if (!ok) fprintf(stderr, "Error: could not clone '%s' to '%s'\n", src, dst);
+    return ok;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+bool list_dir(const char *path, char ***names, size_t *count) {
+    *names = NULL;
+    *count = 0;
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Error: could not open directory '%s'\n", path);
+        return false;
+    }
+
+    size_t cap = 0;
+    bool ok = true;
+    struct dirent *ent;
+    while (ok && (ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 16;
+            char **grown = realloc(*names, cap * sizeof **names);
+            ok = grown != NULL;
+            if (!ok) break;
+            *names = grown;
+        }
+        (*names)[*count] = strdup(ent->d_name);
+        ok = (*names)[(*count)++] != NULL;
+    }
+    closedir(dir);
+
+    if (!ok) {
+        fprintf(stderr, "Error: could not list directory '%s'\n", path);
+        free_names(*names, *count);
+        *names = NULL;
+        *count = 0;
+        return false;
+    }
+    if (*names) qsort(*names, *count, sizeof **names, compare_names);
+    return true;
+}
+
+void free_names(char **names, size_t count) {
+    for (size_t i = 0; i < count; i++) free(names[i]);
+    free(names);
+}
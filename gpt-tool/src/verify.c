@@ -0,0 +1,781 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "verify.h"
+#include "reader.h"
+#include "crc32.h"
+#include "structures.h"
+#include "gpt_constants.h"
+
+enum {
+    MAX_MESSAGES = 100,                 // Per kind, the rest is only counted
+    FAT_UNIT_ENTRIES = 256 * 1024,      // FAT entries per work unit
+};
+
+typedef enum {
+    CHECK_MBR,
+    CHECK_GPT,
+    CHECK_VBR,
+    CHECK_FAT,
+    CHECK_CHAINS,
+    CHECK_FSINFO,
+    NUM_CHECKS,
+} Check;
+
+static const char *check_names[NUM_CHECKS] = { "mbr", "gpt", "vbr", "fat", "chains", "fsinfo" };
+
+// Per worker tallies of the parallel passes, summed afterwards
+typedef enum {
+    COUNT_FREE,
+    COUNT_USED,
+    COUNT_BAD,
+    COUNT_INVALID,
+    COUNT_BEYOND,                       // Non-zero entries past the last cluster
+    COUNT_MISMATCH,                     // Entries differing between FAT copies
+    COUNT_LOST,                         // Allocated but not reached from the root
+    COUNT_MAX_USED,                     // Highest allocated cluster, kept as a maximum
+    NUM_COUNTS,
+} Count;
+
+typedef struct {
+    Check check;
+    char *text;
+} Message;
+
+typedef struct {
+    uint32_t first_cluster;
+    uint32_t size;
+    char *path;
+} File_Chain;
+
+typedef struct {
+    Reader reader;
+    unsigned threads;
+    bool ran[NUM_CHECKS];
+
+    pthread_mutex_t lock;               // Messages come from workers too
+    Message errors[MAX_MESSAGES], warnings[MAX_MESSAGES];
+    uint64_t num_errors, num_warnings;
+    uint64_t check_errors[NUM_CHECKS], check_warnings[NUM_CHECKS];
+
+    uint64_t counts[NUM_COUNTS];
+    _Atomic uint64_t *claimed;          // Bitmap of clusters owned by a chain
+    File_Chain *files;
+    size_t num_files, cap_files;
+    uint64_t directories;
+} Verify;
+
+static void note(Verify *v, bool error, Check check, const char *fmt, ...) {
+    char text[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof text, fmt, args);
+    va_end(args);
+
+    pthread_mutex_lock(&v->lock);
+    uint64_t *count = error ? &v->num_errors : &v->num_warnings;
+    Message *messages = error ? v->errors : v->warnings;
+    if (*count < MAX_MESSAGES) messages[*count] = (Message){ .check = check, .text = strdup(text) };
+    (*count)++;
+    (error ? v->check_errors : v->check_warnings)[check]++;
+    pthread_mutex_unlock(&v->lock);
+}
+
+#define verify_error(v, check, ...) note(v, true, check, __VA_ARGS__)
+#define verify_warn(v, check, ...) note(v, false, check, __VA_ARGS__)
+
+// Units [0, units) spread over the workers, each worker sums its own counts
+typedef void (*Unit_Fn)(Verify *v, uint64_t unit, uint64_t counts[NUM_COUNTS]);
+
+typedef struct {
+    Verify *v;
+    Unit_Fn fn;
+    uint64_t units;
+    _Atomic uint64_t next;
+} Parallel;
+
+typedef struct {
+    pthread_t thread;
+    Parallel *work;
+    uint64_t counts[NUM_COUNTS];
+} Parallel_Worker;
+
+static void *parallel_worker(void *arg) {
+    Parallel_Worker *worker = arg;
+    Parallel *work = worker->work;
+    for (;;) {
+        uint64_t unit = atomic_fetch_add(&work->next, 1);
+        if (unit >= work->units) break;
+        work->fn(work->v, unit, worker->counts);
+    }
+    return NULL;
+}
+
+static void run_parallel(Verify *v, uint64_t units, Unit_Fn fn) {
+    Parallel work = { .v = v, .fn = fn, .units = units };
+    unsigned threads = v->threads < units ? v->threads : (unsigned)units;
+    if (threads == 0) threads = 1;
+
+    Parallel_Worker *workers = calloc(threads, sizeof *workers);
+    Parallel_Worker single = { .work = &work };
+    unsigned started = 0;
+    for (; workers && started < threads && threads > 1; started++) {
+        workers[started].work = &work;
+        if (pthread_create(&workers[started].thread, NULL, parallel_worker, &workers[started]) != 0) break;
+    }
+    // Whatever is left is done here
+    parallel_worker(&single);
+
+    for (unsigned w = 0; w <= started; w++) {
+        Parallel_Worker *worker = &single;
+        if (w < started) {
+            worker = &workers[w];
+            pthread_join(worker->thread, NULL);
+        }
+        for (int c = 0; c < NUM_COUNTS; c++) {
+            if (c == COUNT_MAX_USED) {
+                if (worker->counts[c] > v->counts[c]) v->counts[c] = worker->counts[c];
+            } else {
+                v->counts[c] += worker->counts[c];
+            }
+        }
+    }
+    free(workers);
+}
+
+static void check_mbr(Verify *v) {
+    const Reader *r = &v->reader;
+    const Mbr *mbr = reader_lba(r, 0, 1);
+    uint64_t lbas = r->size / r->lba_size;
+    v->ran[CHECK_MBR] = true;
+
+    if (r->size % r->lba_size != 0) {
+        verify_warn(v, CHECK_MBR, "image size %llu is not a multiple of %u", (unsigned long long)r->size, r->lba_size);
+    }
+    if (mbr->boot_signature != 0xAA55) {
+        verify_error(v, CHECK_MBR, "boot signature is 0x%04x, not 0xAA55", mbr->boot_signature);
+    }
+
+    const Mbr_Partition *p = &mbr->partition[0];
+    uint32_t expected_size = lbas - 1 > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)(lbas - 1);
+    if (p->os_type != 0xEE) {
+        verify_error(v, CHECK_MBR, "partition 1 has type 0x%02x, not protective 0xEE", p->os_type);
+    } else {
+        if (p->starting_lba != 1) {
+            verify_error(v, CHECK_MBR, "protective partition starts at LBA %u, not 1", p->starting_lba);
+        }
+        if (p->size_lba != expected_size) {
+            verify_error(v, CHECK_MBR, "protective partition covers %u LBAs, disk has %u after the MBR",
+                         p->size_lba, expected_size);
+        }
+    }
+    for (int i = 1; i < 4; i++) {
+        if (mbr->partition[i].os_type != 0) {
+            verify_warn(v, CHECK_MBR, "partition %d (type 0x%02x) next to the protective partition",
+                        i + 1, mbr->partition[i].os_type);
+        }
+    }
+}
+
+// Header at lba and its table, NULL when the header itself can not be trusted
+static const Gpt_Header *check_gpt_header(Verify *v, uint64_t lba, uint64_t alternate, const char *which,
+                                          const uint8_t **table) {
+    const Reader *r = &v->reader;
+    uint64_t lbas = r->size / r->lba_size;
+    const Gpt_Header *header = reader_lba(r, lba, 1);
+    *table = NULL;
+
+    if (!header || memcmp(header->signature, "EFI PART", 8) != 0) {
+        verify_error(v, CHECK_GPT, "no %s GPT header at LBA %llu", which, (unsigned long long)lba);
+        return NULL;
+    }
+    if (header->header_size < 92 || header->header_size > r->lba_size) {
+        verify_error(v, CHECK_GPT, "%s GPT header size %u is invalid", which, header->header_size);
+        return NULL;
+    }
+    Gpt_Header copy = *header;
+    copy.header_crc32 = 0;
+    if (calculate_crc32(&copy, header->header_size) != header->header_crc32) {
+        verify_error(v, CHECK_GPT, "%s GPT header CRC32 mismatch", which);
+        return NULL;
+    }
+
+    if (header->my_lba != lba) {
+        verify_error(v, CHECK_GPT, "%s GPT header claims LBA %llu, found at %llu", which,
+                     (unsigned long long)header->my_lba, (unsigned long long)lba);
+    }
+    if (header->alternate_lba != alternate) {
+        verify_error(v, CHECK_GPT, "%s GPT header points to the other header at LBA %llu, expected %llu", which,
+                     (unsigned long long)header->alternate_lba, (unsigned long long)alternate);
+    }
+    if (header->first_usable_lba > header->last_usable_lba || header->last_usable_lba >= lbas - 1) {
+        verify_error(v, CHECK_GPT, "%s GPT usable range %llu-%llu does not fit the disk", which,
+                     (unsigned long long)header->first_usable_lba, (unsigned long long)header->last_usable_lba);
+    }
+    if (header->size_of_entry < sizeof(Gpt_Partition_Entry) || header->size_of_entry % 8 != 0 ||
+        header->number_of_entries == 0 || header->number_of_entries > 65536) {
+        verify_error(v, CHECK_GPT, "%s GPT table has %u entries of %u bytes", which,
+                     header->number_of_entries, header->size_of_entry);
+        return header;
+    }
+
+    uint64_t table_bytes = (uint64_t)header->number_of_entries * header->size_of_entry;
+    uint64_t table_lbas = (table_bytes + r->lba_size - 1) / r->lba_size;
+    *table = reader_lba(r, header->partition_table_lba, table_lbas);
+    if (!*table) {
+        verify_error(v, CHECK_GPT, "%s GPT table at LBA %llu is outside the image", which,
+                     (unsigned long long)header->partition_table_lba);
+        return header;
+    }
+    if (calculate_crc32(*table, table_bytes) != header->partition_table_crc32) {
+        verify_error(v, CHECK_GPT, "%s GPT partition table CRC32 mismatch", which);
+        *table = NULL;
+        return header;
+    }
+
+    // Table has to lie between its header and the usable range
+    uint64_t table_end = header->partition_table_lba + table_lbas;
+    bool placed = lba == 1 ? header->partition_table_lba > 1 && table_end <= header->first_usable_lba
+                           : header->partition_table_lba > header->last_usable_lba && table_end <= lba;
+    if (!placed) {
+        verify_error(v, CHECK_GPT, "%s GPT table at LBA %llu overlaps its header or the usable range", which,
+                     (unsigned long long)header->partition_table_lba);
+    }
+    return header;
+}
+
+// Both headers and tables, returns the ESP found in the best table
+static bool check_gpt(Verify *v, uint64_t *esp_lba, uint64_t *esp_lbas) {
+    uint64_t last = v->reader.size / v->reader.lba_size - 1;
+    const uint8_t *primary_table, *backup_table;
+    v->ran[CHECK_GPT] = true;
+
+    const Gpt_Header *primary = check_gpt_header(v, 1, last, "primary", &primary_table);
+    const Gpt_Header *backup = check_gpt_header(v, last, 1, "backup", &backup_table);
+
+    if (primary && backup) {
+        if (memcmp(&primary->disk_guid, &backup->disk_guid, sizeof(Guid)) != 0 ||
+            primary->first_usable_lba != backup->first_usable_lba ||
+            primary->last_usable_lba != backup->last_usable_lba ||
+            primary->number_of_entries != backup->number_of_entries ||
+            primary->size_of_entry != backup->size_of_entry) {
+            verify_error(v, CHECK_GPT, "primary and backup GPT headers describe different disks");
+        }
+        else if (primary_table && backup_table &&
+                 memcmp(primary_table, backup_table,
+                        (size_t)primary->number_of_entries * primary->size_of_entry) != 0) {
+            verify_error(v, CHECK_GPT, "primary and backup GPT partition tables differ");
+        }
+    }
+
+    const Gpt_Header *header = primary_table ? primary : backup;
+    const uint8_t *table = primary_table ? primary_table : backup_table;
+    if (!table) return false;
+
+    *esp_lba = 0;
+    for (uint32_t i = 0; i < header->number_of_entries; i++) {
+        const Gpt_Partition_Entry *entry = (const Gpt_Partition_Entry *)(table + (size_t)i * header->size_of_entry);
+        static const Guid unused = { 0 };
+        if (memcmp(&entry->partition_type_guid, &unused, sizeof(Guid)) == 0) continue;
+
+        if (entry->starting_lba > entry->ending_lba || entry->starting_lba < header->first_usable_lba ||
+            entry->ending_lba > header->last_usable_lba) {
+            verify_error(v, CHECK_GPT, "partition %u (LBA %llu-%llu) is outside the usable range", i + 1,
+                         (unsigned long long)entry->starting_lba, (unsigned long long)entry->ending_lba);
+            continue;
+        }
+        for (uint32_t j = 0; j < i; j++) {
+            const Gpt_Partition_Entry *other = (const Gpt_Partition_Entry *)(table + (size_t)j * header->size_of_entry);
+            if (memcmp(&other->partition_type_guid, &unused, sizeof(Guid)) == 0) continue;
+            if (entry->starting_lba <= other->ending_lba && other->starting_lba <= entry->ending_lba) {
+                verify_error(v, CHECK_GPT, "partitions %u and %u overlap", j + 1, i + 1);
+            }
+        }
+        if (memcmp(&entry->partition_type_guid, &ESP_GUID, sizeof(Guid)) == 0 && !*esp_lba) {
+            *esp_lba = entry->starting_lba;
+            *esp_lbas = entry->ending_lba - entry->starting_lba + 1;
+        }
+    }
+
+    if (!*esp_lba) {
+        verify_error(v, CHECK_GPT, "no EFI System Partition in the GPT");
+        return false;
+    }
+    return true;
+}
+
+static bool check_vbr(Verify *v, uint64_t esp_lba, uint64_t esp_lbas) {
+    Reader *r = &v->reader;
+    v->ran[CHECK_VBR] = true;
+    if (!reader_open_esp(r, esp_lba, esp_lbas)) {
+        verify_error(v, CHECK_VBR, "ESP at LBA %llu is not a FAT32 volume with %u byte sectors",
+                     (unsigned long long)esp_lba, r->lba_size);
+        return false;
+    }
+
+    const Vbr *vbr = r->vbr;
+    bool ok = true;
+    if (!(vbr->BS_jmpBoot[0] == 0xEB && vbr->BS_jmpBoot[2] == 0x90) && vbr->BS_jmpBoot[0] != 0xE9) {
+        verify_warn(v, CHECK_VBR, "boot jump 0x%02x 0x%02x 0x%02x is not a valid x86 jump",
+                    vbr->BS_jmpBoot[0], vbr->BS_jmpBoot[1], vbr->BS_jmpBoot[2]);
+    }
+    if ((vbr->BPB_SecPerClus & (vbr->BPB_SecPerClus - 1)) != 0 || vbr->BPB_SecPerClus > 128) {
+        verify_error(v, CHECK_VBR, "%u sectors per cluster is not a power of two up to 128", vbr->BPB_SecPerClus);
+        ok = false;
+    }
+    if (vbr->BPB_RootEntCnt != 0 || vbr->BPB_TotSec16 != 0) {
+        verify_error(v, CHECK_VBR, "FAT12/16 root entry or sector count fields are set");
+        ok = false;
+    }
+    if (vbr->BPB_TotSec32 != esp_lbas) {
+        verify_warn(v, CHECK_VBR, "volume has %u sectors, the partition %llu", vbr->BPB_TotSec32,
+                    (unsigned long long)esp_lbas);
+    }
+    if (vbr->BPB_HiddSec != esp_lba) {
+        verify_warn(v, CHECK_VBR, "hidden sectors %u, partition starts at LBA %llu", vbr->BPB_HiddSec,
+                    (unsigned long long)esp_lba);
+    }
+
+    uint64_t clusters = r->max_cluster - 1;
+    if (clusters < 65525) {
+        verify_error(v, CHECK_VBR, "%llu clusters is too few for FAT32", (unsigned long long)clusters);
+    }
+    uint64_t data_clusters = (esp_lba + vbr->BPB_TotSec32 - r->data_offset / r->lba_size) / vbr->BPB_SecPerClus;
+    if (data_clusters + 2 > r->fat_entries) {
+        verify_error(v, CHECK_VBR, "FAT of %u entries can not map %llu clusters", r->fat_entries,
+                     (unsigned long long)data_clusters);
+    }
+    if (vbr->BPB_RootClus < 2 || vbr->BPB_RootClus > r->max_cluster) {
+        verify_error(v, CHECK_VBR, "root directory cluster %u is outside the volume", vbr->BPB_RootClus);
+        ok = false;
+    }
+    if (vbr->BPB_FSInfo == 0 || vbr->BPB_FSInfo >= vbr->BPB_RsvdSecCnt) {
+        verify_error(v, CHECK_VBR, "FSInfo sector %u is not in the reserved area", vbr->BPB_FSInfo);
+    }
+
+    if (vbr->BPB_BkBootSec == 0) {
+        verify_warn(v, CHECK_VBR, "no backup VBR");
+    } else if ((uint32_t)vbr->BPB_BkBootSec + 2 > vbr->BPB_RsvdSecCnt) {
+        verify_error(v, CHECK_VBR, "backup VBR sector %u and its FSInfo are not in the reserved area",
+                     vbr->BPB_BkBootSec);
+    } else if (memcmp(vbr, reader_lba(r, esp_lba + vbr->BPB_BkBootSec, 1), r->lba_size) != 0) {
+        verify_error(v, CHECK_VBR, "backup VBR in sector %u differs from the VBR", vbr->BPB_BkBootSec);
+    }
+    return ok;
+}
+
+// Classify one FAT range and compare it with the other copies
+static void scan_fat_unit(Verify *v, uint64_t unit, uint64_t counts[NUM_COUNTS]) {
+    const Reader *r = &v->reader;
+    uint64_t start = unit * FAT_UNIT_ENTRIES;
+    uint64_t end = start + FAT_UNIT_ENTRIES < r->fat_entries ? start + FAT_UNIT_ENTRIES : r->fat_entries;
+
+    for (uint64_t c = start < 2 ? 2 : start; c < end; c++) {
+        uint32_t value = r->fat[c] & FAT_ENTRY_MASK;
+        if (c > r->max_cluster) {
+            if (value != 0) counts[COUNT_BEYOND]++;
+            continue;
+        }
+        if (value == 0) {
+            counts[COUNT_FREE]++;
+            continue;
+        }
+        if (value == FAT_BAD_CLUSTER) {
+            counts[COUNT_BAD]++;
+            continue;
+        }
+        counts[COUNT_USED]++;
+        if (c > counts[COUNT_MAX_USED]) counts[COUNT_MAX_USED] = c;
+        if (value < FAT_EOC_MIN && (value < 2 || value > r->max_cluster)) {
+            if (counts[COUNT_INVALID]++ == 0) {
+                verify_error(v, CHECK_FAT, "cluster %llu links to invalid cluster 0x%08x", (unsigned long long)c, value);
+            }
+        }
+    }
+
+    const Vbr *vbr = r->vbr;
+    for (unsigned copy = 1; copy < vbr->BPB_NumFATs; copy++) {
+        const uint32_t *other = reader_lba(r, r->data_offset / r->lba_size - (uint64_t)(vbr->BPB_NumFATs - copy) * vbr->BPB_FATSz32,
+                                           vbr->BPB_FATSz32);
+        if (memcmp(r->fat + start, other + start, (end - start) * sizeof *other) == 0) continue;
+        for (uint64_t c = start; c < end; c++) {
+            if (r->fat[c] == other[c]) continue;
+            if (counts[COUNT_MISMATCH]++ == 0) {
+                verify_error(v, CHECK_FAT, "FAT copy %u differs at cluster %llu: 0x%08x, first FAT 0x%08x",
+                             copy + 1, (unsigned long long)c, other[c], r->fat[c]);
+            }
+        }
+    }
+}
+
+static void check_fat(Verify *v) {
+    const Reader *r = &v->reader;
+    v->ran[CHECK_FAT] = true;
+
+    uint32_t media = r->fat[0] & FAT_ENTRY_MASK;
+    if ((media & 0xFF) != r->vbr->BPB_Media || (media | 0xFF) != FAT_ENTRY_MASK) {
+        verify_warn(v, CHECK_FAT, "FAT[0] is 0x%08x, expected media byte 0x%02x", r->fat[0], r->vbr->BPB_Media);
+    }
+    if ((r->fat[1] & FAT_ENTRY_MASK) < FAT_EOC_MIN) {
+        verify_warn(v, CHECK_FAT, "FAT[1] is 0x%08x, not an end of chain mark", r->fat[1]);
+    }
+
+    run_parallel(v, (r->fat_entries + FAT_UNIT_ENTRIES - 1) / FAT_UNIT_ENTRIES, scan_fat_unit);
+
+    if (v->counts[COUNT_INVALID] > 1) {
+        verify_error(v, CHECK_FAT, "%llu clusters link outside the volume", (unsigned long long)v->counts[COUNT_INVALID]);
+    }
+    if (v->counts[COUNT_MISMATCH] > 1) {
+        verify_error(v, CHECK_FAT, "%llu entries differ between FAT copies", (unsigned long long)v->counts[COUNT_MISMATCH]);
+    }
+    if (v->counts[COUNT_BEYOND]) {
+        verify_warn(v, CHECK_FAT, "%llu FAT entries past the last cluster are not zero",
+                    (unsigned long long)v->counts[COUNT_BEYOND]);
+    }
+}
+
+// Take cluster for a chain, false if some chain already has it
+static bool claim(Verify *v, uint32_t cluster) {
+    uint64_t bit = 1ULL << (cluster % 64);
+    return !(atomic_fetch_or(&v->claimed[cluster / 64], bit) & bit);
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (path) snprintf(path, len, "%s%s%s", dir, strcmp(dir, "/") == 0 ? "" : "/", name);
+    return path;
+}
+
+typedef struct {
+    uint32_t cluster, parent;           // Parent 0 for the root
+    char *path;
+} Dir_Work;
+
+// Walk one directory chain, queue subdirectories, collect files. False when
+// out of memory, the rest of the tree can not be checked then
+static bool walk_dir(Verify *v, Dir_Work *dir, Dir_Work **queue, size_t *num_queue, size_t *cap_queue) {
+    const Reader *r = &v->reader;
+    uint32_t root = r->vbr->BPB_RootClus;
+    uint32_t cluster = dir->cluster;
+    bool end = false;
+
+    for (;;) {
+        const uint8_t *data = reader_cluster(r, cluster);
+        if (!data) {
+            verify_error(v, CHECK_CHAINS, "directory %s: cluster %u is outside the volume", dir->path, cluster);
+            return true;
+        }
+        if (!claim(v, cluster)) {
+            verify_error(v, CHECK_CHAINS, "directory %s: cluster %u is cross-linked or loops", dir->path, cluster);
+            return true;
+        }
+
+        const FAT32_Dir_Entry_Short *entries = (const FAT32_Dir_Entry_Short *)data;
+        for (size_t i = 0; !end && i < r->cluster_bytes / sizeof *entries; i++) {
+            const FAT32_Dir_Entry_Short *entry = &entries[i];
+            if (entry->DIR_Name[0] == 0x00) end = true;
+            if (end || entry->DIR_Name[0] == 0xE5) continue;
+            if ((entry->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME || (entry->DIR_Attr & ATTR_VOLUME_ID)) continue;
+
+            uint32_t first = reader_entry_cluster(entry);
+            if (memcmp(entry->DIR_Name, ".          ", 11) == 0) {
+                if (first != dir->cluster) {
+                    verify_warn(v, CHECK_CHAINS, "directory %s: '.' points to cluster %u", dir->path, first);
+                }
+                continue;
+            }
+            if (memcmp(entry->DIR_Name, "..         ", 11) == 0) {
+                uint32_t parent = dir->parent == root ? 0 : dir->parent;
+                if (first != parent) {
+                    verify_warn(v, CHECK_CHAINS, "directory %s: '..' points to cluster %u, parent is %u",
+                                dir->path, first, parent);
+                }
+                continue;
+            }
+
+            char name[13];
+            reader_entry_name(entry, name);
+            char *path = join_path(dir->path, name);
+            if (!path) {
+                verify_error(v, CHECK_CHAINS, "out of memory");
+                return false;
+            }
+
+            if (entry->DIR_Attr & ATTR_DIRECTORY) {
+                v->directories++;
+                if (first < 2 || first > r->max_cluster) {
+                    verify_error(v, CHECK_CHAINS, "directory %s starts at invalid cluster %u", path, first);
+                    free(path);
+                    continue;
+                }
+                if (*num_queue == *cap_queue) {
+                    size_t cap = *cap_queue ? *cap_queue * 2 : 64;
+                    Dir_Work *grown = realloc(*queue, cap * sizeof *grown);
+                    if (!grown) {
+                        verify_error(v, CHECK_CHAINS, "out of memory");
+                        free(path);
+                        return false;
+                    }
+                    *queue = grown;
+                    *cap_queue = cap;
+                }
+                (*queue)[(*num_queue)++] = (Dir_Work){ .cluster = first, .parent = dir->cluster, .path = path };
+                continue;
+            }
+
+            if (v->num_files == v->cap_files) {
+                size_t cap = v->cap_files ? v->cap_files * 2 : 256;
+                File_Chain *grown = realloc(v->files, cap * sizeof *grown);
+                if (!grown) {
+                    verify_error(v, CHECK_CHAINS, "out of memory");
+                    free(path);
+                    return false;
+                }
+                v->files = grown;
+                v->cap_files = cap;
+            }
+            v->files[v->num_files++] = (File_Chain){ .first_cluster = first, .size = entry->DIR_FileSize, .path = path };
+        }
+
+        uint32_t next = reader_fat_entry(r, cluster);
+        if (next >= FAT_EOC_MIN) return true;
+        if (next < 2 || next > r->max_cluster) {
+            verify_error(v, CHECK_CHAINS, "directory %s: chain breaks at cluster %u (entry 0x%08x)",
+                         dir->path, cluster, next);
+            return true;
+        }
+        cluster = next;
+    }
+}
+
+static void check_file_unit(Verify *v, uint64_t unit, uint64_t counts[NUM_COUNTS]) {
+    (void)counts;
+    const Reader *r = &v->reader;
+    const File_Chain *file = &v->files[unit];
+    uint64_t expected = ((uint64_t)file->size + r->cluster_bytes - 1) / r->cluster_bytes;
+
+    if (file->first_cluster == 0) {
+        if (file->size != 0) {
+            verify_error(v, CHECK_CHAINS, "file %s has %u bytes but no clusters", file->path, file->size);
+        }
+        return;
+    }
+
+    uint64_t length = 0;
+    uint32_t cluster = file->first_cluster;
+    for (;;) {
+        if (cluster < 2 || cluster > r->max_cluster) {
+            verify_error(v, CHECK_CHAINS, "file %s: cluster %u is outside the volume", file->path, cluster);
+            return;
+        }
+        if (!claim(v, cluster)) {
+            verify_error(v, CHECK_CHAINS, "file %s: cluster %u is cross-linked or loops", file->path, cluster);
+            return;
+        }
+        length++;
+
+        uint32_t next = reader_fat_entry(r, cluster);
+        if (next >= FAT_EOC_MIN) break;
+        if (next < 2 || next > r->max_cluster) {
+            verify_error(v, CHECK_CHAINS, "file %s: chain breaks at cluster %u (entry 0x%08x)", file->path, cluster, next);
+            return;
+        }
+        cluster = next;
+    }
+
+    if (length != expected) {
+        verify_error(v, CHECK_CHAINS, "file %s: %llu clusters for %u bytes, expected %llu", file->path,
+                     (unsigned long long)length, file->size, (unsigned long long)expected);
+    }
+}
+
+// Allocated clusters no chain reached
+static void lost_unit(Verify *v, uint64_t unit, uint64_t counts[NUM_COUNTS]) {
+    const Reader *r = &v->reader;
+    uint64_t start = unit * FAT_UNIT_ENTRIES;
+    uint64_t end = start + FAT_UNIT_ENTRIES < (uint64_t)r->max_cluster + 1 ? start + FAT_UNIT_ENTRIES
+                                                                           : (uint64_t)r->max_cluster + 1;
+    for (uint64_t c = start < 2 ? 2 : start; c < end; c++) {
+        uint32_t value = r->fat[c] & FAT_ENTRY_MASK;
+        if (value == 0 || value == FAT_BAD_CLUSTER) continue;
+        if (!(atomic_load_explicit(&v->claimed[c / 64], memory_order_relaxed) & (1ULL << (c % 64)))) {
+            counts[COUNT_LOST]++;
+        }
+    }
+}
+
+static void check_chains(Verify *v) {
+    const Reader *r = &v->reader;
+    v->ran[CHECK_CHAINS] = true;
+    v->claimed = calloc(r->max_cluster / 64 + 1, sizeof *v->claimed);
+    if (!v->claimed) {
+        verify_error(v, CHECK_CHAINS, "out of memory");
+        return;
+    }
+
+    // Directories one after the other, they are few and small
+    Dir_Work *queue = malloc(sizeof *queue);
+    size_t num_queue = 1, cap_queue = 1;
+    char *root_path = strdup("/");
+    if (!queue || !root_path) {
+        verify_error(v, CHECK_CHAINS, "out of memory");
+        free(queue);
+        free(root_path);
+        return;
+    }
+    queue[0] = (Dir_Work){ .cluster = r->vbr->BPB_RootClus, .path = root_path };
+    bool ok = true;
+    for (size_t i = 0; i < num_queue; i++) {
+        Dir_Work dir = queue[i];
+        ok = ok && walk_dir(v, &dir, &queue, &num_queue, &cap_queue);
+        free(dir.path);
+    }
+    free(queue);
+    if (!ok) return;
+
+    // File chains, then what is left over
+    run_parallel(v, v->num_files, check_file_unit);
+    run_parallel(v, ((uint64_t)r->max_cluster + FAT_UNIT_ENTRIES) / FAT_UNIT_ENTRIES, lost_unit);
+    if (v->counts[COUNT_LOST]) {
+        verify_warn(v, CHECK_CHAINS, "%llu allocated clusters are not reachable from the root directory",
+                    (unsigned long long)v->counts[COUNT_LOST]);
+    }
+}
+
+static void check_fsinfo_sector(Verify *v, uint32_t sector, const char *which, const FSInfo **out) {
+    const FSInfo *fsinfo = reader_lba(&v->reader, v->reader.esp_lba + sector, 1);
+    *out = NULL;
+    if (!fsinfo || fsinfo->FSI_LeadSig != 0x41615252 || fsinfo->FSI_StrucSig != 0x61417272 ||
+        fsinfo->FSI_TrailSig != 0xAA550000) {
+        verify_error(v, CHECK_FSINFO, "%s FSInfo in sector %u has bad signatures", which, sector);
+        return;
+    }
+    *out = fsinfo;
+
+    uint64_t free_clusters = v->counts[COUNT_FREE];
+    if (fsinfo->FSI_Free_Count != FSI_UNKNOWN && fsinfo->FSI_Free_Count != free_clusters) {
+        verify_warn(v, CHECK_FSINFO, "%s FSInfo free count %u, FAT has %llu free clusters", which,
+                    fsinfo->FSI_Free_Count, (unsigned long long)free_clusters);
+    }
+    if (fsinfo->FSI_Next_Free == FSI_UNKNOWN) return;
+    if (fsinfo->FSI_Next_Free < 2 || fsinfo->FSI_Next_Free > v->reader.max_cluster) {
+        verify_warn(v, CHECK_FSINFO, "%s FSInfo next free cluster %u is outside the volume", which,
+                    fsinfo->FSI_Next_Free);
+    }
+    // New chains are placed from there on, nothing may be allocated beyond it
+    else if (v->counts[COUNT_MAX_USED] >= fsinfo->FSI_Next_Free) {
+        verify_warn(v, CHECK_FSINFO, "%s FSInfo next free cluster %u, cluster %llu is in use", which,
+                    fsinfo->FSI_Next_Free, (unsigned long long)v->counts[COUNT_MAX_USED]);
+    }
+}
+
+static void check_fsinfo(Verify *v) {
+    const Vbr *vbr = v->reader.vbr;
+    const FSInfo *primary, *backup = NULL;
+    v->ran[CHECK_FSINFO] = true;
+
+    check_fsinfo_sector(v, vbr->BPB_FSInfo, "primary", &primary);
+    if (vbr->BPB_BkBootSec == 0) return;
+    check_fsinfo_sector(v, vbr->BPB_BkBootSec + vbr->BPB_FSInfo, "backup", &backup);
+    if (primary && backup && (primary->FSI_Free_Count != backup->FSI_Free_Count ||
+                              primary->FSI_Next_Free != backup->FSI_Next_Free)) {
+        verify_warn(v, CHECK_FSINFO, "backup FSInfo (free %u, next %u) differs from primary (free %u, next %u)",
+                    backup->FSI_Free_Count, backup->FSI_Next_Free, primary->FSI_Free_Count, primary->FSI_Next_Free);
+    }
+}
+
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7F) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void json_messages(FILE *out, const Message *messages, uint64_t count) {
+    fprintf(out, "[");
+    for (uint64_t i = 0; i < count && i < MAX_MESSAGES; i++) {
+        fprintf(out, "%s\n    {\"check\": \"%s\", \"message\": ", i ? "," : "", check_names[messages[i].check]);
+        json_string(out, messages[i].text ? messages[i].text : "");
+        fprintf(out, "}");
+    }
+    fprintf(out, "%s]", count ? "\n  " : "");
+}
+
+static void write_report(Verify *v, FILE *out, double seconds) {
+    const Reader *r = &v->reader;
+    fprintf(out, "{\n  \"image\": ");
+    json_string(out, r->name);
+    fprintf(out, ",\n  \"size\": %llu,\n  \"lba_size\": %u,\n  \"threads\": %u,\n  \"seconds\": %.6f,\n  \"ok\": %s,\n",
+            (unsigned long long)r->size, r->lba_size, v->threads, seconds, v->num_errors ? "false" : "true");
+
+    fprintf(out, "  \"checks\": {");
+    for (int c = 0; c < NUM_CHECKS; c++) {
+        const char *status = !v->ran[c] ? "skipped" : v->check_errors[c] ? "error" : v->check_warnings[c] ? "warning" : "ok";
+        fprintf(out, "%s\"%s\": \"%s\"", c ? ", " : "", check_names[c], status);
+    }
+    fprintf(out, "},\n");
+
+    if (r->vbr) {
+        fprintf(out, "  \"esp\": {\"first_lba\": %llu, \"lbas\": %llu, \"cluster_bytes\": %u, \"clusters\": %u, "
+                     "\"free_clusters\": %llu, \"used_clusters\": %llu, \"bad_clusters\": %llu, "
+                     "\"lost_clusters\": %llu, \"directories\": %llu, \"files\": %zu},\n",
+                (unsigned long long)r->esp_lba, (unsigned long long)r->esp_lbas, r->cluster_bytes, r->max_cluster - 1,
+                (unsigned long long)v->counts[COUNT_FREE], (unsigned long long)v->counts[COUNT_USED],
+                (unsigned long long)v->counts[COUNT_BAD], (unsigned long long)v->counts[COUNT_LOST],
+                (unsigned long long)v->directories, v->num_files);
+    }
+
+    fprintf(out, "  \"num_errors\": %llu,\n  \"errors\": ", (unsigned long long)v->num_errors);
+    json_messages(out, v->errors, v->num_errors);
+    fprintf(out, ",\n  \"num_warnings\": %llu,\n  \"warnings\": ", (unsigned long long)v->num_warnings);
+    json_messages(out, v->warnings, v->num_warnings);
+    fprintf(out, "\n}\n");
+}
+
+bool verify_image(const char *name, unsigned threads, FILE *report) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Verify *v = calloc(1, sizeof *v);
+    if (!v) return false;
+    if (!reader_open(&v->reader, name)) {
+        free(v);
+        return false;
+    }
+    v->threads = threads ? threads : 1;
+    pthread_mutex_init(&v->lock, NULL);
+
+    // Later checks need what the earlier ones found
+    uint64_t esp_lba = 0, esp_lbas = 0;
+    check_mbr(v);
+    if (check_gpt(v, &esp_lba, &esp_lbas) && check_vbr(v, esp_lba, esp_lbas)) {
+        check_fat(v);
+        check_chains(v);
+        check_fsinfo(v);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    write_report(v, report, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    bool ok = v->num_errors == 0;
+
+    for (uint64_t i = 0; i < v->num_errors && i < MAX_MESSAGES; i++) free(v->errors[i].text);
+    for (uint64_t i = 0; i < v->num_warnings && i < MAX_MESSAGES; i++) free(v->warnings[i].text);
+    for (size_t i = 0; i < v->num_files; i++) free(v->files[i].path);
+    free(v->files);
+    free(v->claimed);
+    pthread_mutex_destroy(&v->lock);
+    reader_close(&v->reader);
+    free(v);
+    return ok;
+}
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "write_pool.h"
+#include "stats.h"
+
+typedef struct Write_Job {
+    uint64_t offset, len;
+    Write_Job_Fn fn;
+    void *arg;
+    bool started;
+    struct Write_Job *next;
+} Write_Job;
+
+struct Write_Pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;            // Job queued or shutting down
+    pthread_cond_t done;            // Job finished
+    Write_Job *head, *tail;         // Pending jobs in submit order, running ones included
+    uint64_t pending_bytes, max_pending_bytes;
+    bool failed, stop;
+    unsigned num_threads;
+    pthread_t *threads;
+};
+
+static bool overlaps(const Write_Pool *pool, uint64_t offset, uint64_t len) {
+    for (const Write_Job *job = pool->head; job; job = job->next) {
+        if (offset < job->offset + job->len && job->offset < offset + len) return true;
+    }
+    return false;
+}
+
+static void *worker(void *arg) {
+    Write_Pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        Write_Job *job = pool->head;
+        while (job && job->started) job = job->next;
+        if (!job) {
+            if (pool->stop) break;
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+        job->started = true;
+
+        pthread_mutex_unlock(&pool->lock);
+        Stats_Span span = stats_begin("write_job");
+        bool ok = job->fn(job->arg);
+        stats_end(&span);
+        pthread_mutex_lock(&pool->lock);
+
+        // Unlink finished job
+        Write_Job **link = &pool->head;
+        Write_Job *prev = NULL;
+        while (*link != job) {
+            prev = *link;
+            link = &(*link)->next;
+        }
+        *link = job->next;
+        if (pool->tail == job) pool->tail = prev;
+
+        pool->pending_bytes -= job->len;
+        if (!ok) pool->failed = true;
+        free(job);
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+Write_Pool *write_pool_create(unsigned threads, uint64_t max_pending_bytes) {
+    Write_Pool *pool = calloc(1, sizeof *pool);
+    if (!pool) return NULL;
+    pool->threads = calloc(threads, sizeof *pool->threads);
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+    pool->max_pending_bytes = max_pending_bytes;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (unsigned i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0) {
+            fprintf(stderr, "Error: could not start write thread %u\n", i);
+            break;
+        }
+        pool->num_threads++;
+    }
+    if (pool->num_threads == 0) {
+        write_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+bool write_pool_submit(Write_Pool *pool, uint64_t offset, uint64_t len, Write_Job_Fn fn, void *arg) {
+    Write_Job *job = malloc(sizeof *job);
+    if (!job) return false;
+    *job = (Write_Job){ .offset = offset, .len = len, .fn = fn, .arg = arg };
+
+    pthread_mutex_lock(&pool->lock);
+    // Keep write order for the same bytes, and bound memory held by queued buffers
+    while (overlaps(pool, offset, len) ||
+           (pool->head && pool->pending_bytes + len > pool->max_pending_bytes)) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+
+    if (pool->tail) pool->tail->next = job;
+    else pool->head = job;
+    pool->tail = job;
+    pool->pending_bytes += len;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+void write_pool_wait_range(Write_Pool *pool, uint64_t offset, uint64_t len) {
+    pthread_mutex_lock(&pool->lock);
+    while (overlaps(pool, offset, len)) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool write_pool_wait(Write_Pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head) pthread_cond_wait(&pool->done, &pool->lock);
+    bool ok = !pool->failed;
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+bool write_pool_destroy(Write_Pool *pool) {
+    bool ok = write_pool_wait(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+    return ok;
+}